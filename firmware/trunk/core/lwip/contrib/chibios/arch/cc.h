@@ -76,7 +76,15 @@ typedef uint32_t        mem_ptr_t;
   chSysHalt();                                                          \
 }
 
+#if defined(SIMULATOR)
+/* The host C library has its own errno, timeval and byte order.*/
+#include <endian.h>
+#include <errno.h>
+#include <sys/time.h>
+#define LWIP_TIMEVAL_PRIVATE 0
+#else
 #define BYTE_ORDER LITTLE_ENDIAN
 #define LWIP_PROVIDE_ERRNO
+#endif
 
 #endif /* __CC_H__ */
@@ -61,7 +61,50 @@
 #ifndef __PERF_H__
 #define __PERF_H__
 
+#if LWIP_PERF
+
+/*
+ * PERF_START takes a timestamp from a free running TC channel and
+ * PERF_STOP(x) adds the time since then to the stage labelled x.  The
+ * stages are kept in a small table, see lwip_perf_stats().
+ */
+struct lwip_perf_mark {
+  u16_t ticks;                  /* TC counter value */
+  u32_t time;                   /* system time, to spot counter wraps */
+};
+
+struct lwip_perf_stage {
+  const char *name;             /* label passed to PERF_STOP() */
+  u32_t count;                  /* samples taken */
+  u32_t overruns;               /* samples too long for the counter */
+  u16_t min;                    /* shortest sample, in ticks */
+  u16_t max;                    /* longest sample, in ticks */
+  u32_t total;                  /* sum of all samples, in ticks */
+};
+
+/* The counter runs at MCK/8.*/
+#define LWIP_PERF_TICKS_PER_US  6
+
+#define PERF_START    struct lwip_perf_mark perf_mark__ = lwip_perf_start()
+#define PERF_STOP(x)  lwip_perf_stop(x, &perf_mark__)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+  void lwip_perf_init(void);
+  struct lwip_perf_mark lwip_perf_start(void);
+  void lwip_perf_stop(const char *name, const struct lwip_perf_mark *mark);
+  int lwip_perf_stats(struct lwip_perf_stage *sp, int max);
+  void lwip_perf_reset(void);
+#ifdef __cplusplus
+}
+#endif
+
+#else /* !LWIP_PERF */
+
 #define PERF_START
 #define PERF_STOP(x)
 
+#endif /* LWIP_PERF */
+
 #endif /* __PERF_H__ */
@@ -73,6 +73,8 @@
 #include "arch/cc.h"
 #include "arch/sys_arch.h"
 
+#include "system.h"
+
 void sys_init(void) {
 
 }
@@ -183,12 +185,14 @@ struct sys_timeouts *sys_arch_timeouts(void) {
 
 sys_thread_t sys_thread_new(char *name, void (* thread)(void *arg),
                             void *arg, int stacksize, int prio) {
-  (void)name;
   size_t wsz = THD_WA_SIZE(stacksize);
   void *wsp = chCoreAlloc(wsz);
+  Thread *tp;
   if (wsp == NULL)
     return NULL;
-  return (sys_thread_t)chThdCreateStatic(wsp, wsz, prio, (tfunc_t)thread, arg);
+  tp = chThdCreateStatic(wsp, wsz, prio, (tfunc_t)thread, arg);
+  systemRegisterThread(tp, name, wsz);
+  return (sys_thread_t)tp;
 }
 
 sys_prot_t sys_arch_protect(void) {
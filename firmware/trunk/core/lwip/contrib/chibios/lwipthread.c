@@ -83,17 +83,185 @@
 #include <lwip/tcpip.h>
 #include "netif/etharp.h"
 #include "netif/ppp_oe.h"
+#include "arch/perf.h"
 
 #include "lwipthread.h"
 
+#include <string.h>
+
 #define PERIODIC_TIMER_ID       1
 #define FRAME_RECEIVED_ID       2
 
+#define PERIODIC_TIMER_INTERVAL S2ST(5)
+
 /**
  * Stack area for the LWIP-MAC thread.
  */
 WORKING_AREA(wa_lwip_thread, LWIP_THREAD_STACK_SIZE);
 
+static struct lwipthread_stats stats;
+
+#if LWIP_ZEROCOPY
+/*
+ * Received frames are handed to lwIP where the EMAC put them.  Each of the
+ * frame's receive buffers is swapped out of the ring for a spare one before
+ * the descriptors are released, and passed up as a custom pbuf - one per
+ * buffer - that puts the buffer back on the spare list when lwIP frees it.
+ * If there aren't enough spares the frame is copied, with zerocopy_read().
+ */
+static uint32_t rx_spare_mem[LWIP_ZEROCOPY_RX_BUFFERS][EMAC_RECEIVE_BUFFERS_SIZE / sizeof(uint32_t)];
+static uint8_t *rx_spares[LWIP_ZEROCOPY_RX_BUFFERS];
+static struct pbuf_custom rx_pbuf_mem[LWIP_ZEROCOPY_RX_BUFFERS];
+static struct pbuf_custom *rx_pbufs[LWIP_ZEROCOPY_RX_BUFFERS];
+static unsigned rx_spare_count;
+static EMACDescriptor *rx_ring;
+
+/*
+ * Frames that fit in a single pbuf are sent straight from it - the
+ * descriptor is pointed at the pbuf's payload and the pbuf is held on to
+ * until the EMAC is done with the descriptor.
+ */
+typedef struct {
+  EMACDescriptor *physdesc;
+  uint32_t buffer;              /* the descriptor's own buffer */
+  struct pbuf *p;               /* the pbuf it's sending from instead */
+} tx_frame_t;
+
+static tx_frame_t tx_frames[EMAC_TRANSMIT_DESCRIPTORS];
+
+static void zerocopy_init(void) {
+  unsigned i;
+  for (i = 0; i < LWIP_ZEROCOPY_RX_BUFFERS; i++) {
+    rx_spares[i] = (uint8_t *)rx_spare_mem[i];
+    rx_pbufs[i] = &rx_pbuf_mem[i];
+  }
+  rx_spare_count = LWIP_ZEROCOPY_RX_BUFFERS;
+}
+
+/*
+ * Called by pbuf_free() - the buffer goes back on the spare list.
+ */
+static void zerocopy_free(struct pbuf *p) {
+  struct pbuf_custom *pc = (struct pbuf_custom *)p;
+
+  chSysLock();
+  rx_spares[rx_spare_count] = pc->payload_mem;
+  rx_pbufs[rx_spare_count] = pc;
+  rx_spare_count++;
+  chSysUnlock();
+}
+
+/*
+ * The next descriptor in the receive ring.  The one flagged as the end of
+ * the ring is the last one in it, which is how we find the start.
+ */
+static EMACDescriptor *zerocopy_next(EMACDescriptor *edp) {
+  if (rx_ring == NULL) {
+    EMACDescriptor *wrap = edp;
+    while (!(wrap->w1 & W1_R_WRAP))
+      wrap++;
+    rx_ring = wrap - (EMAC_RECEIVE_DESCRIPTORS - 1);
+  }
+  return (edp->w1 & W1_R_WRAP) ? rx_ring : edp + 1;
+}
+
+/*
+ * Once spares have been swapped into the ring, its buffers aren't one after
+ * the other in the driver's buffer any more, and macReadReceiveDescriptor()
+ * would copy a frame that spans several of them from the wrong place - so
+ * copy it a descriptor at a time, from wherever each one's buffer is.
+ */
+static size_t zerocopy_read(MACReceiveDescriptor *rdp, uint8_t *buf, size_t size) {
+  EMACDescriptor *edp = rdp->rd_physdesc;
+  size_t skip = rdp->rd_offset, done = 0;
+
+  if (size > rdp->rd_size - rdp->rd_offset)
+    size = rdp->rd_size - rdp->rd_offset;
+  while (skip >= EMAC_RECEIVE_BUFFERS_SIZE) {
+    skip -= EMAC_RECEIVE_BUFFERS_SIZE;
+    edp = zerocopy_next(edp);
+  }
+  while (done < size) {
+    size_t n = EMAC_RECEIVE_BUFFERS_SIZE - skip;
+    if (n > size - done)
+      n = size - done;
+    memcpy(buf + done, (uint8_t *)(edp->w1 & W1_R_ADDRESS_MASK) + skip, n);
+    done += n;
+    skip = 0;
+    edp = zerocopy_next(edp);
+  }
+  rdp->rd_offset += size;
+  return size;
+}
+
+static struct pbuf *zerocopy_input(MACReceiveDescriptor *rdp) {
+  EMACDescriptor *edp = rdp->rd_physdesc;
+  struct pbuf *head = NULL, *tail = NULL;
+  size_t left = rdp->rd_size;
+  unsigned buffers = (left + EMAC_RECEIVE_BUFFERS_SIZE - 1) / EMAC_RECEIVE_BUFFERS_SIZE;
+
+  /* pbuf_free() only ever adds spares, so if there are enough now
+     they'll still be there as we take them */
+  if (buffers > rx_spare_count)
+    return NULL;
+
+  while (left > 0) {
+    struct pbuf_custom *pc;
+    uint8_t *spare;
+    uint8_t *frame = (uint8_t *)(edp->w1 & W1_R_ADDRESS_MASK);
+    u16_t len = (u16_t)((left < EMAC_RECEIVE_BUFFERS_SIZE) ? left : EMAC_RECEIVE_BUFFERS_SIZE);
+
+    chSysLock();
+    rx_spare_count--;
+    pc = rx_pbufs[rx_spare_count];
+    spare = rx_spares[rx_spare_count];
+    chSysUnlock();
+
+    edp->w1 = (uint32_t)spare | (edp->w1 & ~W1_R_ADDRESS_MASK);
+    pc->custom_free_function = zerocopy_free;
+    struct pbuf *p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, pc, frame,
+                                         EMAC_RECEIVE_BUFFERS_SIZE);
+    p->tot_len = (u16_t)left;           /* the length of the rest of the chain */
+    if (head == NULL)
+      head = p;
+    else
+      tail->next = p;
+    tail = p;
+    left -= len;
+    edp = zerocopy_next(edp);
+  }
+
+  macReleaseReceiveDescriptor(rdp);
+  stats.rx_zerocopy++;
+  return head;
+}
+
+/*
+ * Once the EMAC has finished with a descriptor we sent a pbuf from,
+ * give it its own buffer back and let go of the pbuf.
+ */
+static tx_frame_t *zerocopy_tx_frame(EMACDescriptor *physdesc) {
+  unsigned i;
+  tx_frame_t *tf = NULL;
+
+  for (i = 0; i < EMAC_TRANSMIT_DESCRIPTORS; i++) {
+    if (tx_frames[i].physdesc == physdesc) {
+      tf = &tx_frames[i];
+      break;
+    }
+    if (tf == NULL && tx_frames[i].physdesc == NULL)
+      tf = &tx_frames[i];
+  }
+  if (tf->p != NULL) {
+    physdesc->w1 = tf->buffer;
+    pbuf_free(tf->p);
+    tf->p = NULL;
+  }
+  tf->physdesc = physdesc;
+  return tf;
+}
+#endif /* LWIP_ZEROCOPY */
+
 /*
  * Initialization.
  */
@@ -126,11 +294,26 @@ static err_t low_level_output(struct netif *netif, struct pbuf *p) {
   pbuf_header(p, -ETH_PAD_SIZE);        /* drop the padding word */
 #endif
 
+#if LWIP_ZEROCOPY
+  tx_frame_t *tf = zerocopy_tx_frame(td.td_physdesc);
+  /* The EMAC takes transmit buffers at any byte address, so a frame can
+     go straight from its pbuf as long as it's all in one piece. */
+  if (p->next == NULL) {
+    tf->buffer = td.td_physdesc->w1;
+    td.td_physdesc->w1 = (uint32_t)p->payload;
+    td.td_offset = p->len;
+    pbuf_ref(p);
+    tf->p = p;
+    stats.tx_zerocopy++;
+  }
+  else
+#endif
   /* Iterates through the pbuf chain. */
   for (q = p; q != NULL; q = q->next) {
     macWriteTransmitDescriptor(&td, (uint8_t *)q->payload, (size_t)q->len);
   }
   macReleaseTransmitDescriptor(&td);
+  stats.tx_frames++;
 
 #if ETH_PAD_SIZE
   pbuf_header(p, ETH_PAD_SIZE);         /* reclaim the padding word */
@@ -152,6 +335,14 @@ static struct pbuf *low_level_input(struct netif *netif) {
   (void)netif;
   if (macWaitReceiveDescriptor(&ETH1, &rd, TIME_IMMEDIATE) == RDY_OK) {
     len = (u16_t)rd.rd_size;
+    stats.rx_frames++;
+
+#if LWIP_ZEROCOPY && !ETH_PAD_SIZE
+    if ((p = zerocopy_input(&rd)) != NULL) {
+      LINK_STATS_INC(link.recv);
+      return p;
+    }
+#endif
 
 #if ETH_PAD_SIZE
     len += ETH_PAD_SIZE;        /* allow room for Ethernet padding */
@@ -168,7 +359,11 @@ static struct pbuf *low_level_input(struct netif *netif) {
 
       /* Iterates through the pbuf chain. */
       for(q = p; q != NULL; q = q->next) {
+#if LWIP_ZEROCOPY && !ETH_PAD_SIZE
+        zerocopy_read(&rd, (uint8_t *)q->payload, (size_t)q->len);
+#else
         macReadReceiveDescriptor(&rd, (uint8_t *)q->payload, (size_t)q->len);
+#endif
       }
       macReleaseReceiveDescriptor(&rd);
 
@@ -180,6 +375,7 @@ static struct pbuf *low_level_input(struct netif *netif) {
     }
     else {
       macReleaseReceiveDescriptor(&rd);
+      stats.rx_dropped++;
       LINK_STATS_INC(link.memerr);
       LINK_STATS_INC(link.drop);
     }
@@ -220,6 +416,153 @@ static err_t ethernetif_init(struct netif *netif) {
   return ERR_OK;
 }
 
+/*
+ * Work out the frame rates over the last period.
+ */
+static void update_rates(void) {
+  static uint32_t rx_last, tx_last;
+  static systime_t last;
+  systime_t now = chTimeNow();
+  systime_t elapsed = now - last;
+
+  if (elapsed > 0) {
+    stats.rx_rate = ((stats.rx_frames - rx_last) * CH_FREQUENCY) / elapsed;
+    stats.tx_rate = ((stats.tx_frames - tx_last) * CH_FREQUENCY) / elapsed;
+  }
+  rx_last = stats.rx_frames;
+  tx_last = stats.tx_frames;
+  last = now;
+}
+
+/**
+ * @brief Reads the Ethernet frame counters.
+ * @details The rates are averaged over the link polling period.
+ *
+ * @param[out] sp where to put the counters
+ */
+void lwip_thread_stats(struct lwipthread_stats *sp) {
+  chSysLock();
+  *sp = stats;
+  chSysUnlock();
+}
+
+#if LWIP_PERF
+
+#if LWIP_PERF_TC == 0
+#define PERF_TC                 AT91C_BASE_TC0
+#define PERF_TC_ID              AT91C_ID_TC0
+#elif LWIP_PERF_TC == 1
+#define PERF_TC                 AT91C_BASE_TC1
+#define PERF_TC_ID              AT91C_ID_TC1
+#else
+#define PERF_TC                 AT91C_BASE_TC2
+#define PERF_TC_ID              AT91C_ID_TC2
+#endif
+
+/*
+ * The counter wraps every 65536 ticks, so samples that the system time
+ * says might have been longer than that are counted as overruns.
+ */
+#define PERF_WRAP_TIME          (65536 / LWIP_PERF_TICKS_PER_US / (1000000 / CH_FREQUENCY))
+
+static struct lwip_perf_stage perf_stages[LWIP_PERF_STAGES];
+
+/**
+ * @brief Starts the free running counter behind PERF_START/PERF_STOP.
+ */
+void lwip_perf_init(void) {
+  AT91C_BASE_PMC->PMC_PCER = 1 << PERF_TC_ID;
+  PERF_TC->TC_CCR = AT91C_TC_CLKDIS;
+  PERF_TC->TC_IDR = 0xFFFFFFFF;
+  PERF_TC->TC_CMR = AT91C_TC_CLKS_TIMER_DIV2_CLOCK; /* capture mode, no trigger */
+  PERF_TC->TC_CCR = AT91C_TC_CLKEN | AT91C_TC_SWTRG;
+  lwip_perf_reset();
+}
+
+/**
+ * @brief Takes the timestamp for PERF_START.
+ */
+struct lwip_perf_mark lwip_perf_start(void) {
+  struct lwip_perf_mark mark;
+
+  mark.time = chTimeNow();
+  mark.ticks = (u16_t)PERF_TC->TC_CV;
+  return mark;
+}
+
+/**
+ * @brief Adds the time since @p mark to the stage called @p name.
+ * @details Stages are added to the table the first time they're seen -
+ *          once it's full, new ones are ignored.
+ *
+ * @param[in] name the stage label, usually a string literal
+ * @param[in] mark the timestamp from PERF_START
+ */
+void lwip_perf_stop(const char *name, const struct lwip_perf_mark *mark) {
+  u16_t ticks = (u16_t)PERF_TC->TC_CV - mark->ticks;
+  bool_t overrun = (chTimeNow() - mark->time) >= PERF_WRAP_TIME;
+  struct lwip_perf_stage *sp;
+
+  chSysLock();
+  for (sp = perf_stages; sp < &perf_stages[LWIP_PERF_STAGES]; sp++) {
+    if (sp->name == NULL)
+      sp->name = name;
+    if (sp->name == name || strcmp(sp->name, name) == 0)
+      break;
+  }
+  if (sp < &perf_stages[LWIP_PERF_STAGES]) {
+    if (overrun)
+      sp->overruns++;
+    else {
+      sp->count++;
+      sp->total += ticks;
+      if (ticks < sp->min)
+        sp->min = ticks;
+      if (ticks > sp->max)
+        sp->max = ticks;
+    }
+  }
+  chSysUnlock();
+}
+
+/**
+ * @brief Reads the stage timings.
+ * @details Times are in counter ticks, see LWIP_PERF_TICKS_PER_US.
+ *
+ * @param[out] sp where to put the stages
+ * @param[in] max how many stages @p sp has room for
+ * @return the number of stages read
+ */
+int lwip_perf_stats(struct lwip_perf_stage *sp, int max) {
+  int n;
+
+  chSysLock();
+  for (n = 0; n < max && n < LWIP_PERF_STAGES && perf_stages[n].name != NULL; n++)
+    sp[n] = perf_stages[n];
+  chSysUnlock();
+  return n;
+}
+
+/**
+ * @brief Clears the stage timings.
+ * @details The stages stay in the table, in the same order.
+ */
+void lwip_perf_reset(void) {
+  unsigned i;
+
+  for (i = 0; i < LWIP_PERF_STAGES; i++) {
+    chSysLock();
+    perf_stages[i].count = 0;
+    perf_stages[i].overruns = 0;
+    perf_stages[i].min = 0xFFFF;
+    perf_stages[i].max = 0;
+    perf_stages[i].total = 0;
+    chSysUnlock();
+  }
+}
+
+#endif /* LWIP_PERF */
+
 static void lwipInitialized(void* a)
 {
   Semaphore *sem = a;
@@ -266,6 +609,9 @@ msg_t lwip_thread(void *p) {
   }
 
   /* Initializes the thing.*/
+#if LWIP_PERF
+  lwip_perf_init();
+#endif
   sys_init();
   mem_init();
   memp_init();
@@ -274,6 +620,9 @@ msg_t lwip_thread(void *p) {
   ip_init();
   tcpip_init(lwipInitialized, (opts != NULL) ? opts->semaphore : 0);
 
+#if LWIP_ZEROCOPY
+  zerocopy_init();
+#endif
   macSetAddress(&ETH1, thisif.hwaddr);
   netif_add(&thisif, &ip, &netmask, &gateway, NULL, ethernetif_init, tcpip_input);
 
@@ -281,7 +630,7 @@ msg_t lwip_thread(void *p) {
   netif_set_up(&thisif);
 
   /* Setup event sources.*/
-  evtInit(&evt, S2ST(5));
+  evtInit(&evt, PERIODIC_TIMER_INTERVAL);
   evtStart(&evt);
   chEvtRegisterMask(&evt.et_es, &el0, PERIODIC_TIMER_ID);
   chEvtRegisterMask(macGetReceiveEventSource(&ETH1), &el1, FRAME_RECEIVED_ID);
@@ -292,8 +641,10 @@ msg_t lwip_thread(void *p) {
 
   while (TRUE) {
     eventmask_t mask = chEvtWaitAny(ALL_EVENTS);
-    if (mask & PERIODIC_TIMER_ID)
+    if (mask & PERIODIC_TIMER_ID) {
       (void)macPollLinkStatus(&ETH1);
+      update_rates();
+    }
     if (mask & FRAME_RECEIVED_ID) {
       struct pbuf *p;
       while ((p = low_level_input(&thisif)) != NULL) {
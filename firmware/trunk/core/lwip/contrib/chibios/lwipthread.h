@@ -99,6 +99,23 @@
 #define LWIP_ETHADDR_5          0x46
 #endif
 
+/**
+ * @brief Hand received frames to lwIP without copying them, and send
+ *        single pbuf frames straight from the pbuf.
+ */
+#if !defined(LWIP_ZEROCOPY) || defined(__DOXYGEN__)
+#define LWIP_ZEROCOPY           TRUE
+#endif
+
+/**
+ * @brief Spare receive buffers to swap into the EMAC ring.
+ * @details This is also the most EMAC buffers lwIP can be holding on to
+ *          at once - beyond that, received frames are copied.
+ */
+#if !defined(LWIP_ZEROCOPY_RX_BUFFERS) || defined(__DOXYGEN__)
+#define LWIP_ZEROCOPY_RX_BUFFERS 16
+#endif
+
 /** @brief Interface name byte 0. */
 #if !defined(LWIP_IFNAME0) || defined(__DOXYGEN__)
 #define LWIP_IFNAME0            'm'
@@ -121,12 +138,26 @@ struct lwipthread_opts {
   Semaphore     *semaphore;
 };
 
+/**
+ * @brief Ethernet frame counters.
+ */
+struct lwipthread_stats {
+  uint32_t      rx_frames;      /**< Frames received.*/
+  uint32_t      rx_zerocopy;    /**< Frames passed to lwIP without a copy.*/
+  uint32_t      rx_dropped;     /**< Frames dropped for lack of pbufs.*/
+  uint32_t      tx_frames;      /**< Frames sent.*/
+  uint32_t      tx_zerocopy;    /**< Frames sent without a copy.*/
+  uint32_t      rx_rate;        /**< Frames received per second.*/
+  uint32_t      tx_rate;        /**< Frames sent per second.*/
+};
+
 extern WORKING_AREA(wa_lwip_thread, LWIP_THREAD_STACK_SIZE);
 
 #ifdef __cplusplus
 extern "C" {
 #endif
   msg_t lwip_thread(void *p);
+  void lwip_thread_stats(struct lwipthread_stats *sp);
 #ifdef __cplusplus
 }
 #endif
@@ -902,6 +902,15 @@
 #define PBUF_POOL_BUFSIZE               LWIP_MEM_ALIGN_SIZE(TCP_MSS+40+PBUF_LINK_HLEN)
 #endif
 
+/**
+ * LWIP_SUPPORT_CUSTOM_PBUF==1: Support for custom pbufs, whose memory
+ * belongs to someone else (e.g. a MAC's DMA buffers) and is handed back
+ * through a callback when the pbuf is freed.
+ */
+#ifndef LWIP_SUPPORT_CUSTOM_PBUF
+#define LWIP_SUPPORT_CUSTOM_PBUF        0
+#endif
+
 /*
    ------------------------------------------------
    ---------- Network Interfaces options ----------
@@ -60,6 +60,9 @@ typedef enum {
 
 /** indicates this packet's data should be immediately passed to the application */
 #define PBUF_FLAG_PUSH 0x01U
+/** indicates this is a custom pbuf: pbuf_free calls its custom_free_function
+    instead of handing it back to a pool or the heap */
+#define PBUF_FLAG_IS_CUSTOM 0x02U
 
 struct pbuf {
   /** next pbuf in singly linked pbuf chain */
@@ -96,9 +99,31 @@ struct pbuf {
 };
 
 /* Initializes the pbuf module. This call is empty for now, but may not be in future. */
+#if LWIP_SUPPORT_CUSTOM_PBUF
+/** Prototype for a function to free a custom pbuf */
+typedef void (*pbuf_free_custom_fn)(struct pbuf *p);
+
+/** A custom pbuf: like a pbuf, but following a function pointer to free it. */
+struct pbuf_custom {
+  /** The actual pbuf */
+  struct pbuf pbuf;
+  /** This function is called when pbuf_free deallocates this pbuf(_custom) */
+  pbuf_free_custom_fn custom_free_function;
+  /** Start of the memory the payload lives in.  A PBUF_REF custom pbuf can
+      move its payload back to here with pbuf_header(), eg. to put back the
+      link and IP headers of a received frame to reply with it. */
+  void *payload_mem;
+};
+#endif /* LWIP_SUPPORT_CUSTOM_PBUF */
+
 #define pbuf_init()
 
 struct pbuf *pbuf_alloc(pbuf_layer l, u16_t size, pbuf_type type);
+#if LWIP_SUPPORT_CUSTOM_PBUF
+struct pbuf *pbuf_alloced_custom(pbuf_layer l, u16_t length, pbuf_type type,
+                                 struct pbuf_custom *p, void *payload_mem,
+                                 u16_t payload_mem_len);
+#endif /* LWIP_SUPPORT_CUSTOM_PBUF */
 void pbuf_realloc(struct pbuf *p, u16_t size); 
 u8_t pbuf_header(struct pbuf *p, s16_t header_size);
 void pbuf_ref(struct pbuf *p);
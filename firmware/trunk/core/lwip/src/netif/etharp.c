@@ -57,6 +57,7 @@
 #include "lwip/dhcp.h"
 #include "lwip/autoip.h"
 #include "netif/etharp.h"
+#include "arch/perf.h"
 
 #if PPPOE_SUPPORT
 #include "netif/ppp_oe.h"
@@ -1191,7 +1192,9 @@ ethernet_input(struct pbuf *p, struct netif *netif)
         p = NULL;
       } else {
         /* pass to IP layer */
+        PERF_START;
         ip_input(p, netif);
+        PERF_STOP("ip_input");
       }
       break;
       
@@ -25,14 +25,55 @@
 
 #define ANALOGIN_CHANNELS 8
 
+// which timer/counter channel triggers conversions while streaming
+#ifndef ANALOGIN_STREAM_TC
+#define ANALOGIN_STREAM_TC 1
+#endif
+
+#if ANALOGIN_STREAM_TC == 0
+#define AIN_STREAM_TC     AT91C_BASE_TC0
+#define AIN_STREAM_TC_ID  AT91C_ID_TC0
+#define AIN_STREAM_TRGSEL AT91C_ADC_TRGSEL_TIOA0
+#elif ANALOGIN_STREAM_TC == 1
+#define AIN_STREAM_TC     AT91C_BASE_TC1
+#define AIN_STREAM_TC_ID  AT91C_ID_TC1
+#define AIN_STREAM_TRGSEL AT91C_ADC_TRGSEL_TIOA1
+#else
+#define AIN_STREAM_TC     AT91C_BASE_TC2
+#define AIN_STREAM_TC_ID  AT91C_ID_TC2
+#define AIN_STREAM_TRGSEL AT91C_ADC_TRGSEL_TIOA2
+#endif
+
+// number of frames (one sample of each channel) in each half of the stream buffer
+#ifndef ANALOGIN_STREAM_FRAMES
+#define ANALOGIN_STREAM_FRAMES 8
+#endif
+
+// with the sample & hold time set up in analoginInit(), a scan of all 8
+// channels takes about 460us, so this is as fast as we can go
+#ifndef ANALOGIN_STREAM_MAX_RATE
+#define ANALOGIN_STREAM_MAX_RATE 2000
+#endif
+
 struct AinDriver {
   Mutex mtx;                   // lock for the adc system
   Thread *thd;
   bool processMultiChannelIsr; // are we waiting for a multi conversion or just a single channel
   uint8_t multiChannelConversions; // mask of which conversions have been completed
+  bool streaming;
+  int streamRate;              // the rate we actually got, in frames per second
+  uint8_t streamCurrent;       // which half of the buffer the PDC is filling
+  AnaloginStreamHandler streamHandler;
+  volatile uint32_t streamSeq; // bumped each time latest is updated
+  uint16_t latest[ANALOGIN_CHANNELS];
+  bool snapshotValid;
+  systime_t snapshotTime;
+  int snapshot[ANALOGIN_CHANNELS];
+  uint16_t streamBuf[2][ANALOGIN_STREAM_FRAMES * ANALOGIN_CHANNELS];
 };
 
 static struct AinDriver aind;
+static Stat analoginConversions = { .name = "analogin.conversions" };
 
 #ifdef OSC
 static void analoginAutoSendInit(void);
@@ -79,6 +120,12 @@ int analoginValue(int channel)
   int value;
   chSysLock();
   chMtxLockS(&aind.mtx);
+  if (aind.streaming) { // the ADC is busy streaming - just grab the latest
+    value = aind.latest[channel];
+    chMtxUnlockS();
+    chSysUnlock();
+    return value;
+  }
   aind.processMultiChannelIsr = NO;
   // disable other channels, and enable the one we want
   AT91C_BASE_ADC->ADC_CHDR = ~(1 << channel);
@@ -111,6 +158,8 @@ int analoginValue(int channel)
 */
 bool analoginMulti(int values[])
 {
+  if (analoginStreamSnapshot(values))
+    return true;
   chSysLock();
   chMtxLockS(&aind.mtx);
   // enable all the channels
@@ -144,10 +193,33 @@ __attribute__((noinline))
 static void analoginServeInterrupt(void)
 {
   uint32_t status = AT91C_BASE_ADC->ADC_SR;
-  if (aind.processMultiChannelIsr) {
+  if (aind.streaming) {
+    if (status & AT91C_ADC_ENDRX) {
+      // the PDC has moved on to the other half of the buffer,
+      // so queue this half back up to follow it
+      uint16_t* done = aind.streamBuf[aind.streamCurrent];
+      AT91C_BASE_ADC->ADC_RNPR = (uint32_t)done;
+      AT91C_BASE_ADC->ADC_RNCR = ANALOGIN_STREAM_FRAMES * ANALOGIN_CHANNELS;
+      aind.streamCurrent ^= 1;
+
+      const uint16_t* last = done + (ANALOGIN_STREAM_FRAMES - 1) * ANALOGIN_CHANNELS;
+      int i;
+      for (i = 0; i < ANALOGIN_CHANNELS; i++)
+        aind.latest[i] = last[i];
+      aind.streamSeq++;
+
+      chSysLockFromIsr(); // so the handler can use I-class functions
+      statAddI(&analoginConversions, ANALOGIN_STREAM_FRAMES * ANALOGIN_CHANNELS);
+      if (aind.streamHandler)
+        aind.streamHandler(done, ANALOGIN_STREAM_FRAMES);
+      chSysUnlockFromIsr();
+    }
+  }
+  else if (aind.processMultiChannelIsr) {
     aind.multiChannelConversions |= (status & 0xFF); // EoC channels are the low byte
     // if we got End Of Conversion in all our channels, indicate we're done
     if (aind.multiChannelConversions == 0xFF && aind.thd) {
+      statAddI(&analoginConversions, ANALOGIN_CHANNELS);
       chSysLockFromIsr();
       // dummy read to clear the AT91C_ADC_DRDY bit
       (void)AT91C_BASE_ADC->ADC_LCDR;
@@ -156,13 +228,17 @@ static void analoginServeInterrupt(void)
       chSysUnlockFromIsr();
     }
   }
-  else if ((status & AT91C_ADC_DRDY) && (aind.thd != 0)) {
-    chSysLockFromIsr();
-    // send a msg back to the calling thread with the conversion result
-    aind.thd->p_u.rdymsg = AT91C_BASE_ADC->ADC_LCDR & 0xFFFF;
-    chSchReadyI(aind.thd);
-    aind.thd = 0;
-    chSysUnlockFromIsr();
+  else if (status & AT91C_ADC_DRDY) {
+    int value = AT91C_BASE_ADC->ADC_LCDR & 0xFFFF; // always read, to clear DRDY
+    statAddI(&analoginConversions, 1);
+    if (aind.thd != 0) {
+      chSysLockFromIsr();
+      // send a msg back to the calling thread with the conversion result
+      aind.thd->p_u.rdymsg = value;
+      chSchReadyI(aind.thd);
+      aind.thd = 0;
+      chSysUnlockFromIsr();
+    }
   }
 }
 
@@ -208,6 +284,8 @@ void analoginInit()
   chMtxInit(&aind.mtx);
   aind.multiChannelConversions = NO;
   aind.processMultiChannelIsr = NO;
+  aind.streaming = false;
+  statsAdd(&analoginConversions);
   
   // initialize interrupts
   AT91C_BASE_ADC->ADC_IER = AT91C_ADC_DRDY;
@@ -224,10 +302,185 @@ void analoginInit()
 */
 void analoginDeinit()
 {
+  analoginStreamStop();
   AT91C_BASE_PMC->PMC_PCDR = 1 << AT91C_ID_ADC; // disable peripheral clock
   AIC_DisableIT(AT91C_ID_ADC);                  // disable interrupts
 }
 
+/**
+  Start sampling all the analog inputs continuously.
+  Rather than starting each conversion from software, a timer triggers a scan of all
+  8 channels at the given rate, and the results are transferred into a double buffer
+  by DMA without any work from the processor.  While streaming, analoginValue() and
+  analoginMulti() return the most recent samples immediately rather than doing a
+  conversion of their own.
+
+  Each time one half of the buffer fills up, \b handler is called with ANALOGIN_STREAM_FRAMES
+  frames of samples - each frame is one value for each of the 8 channels, in order.  The
+  handler is called from the ADC interrupt with the system locked, so it should be quick
+  about it and only use I-class functions - copy out what you need and signal a thread to
+  do any real work.
+  The samples are only valid until the handler returns.
+
+  The timer used can be selected by defining \b ANALOGIN_STREAM_TC as 0, 1 or 2 in your
+  config.h - it defaults to 1.  Make sure it's not also being used by the FastTimer.
+  @param rate The number of times per second to sample all the channels - up to ANALOGIN_STREAM_MAX_RATE.
+  @param handler (optional) A function to be called with each block of samples.
+  @return The sample rate actually achieved, or CONTROLLER_ERROR_ILLEGAL_PARAMETER_VALUE.
+
+  \b Example
+  \code
+  int achieved = analoginStreamStart(1000, 0); // 1000 frames per second
+  int samples[8];
+  analoginStreamSnapshot(samples); // grab the latest without waiting
+  \endcode
+*/
+int analoginStreamStart(int rate, AnaloginStreamHandler handler)
+{
+  static const uint16_t dividers[] = { 2, 8, 32, 128, 1024 }; // TIMER_DIV1 - TIMER_DIV5
+  uint32_t rc = 0;
+  int clks;
+
+  if (rate <= 0 || rate > ANALOGIN_STREAM_MAX_RATE)
+    return CONTROLLER_ERROR_ILLEGAL_PARAMETER_VALUE;
+
+  analoginStreamStop();
+  // pick the fastest timer clock that lets us count out a whole period
+  for (clks = 0; clks < 5; clks++) {
+    rc = (MCK / dividers[clks]) / rate;
+    if (rc <= 0xFFFF)
+      break;
+  }
+
+  chMtxLock(&aind.mtx); // wait for any conversion in progress
+  aind.streamHandler = handler;
+  aind.streamCurrent = 0;
+  aind.streamRate = (MCK / dividers[clks]) / rc;
+
+  // two halves of the buffer - when the first fills, the PDC moves on to the next
+  AT91C_BASE_ADC->ADC_PTCR = AT91C_PDC_RXTDIS;
+  AT91C_BASE_ADC->ADC_RPR = (uint32_t)aind.streamBuf[0];
+  AT91C_BASE_ADC->ADC_RCR = ANALOGIN_STREAM_FRAMES * ANALOGIN_CHANNELS;
+  AT91C_BASE_ADC->ADC_RNPR = (uint32_t)aind.streamBuf[1];
+  AT91C_BASE_ADC->ADC_RNCR = ANALOGIN_STREAM_FRAMES * ANALOGIN_CHANNELS;
+
+  AT91C_BASE_ADC->ADC_CHER = 0xFF;
+  AT91C_BASE_ADC->ADC_IDR = AT91C_ADC_DRDY;
+  AT91C_BASE_ADC->ADC_IER = AT91C_ADC_ENDRX;
+  AT91C_BASE_ADC->ADC_MR = (AT91C_BASE_ADC->ADC_MR & ~(AT91C_ADC_TRGEN | AT91C_ADC_TRGSEL)) |
+                           AT91C_ADC_TRGEN_EN | AIN_STREAM_TRGSEL;
+  aind.streaming = true;
+  AT91C_BASE_ADC->ADC_PTCR = AT91C_PDC_RXTEN;
+
+  // TIOA rises at RA and is cleared at RC, where the counter starts over,
+  // which kicks off one scan each period
+  AT91C_BASE_PMC->PMC_PCER = 1 << AIN_STREAM_TC_ID;
+  AIN_STREAM_TC->TC_CCR = AT91C_TC_CLKDIS;
+  AIN_STREAM_TC->TC_IDR = 0xFF;
+  AIN_STREAM_TC->TC_CMR = clks | AT91C_TC_WAVE | AT91C_TC_WAVESEL_UP_AUTO |
+                          AT91C_TC_ACPA_SET | AT91C_TC_ACPC_CLEAR;
+  AIN_STREAM_TC->TC_RA = rc / 2;
+  AIN_STREAM_TC->TC_RC = rc;
+  AIN_STREAM_TC->TC_CCR = AT91C_TC_CLKEN | AT91C_TC_SWTRG;
+  chMtxUnlock();
+  return aind.streamRate;
+}
+
+/**
+  Stop streaming analog input values.
+  analoginValue() and analoginMulti() go back to doing a conversion each time they're called.
+*/
+void analoginStreamStop()
+{
+  chMtxLock(&aind.mtx);
+  if (aind.streaming) {
+    AIN_STREAM_TC->TC_CCR = AT91C_TC_CLKDIS;
+    AT91C_BASE_PMC->PMC_PCDR = 1 << AIN_STREAM_TC_ID;
+    AT91C_BASE_ADC->ADC_PTCR = AT91C_PDC_RXTDIS;
+    AT91C_BASE_ADC->ADC_MR = (AT91C_BASE_ADC->ADC_MR & ~(AT91C_ADC_TRGEN | AT91C_ADC_TRGSEL)) |
+                             AT91C_ADC_TRGEN_DIS;
+    AT91C_BASE_ADC->ADC_IDR = AT91C_ADC_ENDRX;
+    chSysLock();
+    aind.streaming = false;
+    aind.streamRate = 0;
+    chSysUnlock();
+    AT91C_BASE_ADC->ADC_IER = AT91C_ADC_DRDY;
+  }
+  chMtxUnlock();
+}
+
+/**
+  The rate that analog inputs are currently being streamed at.
+  @return The number of frames per second, or 0 if we're not streaming.
+*/
+int analoginStreamRate()
+{
+  return aind.streamRate;
+}
+
+/**
+  Get the most recent value of all the analog inputs while streaming.
+  This doesn't wait for anything or take any locks - all 8 values are guaranteed to
+  come from the same scan.  Make sure to provide an array of 8 ints.
+  @param values An array of ints to be filled with the values.
+  @return True if we're streaming and values was filled in, false if not.
+*/
+bool analoginStreamSnapshot(int values[])
+{
+  uint32_t seq;
+  int i;
+  if (!aind.streaming)
+    return false;
+  do { // if the ISR updates the values while we're copying, go again
+    seq = aind.streamSeq;
+    for (i = 0; i < ANALOGIN_CHANNELS; i++)
+      values[i] = aind.latest[i];
+  } while (seq != aind.streamSeq);
+  return true;
+}
+
+/**
+  Get a recent value of all the analog inputs, sharing one conversion between callers.
+  If the last snapshot is less than \b maxAge milliseconds old, you get that - otherwise
+  a new one is taken with analoginMulti().  This lets several readers that run at about
+  the same time, like the analogin and digitalin autosenders, get a coherent set of values
+  from one conversion instead of each doing their own.  If we're streaming, you always get
+  the latest streamed values.  Make sure to provide an array of 8 ints.
+  @param values An array of ints to be filled with the values.
+  @param maxAge How old, in milliseconds, the values can be.
+  @return non-zero on success, zero on failure.
+
+  \b Example
+  \code
+  int samples[8];
+  analoginSnapshot(samples, 5); // no more than 5 milliseconds old
+  \endcode
+*/
+bool analoginSnapshot(int values[], int maxAge)
+{
+  int i;
+  if (analoginStreamSnapshot(values))
+    return true;
+
+  if (!aind.snapshotValid || chTimeNow() - aind.snapshotTime > MS2ST(maxAge)) {
+    int fresh[ANALOGIN_CHANNELS];
+    if (!analoginMulti(fresh))
+      return false;
+    chSysLock();
+    for (i = 0; i < ANALOGIN_CHANNELS; i++)
+      aind.snapshot[i] = fresh[i];
+    aind.snapshotTime = chTimeNow();
+    aind.snapshotValid = true;
+    chSysUnlock();
+  }
+
+  chSysLock();
+  for (i = 0; i < ANALOGIN_CHANNELS; i++)
+    values[i] = aind.snapshot[i];
+  chSysUnlock();
+  return true;
+}
+
 /** @}
 */
 
@@ -243,10 +496,16 @@ void analoginDeinit()
   There are 8 Analog Inputs on the Make Application Board, numbered 0 - 7.
   
   \section properties Properties
-  The Analog Ins have the following properties:
+  Each Analog In has the following properties:
   - value
   - autosend
 
+  and the Analog Ins as a whole have these, at \b /analogins:
+  - stream
+  - all
+  - autosend-all
+  - autosend-interval
+
   \par Value
   The \b value property corresponds to the incoming signal of an Analog In.
   The range of values you can expect to get back are from 0 - 1023.
@@ -267,25 +526,50 @@ void analoginDeinit()
   milliseconds, by sending the message
   \verbatim /system/autosend-interval 10 \endverbatim
   so that messages will be sent every 10 milliseconds.  This can be anywhere from 1 to 5000 milliseconds.
+  To have the Analog Ins autosend at their own interval instead, send
+  \verbatim /analogins/autosend-interval 2 \endverbatim
+  and send an interval of 0 to go back to following the system interval.
   \par
   You also need to select whether the board should send to you over USB or Ethernet.  Send
   \verbatim /system/autosend-usb 1 \endverbatim
   to send via USB, and 
   \verbatim /system/autosend-udp 1 \endverbatim
   to send via Ethernet.  Via Ethernet, the board will send messages to the last address it received a message from.
+
+  \par Stream
+  The \b stream property samples all 8 Analog Ins continuously, in hardware, at a given rate.
+  While streaming, reading the \b value of an Analog In (or autosending it) just picks
+  up the most recent sample rather than waiting for a new conversion.
+  To sample all the Analog Ins 1000 times a second, send the message
+  \verbatim /analogins/stream 1000 \endverbatim
+  The board will respond with the rate it was actually able to set up, which may differ slightly.
+  This can be anywhere up to 2000.  To stop streaming, send
+  \verbatim /analogins/stream 0 \endverbatim
+  To find out the current rate (0 if not streaming), send the message with no argument.
+
+  \par All
+  The \b all property reads all 8 Analog Ins at once, from a single conversion.  Send the message
+  \verbatim /analogins/all \endverbatim
+  and the board will respond with one message containing 8 values, in order.
+
+  \par Autosend-all
+  By default, each Analog In that has autosend turned on sends its own message.  To send
+  a single \b /analogins/all message with all 8 values instead, whenever any of them changes, send
+  \verbatim /analogins/autosend-all 1 \endverbatim
+  which saves quite a bit of bandwidth when several inputs are autosending.  Send a 0 to go
+  back to separate messages.
 */
 
-// sort of a checksum to verify whether a previous save was legit
-#define AIN_AUTOSEND_SAVED 0xDF
+// send all channels in one /analogins/all message
+#define AIN_AUTOSEND_ALL (1 << 16)
 
 static int analoginAutosendVals[ANALOGIN_CHANNELS];
-static uint16_t analoginAutosendChannels;
+static uint32_t analoginAutosendChannels;
 
 void analoginAutoSendInit()
 {
-  analoginAutosendChannels = eepromRead(EEPROM_ANALOGIN_AUTOSEND);
-  if (((analoginAutosendChannels >> 8) & 0xFF) != AIN_AUTOSEND_SAVED)
-    analoginAutosendChannels = AIN_AUTOSEND_SAVED << 8;
+  int saved = eepromRead(EEPROM_ANALOGIN_AUTOSEND);
+  analoginAutosendChannels = (saved == -1) ? 0 : saved & (0xFF | AIN_AUTOSEND_ALL);
 }
 
 static void analoginOscHandler(OscChannel ch, char* address, int idx, OscData d[], int datalen)
@@ -300,18 +584,63 @@ static void analoginOscHandler(OscChannel ch, char* address, int idx, OscData d[
 static void analoginOscAutosender(OscChannel ch)
 {
   uint8_t i;
-  OscData d = { .type = INT };
+  OscData d[ANALOGIN_CHANNELS];
+  int values[ANALOGIN_CHANNELS];
   char addr[19];
+  bool changed = false;
+
+  if ((analoginAutosendChannels & 0xFF) == 0)
+    return;
+  // one conversion per autosend period, shared with anybody else autosending from the inputs
+  if (!analoginSnapshot(values, oscAutosendNodeInterval(&analoginOsc) / 2))
+    return; // no reading this time around - try again next period
   for (i = 0; i < ANALOGIN_CHANNELS; i++) {
-    if (analoginAutosendChannels & (1 << i)) {
-      d.value.i = analoginValue(i);
-      if (analoginAutosendVals[i] != d.value.i) {
-        analoginAutosendVals[i] = d.value.i;
+    d[i].type = INT;
+    d[i].value.i = values[i];
+    if ((analoginAutosendChannels & (1 << i)) && analoginAutosendVals[i] != values[i]) {
+      analoginAutosendVals[i] = values[i];
+      changed = true;
+      if (!(analoginAutosendChannels & AIN_AUTOSEND_ALL)) {
         sniprintf(addr, sizeof(addr), "/analogin/%d/value", i);
-        oscCreateMessage(ch, addr, &d, 1);
+        oscCreateMessage(ch, addr, &d[i], 1);
       }
     }
   }
+  if (changed && (analoginAutosendChannels & AIN_AUTOSEND_ALL))
+    oscCreateMessage(ch, "/analogins/all", d, ANALOGIN_CHANNELS);
+}
+
+static void analoginAllHandler(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  UNUSED(idx);
+  UNUSED(d);
+  if (datalen == 0) {
+    OscData all[ANALOGIN_CHANNELS];
+    int values[ANALOGIN_CHANNELS];
+    int i;
+    analoginMulti(values);
+    for (i = 0; i < ANALOGIN_CHANNELS; i++) {
+      all[i].type = INT;
+      all[i].value.i = values[i];
+    }
+    oscCreateMessage(ch, address, all, ANALOGIN_CHANNELS);
+  }
+}
+
+static void analoginAutosendAllHandler(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  UNUSED(idx);
+  if (datalen == 0) {
+    OscData d = { .type = INT, .value.i = (analoginAutosendChannels & AIN_AUTOSEND_ALL) ? 1 : 0 };
+    oscCreateMessage(ch, address, &d, 1);
+  }
+  else if (datalen == 1) {
+    if (d[0].value.i)
+      analoginAutosendChannels |= AIN_AUTOSEND_ALL;
+    else
+      analoginAutosendChannels &= ~AIN_AUTOSEND_ALL;
+    eepromWriteDeferred(EEPROM_ANALOGIN_AUTOSEND, analoginAutosendChannels);
+  }
 }
 
 static void analoginAutosendHandler(OscChannel ch, char* address, int idx, OscData d[], int datalen)
@@ -330,17 +659,57 @@ static void analoginAutosendHandler(OscChannel ch, char* address, int idx, OscDa
     else
       analoginAutosendChannels &= ~(1 << idx);
 
-    eepromWrite(EEPROM_ANALOGIN_AUTOSEND, analoginAutosendChannels);
+    eepromWriteDeferred(EEPROM_ANALOGIN_AUTOSEND, analoginAutosendChannels);
   }
 }
 
+static void analoginStreamOscHandler(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  UNUSED(idx);
+  if (datalen == 1 && d[0].type == INT) {
+    if (d[0].value.i > 0)
+      analoginStreamStart(d[0].value.i, 0);
+    else
+      analoginStreamStop();
+  }
+  OscData rate = { .type = INT, .value.i = analoginStreamRate() };
+  oscCreateMessage(ch, address, &rate, 1);
+}
+
+// the autosender belongs to analoginOsc, even though its interval is set via /analogins
+static void analoginAutosendIntervalHandler(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  UNUSED(idx);
+  oscAutosendIntervalProperty(ch, address, &analoginOsc, d, datalen);
+}
+
 static const OscNode analoginAutosendNode = { .name = "autosend", .handler = analoginAutosendHandler };
 static const OscNode analoginValueNode = { .name = "value", .handler = analoginOscHandler };
 
 const OscNode analoginOsc = {
   .name = "analogin",
   .range = ANALOGIN_CHANNELS,
-  .children = { &analoginValueNode, &analoginAutosendNode, 0 },
+  .children = {
+    &analoginValueNode,
+    &analoginAutosendNode, 0
+  },
   .autosender = analoginOscAutosender
 };
+
+static const OscNode analoginStreamNode = { .name = "stream", .handler = analoginStreamOscHandler };
+static const OscNode analoginAllNode = { .name = "all", .handler = analoginAllHandler };
+static const OscNode analoginAutosendAllNode = { .name = "autosend-all", .handler = analoginAutosendAllHandler };
+static const OscNode analoginAutosendIntervalNode = { .name = "autosend-interval", .handler = analoginAutosendIntervalHandler };
+
+// properties of all the inputs at once - they can't live under analoginOsc,
+// since everything below a range node is addressed per channel
+const OscNode analoginsOsc = {
+  .name = "analogins",
+  .children = {
+    &analoginStreamNode,
+    &analoginAllNode,
+    &analoginAutosendAllNode,
+    &analoginAutosendIntervalNode, 0
+  }
+};
 #endif // OSC
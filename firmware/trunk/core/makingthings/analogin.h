@@ -23,6 +23,8 @@
 #include "config.h"
 #include "types.h"
 
+typedef void (*AnaloginStreamHandler)(const uint16_t samples[], int frames);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -30,6 +32,11 @@ void analoginInit(void);
 void analoginDeinit(void);
 int  analoginValue(int channel);
 bool analoginMulti(int values[]);
+bool analoginSnapshot(int values[], int maxAge);
+int  analoginStreamStart(int rate, AnaloginStreamHandler handler);
+void analoginStreamStop(void);
+int  analoginStreamRate(void);
+bool analoginStreamSnapshot(int values[]);
 #ifdef __cplusplus
 }
 #endif
@@ -37,5 +44,6 @@ bool analoginMulti(int values[]);
 #ifdef OSC
 #include "osc.h"
 extern const OscNode analoginOsc;
+extern const OscNode analoginsOsc;
 #endif // OSC
 #endif // ANALOGIN_H
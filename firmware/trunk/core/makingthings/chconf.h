@@ -153,7 +153,7 @@
  * @note    The default is @p TRUE.
  */
 #if !defined(CH_USE_REGISTRY) || defined(__DOXYGEN__)
-#define CH_USE_REGISTRY                 FALSE
+#define CH_USE_REGISTRY                 TRUE
 #endif
 
 /**
@@ -431,7 +431,7 @@
  * @note    The default is @p FALSE.
  */
 #if !defined(CH_DBG_FILL_THREADS) || defined(__DOXYGEN__)
-#define CH_DBG_FILL_THREADS             FALSE
+#define CH_DBG_FILL_THREADS             TRUE
 #endif
 
 /**
@@ -444,7 +444,7 @@
  *          some test cases into the test suite.
  */
 #if !defined(CH_DBG_THREADS_PROFILING) || defined(__DOXYGEN__)
-#define CH_DBG_THREADS_PROFILING        FALSE
+#define CH_DBG_THREADS_PROFILING        TRUE
 #endif
 
 /*===========================================================================*/
@@ -461,6 +461,10 @@ struct {                                                                    \
   /* Add threads custom fields here.*/                                      \
   /* Space for the LWIP sys_timeouts structure.*/                           \
   void                  *p_lwipspace[1];                                    \
+  /* Set by systemRegisterThread(), for /system/threads.*/                  \
+  const char            *p_label;                                           \
+  size_t                p_wasize;                                           \
+  systime_t             p_lasttime;                                         \
 };
 #endif
 
@@ -475,6 +479,9 @@ struct {                                                                    \
 #define THREAD_EXT_INIT_HOOK(tp) {                                          \
   /* Add threads initialization code here.*/                                \
   (tp)->p_lwipspace[0] = NULL;                                              \
+  (tp)->p_label = NULL;                                                     \
+  (tp)->p_wasize = 0;                                                       \
+  (tp)->p_lasttime = 0;                                                     \
 }
 #endif
 
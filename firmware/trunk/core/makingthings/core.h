@@ -23,6 +23,11 @@
 #ifndef CORE_H
 #define CORE_H
 
+// before the macros below, which would otherwise clash with a host C library's random() and sleep()
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
 #define UNUSED(x) (void)x
 #define MIN(a, b) ((a < b) ? a : b)
 #define MAX(a, b) ((a > b) ? a : b)
@@ -60,6 +65,7 @@ void name##Function()
 #define createThread(name, priority)                                                  \
 {                                                                                     \
   name = chThdCreateStatic(name##_WA, sizeof(name##_WA), priority, name##_Thd, NULL); \
+  systemRegisterThread(name, #name, sizeof(name##_WA));                               \
 }
 
 /**
@@ -95,10 +101,6 @@ void kill(void);
 #include "ch.h"
 #include "hal.h"
 
-#include <stdlib.h>
-#include <string.h>
-#include <stdio.h>
-
 // all the basics
 #include "types.h"
 #include "error.h"
@@ -107,12 +109,16 @@ void kill(void);
 #include "system.h"
 #include "pwm.h"
 #include "mtserial.h"
+#if !defined(SIMULATOR)
 #include "mtspi.h"
+#endif
 #include "eeprom.h"
 #include "timer.h"
 #include "fasttimer.h"
 #include "led.h"
 #include "analogin.h"
+#include "mtstats.h"
+#include "defer.h"
 
 #ifdef MAKE_CTRL_NETWORK
 #include "network.h"
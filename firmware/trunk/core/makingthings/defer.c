@@ -0,0 +1,259 @@
+/*********************************************************************************
+
+ Copyright 2006-2009 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+#include "defer.h"
+#include "core.h"
+
+#ifndef DEFER_QUEUE_SIZE
+#define DEFER_QUEUE_SIZE 16
+#endif
+
+#ifndef DEFER_STACK_SIZE
+#define DEFER_STACK_SIZE 512
+#endif
+
+#ifndef DEFER_PRIORITY
+#define DEFER_PRIORITY LOWPRIO
+#endif
+
+typedef struct {
+  DeferHandler handler; // 0 once cancelled
+  int key;
+  int value;
+} DeferItem;
+
+static struct {
+  DeferItem items[DEFER_QUEUE_SIZE];
+  int head;
+  int count;
+  bool running;         // the item at head is being run right now
+  Mutex lock;
+  Semaphore ready;      // one count per item in the queue
+  Thread* thd;
+  Stat posted;
+  Stat coalesced;
+  Stat stalls;
+  Stat depthMax;
+} defer = {
+  .lock = _MUTEX_DATA(defer.lock),
+  .ready = _SEMAPHORE_DATA(defer.ready, 0),
+  .posted = { .name = "defer.posted" },
+  .coalesced = { .name = "defer.coalesced" },
+  .stalls = { .name = "defer.stalls" },
+  .depthMax = { .name = "defer.depth.max" }
+};
+
+static WORKING_AREA(deferWA, DEFER_STACK_SIZE);
+static msg_t deferThread(void *arg);
+static void deferStart(void);
+
+/**
+  \defgroup defer Deferred Work
+  Hand slow jobs off to a low priority thread.
+
+  Some things take a while - writing to the EEPROM, for instance, has to wait out the
+  chip's whole write cycle.  An OSC handler that does that directly holds up every
+  other message on its channel in the meantime.  Instead, it can post the job with
+  deferPost() and get on with it - the deferred work thread will get to it when
+  nothing more important is going on.
+
+  \section Coalescing
+  Each job is a handler plus a \b key and a \b value.  If a job for the same handler and
+  key is still waiting when another is posted, the waiting one just takes the new value -
+  so a slider sending a new setting 50 times a second makes one write, not 50.  Jobs
+  otherwise run in the order they were posted.
+
+  Since a job might not have run yet, deferPending() lets you check for a value that's
+  on its way - eepromRead() uses it so it never returns something older than what was
+  last written with eepromWriteDeferred().  deferFlush() waits for the queue to empty,
+  which is worth doing before a reset.
+
+  The queue's activity shows up in the \ref stats as \b defer.posted, \b defer.coalesced,
+  \b defer.stalls (posts that had to wait for room in the queue) and \b defer.depth.max.
+
+  \b Example
+  \code
+  void saveSetting(int key, int value)
+  {
+    // something slow...
+  }
+
+  void mySettingOscHandler(int value)
+  {
+    deferPost(saveSetting, MY_SETTING, value); // returns right away
+  }
+  \endcode
+  \ingroup Core
+  @{
+*/
+
+/**
+  Run a job on the deferred work thread.
+  If the same handler and key are already waiting to run, that job is updated with
+  the new value instead.  If the queue is full, this waits until there's room.
+  @param handler The function to run.
+  @param key Passed to the handler - also identifies jobs that can be combined.
+  @param value Passed to the handler.
+*/
+void deferPost(DeferHandler handler, int key, int value)
+{
+  if (defer.thd == 0)
+    deferStart();
+
+  if (chThdSelf() == defer.thd) { // posted from a job - waiting for room would never end
+    handler(key, value);
+    return;
+  }
+
+  statInc(&defer.posted);
+  bool stalled = false;
+  while (true) {
+    chMtxLock(&defer.lock);
+    int i;
+    for (i = defer.running ? 1 : 0; i < defer.count; i++) {
+      DeferItem* item = &defer.items[(defer.head + i) % DEFER_QUEUE_SIZE];
+      if (item->handler == handler && item->key == key) {
+        item->value = value;
+        chMtxUnlock();
+        statInc(&defer.coalesced);
+        return;
+      }
+    }
+    if (defer.count < DEFER_QUEUE_SIZE) {
+      DeferItem* item = &defer.items[(defer.head + defer.count) % DEFER_QUEUE_SIZE];
+      item->handler = handler;
+      item->key = key;
+      item->value = value;
+      defer.count++;
+      statMax(&defer.depthMax, defer.count);
+      chMtxUnlock();
+      chSemSignal(&defer.ready);
+      return;
+    }
+    chMtxUnlock();
+    if (!stalled) {
+      statInc(&defer.stalls);
+      stalled = true;
+    }
+    chThdSleepMilliseconds(1);
+  }
+}
+
+/**
+  Check whether a job is still waiting to run, and get its value.
+  If there's more than one, the most recently posted value is returned.
+  @param handler The function it was posted with.
+  @param key The key it was posted with.
+  @param value Set to its value, if there's one waiting.
+  @return True if there's a job waiting.
+*/
+bool deferPending(DeferHandler handler, int key, int* value)
+{
+  if (defer.thd == 0)
+    return false;
+  bool found = false;
+  chMtxLock(&defer.lock);
+  int i;
+  for (i = defer.count - 1; i >= 0 && !found; i--) {
+    DeferItem* item = &defer.items[(defer.head + i) % DEFER_QUEUE_SIZE];
+    if (item->handler == handler && item->key == key) {
+      *value = item->value;
+      found = true;
+    }
+  }
+  chMtxUnlock();
+  return found;
+}
+
+/**
+  Drop any jobs for a handler and key that haven't started yet.
+  Handy when doing the same thing right away - so a stale job doesn't undo it later.
+  @param handler The function they were posted with.
+  @param key The key they were posted with.
+*/
+void deferCancel(DeferHandler handler, int key)
+{
+  if (defer.thd == 0)
+    return;
+  chMtxLock(&defer.lock);
+  int i;
+  for (i = defer.running ? 1 : 0; i < defer.count; i++) {
+    DeferItem* item = &defer.items[(defer.head + i) % DEFER_QUEUE_SIZE];
+    if (item->handler == handler && item->key == key)
+      item->handler = 0;
+  }
+  chMtxUnlock();
+}
+
+/**
+  Wait for all the queued jobs to finish.
+  @param timeout The longest to wait, in milliseconds.
+  @return True if the queue is empty.
+*/
+bool deferFlush(int timeout)
+{
+  if (defer.thd == 0 || chThdSelf() == defer.thd)
+    return true;
+  systime_t end = chTimeNow() + MS2ST(timeout);
+  while (defer.count > 0) {
+    if ((int32_t)(end - chTimeNow()) <= 0)
+      return false;
+    chThdSleepMilliseconds(1);
+  }
+  return true;
+}
+
+/** @} */
+
+// the thread is only started once somebody has work for it
+static void deferStart()
+{
+  chMtxLock(&defer.lock);
+  if (defer.thd == 0) {
+    statsAdd(&defer.posted);
+    statsAdd(&defer.coalesced);
+    statsAdd(&defer.stalls);
+    statsAdd(&defer.depthMax);
+    defer.thd = chThdCreateStatic(deferWA, sizeof(deferWA), DEFER_PRIORITY, deferThread, NULL);
+    systemRegisterThread(defer.thd, "defer", sizeof(deferWA));
+  }
+  chMtxUnlock();
+}
+
+static msg_t deferThread(void *arg)
+{
+  UNUSED(arg);
+  while (true) {
+    chSemWait(&defer.ready);
+
+    // leave it in the queue while it runs, so deferPending() still sees it
+    chMtxLock(&defer.lock);
+    DeferItem item = defer.items[defer.head];
+    defer.running = true;
+    chMtxUnlock();
+
+    if (item.handler)
+      item.handler(item.key, item.value);
+
+    chMtxLock(&defer.lock);
+    defer.head = (defer.head + 1) % DEFER_QUEUE_SIZE;
+    defer.count--;
+    defer.running = false;
+    chMtxUnlock();
+  }
+  return 0;
+}
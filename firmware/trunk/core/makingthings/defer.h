@@ -0,0 +1,41 @@
+/*********************************************************************************
+
+ Copyright 2006-2009 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+#ifndef DEFER_H
+#define DEFER_H
+
+#include "types.h"
+
+/**
+  A function to be run later by the deferred work thread.
+  It gets the \b key and \b value it was posted with.
+  \ingroup defer
+*/
+typedef void (*DeferHandler)(int key, int value);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void deferPost(DeferHandler handler, int key, int value);
+bool deferPending(DeferHandler handler, int key, int* value);
+void deferCancel(DeferHandler handler, int key);
+bool deferFlush(int timeout);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEFER_H
@@ -16,6 +16,7 @@
 *********************************************************************************/
 
 #include "eeprom.h"
+#include "defer.h"
 
 #define EEPROM_INSTRUCTION_WREN 0x06
 #define EEPROM_INSTRUCTION_WRDI 0x04
@@ -27,6 +28,64 @@
 #define EEPROM_DEVICE 0x03
 //#define EEPROM_NOTCS 0x0B
 
+#define EEPROM_STATUS_WIP 0x01 // write in progress
+
+#ifndef EEPROM_WRITE_TIME
+#define EEPROM_WRITE_TIME 5 // the longest a write cycle takes, in milliseconds
+#endif
+
+// bump this if the layout of the system section changes
+#define EEPROM_SYSTEM_VERSION 1
+#define EEPROM_SYSTEM_PAGES (EEPROM_RESERVE_SIZE / EEPROM_PAGE_SIZE)
+#if EEPROM_SYSTEM_PAGES > 32
+#error "the dirty page mask only has room for 32 pages"
+#endif
+
+/*
+  The system section, kept in RAM.  Reads come straight from here, and writes
+  mark their pages dirty and leave the defer thread to write them out.
+*/
+static struct {
+  uint8_t data[EEPROM_RESERVE_SIZE];
+  uint32_t dirty;       // one bit per page
+  bool loaded;
+  Mutex lock;
+  Stat flushes;
+  Stat pages;
+} eepromSystem = {
+  .lock = _MUTEX_DATA(eepromSystem.lock),
+  .flushes = { .name = "eeprom.system.flushes" },
+  .pages = { .name = "eeprom.system.pages" }
+};
+
+/*
+  The chip itself.  Only one thread talks to it at a time, and after a write we
+  remember when the write cycle will be over, so the next access can sleep
+  until then rather than asking the chip over and over.
+*/
+static struct {
+  Mutex lock;
+  bool busy;            // a write cycle might still be going
+  systime_t writeDone;  // when it's sure to be finished
+  bool statsAdded;
+  Stat readBytes;
+  Stat writeBytes;
+  Stat writeCycles;
+} eepromChip = {
+  .lock = _MUTEX_DATA(eepromChip.lock),
+  .readBytes = { .name = "eeprom.read.bytes" },
+  .writeBytes = { .name = "eeprom.write.bytes" },
+  .writeCycles = { .name = "eeprom.write.cycles" }
+};
+
+static void eepromDeferredWrite(int address, int value);
+static void eepromSystemLoad(void);
+static void eepromSystemFlush(int key, int value);
+static void eepromSystemWritePage(int p, uint8_t* page);
+static void eepromChipLock(void);
+static int eepromChipReadBlock(int address, uint8_t* data, int length);
+static int eepromChipWriteBlock(int address, uint8_t *data, int length);
+
 /**
   \defgroup eeprom EEPROM
   Persistent storage of 32k bytes of data.
@@ -45,6 +104,26 @@
   \b EEPROM_SYSTEM_BASE provides the last available address before the reserved section, so
   make sure that none of the addresses that you're writing to are greater than \b EEPROM_SYSTEM_BASE.
 
+  \section system System Settings
+  The reserved section is read into RAM the first time it's used, so reading a setting never
+  has to wait for the chip.  Writing one only changes the copy in RAM and marks its page - the
+  \ref defer thread then writes the changed pages back a whole page at a time, so a handful of
+  settings changed together cost one write cycle rather than one each.
+
+  The section starts with a version and checksum (\b EEPROM_SYSTEM_HEADER).  If they don't
+  check out when it's loaded, everything but the serial number is erased, so each setting goes
+  back to its default.  Settings that have never been written read back as -1.
+
+  Each write has to wait out the chip's write cycle, which can hold up whatever else the
+  calling thread was doing.  eepromWriteDeferred() hands the write to the \ref defer thread
+  instead - handy in OSC handlers, and repeated writes to the same address only hit the
+  chip once.
+
+  Blocks are streamed to and from the chip by the SPI's DMA controller, and writes are split
+  up at the chip's page boundaries (\b EEPROM_PAGE_SIZE) as needed.  While the chip is busy
+  with a write cycle, the next thread to use it sleeps rather than tying up the CPU.  The
+  \ref stats include \b eeprom.read.bytes, \b eeprom.write.bytes and \b eeprom.write.cycles.
+
   Internally, Eeprom relies on \ref SPI, so activating Eeprom also activates \ref SPI.
   \ingroup Core
   @{
@@ -58,20 +137,36 @@ void eepromInit()
   spiConfigure(Spi0, EEPROM_DEVICE, 8, 16, 0, 1);
 }
 
+// call with the SPI locked
 static void eepromWriteEnable(void)
 {
   uint8_t c = EEPROM_INSTRUCTION_WREN;
   spiReadWriteBlock(Spi0, EEPROM_DEVICE, &c, 1);
 }
 
+static bool eepromWriteInProgress(void)
+{
+  uint8_t c[2] = { EEPROM_INSTRUCTION_RDSR, 0 };
+  spiLock(Spi0);
+  spiReadWriteBlock(Spi0, EEPROM_DEVICE, c, 2);
+  spiUnlock();
+  return (c[1] & EEPROM_STATUS_WIP) != 0;
+}
+
+/*
+  Wait for the last write cycle to finish - call with eepromChip.lock held.
+  The SPI isn't held while we sleep, so the rest of the bus carries on.
+*/
 static void eepromReady(void)
 {
-  uint8_t c[2];
-  do {
-    c[0] = EEPROM_INSTRUCTION_RDSR;
-    c[1] = 0;
-    spiReadWriteBlock(Spi0, EEPROM_DEVICE, c, 2);
-  } while ((c[1] & 1) != 0);
+  if (!eepromChip.busy)
+    return;
+  systime_t left = eepromChip.writeDone - chTimeNow();
+  if ((int32_t)left > 0)
+    chThdSleep(left);
+  while (eepromWriteInProgress()) // only if the chip is slower than its datasheet
+    chThdSleepMilliseconds(1);
+  eepromChip.busy = false;
 }
 
 /**
@@ -87,7 +182,8 @@ static void eepromReady(void)
 int eepromRead(int address)
 {
   int val;
-  eepromReadBlock(address, (uint8_t*)&val, 4);
+  if (!deferPending(eepromDeferredWrite, address, &val)) // not written out yet
+    eepromReadBlock(address, (uint8_t*)&val, 4);
   return val;
 }
 
@@ -104,9 +200,35 @@ int eepromRead(int address)
 */
 void eepromWrite(int address, int value)
 {
+  deferCancel(eepromDeferredWrite, address); // so an older deferred write can't land on top of this one
   eepromWriteBlock(address, (uint8_t*)&value, 4);
 }
 
+/**
+  Write an int to EEPROM in the background.
+  This returns right away, and the write happens on the \ref defer thread.  If
+  there's already a write to the same address waiting, it just gets the new value.
+  eepromRead() returns the new value straight away, but eepromReadBlock() won't
+  see it until it has actually been written.
+  @param address The address to write to.
+  @param value The value to store
+
+  \b Example
+  \code
+  void mySettingOscHandler(int value)
+  {
+    eepromWriteDeferred(MY_SETTING_ADDRESS, value); // don't hold up the other OSC messages
+  }
+  \endcode
+*/
+void eepromWriteDeferred(int address, int value)
+{
+  if (address >= EEPROM_SYSTEM_BASE)
+    eepromWrite(address, value); // only touches RAM - it gets written out later anyway
+  else
+    deferPost(eepromDeferredWrite, address, value);
+}
+
 /**
   Read a block of data from EEPROM.
   @param address The address to start reading from
@@ -122,26 +244,22 @@ void eepromWrite(int address, int value)
 */
 int eepromReadBlock(int address, uint8_t* data, int length)
 {
-  if (address < 0 || address > EEPROM_SIZE)
+  if (address < 0 || length < 0 || address + length > EEPROM_SIZE)
     return CONTROLLER_ERROR_BAD_ADDRESS;
 
-  spiLock(Spi0);
-  eepromReady();
-
-  unsigned char c[length + 4];
-  c[0] = EEPROM_INSTRUCTION_READ;
-  c[1] = (unsigned char)(address >> 8);
-  c[2] = (unsigned char)(address & 0xFF);
-  c[3] = 0;
-  
-  spiReadWriteBlock(Spi0, EEPROM_DEVICE, c, length + 3);
-
-  int i;
-  for (i = 0; i < length; i++)
-    data[i] = c[i + 3];
-
-  spiUnlock();
-
+  if (address < EEPROM_SYSTEM_BASE) {
+    int n = MIN(length, EEPROM_SYSTEM_BASE - address);
+    eepromChipReadBlock(address, data, n);
+    address += n;
+    data += n;
+    length -= n;
+  }
+  if (length > 0) {
+    eepromSystemLoad();
+    chMtxLock(&eepromSystem.lock);
+    memcpy(data, &eepromSystem.data[address - EEPROM_SYSTEM_BASE], length);
+    chMtxUnlock();
+  }
   return CONTROLLER_OK;
 }
 
@@ -159,32 +277,212 @@ int eepromReadBlock(int address, uint8_t* data, int length)
 */
 int eepromWriteBlock(int address, uint8_t *data, int length)
 {
-  if (address < 0 || address >= EEPROM_SIZE)
+  if (address < 0 || length < 0 || address + length > EEPROM_SIZE)
     return CONTROLLER_ERROR_BAD_ADDRESS;
 
-  spiLock(Spi0);
-  eepromReady();
-  eepromWriteEnable();    
+  if (address < EEPROM_SYSTEM_BASE) {
+    int n = MIN(length, EEPROM_SYSTEM_BASE - address);
+    eepromChipWriteBlock(address, data, n);
+    address += n;
+    data += n;
+    length -= n;
+  }
+  if (length > 0) {
+    eepromSystemLoad();
+    int offset = address - EEPROM_SYSTEM_BASE;
+    chMtxLock(&eepromSystem.lock);
+    if (memcmp(&eepromSystem.data[offset], data, length) != 0) {
+      memcpy(&eepromSystem.data[offset], data, length);
+      int page;
+      for (page = offset / EEPROM_PAGE_SIZE; page <= (offset + length - 1) / EEPROM_PAGE_SIZE; page++)
+        eepromSystem.dirty |= (1 << page);
+      chMtxUnlock();
+      deferPost(eepromSystemFlush, 0, 0);
+    }
+    else
+      chMtxUnlock();
+  }
+  return CONTROLLER_OK;
+}
+
+/**
+  Write any changed system settings out to the chip now.
+  They're normally written in the background shortly after they change - this
+  waits until they have been.
+  @param timeout The longest to wait, in milliseconds.
+  @return True if everything has been written.
+*/
+bool eepromSystemSync(int timeout)
+{
+  return deferFlush(timeout) && eepromSystem.dirty == 0;
+}
 
-  uint8_t c[length + 4];
-  c[0] = EEPROM_INSTRUCTION_WRITE;
-  c[1] = (uint8_t)(address >> 8);
-  c[2] = (uint8_t)(address & 0xFF);
-  c[3] = 0;
+/** @} */
 
+// runs on the defer thread
+void eepromDeferredWrite(int address, int value)
+{
+  eepromWriteBlock(address, (uint8_t*)&value, 4);
+}
+
+static uint16_t eepromSystemChecksum(void)
+{
+  // Fletcher-16 over everything but the header itself
+  uint16_t a = 0, b = 0;
   int i;
-  for (i = 0; i < length; i++)
-    c[i + 3] = data[i];
-  
-  spiReadWriteBlock(Spi0, EEPROM_DEVICE, c, 3 + length);
-  spiUnlock();
+  for (i = 0; i < EEPROM_RESERVE_SIZE; i++) {
+    if (i >= EEPROM_SYSTEM_HEADER - EEPROM_SYSTEM_BASE && i < EEPROM_SYSTEM_HEADER - EEPROM_SYSTEM_BASE + 4)
+      continue;
+    a = (a + eepromSystem.data[i]) % 255;
+    b = (b + a) % 255;
+  }
+  return (b << 8) | a;
+}
 
-  return CONTROLLER_OK;
+static uint32_t eepromSystemHeader(void)
+{
+  return ((uint32_t)eepromSystemChecksum() << 16) | EEPROM_SYSTEM_VERSION;
 }
 
-/** @} */
+/*
+  Read the system section into RAM, the first time it's needed.  If it was
+  last saved by firmware from before it had a header, the settings are kept
+  and the old network address check is used one last time.
+*/
+static void eepromSystemLoad(void)
+{
+  if (eepromSystem.loaded)
+    return;
+  chMtxLock(&eepromSystem.lock);
+  if (!eepromSystem.loaded) {
+    int i;
+    for (i = 0; i < EEPROM_RESERVE_SIZE; i += EEPROM_PAGE_SIZE)
+      eepromChipReadBlock(EEPROM_SYSTEM_BASE + i, &eepromSystem.data[i], EEPROM_PAGE_SIZE);
+
+    int32_t* words = (int32_t*)eepromSystem.data;
+    #define SYSTEM_WORD(address) words[((address) - EEPROM_SYSTEM_BASE) / 4]
+    uint32_t header = SYSTEM_WORD(EEPROM_SYSTEM_HEADER);
+    if (header == 0xFFFFFFFF) { // older firmware
+      if (SYSTEM_WORD(EEPROM_SYSTEM_NET_CHECK) != SYSTEM_WORD(EEPROM_SYSTEM_NET_ADDRESS) +
+                                                  SYSTEM_WORD(EEPROM_SYSTEM_NET_MASK) +
+                                                  SYSTEM_WORD(EEPROM_SYSTEM_NET_GATEWAY)) {
+        SYSTEM_WORD(EEPROM_SYSTEM_NET_ADDRESS) = -1;
+        SYSTEM_WORD(EEPROM_SYSTEM_NET_MASK) = -1;
+        SYSTEM_WORD(EEPROM_SYSTEM_NET_GATEWAY) = -1;
+      }
+      SYSTEM_WORD(EEPROM_SYSTEM_NET_CHECK) = -1;
+    }
+    else if (header != eepromSystemHeader()) {
+      int serial = SYSTEM_WORD(EEPROM_SYSTEM_SERIAL_NUMBER);
+      memset(eepromSystem.data, 0xFF, sizeof(eepromSystem.data));
+      SYSTEM_WORD(EEPROM_SYSTEM_SERIAL_NUMBER) = serial;
+    }
+    #undef SYSTEM_WORD
+    if (header != eepromSystemHeader())
+      eepromSystem.dirty = (1 << EEPROM_SYSTEM_PAGES) - 1; // write it all back with a good header
+
+    statsAdd(&eepromSystem.flushes);
+    statsAdd(&eepromSystem.pages);
+    eepromSystem.loaded = true;
+  }
+  chMtxUnlock();
+  if (eepromSystem.dirty)
+    deferPost(eepromSystemFlush, 0, 0);
+}
 
+/*
+  Runs on the defer thread.  The header goes in last, so if the power goes
+  partway through, the next load sees a bad checksum rather than a mix of
+  old and new settings.
+*/
+static void eepromSystemFlush(int key, int value)
+{
+  UNUSED(key);
+  UNUSED(value);
+  uint8_t page[EEPROM_PAGE_SIZE];
+  int headerPage = (EEPROM_SYSTEM_HEADER - EEPROM_SYSTEM_BASE) / EEPROM_PAGE_SIZE;
+
+  chMtxLock(&eepromSystem.lock);
+  if (eepromSystem.dirty == 0) {
+    chMtxUnlock();
+    return;
+  }
+  uint32_t header = eepromSystemHeader();
+  memcpy(&eepromSystem.data[EEPROM_SYSTEM_HEADER - EEPROM_SYSTEM_BASE], &header, 4);
+  eepromSystem.dirty |= (1 << headerPage);
+  chMtxUnlock();
+  statInc(&eepromSystem.flushes);
+
+  int p;
+  for (p = 0; p < EEPROM_SYSTEM_PAGES; p++) {
+    if (p != headerPage)
+      eepromSystemWritePage(p, page);
+  }
+  eepromSystemWritePage(headerPage, page);
+}
 
+static void eepromSystemWritePage(int p, uint8_t* page)
+{
+  chMtxLock(&eepromSystem.lock);
+  bool dirty = (eepromSystem.dirty & (1 << p)) != 0;
+  eepromSystem.dirty &= ~(1 << p);
+  memcpy(page, &eepromSystem.data[p * EEPROM_PAGE_SIZE], EEPROM_PAGE_SIZE);
+  chMtxUnlock();
+  if (dirty) {
+    eepromChipWriteBlock(EEPROM_SYSTEM_BASE + p * EEPROM_PAGE_SIZE, page, EEPROM_PAGE_SIZE);
+    statInc(&eepromSystem.pages);
+  }
+}
 
+/*
+  eepromInit() runs before the kernel is started, so the stats get added
+  the first time the chip is used instead.
+*/
+static void eepromChipLock(void)
+{
+  chMtxLock(&eepromChip.lock);
+  if (!eepromChip.statsAdded) {
+    statsAdd(&eepromChip.readBytes);
+    statsAdd(&eepromChip.writeBytes);
+    statsAdd(&eepromChip.writeCycles);
+    eepromChip.statsAdded = true;
+  }
+}
 
+static int eepromChipReadBlock(int address, uint8_t* data, int length)
+{
+  uint8_t cmd[3] = { EEPROM_INSTRUCTION_READ, address >> 8, address & 0xFF };
+  eepromChipLock();
+  eepromReady();
+  spiLock(Spi0);
+  spiTransfer(Spi0, EEPROM_DEVICE, cmd, 3, 0, data, length); // reads run on across pages
+  spiUnlock();
+  chMtxUnlock();
+  statAdd(&eepromChip.readBytes, length);
+  return CONTROLLER_OK;
+}
 
+static int eepromChipWriteBlock(int address, uint8_t *data, int length)
+{
+  eepromChipLock();
+  while (length > 0) {
+    // a write that runs off the end of a page wraps around to the start of the same
+    // page, so split it up and give each page its own write cycle
+    int n = MIN(length, EEPROM_PAGE_SIZE - (address % EEPROM_PAGE_SIZE));
+    uint8_t cmd[3] = { EEPROM_INSTRUCTION_WRITE, address >> 8, address & 0xFF };
+    eepromReady();
+    spiLock(Spi0);
+    eepromWriteEnable();
+    spiTransfer(Spi0, EEPROM_DEVICE, cmd, 3, data, 0, n);
+    spiUnlock();
+    eepromChip.busy = true;
+    eepromChip.writeDone = chTimeNow() + MS2ST(EEPROM_WRITE_TIME) + 1; // we might be partway through a tick
+    statAdd(&eepromChip.writeBytes, n);
+    statInc(&eepromChip.writeCycles);
+    address += n;
+    data += n;
+    length -= n;
+  }
+  chMtxUnlock();
+  return CONTROLLER_OK;
+}
@@ -26,6 +26,8 @@ extern "C" {
 void eepromInit(void);
 int  eepromRead(int address);
 void eepromWrite(int address, int value);
+void eepromWriteDeferred(int address, int value);
+bool eepromSystemSync(int timeout);
 int  eepromReadBlock(int address, uint8_t* data, int length);
 int  eepromWriteBlock(int address, uint8_t *data, int length);
 #ifdef __cplusplus
@@ -34,10 +36,13 @@ int  eepromWriteBlock(int address, uint8_t *data, int length);
 
 #define EEPROM_RESERVE_SIZE 1024
 #define EEPROM_SIZE (32 * 1024)
+#ifndef EEPROM_PAGE_SIZE
+#define EEPROM_PAGE_SIZE 64 // writes wrap around within a page of this size
+#endif
 #define EEPROM_SYSTEM_BASE          (EEPROM_SIZE - EEPROM_RESERVE_SIZE)
 #define EEPROM_SYSTEM_SERIAL_NUMBER         EEPROM_SYSTEM_BASE + 0
-#define EEPROM_SYSTEM_NOTUSED               EEPROM_SYSTEM_BASE + 4
-#define EEPROM_SYSTEM_NET_CHECK             EEPROM_SYSTEM_BASE + 8
+#define EEPROM_SYSTEM_HEADER                EEPROM_SYSTEM_BASE + 4  // version and checksum of the system section
+#define EEPROM_SYSTEM_NET_CHECK             EEPROM_SYSTEM_BASE + 8  // only read from boards that predate the header
 #define EEPROM_SYSTEM_NET_ADDRESS           EEPROM_SYSTEM_BASE + 12
 #define EEPROM_SYSTEM_NET_MASK              EEPROM_SYSTEM_BASE + 16
 #define EEPROM_SYSTEM_NET_GATEWAY           EEPROM_SYSTEM_BASE + 20
@@ -68,5 +73,6 @@ int  eepromWriteBlock(int address, uint8_t *data, int length);
 #define EEPROM_ANALOGIN_AUTOSEND            EEPROM_SYSTEM_BASE + 216
 #define EEPROM_OSC_ASYNC_INTERVAL           EEPROM_SYSTEM_BASE + 220
 #define EEPROM_DIGITALIN_AUTOSEND           EEPROM_SYSTEM_BASE + 224
+#define EEPROM_OSC_AUTOSEND_INTERVALS       EEPROM_SYSTEM_BASE + 228 // 4 bytes for each of OSC_MAX_AUTOSENDERS
 
 #endif
@@ -17,50 +17,60 @@
 
 #include "fasttimer.h"
 #include "error.h"
+#include "mtstats.h"
 #include "ch.h"
+#if defined(SIMULATOR)
+#include "simtc.h" // mock TC registers, which the simulator drives by hand
+#else
 #include "at91lib/AT91SAM7X256.h"
+#endif
+#include <string.h>
+#ifdef FASTIRQ_MONITOR_IO
+#include "pin.h"
+#endif
 
-#define FASTTIMER_COUNT 8
-#define FASTTIMER_MARGIN 2
 #define FASTTIMER_MAXCOUNT 0xFF00
 #define FASTTIMER_MINCOUNT 20
-#define FAST_TIMER_CYCLES_PER_US 6
 
-struct FastTimerManager {
-  char users;
-  short count;
-
-#ifdef FASTIRQ_STATS
-  int jitterTotal;
-  int jitterMax;
-  int jitterMaxAllDay;
-  int durationTotal;
-  int durationMax;
-  int durationMaxAllDay;
+// a handler that runs this long after it was due counts as late
+#ifndef FASTTIMER_LATE_TICKS
+#define FASTTIMER_LATE_TICKS (20 * FASTTIMER_TICKS_PER_US)
 #endif
 
-  char servicing;
-
-  int nextTime;
+/*
+  Running timers are kept in a queue sorted by when they're due.  Each
+  entry's delta is the number of ticks after the entry in front of it,
+  and the head's delta is counted from the start of the current slice -
+  the last time the counter was reset by an RC compare.  The interrupt
+  only needs to take expired entries off the front, however many
+  timers are running.
+*/
+struct FastTimerManager {
+  bool servicing;
+  int slice;         // what RC was set to, ie. how long the current slice is
+  int queued;
+  FastTimer* first;
+  FastTimer* current; // the entry whose handler is running
 
   AT91S_TC* tc;
   unsigned short channel_id;
 
-  FastTimer* first;
-  FastTimer* next;
-  FastTimer* previous;
-  FastTimer* lastAdded;
+  FastTimerStats stats;
 };
 
 static struct FastTimerManager manager;
 
+static void fasttimerJitterUpdate(Stat* s);
+static Stat fasttimerJitterStat = { .name = "fasttimer.jitter.max", .update = fasttimerJitterUpdate };
+
 #define fasttimerEnable() (manager.tc->TC_CCR = AT91C_TC_CLKEN | AT91C_TC_SWTRG)
-#define fasttimerTimeTarget() (manager.tc->TC_RC)
-#define fasttimerCurrentTime() (manager.tc->TC_CV)
-#define fasttimerSetTimeTarget(target) (manager.tc->TC_RC = (uint16_t)target)
-#define fasttimerIsRunning()  (manager.tc->TC_CCR & AT91C_TC_CLKSTA)
+#define fasttimerDisable() (manager.tc->TC_CCR = AT91C_TC_CLKDIS)
+#define fasttimerCurrentTime() ((int)manager.tc->TC_CV)
 
 static void fasttimerServeInterrupt(void);
+static void fasttimerInsert(FastTimer* ft, int ticks);
+static void fasttimerRemove(FastTimer* ft);
+static void fasttimerSetSlice(int ticks);
 
 /**
   \defgroup fasttimer Fast Timer
@@ -74,13 +84,15 @@ static void fasttimerServeInterrupt(void);
   A few things to be aware of when using FastTimers:
   - In your handler, you must not sleep or make any calls that will take a long time.  You may, however, use
   the Queue and Semaphore calls that end in \b fromISR in order to synchronize with running tasks.
-  - To modify an existing FastTimer, stop() it and then start() it again.  Modifying it while running is not recommended.
+  - Calling start() on a timer that's already running restarts it with the new interval.  A handler
+  may start() or stop() its own timer.
   - There are 3 identical hardware timers on the Make Controller.  The first FastTimer that you create
   will specify which of them to use, and it will be used for all subsequent fast timers created.  
   If you don't specify a channel, 2 is used which is usually fine.  Specifically, the \ref Timer is on 
   channel 0 by default, so make sure to keep them separate if you're running them at the same time.
-  - if you have lots of FastTimers, the timing can start to get a little jittery.  For instance, the \ref Servo and \ref Stepper
-  libraries use the FastTimer and they can become a little unstable if too many of them are running at once.
+  - Running timers are kept sorted by when they're next due, so the interrupt only deals with the 
+  timers that have expired.  Timers that come due at nearly the same moment still have to wait for each 
+  other's handlers though - use fasttimerStats() to see how much latency you're getting.
   \ingroup Core
   @{
 */
@@ -88,122 +100,137 @@ static void fasttimerServeInterrupt(void);
 /**
   Sets the requested entry to run.
   This routine adds the entry to the running queue and then decides if it needs
-  to start the timer (if it's not running) or alter the timer's clock for a shorter
-  period.
+  to bring the timer's next interrupt forward.
+  @param ft The timer to start.
   @param micros The interval (in microseconds) at which the handler should be called.
-  @param repeat Whether to call the handler repeatedly.  True by default.
+  @param repeat Whether to call the handler repeatedly, or just once.
+  @return CONTROLLER_OK.
 
   \b Example
   \code
   FastTimer t;
-  t.setHandler( myHandler, 345 );
-  t.start(250); // call myHandler every 250 microseconds
+  t.handler = myHandler;
+  t.id = 345;
+  fasttimerStart(&t, 250, true); // call myHandler every 250 microseconds
   \endcode
-  */
-int fasttimerStart(FastTimer *ft, int micros)
+*/
+int fasttimerStart(FastTimer *ft, int micros, bool repeat)
 {
-  ft->timeInitial = micros * FAST_TIMER_CYCLES_PER_US;
-  ft->next = NULL;
-  // this could be a lot smarter - for example, modifying the current period?
-  if (!manager.servicing)
+  if (!manager.servicing) {
     chSysLock();
+    manager.tc->TC_IDR = AT91C_TC_CPCS; // the FIQ isn't masked by chSysLock()
+  }
 
-  if (!fasttimerIsRunning()) {
-    fasttimerSetTimeTarget(ft->timeInitial);
-    fasttimerEnable();
-  }  
-
-  int target = fasttimerTimeTarget();
-  int remaining = target - fasttimerCurrentTime(); // Calculate how long remaining
-  ft->timeCurrent = ft->timeInitial; // Get the entry ready to roll
+  if (ft->queued)
+    fasttimerRemove(ft);
+  if (manager.current == ft)
+    manager.current = NULL; // the interrupt shouldn't reschedule it - we're doing that here
 
-  // Add entry
-  FastTimer* first = manager.first;
-  manager.first = ft;
-  ft->next = first;
+  ft->timeInitial = micros * FASTTIMER_TICKS_PER_US;
+  if (ft->timeInitial <= FASTTIMER_MINCOUNT)
+    ft->timeInitial = FASTTIMER_MINCOUNT + 1;
+  ft->repeat = repeat;
 
-  // Are we actually servicing an interrupt right now?
-  if (!manager.servicing) {
-    // No - so does the time requested by this new timer make the time need to come earlier?
-    if (ft->timeCurrent < (remaining - FASTTIMER_MARGIN)) {
-      // Damn it!  Reschedule the next callback
-      fasttimerSetTimeTarget(target - (remaining - ft->timeCurrent));
+  if (manager.servicing)
+    fasttimerInsert(ft, ft->timeInitial); // due times in the interrupt count from the compare
+  else {
+    int now = 0;
+    unsigned int status = manager.tc->TC_SR; // reading it clears CPCS, so only do it once
+    if (manager.first == NULL && !(status & AT91C_TC_CLKSTA)) {
+      fasttimerEnable(); // resets the counter, so a new slice starts now
+      manager.slice = FASTTIMER_MAXCOUNT;
     }
     else {
-      // pretend that the existing time has been with us for the whole slice so that when the 
-      // IRQ happens it credits the correct (reduced) time.
-      ft->timeCurrent += ft->timeCurrent;
+      // if the compare went off while the interrupt was masked, the counter has
+      // already started the next slice, and the interrupt won't come now that the
+      // status has been read - so close out the slice that ended here instead
+      if ((status & AT91C_TC_CPCS) && manager.first != NULL)
+        manager.first->delta -= manager.slice;
+      now = fasttimerCurrentTime();
     }
-  }
-  else {
-    // Yep... we're servicing something right now
-
-    // Make sure the previous pointer is OK.  This comes up if we were servicing the first item
-    // and it subsequently wants to delete itself, it would need to alter the next pointer of the 
-    // the new head... err... kind of a pain, this
-    if (manager.previous == NULL)
-      manager.previous = ft;
-
-    // Need to make sure that if this new time is the lowest yet, that the IRQ routine 
-    // knows that.  Since we added this entry onto the beginning of the list, the IRQ
-    // won't look at it again
-    if (manager.nextTime == -1 || manager.nextTime > ft->timeCurrent)
-        manager.nextTime = ft->timeCurrent;
-  }
-
-  if (!manager.servicing)
+    fasttimerInsert(ft, now + ft->timeInitial);
+    // if the front of the queue is due before the slice ends, bring the interrupt
+    // forward - anything left overdue by the slice we closed out goes straight away
+    if (manager.first != NULL && manager.first->delta < manager.slice)
+      fasttimerSetSlice(manager.first->delta);
+    manager.tc->TC_IER = AT91C_TC_CPCS;
     chSysUnlock();
+  }
 
   return CONTROLLER_OK;
 }
 
 /**
   Stops a fast timer.
-  You should always stop the timer, then start() it again
-  if you need to change its interval.
 
   \code
   FastTimer t;
-  t.start(250);
-  t.stop();
+  fasttimerStart(&t, 250, true);
+  fasttimerStop(&t);
   \endcode
 */
 void fasttimerStop(FastTimer *ft)
 {
-  if (!manager.servicing)
+  if (!manager.servicing) {
     chSysLock();
-
-  // Look through the running list - clobber the entry
-  FastTimer* te = manager.first;
-  FastTimer* previousEntry = NULL;
-  while (te != NULL) {
-    // check for the requested entry
-    if (te == ft) {
-      // remove the entry from the list
-      if (te == manager.first)
-        manager.first = te->next;
-      else
-        previousEntry->next = te->next;
-      
-      // make sure the in-IRQ pointers are all OK
-      if (manager.servicing) {
-        if (manager.previous == ft)
-          manager.previous = previousEntry;
-        if (manager.next == ft)
-          manager.next = te->next;
-      }
-
-      // update the pointers - leave previous where it is
-      te = te->next;
-    }
-    else {
-      previousEntry = te;
-      te = te->next;
-    }
+    manager.tc->TC_IDR = AT91C_TC_CPCS;
   }
 
-  if (!manager.servicing)
+  if (ft->queued)
+    fasttimerRemove(ft);
+  if (manager.current == ft)
+    manager.current = NULL;
+
+  if (!manager.servicing) {
+    manager.tc->TC_IER = AT91C_TC_CPCS;
     chSysUnlock();
+  }
+}
+
+/**
+  Read the fast timer's instrumentation.
+  This is always being gathered, so it's a handy way to check whether
+  your timers are running when you expect them to.  Times are in timer
+  ticks - divide by FASTTIMER_TICKS_PER_US for microseconds.
+  @param stats The FastTimerStats to fill in.
+
+  \b Example
+  \code
+  FastTimerStats stats;
+  fasttimerStats(&stats);
+  if (stats.interrupts > 0) {
+    int avgJitter = stats.jitterTotal / stats.interrupts / FASTTIMER_TICKS_PER_US;
+    // ...
+  }
+  \endcode
+*/
+void fasttimerStats(FastTimerStats* stats)
+{
+  chSysLock();
+  manager.tc->TC_IDR = AT91C_TC_CPCS;
+  *stats = manager.stats;
+  manager.tc->TC_IER = AT91C_TC_CPCS;
+  chSysUnlock();
+}
+
+/**
+  Clear the fast timer's instrumentation.
+  Handy to start a new measurement after changing how many timers are running.
+*/
+void fasttimerResetStats()
+{
+  chSysLock();
+  manager.tc->TC_IDR = AT91C_TC_CPCS;
+  memset(&manager.stats, 0, sizeof(manager.stats));
+  manager.stats.queueMax = manager.queued;
+  manager.tc->TC_IER = AT91C_TC_CPCS;
+  chSysUnlock();
+}
+
+// report the worst latency via the board-wide stats, in microseconds
+static void fasttimerJitterUpdate(Stat* s)
+{
+  s->value = manager.stats.jitterMax / FASTTIMER_TICKS_PER_US;
 }
 
 CH_FAST_IRQ_HANDLER(FiqHandler) {
@@ -226,24 +253,23 @@ void fasttimerInit(int channel)
       manager.channel_id = AT91C_ID_TC2;
       break;
   }
-  
-  manager.first = NULL;
-  manager.count = 0;
-  manager.servicing = false;
-#ifdef FASTIRQ_STATS
-  manager.jitterTotal = 0;
-  manager.jitterMax = 0;  
-  manager.jitterMaxAllDay = 0;
-#endif
                                     
   unsigned int mask = 0x1 << manager.channel_id;
   if (AT91C_BASE_PMC->PMC_PCSR & mask) // we're already configured on this channel
     return;
+
+  manager.first = NULL;
+  manager.current = NULL;
+  manager.queued = 0;
+  manager.servicing = false;
+  manager.slice = FASTTIMER_MAXCOUNT;
+  memset(&manager.stats, 0, sizeof(manager.stats));
+  statsAdd(&fasttimerJitterStat);
+
   AT91C_BASE_PMC->PMC_PCER = mask;
 
   // Disable the interrupt, configure it, reenable it
   AT91C_BASE_AIC->AIC_IDCR = mask;
-//  AT91C_BASE_AIC->AIC_SVR[AT91C_ID_FIQ] = (unsigned int)fasttimerIsr;
   AT91C_BASE_AIC->AIC_SMR[manager.channel_id] = AT91C_AIC_SRCTYPE_INT_HIGH_LEVEL | 7  ;
   AT91C_BASE_AIC->AIC_ICCR = mask ;
 
@@ -269,145 +295,157 @@ void fasttimerInit(int channel)
   manager.tc->TC_RC = FASTTIMER_MAXCOUNT; // load the RC value with something
   AT91C_BASE_AIC->AIC_FFER = 0x1 << manager.channel_id; // Make it fast forcing
   AT91C_BASE_AIC->AIC_IECR = mask; // Enable the interrupt
-  manager.tc->TC_CCR = AT91C_TC_CLKEN | AT91C_TC_SWTRG; // Enable the device
+  fasttimerDisable(); // started by the first fasttimerStart()
 
   /// Finally, prep the IO flag if it's being used
 #ifdef FASTIRQ_MONITOR_IO
-    Io_Start(FASTIRQ_MONITOR_IO, true);
-    Io_PioEnable(FASTIRQ_MONITOR_IO);
-    Io_SetOutput(FASTIRQ_MONITOR_IO);
+  pinSetMode(FASTIRQ_MONITOR_IO, OUTPUT);
 #endif
 }
 
+void fasttimerDeinit()
+{
+  AT91C_BASE_AIC->AIC_IDCR = manager.channel_id; // disable the interrupt
+  AT91C_BASE_PMC->PMC_PCDR = manager.channel_id; // power down
+}
 
-//FastTimerEntry* te;
-//int jitter;
+/** @} */
 
-void fasttimerServeInterrupt()
+/*
+  Put an entry into the queue, due the given number of ticks after
+  the start of the current slice.
+*/
+void fasttimerInsert(FastTimer* ft, int ticks)
 {
-  // only process if RC compare match has happened
-  if (manager.tc->TC_SR & AT91C_TC_CPCS) {
-    manager.servicing = true;
+  FastTimer* prev = NULL;
+  FastTimer* te = manager.first;
+  while (te != NULL && te->delta <= ticks) {
+    ticks -= te->delta;
+    prev = te;
+    te = te->next;
+  }
 
-    //AT91C_BASE_TC2->TC_CCR = AT91C_TC_CLKDIS;
+  ft->delta = ticks;
+  ft->next = te;
+  if (te != NULL)
+    te->delta -= ticks;
+  if (prev == NULL)
+    manager.first = ft;
+  else
+    prev->next = ft;
+
+  ft->queued = true;
+  if (++manager.queued > manager.stats.queueMax)
+    manager.stats.queueMax = manager.queued;
+}
 
-    // make sure there's not another IRQ while we're processing
-    int timeReference = manager.tc->TC_RC;
-    manager.tc->TC_RC = 0xFF00;
+void fasttimerRemove(FastTimer* ft)
+{
+  FastTimer* prev = NULL;
+  FastTimer* te = manager.first;
+  while (te != NULL && te != ft) {
+    prev = te;
+    te = te->next;
+  }
+  if (te == NULL)
+    return;
 
-#ifdef FASTIRQ_MONITOR_IO
-    pinOn(FASTIRQ_MONITOR_IO);
-#endif
+  if (ft->next != NULL) // whoever was behind it now waits for its time too
+    ft->next->delta += ft->delta;
+  if (prev == NULL)
+    manager.first = ft->next;
+  else
+    prev->next = ft->next;
+  ft->next = NULL;
+  ft->queued = false;
+  manager.queued--;
+  // if it was at the front, the interrupt will still fire when it would
+  // have been due, find nothing to do, and move on to the new front.
+}
 
-#ifdef FASTIRQ_STATS
-    int startCount = manager.tc->TC_CV;
-
-    // moved outside for debugging
-    //int jitter;
-    jitter = manager.tc->TC_CV;
-
-    if (++manager.count == 1000) {
-      // need to not do division here... takes too long
-      //manager.jitterTotal = manager.jitterTotal / manager.count;
-      manager.jitterTotal = 0;
-      manager.jitterMax = 0;
-      // need to not do division here... takes too long
-      // manager.durationTotal = manager.durationTotal / manager.count;
-      manager.durationTotal = 0;
-      manager.durationMax = 0;
-      manager.count = 1;
-    }
+/*
+  Set when the current slice ends.  The counter's already been running
+  for a bit, so make sure we don't set the compare to a time that's
+  already gone by, or we'd wait for the counter to wrap.
+*/
+void fasttimerSetSlice(int ticks)
+{
+  int soonest = fasttimerCurrentTime() + FASTTIMER_MINCOUNT;
+  if (ticks > FASTTIMER_MAXCOUNT)
+    ticks = FASTTIMER_MAXCOUNT;
+  if (ticks < soonest)
+    ticks = soonest;
+  manager.slice = ticks;
+  manager.tc->TC_RC = ticks;
+}
 
-    manager.jitterTotal += jitter;
+void fasttimerServeInterrupt()
+{
+  // only process if RC compare match has happened
+  if (!(manager.tc->TC_SR & AT91C_TC_CPCS))
+    return;
 
-    if (jitter > manager.jitterMax)
-      manager.jitterMax = jitter;
-    if (jitter > manager.jitterMaxAllDay)
-      manager.jitterMaxAllDay = jitter;
+  // the counter went back to 0 at the compare, so it's now how long we took to get here
+  int jitter = fasttimerCurrentTime();
+  manager.servicing = true;
+
+  // make sure there's not another IRQ while we're processing
+  manager.tc->TC_RC = FASTTIMER_MAXCOUNT;
+
+#ifdef FASTIRQ_MONITOR_IO
+  pinOn(FASTIRQ_MONITOR_IO);
 #endif
 
-    // Use this during debuggin
-    FastTimer *ftimer = manager.first;
-    manager.next = NULL;
-    manager.previous = NULL;
-    manager.nextTime = 0xFF00;
-    int removed = false;
-    // timeReference = AT91C_BASE_TC2->TC_CV;
-
-    while (ftimer != NULL) {
-      manager.next = ftimer->next;
-      ftimer->timeCurrent -= (timeReference + fasttimerCurrentTime());
-      if (ftimer->timeCurrent <= FASTTIMER_MINCOUNT) {
-        // Watch out for gross errors
-        //if ( ftimer->timeCurrent < -FASTTIMER_MINCOUNT)
-        //  ftimer->timeCurrent = -FASTTIMER_MINCOUNT;
-
-        if (0) //ftimer->repeat)
-          ftimer->timeCurrent += ftimer->timeInitial;
-        else {
-          // remove it if necessary (do this first!)
-          if (manager.previous == NULL)
-            manager.first = manager.next;
-          else
-            manager.previous->next = manager.next;
-          removed = true;
-        }
-
-        if (ftimer->handler != NULL) {
-          // in this callback, the callee is free to add and remove any members of this list
-          // which might effect the first, next and previous pointers
-          // so don't assume any of those local variables are good anymore
-          (*ftimer->handler)(ftimer->id);
-        }
-      }
-
-      // note that this has to be better than this ultimately - since
-      // the callback routine can remove the entry without letting us know
-      // at all.
-      if (!removed) {
-        if (manager.nextTime == -1 || ftimer->timeCurrent < manager.nextTime)
-          manager.nextTime = ftimer->timeCurrent;
-        manager.previous = ftimer;
-      }
-      ftimer = manager.next;
+  manager.stats.interrupts++;
+  manager.stats.jitterTotal += jitter;
+  if (jitter > manager.stats.jitterMax)
+    manager.stats.jitterMax = jitter;
+
+  // the slice that just finished is now behind us
+  if (manager.first != NULL)
+    manager.first->delta -= manager.slice;
+
+  while (manager.first != NULL && manager.first->delta <= FASTTIMER_MINCOUNT) {
+    FastTimer* ft = manager.first;
+    int overdue = ft->delta; // <= 0 if we're late, so the next entry is due that much sooner
+    manager.first = ft->next;
+    if (manager.first != NULL)
+      manager.first->delta += overdue;
+    ft->next = NULL;
+    ft->queued = false;
+    manager.queued--;
+
+    if (fasttimerCurrentTime() - overdue > FASTTIMER_LATE_TICKS)
+      manager.stats.late++;
+    manager.stats.fired++;
+
+    // the handler is free to start or stop any timer, including this one
+    manager.current = ft;
+    if (ft->handler != NULL)
+      (*ft->handler)(ft->id);
+    // if it's repeating and the handler didn't do anything with it, schedule the next one.
+    // Count from when it was due rather than now, so it doesn't drift - unless
+    // we're so late it would be due again already, in which case skip ahead.
+    if (manager.current == ft && ft->repeat) {
+      int next = ft->timeInitial + overdue;
+      fasttimerInsert(ft, (next > FASTTIMER_MINCOUNT) ? next : ft->timeInitial);
     }
+    manager.current = NULL;
+  }
 
-    if (manager.first != NULL) {
-      // Make sure it's not too big
-      if (manager.nextTime > 0xFF00)
-        manager.nextTime = 0xFF00;
-      // Make sure it's not too small
-      if (manager.nextTime < (int)manager.tc->TC_CV + 20)
-        manager.nextTime = manager.tc->TC_CV + 20;
-      manager.tc->TC_RC = manager.nextTime;
-    }
-    else {
-      manager.tc->TC_CCR = AT91C_TC_CLKDIS;
-    }
+  if (manager.first != NULL)
+    fasttimerSetSlice(manager.first->delta);
+  else
+    fasttimerDisable();
 
-#ifdef FASTIRQ_STATS
-    int duration = manager.tc->TC_CV - startCount;
-    manager.durationTotal += duration;
-    if (duration > manager.durationMax)
-      manager.durationMax = duration;
-    if (duration > manager.durationMaxAllDay)
-      manager.durationMaxAllDay = duration;
-#endif
+  int duration = fasttimerCurrentTime() - jitter;
+  manager.stats.durationTotal += duration;
+  if (duration > manager.stats.durationMax)
+    manager.stats.durationMax = duration;
 
 #ifdef FASTIRQ_MONITOR_IO
-    pinOff(FASTIRQ_MONITOR_IO);
+  pinOff(FASTIRQ_MONITOR_IO);
 #endif
 
-    // AT91C_BASE_TC2->TC_CCR = AT91C_TC_CLKEN | AT91C_TC_SWTRG;
-    manager.servicing = false;
-  }
-}
-
-void fasttimerDeinit()
-{
-  AT91C_BASE_AIC->AIC_IDCR = manager.channel_id; // disable the interrupt
-  AT91C_BASE_PMC->PMC_PCDR = manager.channel_id; // power down
+  manager.servicing = false;
 }
-
-/** @} */
-
@@ -20,24 +20,50 @@
 
 #include "types.h"
 
+/**
+  The number of fast timer ticks in a microsecond.
+  The timer runs at MCK/8, so this is approximate - times reported by
+  fasttimerStats() are in ticks, divide by this to get microseconds.
+*/
+#define FASTTIMER_TICKS_PER_US 6
+
 typedef void (*FastTimerHandler)(int id);
 
 typedef struct FastTimer_t {
   FastTimerHandler handler;
   short id;
-  int   timeCurrent;
-  int   timeInitial;
+  bool  repeat;
+  bool  queued;
+  int   delta;       // ticks after the entry ahead of it in the queue
+  int   timeInitial; // interval in ticks
   struct FastTimer_t* next;
 } FastTimer;
 
+/**
+  Instrumentation for the fast timer interrupt.
+  All times are in timer ticks - see FASTTIMER_TICKS_PER_US.
+*/
+typedef struct FastTimerStats_t {
+  int interrupts;    ///< number of times the interrupt has been serviced
+  int fired;         ///< number of handlers that have been called
+  int late;          ///< handlers that ran more than FASTTIMER_LATE_TICKS after they were due
+  int jitterTotal;   ///< sum of the interrupt latencies, for an average
+  int jitterMax;     ///< the longest interrupt latency
+  int durationTotal; ///< sum of the time spent in the interrupt, for an average
+  int durationMax;   ///< the longest time spent in the interrupt
+  int queueMax;      ///< the most timers that have been running at once
+} FastTimerStats;
+
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 void fasttimerInit(int channel);
 void fasttimerDeinit(void);
-int  fasttimerStart(FastTimer *ft, int micros);
+int  fasttimerStart(FastTimer *ft, int micros, bool repeat);
 void fasttimerStop(FastTimer *ft);
+void fasttimerStats(FastTimerStats* stats);
+void fasttimerResetStats(void);
 #ifdef __cplusplus
 }
 #endif
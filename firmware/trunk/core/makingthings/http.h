@@ -22,12 +22,14 @@
 #define HTTP_PORT 80
 #define HTTP_CONTENT_HTML "text/html\r\n\r\n"
 #define HTTP_CONTENT_PLAIN "text/plain\r\n\r\n"
+#define HTTP_CONTENT_JSON "application/json\r\n\r\n"
 
 typedef enum {
   HTTP_GET,
   HTTP_PUT,
   HTTP_POST,
-  HTTP_DELETE
+  HTTP_DELETE,
+  HTTP_HEAD
 } HttpMethod;
 
 
@@ -288,7 +288,7 @@
  * (only needed if you use the sequential API, like api_lib.c)
  */
 #ifndef MEMP_NUM_NETCONN
-#define MEMP_NUM_NETCONN                4
+#define MEMP_NUM_NETCONN                6 // the webserver's listener and workers take 3 of these
 #endif
 
 /**
@@ -874,6 +874,16 @@
 #define PBUF_POOL_BUFSIZE               LWIP_MEM_ALIGN_SIZE(TCP_MSS+40+PBUF_LINK_HLEN)
 #endif
 
+/**
+ * LWIP_SUPPORT_CUSTOM_PBUF==1: Support for custom pbufs, whose memory
+ * belongs to someone else (e.g. a MAC's DMA buffers) and is handed back
+ * through a callback when the pbuf is freed.  The Ethernet driver uses
+ * these to pass received frames up without copying them.
+ */
+#ifndef LWIP_SUPPORT_CUSTOM_PBUF
+#define LWIP_SUPPORT_CUSTOM_PBUF        1
+#endif
+
 /*
    ------------------------------------------------
    ---------- Network Interfaces options ----------
@@ -1203,7 +1213,7 @@
  * LWIP_SO_RCVTIMEO==1: Enable SO_RCVTIMEO processing.
  */
 #ifndef LWIP_SO_RCVTIMEO
-#define LWIP_SO_RCVTIMEO                0
+#define LWIP_SO_RCVTIMEO                1 // for tcpSetReadTimeout()
 #endif
 
 /**
@@ -1344,6 +1354,32 @@
 
 #endif /* LWIP_STATS */
 
+/**
+ * LWIP_PERF==1: Time the stages marked with PERF_START/PERF_STOP (ip_input,
+ * udp_input, tcp_input, pbuf_free...) against a free running TC channel.
+ * See arch/perf.h - the results are available as /network/perf over OSC.
+ * It costs a little on every stage and takes up a TC channel, so it's off
+ * unless you turn it on in your config.h for a profiling build.
+ */
+#ifndef LWIP_PERF
+#define LWIP_PERF                       0
+#endif
+
+/**
+ * LWIP_PERF_TC: Timer/counter channel (0-2) used by LWIP_PERF.  It can't be
+ * shared with the FastTimer, the analogin stream or a HwTimer.
+ */
+#ifndef LWIP_PERF_TC
+#define LWIP_PERF_TC                    0
+#endif
+
+/**
+ * LWIP_PERF_STAGES: Number of distinct stages LWIP_PERF keeps track of.
+ */
+#ifndef LWIP_PERF_STAGES
+#define LWIP_PERF_STAGES                8
+#endif
+
 /*
    ---------------------------------
    ---------- PPP options ----------
@@ -42,6 +42,7 @@ int main(int argc, char **argv)
   #endif
 
   chSysInit(); // ChibiOS/RT initialization.
+  systemRegisterThread(chThdSelf(), "main", 0); // runs on the system stack, so no working area
 
   // would rather not put this below chSysInit() but it relies on the RTOS being setup
   #ifndef NO_AIN_INIT
@@ -2,6 +2,8 @@
 MTCORESRC = ${MT}/board.c \
 						${MT}/watchdog.c \
 						${MT}/system.c \
+						${MT}/mtstats.c \
+						${MT}/defer.c \
 						${MT}/led.c \
 						${MT}/pin.c \
 						${MT}/mtserial.c \
@@ -9,6 +11,7 @@ MTCORESRC = ${MT}/board.c \
 						${MT}/pwm.c \
 						${MT}/timer.c \
 						${MT}/usbserial.c \
+						${MT}/slip.c \
 						${MT}/usbmouse.c \
 						${MT}/mtspi.c \
 						${MT}/eeprom.c \
@@ -22,3 +25,18 @@ MTCORESRC = ${MT}/board.c \
 						${MT}/osc_data.c \
 						${MT}/osc_patternmatch.c
 
+
+# The parts of the core that build on the host for the simulator - the
+# hardware drivers are replaced by the mock backends in projects/simulator.
+MTSIMSRC = ${MT}/system.c \
+						${MT}/mtstats.c \
+						${MT}/defer.c \
+						${MT}/main.c \
+						${MT}/network.c \
+						${MT}/udpsocket.c \
+						${MT}/tcpsocket.c \
+						${MT}/tcpserver.c \
+						${MT}/osc.c \
+						${MT}/osc_data.c \
+						${MT}/osc_patternmatch.c \
+						${MT}/slip.c
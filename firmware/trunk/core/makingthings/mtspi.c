@@ -35,6 +35,10 @@
 #define SPI_SEL2_MODE PERIPHERAL_B
 #define SPI_SEL3_MODE PERIPHERAL_B
 
+#ifndef SPI_IRQ_PRIORITY
+#define SPI_IRQ_PRIORITY 4
+#endif
+
 /** 
   \defgroup SPI
   Communicate with peripheral devices via SPI.
@@ -42,17 +46,77 @@
   with the outside world.  The Make Controller SPI interface has 4 channels, although 2 of these
   are not available since they're used internally.  Channels 2 and 3 can still be used, though.
   
-  \b Note - the SPI routines are not thread-safe.  If you're going to be using them from different
-  threads, use the spiLock() and spiUnlock() routines to get exclusive access.
+  \section Transactions
+  Every exchange on the bus is a \b transaction - a chip select, some command bytes and some
+  data.  Transactions are queued up and run one after the other by the SPI's DMA controller,
+  so the CPU isn't tied up shuffling bytes in the meantime.  spiReadWriteBlock() and
+  spiTransfer() queue one up and sleep until it's done.  To carry on with something else
+  while it runs, fill in an SpiTransaction yourself, then spiStart() it and spiWait() for it
+  later.
+
+  A transaction can also have a \b callback, which is called from the interrupt as soon as it's
+  finished.  The callback can start another transaction straight away with spiStartI() - handy
+  for polling a sensor as fast as the bus will go without waking up a thread for each reading.
+  The \ref stats include \b spi.transfers and \b spi.bytes.
+
+  \b Note - each transaction runs on its own, but if you need several in a row without another
+  thread's transactions getting in between, use the spiLock() and spiUnlock() routines to get
+  exclusive access.
+
+  \b Example
+  \code
+  uint8_t cmd[3] = { 0x03, 0, 0 };
+  uint8_t data[128];
+  SpiTransaction t = {
+    .csn = MY_DEVICE,
+    .header = cmd,
+    .headerLength = 3,
+    .rx = data,
+    .count = sizeof(data)
+  };
+  spiStart(Spi0, &t);
+  // ...do something else while it's running...
+  spiWait(&t, FOREVER);
+  \endcode
   \ingroup interfacing
   @{
 */
 
+typedef struct {
+  Spi spi;
+  SpiTransaction* head; // the one on the bus right now
+  SpiTransaction* tail;
+} SpiBus;
+
 static Mutex spi0Mutex;
+static SpiBus spi0Bus;
 #if USE_SPI1
 static Mutex spi1Mutex;
+static SpiBus spi1Bus;
+#endif
+
+static Stat spiTransfers = { .name = "spi.transfers" };
+static Stat spiBytes = { .name = "spi.bytes" };
+static bool spiStatsAdded;
+
+static CH_IRQ_HANDLER(spi0Isr);
+#if USE_SPI1
+static CH_IRQ_HANDLER(spi1Isr);
 #endif
 
+static void spiBegin(SpiBus* bus);
+
+static SpiBus* spiGetBus(Spi spi)
+{
+  #if USE_SPI1
+  if (spi == Spi1)
+    return &spi1Bus;
+  #else
+  UNUSED(spi);
+  #endif
+  return &spi0Bus;
+}
+
 static int spiGetPin(int channel)
 {
   switch (channel) {
@@ -87,19 +151,25 @@ void spiInit()
   pinGroupSetMode(GROUP_A, PIN_PA16_BIT | PIN_PA17_BIT | PIN_PA18_BIT, PERIPHERAL_A);
 
   chMtxInit(&spi0Mutex);
+  spi0Bus.spi = Spi0;
   AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_SPI0;  // power on SPI device
   AT91C_BASE_SPI0->SPI_CR = AT91C_SPI_SWRST;      // two resets to account for errata
   AT91C_BASE_SPI0->SPI_CR = AT91C_SPI_SWRST;
-  AT91C_BASE_SPI0->SPI_IDR = 0x3FF;               // All interrupts are off
+  AT91C_BASE_SPI0->SPI_IDR = 0x3FF;               // All interrupts are off until there's a transaction
   AT91C_BASE_SPI0->SPI_CR = AT91C_SPI_SPIEN;      // enable the device
+  AIC_ConfigureIT(AT91C_ID_SPI0, AT91C_AIC_SRCTYPE_INT_HIGH_LEVEL | SPI_IRQ_PRIORITY, spi0Isr);
+  AIC_EnableIT(AT91C_ID_SPI0);
 
   #if USE_SPI1
   chMtxInit(&spi1Mutex);
+  spi1Bus.spi = Spi1;
   AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_SPI1;
   AT91C_BASE_SPI1->SPI_CR = AT91C_SPI_SWRST;
   AT91C_BASE_SPI1->SPI_CR = AT91C_SPI_SWRST;
   AT91C_BASE_SPI1->SPI_IDR = 0x3FF;
   AT91C_BASE_SPI1->SPI_CR = AT91C_SPI_SPIEN;
+  AIC_ConfigureIT(AT91C_ID_SPI1, AT91C_AIC_SRCTYPE_INT_HIGH_LEVEL | SPI_IRQ_PRIORITY, spi1Isr);
+  AIC_EnableIT(AT91C_ID_SPI1);
   #endif
 }
 
@@ -148,12 +218,7 @@ int spiConfigure(Spi spi, int csn, int bits, int clockDivider, int delayBeforeSP
   if (spi == Spi0)
     pinSetMode(spiGetPin(csn), spiGetMode(csn));
 
-  // DON'T USE FDIV FLAG - it makes the SPI unit fail!!
-  spi->SPI_MR = AT91C_SPI_MSTR |         // Select the master
-                AT91C_SPI_PS_VARIABLE |
-                AT91C_SPI_PCS |         // Variable Addressing - can address different chip select each transfer
-                AT91C_SPI_MODFDIS;      // Disable fault detect
-
+  // the mode register is set up at the start of each transaction, in spiBegin()
   spi->SPI_CSR[csn] =
         AT91C_SPI_NCPHA | // Clock Phase TRUE
         AT91C_SPI_CSAAT | // Chip Select Active After Transfer - make sure chip select stays low between bytes
@@ -189,21 +254,157 @@ int spiConfigure(Spi spi, int csn, int bits, int clockDivider, int delayBeforeSP
 */
 int spiReadWriteBlock(Spi spi, int csn, unsigned char* buffer, int count)
 {
-  while (count--) {
-    // write byte of data, if last one set AT91C_SPI_LASTXFER
-    spi->SPI_TDR = (*buffer & 0xFF) |
-                    ((~(1 << csn) << 16) &  AT91C_SPI_TPCS) |
-                    ((0 == count) ? AT91C_SPI_LASTXFER : 0);
+  return spiTransfer(spi, csn, buffer, count, 0, 0, 0);
+}
 
-    // wait for byte of data, then read it
-    while (!(spi->SPI_SR & AT91C_SPI_RDRF));
-    *buffer++ = (unsigned char)(spi->SPI_RDR & 0xFF);
+/**
+  Exchange a command and a block of data in one go.
+  Lots of devices want a few bytes of command before the data - rather than copying
+  both into one buffer, pass them separately and the PDC streams one straight after
+  the other without the chip select being released in between.  The calling thread
+  sleeps until it's done.
 
-    // ensure previous byte has been completely written out
-    while (!(spi->SPI_SR & AT91C_SPI_TDRE));
+  The \b header is exchanged in place, like spiReadWriteBlock().  The data is sent
+  from \b tx and the response read into \b rx - either can be 0.  With no \b tx,
+  whatever is in \b rx gets sent, which is fine for devices that don't care what's
+  on the line while they're talking.  With no \b rx, the response is thrown away.
+
+  @param spi Which SPI device - options are \b Spi0 or \b Spi1
+  @param csn Which chip select line - options are 0-3.
+  @param header The command bytes, sent first.
+  @param headerLength How many command bytes there are.
+  @param tx The data to send after the header.
+  @param rx Where to read the response to the data into.
+  @param count How many bytes of data to exchange.
+  @return 0 on success, otherwise less than 0.
+
+  \b Example
+  \code
+  uint8_t cmd[3] = { READ, address >> 8, address & 0xFF };
+  uint8_t data[256];
+  spiTransfer(Spi0, MY_DEVICE, cmd, 3, 0, data, sizeof(data));
+  \endcode
+*/
+int spiTransfer(Spi spi, int csn, unsigned char* header, int headerLength,
+                const unsigned char* tx, unsigned char* rx, int count)
+{
+  SpiTransaction t = {
+    .csn = csn,
+    .header = header,
+    .headerLength = headerLength,
+    .tx = tx,
+    .rx = rx,
+    .count = count
+  };
+  return spiRun(spi, &t);
+}
+
+/**
+  Queue up a transaction to run in the background.
+  It starts straight away if the bus is free, otherwise as soon as the transactions
+  ahead of it are done.  Check its \b busy field, or use spiWait(), to find out when
+  it has finished - until then, it and its buffers need to stay put.
+  @param spi Which SPI device - options are \b Spi0 or \b Spi1
+  @param t The transaction.
+  @return 0 on success, otherwise less than 0.
+
+  \b Example
+  \code
+  static uint8_t reading[2];
+  static SpiTransaction t = { .csn = MY_SENSOR, .rx = reading, .count = 2 };
+  spiStart(Spi0, &t);
+  \endcode
+*/
+int spiStart(Spi spi, SpiTransaction* t)
+{
+  // spiInit() runs before the kernel is started, so add the stats here instead
+  if (!spiStatsAdded) {
+    statsAdd(&spiTransfers);
+    statsAdd(&spiBytes);
+    spiStatsAdded = true;
   }
+  chSysLock();
+  int rv = spiStartI(spi, t);
+  chSysUnlock();
+  return rv;
+}
+
+/**
+  Queue up a transaction from an interrupt, or from a transaction's callback.
+  Just like spiStart(), but for when the system is already locked.
+  @param spi Which SPI device - options are \b Spi0 or \b Spi1
+  @param t The transaction.
+  @return 0 on success, otherwise less than 0.
 
-  return 0;
+  \b Example
+  \code
+  // read the sensor again as soon as the last reading is in
+  void sensorDone(SpiTransaction* t)
+  {
+    processReading(t->rx);
+    spiStartI(Spi0, t);
+  }
+  \endcode
+*/
+int spiStartI(Spi spi, SpiTransaction* t)
+{
+  if (t->busy)
+    return CONTROLLER_ERROR_QUEUE_ERROR; // already queued up
+  if (t->csn < 0 || t->csn > 3 || t->headerLength < 0 || t->count < 0 ||
+      t->headerLength + t->count == 0 || (t->count > 0 && !t->tx && !t->rx))
+    return CONTROLLER_ERROR_ILLEGAL_PARAMETER_VALUE;
+
+  SpiBus* bus = spiGetBus(spi);
+  t->busy = true;
+  t->thd = 0;
+  t->next = 0;
+  if (bus->tail)
+    bus->tail->next = t;
+  else {
+    bus->head = t;
+    spiBegin(bus);
+  }
+  bus->tail = t;
+  return CONTROLLER_OK;
+}
+
+/**
+  Wait for a transaction to finish.
+  The thread sleeps until the transaction is done - it's woken up from the interrupt.
+  @param t The transaction.
+  @param timeout How long to wait, in milliseconds.  The special values FOREVER and
+  IMMEDIATE may be used to wait either forever, or not at all.
+  @return 0 once it's done, or CONTROLLER_ERROR_TIMEOUT if it's still going.
+*/
+int spiWait(SpiTransaction* t, int timeout)
+{
+  msg_t msg = RDY_OK;
+  chSysLock();
+  if (t->busy) {
+    if (timeout == IMMEDIATE)
+      msg = RDY_TIMEOUT;
+    else {
+      t->thd = chThdSelf();
+      msg = chSchGoSleepTimeoutS(THD_STATE_SUSPENDED, (timeout == (int)FOREVER) ? TIME_INFINITE : MS2ST(timeout));
+      t->thd = 0;
+    }
+  }
+  chSysUnlock();
+  return (msg == RDY_TIMEOUT) ? CONTROLLER_ERROR_TIMEOUT : CONTROLLER_OK;
+}
+
+/**
+  Run a transaction and wait for it to finish.
+  @param spi Which SPI device - options are \b Spi0 or \b Spi1
+  @param t The transaction.
+  @return 0 on success, otherwise less than 0.
+*/
+int spiRun(Spi spi, SpiTransaction* t)
+{
+  int rv = spiStart(spi, t);
+  if (rv == CONTROLLER_OK)
+    rv = spiWait(t, FOREVER);
+  return rv;
 }
 
 /**
@@ -229,3 +430,92 @@ void spiUnlock()
 }
 
 /** @} */
+
+/*
+  Put the transaction at the head of the queue on the bus.  The PDC moves bytes,
+  with no room for a chip select in each one, so the chip select is fixed for
+  the length of the transaction.  Called with the system locked.
+*/
+static void spiBegin(SpiBus* bus)
+{
+  SpiTransaction* t = bus->head;
+  Spi spi = bus->spi;
+
+  // DON'T USE FDIV FLAG - it makes the SPI unit fail!!
+  spi->SPI_MR = AT91C_SPI_MSTR |         // Select the master
+                AT91C_SPI_PS_FIXED |
+                AT91C_SPI_MODFDIS |      // Disable fault detect
+                ((~(1 << t->csn) << 16) & AT91C_SPI_PCS);
+  (void)spi->SPI_RDR; // anything left over from before
+  (void)spi->SPI_SR;  // clears OVRES
+
+  spi->SPI_RPR = (uint32_t)t->header;
+  spi->SPI_RCR = t->headerLength;
+  spi->SPI_RNPR = (uint32_t)t->rx;
+  spi->SPI_RNCR = t->rx ? t->count : 0;
+  spi->SPI_TPR = (uint32_t)t->header;
+  spi->SPI_TCR = t->headerLength;
+  spi->SPI_TNPR = (uint32_t)(t->tx ? t->tx : t->rx); // nobody's listening, so anything will do
+  spi->SPI_TNCR = t->count;
+  spi->SPI_PTCR = AT91C_PDC_RXTEN | AT91C_PDC_TXTEN;
+  spi->SPI_IER = AT91C_SPI_TXEMPTY;
+}
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static void spiServeInterrupt(SpiBus* bus)
+{
+  Spi spi = bus->spi;
+  // TXEMPTY only means the last byte is out if the PDC has nothing left to send -
+  // RXBUFF covers the response, which might finish a moment later
+  uint32_t done = AT91C_SPI_TXBUFE | AT91C_SPI_TXEMPTY | AT91C_SPI_RXBUFF;
+  if ((spi->SPI_SR & done) != done)
+    return;
+
+  spi->SPI_IDR = AT91C_SPI_TXEMPTY;
+  spi->SPI_PTCR = AT91C_PDC_TXTDIS | AT91C_PDC_RXTDIS;
+  spi->SPI_CR = AT91C_SPI_LASTXFER; // release the chip select
+  (void)spi->SPI_RDR;
+  (void)spi->SPI_SR;
+
+  chSysLockFromIsr();
+  SpiTransaction* t = bus->head;
+  if (t) {
+    bus->head = t->next;
+    if (bus->head)
+      spiBegin(bus); // straight on to the next one
+    else
+      bus->tail = 0;
+    statIncI(&spiTransfers);
+    statAddI(&spiBytes, t->headerLength + t->count);
+
+    t->busy = false;
+    if (t->thd) {
+      t->thd->p_u.rdymsg = RDY_OK;
+      chSchReadyI(t->thd);
+      t->thd = 0;
+    }
+    if (t->callback)
+      t->callback(t);
+  }
+  chSysUnlockFromIsr();
+}
+
+static CH_IRQ_HANDLER(spi0Isr)
+{
+  CH_IRQ_PROLOGUE();
+  spiServeInterrupt(&spi0Bus);
+  AT91C_BASE_AIC->AIC_EOICR = 0;
+  CH_IRQ_EPILOGUE();
+}
+
+#if USE_SPI1
+static CH_IRQ_HANDLER(spi1Isr)
+{
+  CH_IRQ_PROLOGUE();
+  spiServeInterrupt(&spi1Bus);
+  AT91C_BASE_AIC->AIC_EOICR = 0;
+  CH_IRQ_EPILOGUE();
+}
+#endif
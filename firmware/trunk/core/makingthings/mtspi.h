@@ -24,6 +24,26 @@ typedef AT91S_SPI* Spi;
 #define Spi0 AT91C_BASE_SPI0
 #define Spi1 AT91C_BASE_SPI1
 
+/**
+  One exchange on the SPI bus, to be run in the background by spiStart().
+  Fill in the chip select and buffers, then hand it to spiStart() - it has to
+  stay put (not on the stack of a function that returns) until it's done.
+  \ingroup SPI
+*/
+typedef struct SpiTransaction_t {
+  int csn;                          /**< Which chip select line - 0-3. */
+  unsigned char* header;            /**< Command bytes sent first, and exchanged in place - can be 0. */
+  int headerLength;                 /**< How many command bytes there are. */
+  const unsigned char* tx;          /**< The data to send after the header - if 0, \b rx is sent. */
+  unsigned char* rx;                /**< Where to read the response to the data - if 0, it's thrown away. */
+  int count;                        /**< How many bytes of data to exchange. */
+  void (*callback)(struct SpiTransaction_t* t); /**< Optional - called from the interrupt once it's done. */
+  void* context;                    /**< Anything you like, for the callback. */
+  volatile bool busy;               /**< True until it's done. */
+  Thread* thd;                      // waiting in spiWait()
+  struct SpiTransaction_t* next;
+} SpiTransaction;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -31,6 +51,13 @@ void spiInit(void);
 void spiDisable(Spi spi);
 int  spiConfigure(Spi spi, int csn, int bits, int clockDivider, int delayBeforeSPCK, int delayBetweenTransfers);
 int  spiReadWriteBlock(Spi spi, int csn, unsigned char* buffer, int count);
+int  spiTransfer(Spi spi, int csn, unsigned char* header, int headerLength,
+                 const unsigned char* tx, unsigned char* rx, int count);
+
+int  spiStart(Spi spi, SpiTransaction* t);
+int  spiStartI(Spi spi, SpiTransaction* t);
+int  spiWait(SpiTransaction* t, int timeout);
+int  spiRun(Spi spi, SpiTransaction* t);
 
 void spiLock(Spi spi);
 void spiUnlock(void);
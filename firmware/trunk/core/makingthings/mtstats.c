@@ -0,0 +1,182 @@
+/*********************************************************************************
+
+ Copyright 2006-2009 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+#include "mtstats.h"
+#include "core.h"
+
+static Stat* statsList;
+
+/**
+  \defgroup stats Stats
+  Runtime counters and gauges from around the board.
+
+  \section Usage
+  Each subsystem keeps its own Stat structures and adds them to the list once with
+  statsAdd() - after that, bumping a counter is just statInc() or statAdd(), and a gauge
+  can be set with statSet() or statMax().  These only take a moment with interrupts
+  disabled, and nothing else happens until somebody asks for the values.  From an
+  interrupt handler, use the I versions - statIncI(), statAddI() and statMaxI().
+
+  To read them all, statsRead() returns the first one in the list - follow each one's
+  \b next pointer to get the rest.  Over OSC, they're all reported in one bundle
+  via \b /system/stats, and the webserver library can serve them as JSON.
+
+  The core reports, among others:
+  - \b osc.usb.in, \b osc.udp.in ... - OSC messages received, created, dropped and
+    buffer flushes on each channel, and the most messages sent in one bundle
+  - \b osc.autosend.overruns - autosenders that ran a whole period late
+  - \b usb.tx.bytes, \b usb.tx.stalls - bytes sent over USB, and writes that failed
+  - \b udp.recv.errors - failed reads on UDP sockets
+  - \b analogin.conversions - analog samples taken
+  - \b fasttimer.jitter.max - worst FastTimer lateness, in microseconds
+  - \b defer.posted, \b defer.coalesced ... - jobs handed to the \ref defer thread
+  - \b eeprom.system.flushes, \b eeprom.system.pages - write-backs of the system settings
+    and the EEPROM pages they wrote
+  - \b eeprom.read.bytes, \b eeprom.write.bytes, \b eeprom.write.cycles - traffic to the \ref eeprom chip
+
+  \b Example
+  \code
+  Stat packets = { .name = "myapp.packets" };
+
+  void setup()
+  {
+    statsAdd(&packets);
+  }
+
+  void gotPacket()
+  {
+    statInc(&packets);
+  }
+  \endcode
+  \ingroup Core
+  @{
+*/
+
+/**
+  Add a stat to the list.
+  Adding one that's already on the list does nothing, so it's safe to call
+  from an init function that might run more than once.
+  @param s The stat to add.
+*/
+void statsAdd(Stat* s)
+{
+  Stat** sp;
+  chSysLock();
+  for (sp = &statsList; *sp != 0; sp = &(*sp)->next) {
+    if (*sp == s)
+      break;
+  }
+  if (*sp == 0) {
+    s->next = 0;
+    *sp = s;
+  }
+  chSysUnlock();
+}
+
+/**
+  Bring the stats up to date and get the first one in the list.
+  Stats with an update function get it called now.
+  @return The first stat - the rest follow via each one's \b next pointer.
+
+  \b Example
+  \code
+  Stat* s;
+  for (s = statsRead(); s != 0; s = s->next) {
+    // s->name and s->value...
+  }
+  \endcode
+*/
+Stat* statsRead()
+{
+  Stat* s;
+  for (s = statsList; s != 0; s = s->next) {
+    if (s->update)
+      s->update(s);
+  }
+  return statsList;
+}
+
+/**
+  Set all the stats back to 0.
+  Stats with an update function mirror a value kept elsewhere, so they'll
+  pick it up again the next time they're read.
+*/
+void statsReset()
+{
+  Stat* s;
+  for (s = statsList; s != 0; s = s->next)
+    s->value = 0;
+}
+
+/**
+  Add to a counter.
+  @param s The counter.
+  @param n How much to add.
+*/
+void statAdd(Stat* s, uint32_t n)
+{
+  chSysLock();
+  s->value += n;
+  chSysUnlock();
+}
+
+/**
+  Add to a counter from an interrupt handler, or with the system already locked.
+  @param s The counter.
+  @param n How much to add.
+*/
+void statAddI(Stat* s, uint32_t n)
+{
+  s->value += n;
+}
+
+/**
+  Set a gauge.
+  @param s The gauge.
+  @param value The new value.
+*/
+void statSet(Stat* s, uint32_t value)
+{
+  s->value = value;
+}
+
+/**
+  Raise a gauge to a new value if it's higher than the current one.
+  Handy for keeping track of high-water marks.
+  @param s The gauge.
+  @param value The new value.
+*/
+void statMax(Stat* s, uint32_t value)
+{
+  chSysLock();
+  statMaxI(s, value);
+  chSysUnlock();
+}
+
+/**
+  Like statMax(), from an interrupt handler or with the system already locked.
+  @param s The gauge.
+  @param value The new value.
+*/
+void statMaxI(Stat* s, uint32_t value)
+{
+  if (value > s->value)
+    s->value = value;
+}
+
+/** @}
+*/
@@ -0,0 +1,55 @@
+/*********************************************************************************
+
+ Copyright 2006-2009 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+#ifndef MTSTATS_H
+#define MTSTATS_H
+
+#include "types.h"
+
+/**
+  A named counter or gauge.
+  Declare one for each thing you want to keep track of, give it a name and
+  add it with statsAdd().  If the value lives somewhere else already, give it
+  an \b update function instead and it will be copied into \b value whenever
+  the stats are read.
+*/
+typedef struct Stat_t {
+  const char* name;                  /**< The name it's reported under. */
+  volatile uint32_t value;           /**< The current value. */
+  void (*update)(struct Stat_t* s);  /**< Optional - refreshes \b value just before it's read. */
+  struct Stat_t* next;
+} Stat;
+
+#define statInc(s)  statAdd(s, 1)
+#define statIncI(s) statAddI(s, 1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void  statsAdd(Stat* s);
+Stat* statsRead(void);
+void  statsReset(void);
+void  statAdd(Stat* s, uint32_t n);
+void  statAddI(Stat* s, uint32_t n);
+void  statSet(Stat* s, uint32_t value);
+void  statMax(Stat* s, uint32_t value);
+void  statMaxI(Stat* s, uint32_t value);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MTSTATS_H
@@ -13,6 +13,7 @@
 #include "lwip/netif.h"
 #include "lwip/netifapi.h"
 #include "lwipopts.h"
+#include "arch/perf.h"
 
 #include "stdio.h"
 #include "error.h"
@@ -88,7 +89,9 @@ void networkInit()
   // Low nibble of the third byte - gives us around 1M serial numbers
   macAddress[3] = 0x50 | ((serialNumber >> 12) & 0xF);
   
+#if HAL_USE_MAC
   macInit(); // chibios mac init
+#endif
   int address, mask, gateway;
   // if DHCP is compiled in and it's enabled, init address values with 0 - DHCP doesn't seem to work otherwise
 #if LWIP_DHCP
@@ -113,7 +116,8 @@ void networkInit()
   opts.netif = &mcnetif;
   opts.semaphore = (void*)&initSemaphore;
 
-  chThdCreateStatic(wa_lwip_thread, LWIP_THREAD_STACK_SIZE, NORMALPRIO + 1, lwip_thread, &opts);
+  Thread* t = chThdCreateStatic(wa_lwip_thread, LWIP_THREAD_STACK_SIZE, NORMALPRIO + 1, lwip_thread, &opts);
+  systemRegisterThread(t, "lwip", LWIP_THREAD_STACK_SIZE);
   chSemWait(&initSemaphore); // wait until lwip is set up
 
   mcnetif->hostname = "tester";
@@ -158,12 +162,9 @@ bool networkSetAddress(int address, int mask, int gateway)
 
   // but write the addresses to memory regardless,
   // so we can use them next time DHCP is disabled
-  eepromWrite(EEPROM_SYSTEM_NET_ADDRESS, address);
-  eepromWrite(EEPROM_SYSTEM_NET_MASK, mask);
-  eepromWrite(EEPROM_SYSTEM_NET_GATEWAY, gateway);
-
-  int total = address + mask + gateway;
-  eepromWrite(EEPROM_SYSTEM_NET_CHECK, total);
+  eepromWriteDeferred(EEPROM_SYSTEM_NET_ADDRESS, address);
+  eepromWriteDeferred(EEPROM_SYSTEM_NET_MASK, mask);
+  eepromWriteDeferred(EEPROM_SYSTEM_NET_GATEWAY, gateway);
 
   return rv;
 }
@@ -248,11 +249,11 @@ void networkSetDhcp(bool enabled, int timeout)
 {
   if (enabled && !networkDhcp()) {
     networkDhcpStart(timeout);
-    eepromWrite(EEPROM_DHCP_ENABLED, enabled);
+    eepromWriteDeferred(EEPROM_DHCP_ENABLED, enabled);
   }
   else if(!enabled && networkDhcp()) {
     networkDhcpStop(timeout);
-    eepromWrite(EEPROM_DHCP_ENABLED, enabled);
+    eepromWriteDeferred(EEPROM_DHCP_ENABLED, enabled);
     int a, m, g;
     networkLastValidAddress(&a, &m, &g);
     networkSetAddress(a, m, g);
@@ -352,11 +353,11 @@ void dnsCallback(const char *name, struct ip_addr *addr, void *arg)
 
 bool networkLastValidAddress(int* address, int *mask, int* gateway)
 {
-  int total = eepromRead(EEPROM_SYSTEM_NET_CHECK);
   *address  = eepromRead(EEPROM_SYSTEM_NET_ADDRESS);
   *mask     = eepromRead(EEPROM_SYSTEM_NET_MASK);
   *gateway  = eepromRead(EEPROM_SYSTEM_NET_GATEWAY);
-  if (total == *address + *mask + *gateway) {
+  // the EEPROM's checksum covers these - they're only -1 if they've never been set
+  if (*address != -1 && *mask != -1 && *gateway != -1) {
     return true;
   }
   else {
@@ -463,12 +464,63 @@ static void networkOscUdpListenPortHandler(OscChannel ch, char* address, int idx
   }
 }
 
+static void networkOscPacketsHandler(OscChannel ch, char* address, int idx, OscData data[], int datalen)
+{
+  UNUSED(idx);
+  UNUSED(data);
+  if (datalen == 0) {
+    struct lwipthread_stats stats;
+    lwip_thread_stats(&stats);
+    OscData d[4] = {
+      { .type = INT, .value.i = stats.rx_rate },
+      { .type = INT, .value.i = stats.tx_rate },
+      { .type = INT, .value.i = stats.rx_zerocopy },
+      { .type = INT, .value.i = stats.rx_dropped }
+    };
+    oscCreateMessage(ch, address, d, 4);
+  }
+}
+
+#if LWIP_PERF
+/*
+  One message per stage - name, count, min, max and total time in
+  microseconds, and the number of samples too long to time.
+  Send a 0 to clear them.
+*/
+static void networkOscPerfHandler(OscChannel ch, char* address, int idx, OscData data[], int datalen)
+{
+  UNUSED(idx);
+  if (datalen == 0) {
+    struct lwip_perf_stage stages[LWIP_PERF_STAGES];
+    int i, count = lwip_perf_stats(stages, LWIP_PERF_STAGES);
+    for (i = 0; i < count; i++) {
+      OscData d[6] = {
+        { .type = STRING, .value.s = (char*)stages[i].name },
+        { .type = INT, .value.i = stages[i].count },
+        { .type = INT, .value.i = stages[i].count ? stages[i].min / LWIP_PERF_TICKS_PER_US : 0 },
+        { .type = INT, .value.i = stages[i].max / LWIP_PERF_TICKS_PER_US },
+        { .type = INT, .value.i = stages[i].total / LWIP_PERF_TICKS_PER_US },
+        { .type = INT, .value.i = stages[i].overruns }
+      };
+      oscCreateMessage(ch, address, d, 6);
+    }
+  }
+  else if (datalen == 1 && data[0].type == INT && data[0].value.i == 0) {
+    lwip_perf_reset();
+  }
+}
+#endif // LWIP_PERF
+
 static const OscNode networkOscFind = { .name = "find", .handler = networkOscFindHandler };
 static const OscNode networkOscDhcp = { .name = "dhcp", .handler = networkOscDhcpHandler };
 static const OscNode networkOscAddress = { .name = "address", .handler = networkOscAddressHandler };
 static const OscNode networkOscMac = { .name = "mac", .handler = networkOscMacHandler };
 static const OscNode networkOscUdpSendPort = { .name = "osc_udp_send_port", .handler = networkOscUdpPortHandler };
 static const OscNode networkOscUdpListenPort = { .name = "osc_udp_listen_port", .handler = networkOscUdpListenPortHandler };
+static const OscNode networkOscPackets = { .name = "packets", .handler = networkOscPacketsHandler };
+#if LWIP_PERF
+static const OscNode networkOscPerf = { .name = "perf", .handler = networkOscPerfHandler };
+#endif
 
 const OscNode networkOsc = {
   .name = "network",
@@ -478,7 +530,12 @@ const OscNode networkOsc = {
     &networkOscAddress,
     &networkOscMac,
     &networkOscUdpSendPort,
-    &networkOscUdpListenPort, 0
+    &networkOscUdpListenPort,
+    &networkOscPackets,
+#if LWIP_PERF
+    &networkOscPerf,
+#endif
+    0
   }
 };
 
@@ -9,6 +9,20 @@
 #include "osc_data.h"
 #include <string.h>
 #include <stdio.h>
+#include <ctype.h>
+
+/*
+  Define OSC_UDP_NETCONN to receive OSC over UDP via lwIP's netconn API
+  rather than sockets.  Packets are parsed straight out of the pbufs
+  they arrived in instead of being copied into the channel's inBuf first.
+*/
+#if defined(MAKE_CTRL_NETWORK) && defined(OSC_UDP_NETCONN)
+#include "lwip/api.h"
+#endif
+#ifdef MAKE_CTRL_NETWORK
+#include "lwip/opt.h"
+#include "arch/perf.h" // times UDP packets alongside the lwIP stages
+#endif
 
 #ifndef OSC_MAX_MSG_IN
 #define OSC_MAX_MSG_IN 512
@@ -18,10 +32,38 @@
 #define OSC_MAX_MSG_OUT 512
 #endif
 
+/*
+  Each channel encodes outgoing messages into a ring of output buffers.
+  Once a buffer is ready it's handed off to the channel's transmit thread,
+  and encoding carries on in the next one.  If no buffer frees up within
+  OSC_OUT_TIMEOUT milliseconds, the messages in the current one are dropped.
+  A depth of 1 sends synchronously from the calling thread, with no
+  transmit thread.
+*/
+#ifndef OSC_USB_OUT_BUFFERS
+#define OSC_USB_OUT_BUFFERS 2
+#endif
+
+#ifndef OSC_UDP_OUT_BUFFERS
+#define OSC_UDP_OUT_BUFFERS 2
+#endif
+
+#ifndef OSC_OUT_TIMEOUT
+#define OSC_OUT_TIMEOUT 100
+#endif
+
+#ifndef OSC_TX_STACK_SIZE
+#define OSC_TX_STACK_SIZE 512
+#endif
+
 #ifndef OSC_MAX_DATA_ITEMS
 #define OSC_MAX_DATA_ITEMS 20
 #endif
 
+// room left after an address for the dispatcher to write into - namespace
+// queries append child names and ranges get rewritten in place
+#define OSC_ADDRESS_SLACK 32
+
 #ifndef OSC_AUTOSEND_STACK_SIZE
 #define OSC_AUTOSEND_STACK_SIZE 512
 #endif
@@ -38,46 +80,158 @@
 #define OSC_AUTOSEND_DEFAULT_INTERVAL 10
 #endif
 
-typedef int (*OscSendMsg)(const char* data, int len);
+// how many of oscRoot's children can have autosenders - each one can have
+// its own interval, saved at EEPROM_OSC_AUTOSEND_INTERVALS
+#ifndef OSC_MAX_AUTOSENDERS
+#define OSC_MAX_AUTOSENDERS 8
+#endif
+
+typedef struct OscAutosendEntry_t {
+  const OscNode* node;
+  uint32_t period;  // in milliseconds - 0 to follow the global autosend interval
+  systime_t due;    // when the autosender should run next
+  uint8_t slot;     // which interval in EEPROM belongs to this guy
+} OscAutosendEntry;
+
+#ifndef OSC_NO_INDEX
+
+// max number of handlers that can be looked up directly - any others
+// still work, they just go through the full pattern matching dispatcher
+#ifndef OSC_INDEX_SIZE
+#define OSC_INDEX_SIZE 64
+#endif
+
+// max number of address components for an indexed handler
+#ifndef OSC_INDEX_MAX_DEPTH
+#define OSC_INDEX_MAX_DEPTH 4
+#endif
+
+#define OSC_INDEX_RANGE       0xFF  // path marker for a numeric range component
+#define OSC_INDEX_RANGE_CHAR  '#'   // what a range component contributes to the hash
+#define OSC_HASH_SEED         2166136261UL // FNV-1a
+#define OSC_HASH_PRIME        16777619UL
+#define oscHashChar(h, c)     (((h) ^ (uint8_t)(c)) * OSC_HASH_PRIME)
+
+typedef struct OscIndexEntry_t {
+  uint32_t hash;                      // hash of the address, with range indexes replaced
+  const OscNode* node;                // the node whose handler to call
+  uint8_t path[OSC_INDEX_MAX_DEPTH];  // child index at each level from oscRoot, or OSC_INDEX_RANGE
+  uint8_t depth;                      // number of address components
+} OscIndexEntry;
+
+#endif // OSC_NO_INDEX
+
+typedef struct OscOutBuffer_t {
+  char* start;        // where the packet to send starts - skips the bundle preamble for single messages
+  uint32_t length;
+  int address;        // UDP only - where to send it, as of when it was queued
+  int port;
+  char data[OSC_MAX_MSG_OUT];
+} OscOutBuffer;
+
+typedef int (*OscSendMsg)(const OscOutBuffer* ob);
+
+typedef struct OscChannelStats_t {
+  Stat in;          // messages received
+  Stat out;         // messages created
+  Stat dropped;     // outgoing messages that couldn't be created, or were dropped because no buffer freed up
+  Stat stalls;      // times a producer had to wait for a free buffer
+  Stat flushes;     // times a message didn't fit, so the buffer was sent early
+  Stat bundleMax;   // most messages sent in one packet
+} OscChannelStats;
+
+#define OSC_CHANNEL_STATS(ch) {                    \
+  .in = { .name = "osc." ch ".in" },               \
+  .out = { .name = "osc." ch ".out" },             \
+  .dropped = { .name = "osc." ch ".dropped" },     \
+  .stalls = { .name = "osc." ch ".stalls" },       \
+  .flushes = { .name = "osc." ch ".flushes" },     \
+  .bundleMax = { .name = "osc." ch ".bundle-max" } \
+}
 
 typedef struct OscChannelData_t {
   Mutex lock;
   uint8_t outMsgCount;
   uint32_t outBufRemaining;
   char* outBufPtr;
-  char outBuf[OSC_MAX_MSG_OUT];
+  OscOutBuffer* outBufs;  // ring of output buffers
+  uint8_t outBufCount;    // depth of the ring
+  uint8_t outHead;        // the buffer being encoded into
+  uint8_t outTail;        // the next buffer to transmit
+  Semaphore outFree;      // buffers available to encode into, besides outHead
+  Semaphore outQueued;    // buffers waiting on the transmit thread
+  Thread* txThd;
+  OscChannelStats stats;
   char inBuf[OSC_MAX_MSG_IN];
   OscSendMsg sendMessage;
+  OscMessageSink sink;    // LOCAL only - gets each message instead of a buffer
+  void* sinkContext;
 } OscChannelData;
 
 typedef struct Osc_t {
 #ifdef MAKE_CTRL_USB
   Thread* usbThd;
   OscChannelData usb;
+  OscOutBuffer usbOut[OSC_USB_OUT_BUFFERS];
 #endif
 #ifdef MAKE_CTRL_NETWORK
   Thread* udpThd;
   OscChannelData udp;
+  OscOutBuffer udpOut[OSC_UDP_OUT_BUFFERS];
+#ifdef OSC_UDP_NETCONN
+  struct netconn* udpconn;
+#else
   int udpsock;
+#endif
   int udpReplyPort;
   int udpReplyAddress;
   int udpListenPort;
 #endif
+  OscChannelData local;
+  bool localReady;
   Thread* autosendThd;
   OscChannel autosendDestination;
   uint32_t autosendPeriod;
+  OscAutosendEntry autosenders[OSC_MAX_AUTOSENDERS]; // min-heap, ordered by due time
+  uint8_t autosenderCount;
+  Semaphore autosendWake;     // signalled when an interval changes
+  Stat autosendOverruns;      // times an autosender ran a whole period late
+#ifndef OSC_NO_INDEX
+  OscIndexEntry index[OSC_INDEX_SIZE];
+  uint8_t indexCount;
+  bool indexBuilt;            // set once the table is complete - it's never touched after that
+  Mutex indexLock;            // in case two channels start up at once
+#endif
 } Osc;
 
 static void oscReceivePacket(OscChannel ch, char* data, uint32_t len);
 static void oscReceiveMessage(OscChannel ch, char* data, uint32_t len);
 static void oscResetChannel(OscChannelData* ch);
+static void oscInitChannel(OscChannelData* chd, OscOutBuffer* bufs, uint8_t count, OscSendMsg send, void* wa, size_t wasize);
 static OscChannelData* oscGetChannelByType(OscChannel ct);
 static uint32_t oscExtractData(char* buf, uint32_t len, OscData data[], int maxdata);
 static bool oscDispatchNode(OscChannel ch, char* addr, char* fulladdr,
                               const OscNode* node, OscData d[], int datalen);
 static bool oscNameSpaceQuery(OscChannel ch, char* addr, char *fulladdr, const OscNode* node);
+#ifndef OSC_NO_INDEX
+static void oscIndexBuild(void);
+static bool oscIndexDispatch(OscChannel ch, char* address, OscData d[], int datalen);
+#endif
 
-static Osc osc;
+static Osc osc = {
+#ifdef MAKE_CTRL_USB
+  .usb.stats = OSC_CHANNEL_STATS("usb"),
+#endif
+#ifdef MAKE_CTRL_NETWORK
+  .udp.stats = OSC_CHANNEL_STATS("udp"),
+#endif
+  .local.lock = _MUTEX_DATA(osc.local.lock),
+  .local.stats = OSC_CHANNEL_STATS("local"),
+#ifndef OSC_NO_INDEX
+  .indexLock = _MUTEX_DATA(osc.indexLock),
+#endif
+  .autosendOverruns = { .name = "osc.autosend.overruns" }
+};
 extern const OscNode oscRoot; // must be defined by the user
 
 #ifdef MAKE_CTRL_USB
@@ -87,6 +241,14 @@ extern const OscNode oscRoot; // must be defined by the user
 #endif
 
 static WORKING_AREA(waUsbThd, OSC_USB_STACK_SIZE);
+#if OSC_USB_OUT_BUFFERS > 1
+static WORKING_AREA(waUsbTxThd, OSC_TX_STACK_SIZE);
+#endif
+static int oscSendMessageUSB(const OscOutBuffer* ob)
+{
+  return usbserialWriteSlip(ob->start, ob->length);
+}
+
 static msg_t OscUsbSerialThread(void *arg)
 {
   UNUSED(arg);
@@ -109,9 +271,19 @@ static msg_t OscUsbSerialThread(void *arg)
 bool oscUsbEnable(bool on)
 {
   if (on && osc.usbThd == 0) {
-    chMtxInit(&osc.usb.lock);
-    osc.usb.sendMessage = usbserialWriteSlip;
+    #ifndef OSC_NO_INDEX
+    oscIndexBuild();
+    #endif
+    #if OSC_USB_OUT_BUFFERS > 1
+    oscInitChannel(&osc.usb, osc.usbOut, OSC_USB_OUT_BUFFERS, oscSendMessageUSB, waUsbTxThd, sizeof(waUsbTxThd));
+    #else
+    oscInitChannel(&osc.usb, osc.usbOut, OSC_USB_OUT_BUFFERS, oscSendMessageUSB, 0, 0);
+    #endif
+    #if OSC_USB_OUT_BUFFERS > 1
+    systemRegisterThread(osc.usb.txThd, "osc-usb-tx", sizeof(waUsbTxThd));
+    #endif
     osc.usbThd = chThdCreateStatic(waUsbThd, sizeof(waUsbThd), NORMALPRIO, OscUsbSerialThread, NULL);
+    systemRegisterThread(osc.usbThd, "osc-usb", sizeof(waUsbThd));
     return true;
   }
   if (!on && osc.usbThd != 0) {
@@ -131,6 +303,137 @@ bool oscUsbEnable(bool on)
 #endif
 
 static WORKING_AREA(waUdpThd, OSC_UDP_STACK_SIZE);
+#if OSC_UDP_OUT_BUFFERS > 1
+static WORKING_AREA(waUdpTxThd, OSC_TX_STACK_SIZE);
+#endif
+
+#ifdef OSC_UDP_NETCONN
+
+/*
+  Return a pointer to len contiguous bytes at offset in the pbuf chain,
+  or 0 if they straddle the end of a pbuf.
+*/
+static char* oscPbufSpan(struct pbuf* p, uint32_t offset, uint32_t len)
+{
+  for (; p != 0; p = p->next) {
+    if (offset < p->len)
+      return (offset + len <= p->len) ? (char*)p->payload + offset : 0;
+    offset -= p->len;
+  }
+  return 0;
+}
+
+/*
+  Whether a message can be dispatched where it sits in a pbuf.  Namespace
+  queries and patterns get written to past the end of the address as
+  they're dispatched, and there's no room for that in a pbuf - right after
+  the message is either the next bundle element or the end of the buffer.
+  Nested bundles might contain either, so they don't qualify either.
+*/
+static bool oscInPlaceOk(const char* msg, uint32_t len)
+{
+  const char* p = msg;
+  if (*p != '/')
+    return false;
+  for (; p < msg + len && *p != 0; p++) {
+    switch (*p) {
+      case '*': case '?': case '[': case '{': case '\\':
+        return false;
+    }
+  }
+  return p < msg + len && p[-1] != '/';
+}
+
+/*
+  Dispatch len bytes at offset in the pbuf chain.  Plain messages that sit
+  within a single pbuf are parsed in place - anything else is copied into
+  inBuf, with room left over for the dispatcher.
+*/
+static void oscReceivePbufMessage(struct pbuf* p, uint32_t offset, uint32_t len)
+{
+  char* msg = oscPbufSpan(p, offset, len);
+  if (msg == 0 || !oscInPlaceOk(msg, len)) {
+    if (len > sizeof(osc.udp.inBuf) - OSC_ADDRESS_SLACK)
+      return;
+    msg = osc.udp.inBuf;
+    pbuf_copy_partial(p, msg, len, offset);
+  }
+  oscReceivePacket(UDP, msg, len);
+}
+
+/*
+  Process a packet, copying as little of it out of the pbufs it arrived in
+  as we can get away with.  Bundles are taken apart here rather than by
+  oscReceivePacket(), so each element gets its own chance to be dispatched
+  in place.
+*/
+static void oscReceivePbuf(struct pbuf* p)
+{
+  char lenbuf[4];
+  uint32_t offset = 16; // skip "#bundle" and the timetag
+
+  if (pbuf_copy_partial(p, lenbuf, 1, 0) != 1)
+    return;
+  if (lenbuf[0] != '#') {
+    oscReceivePbufMessage(p, 0, p->tot_len);
+    return;
+  }
+
+  while (offset + sizeof(lenbuf) <= p->tot_len) {
+    uint32_t remaining = sizeof(lenbuf);
+    int msglen;
+    pbuf_copy_partial(p, lenbuf, sizeof(lenbuf), offset);
+    oscDecodeInt32(lenbuf, &remaining, &msglen);
+    offset += sizeof(lenbuf);
+    if (msglen <= 0 || offset + msglen > p->tot_len) // we got a bogus length
+      break;
+    oscReceivePbufMessage(p, offset, msglen);
+    offset += msglen;
+  }
+}
+
+static msg_t OscUdpThread(void *arg)
+{
+  UNUSED(arg);
+
+  while ((osc.udpconn = netconn_new(NETCONN_UDP)) == 0)
+    chThdSleepMilliseconds(500);
+
+  netconn_bind(osc.udpconn, IP_ADDR_ANY, osc.udpListenPort);
+
+  while (!chThdShouldTerminate()) {
+    struct netbuf* buf = netconn_recv(osc.udpconn);
+    if (buf != 0) {
+      chMtxLock(&osc.udp.lock);
+      osc.udpReplyAddress = netbuf_fromaddr(buf)->addr;
+      PERF_START;
+      oscReceivePbuf(buf->p);
+      PERF_STOP("oscReceivePacket");
+      oscSendPendingMessages(UDP);
+      chMtxUnlock();
+      netbuf_delete(buf); // only now that nobody's looking at it anymore
+    }
+  }
+  return 0;
+}
+
+static int oscSendMessageUDP(const OscOutBuffer* ob)
+{
+  struct ip_addr addr;
+  int len = ob->length;
+  struct netbuf* buf = netbuf_new();
+  if (buf == 0)
+    return 0;
+  addr.addr = ob->address;
+  netbuf_ref(buf, ob->start, len);
+  if (netconn_sendto(osc.udpconn, buf, &addr, ob->port) != ERR_OK)
+    len = 0;
+  netbuf_delete(buf);
+  return len;
+}
+
+#else
+
 static msg_t OscUdpThread(void *arg)
 {
   UNUSED(arg);
@@ -141,10 +444,15 @@ static msg_t OscUdpThread(void *arg)
   udpBind(osc.udpsock, osc.udpListenPort);
 
   while (!chThdShouldTerminate()) {
-    int justGot = udpRead(osc.udpsock, osc.udp.inBuf, sizeof(osc.udp.inBuf), &osc.udpReplyAddress, 0);
+    // whoever queues a buffer reads the reply address, so only update it under the lock
+    int from;
+    int justGot = udpRead(osc.udpsock, osc.udp.inBuf, sizeof(osc.udp.inBuf), &from, 0);
     if (justGot > 0) {
       chMtxLock(&osc.udp.lock);
+      osc.udpReplyAddress = from;
+      PERF_START;
       oscReceivePacket(UDP, osc.udp.inBuf, justGot);
+      PERF_STOP("oscReceivePacket");
       oscSendPendingMessages(UDP);
       chMtxUnlock();
     }
@@ -152,19 +460,31 @@ static msg_t OscUdpThread(void *arg)
   return 0;
 }
 
-static int oscSendMessageUDP(const char* data, int len)
+static int oscSendMessageUDP(const OscOutBuffer* ob)
 {
-  return udpWrite(osc.udpsock, data, len, osc.udpReplyAddress, osc.udpReplyPort);
+  return udpWrite(osc.udpsock, ob->start, ob->length, ob->address, ob->port);
 }
 
+#endif // OSC_UDP_NETCONN
+
 bool oscUdpEnable(bool on)
 {
   if (on && osc.udpThd == 0) {
+    #ifndef OSC_NO_INDEX
+    oscIndexBuild();
+    #endif
     osc.udpListenPort = OSC_UDP_DEFAULT_PORT;
     oscUdpReplyPort();
-    osc.udp.sendMessage = oscSendMessageUDP;
-    chMtxInit(&osc.udp.lock);
+    #if OSC_UDP_OUT_BUFFERS > 1
+    oscInitChannel(&osc.udp, osc.udpOut, OSC_UDP_OUT_BUFFERS, oscSendMessageUDP, waUdpTxThd, sizeof(waUdpTxThd));
+    #else
+    oscInitChannel(&osc.udp, osc.udpOut, OSC_UDP_OUT_BUFFERS, oscSendMessageUDP, 0, 0);
+    #endif
+    #if OSC_UDP_OUT_BUFFERS > 1
+    systemRegisterThread(osc.udp.txThd, "osc-udp-tx", sizeof(waUdpTxThd));
+    #endif
     osc.udpThd = chThdCreateStatic(waUdpThd, sizeof(waUdpThd), NORMALPRIO, OscUdpThread, NULL);
+    systemRegisterThread(osc.udpThd, "osc-udp", sizeof(waUdpThd));
     return true;
   }
   if (!on && osc.udpThd != 0) {
@@ -179,7 +499,7 @@ void oscUdpSetReplyPort(int port)
 {
   if (osc.udpReplyPort != port) {
     osc.udpReplyPort = port;
-    eepromWrite(EEPROM_OSC_UDP_SEND_PORT, port);
+    eepromWriteDeferred(EEPROM_OSC_UDP_SEND_PORT, port);
   }
 }
 
@@ -197,7 +517,7 @@ void oscUdpSetListenPort(int port)
 {
   if (osc.udpListenPort != port) {
     osc.udpListenPort = port;
-    eepromWrite(EEPROM_OSC_UDP_LISTEN_PORT, port);
+    eepromWriteDeferred(EEPROM_OSC_UDP_LISTEN_PORT, port);
   }
 }
 
@@ -214,31 +534,84 @@ int oscUdpListenPort()
 #endif // MAKE_CTRL_NETWORK
 
 static WORKING_AREA(waAutosendThd, OSC_AUTOSEND_STACK_SIZE);
+
+#define oscAutosendPeriodOf(e) MS2ST((e)->period ? (e)->period : osc.autosendPeriod)
+#define oscAutosendBefore(a, b) ((int32_t)((a)->due - (b)->due) < 0)
+
+static void oscAutosendSiftDown(uint8_t i)
+{
+  OscAutosendEntry* h = osc.autosenders;
+  while (true) {
+    uint8_t smallest = i;
+    uint8_t child = 2 * i + 1;
+    if (child < osc.autosenderCount && oscAutosendBefore(&h[child], &h[smallest]))
+      smallest = child;
+    if (child + 1 < osc.autosenderCount && oscAutosendBefore(&h[child + 1], &h[smallest]))
+      smallest = child + 1;
+    if (smallest == i)
+      return;
+    OscAutosendEntry tmp = h[i];
+    h[i] = h[smallest];
+    h[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+static void oscAutosendHeapify(void)
+{
+  int i;
+  for (i = osc.autosenderCount / 2 - 1; i >= 0; i--)
+    oscAutosendSiftDown(i);
+}
+
+/*
+  Run each subsystem's autosender when it comes due, and sleep until the
+  next one is due in between.  Everything that's due at the same time goes
+  out in the same bundle.
+*/
 static msg_t OscAutosendThread(void *arg)
 {
   UNUSED(arg);
-  uint8_t i;
-  const OscNode* node;
   OscChannelData* chd;
 
   while (!chThdShouldTerminate()) {
-    if (osc.autosendDestination == NONE) {
+    if (osc.autosendDestination == NONE || osc.autosenderCount == 0) {
       sleep(250);
+      continue;
     }
-    else {
-      chd = oscGetChannelByType(osc.autosendDestination);
-      i = 0;
-      node = oscRoot.children[i++];
-      chMtxLock(&chd->lock);
-      while (node != 0) {
-        if (node->autosender != 0)
-          node->autosender(osc.autosendDestination);
-        node = oscRoot.children[i++];
+
+    chSysLock();
+    int32_t wait = (int32_t)(osc.autosenders[0].due - chTimeNow());
+    chSysUnlock();
+    if (wait > 0) {
+      // wake up early if somebody changes an interval
+      chSemWaitTimeout(&osc.autosendWake, wait);
+      continue;
+    }
+
+    OscChannel dest = osc.autosendDestination;
+    chd = oscGetChannelByType(dest);
+    chMtxLock(&chd->lock);
+    while (true) {
+      chSysLock();
+      systime_t now = chTimeNow();
+      OscAutosendEntry* e = &osc.autosenders[0];
+      if ((int32_t)(e->due - now) > 0) {
+        chSysUnlock();
+        break;
       }
-      oscSendPendingMessages(osc.autosendDestination);
-      chMtxUnlock();
-      sleep(osc.autosendPeriod);
+      const OscNode* node = e->node;
+      e->due += oscAutosendPeriodOf(e);
+      if ((int32_t)(e->due - now) <= 0) { // fell a whole period behind - don't try to catch up
+        e->due = now + oscAutosendPeriodOf(e);
+        statAddI(&osc.autosendOverruns, 1);
+      }
+      oscAutosendSiftDown(0);
+      chSysUnlock();
+      node->autosender(dest);
     }
+    oscSendPendingMessages(dest);
+    chMtxUnlock();
   }
   return 0;
 }
@@ -249,7 +622,27 @@ void oscAutosendEnable(bool enabled)
     // load up the interval and destination, and start the thread
     oscAutosendInterval();
     oscAutosendDestination();
+    chSemInit(&osc.autosendWake, 0);
+
+    // gather up everybody with an autosender, along with their intervals
+    uint8_t i;
+    systime_t now = chTimeNow();
+    osc.autosenderCount = 0;
+    for (i = 0; oscRoot.children[i] != 0 && osc.autosenderCount < OSC_MAX_AUTOSENDERS; i++) {
+      if (oscRoot.children[i]->autosender != 0) {
+        OscAutosendEntry* e = &osc.autosenders[osc.autosenderCount];
+        e->node = oscRoot.children[i];
+        e->slot = osc.autosenderCount++;
+        e->period = eepromRead(EEPROM_OSC_AUTOSEND_INTERVALS + (e->slot * 4));
+        if (e->period < 1 || e->period > OSC_AUTOSEND_MAX_INTERVAL)
+          e->period = 0;
+        e->due = now + oscAutosendPeriodOf(e);
+      }
+    }
+    oscAutosendHeapify();
+    statsAdd(&osc.autosendOverruns);
     osc.autosendThd = chThdCreateStatic(waAutosendThd, sizeof(waAutosendThd), NORMALPRIO - 2, OscAutosendThread, NULL);
+    systemRegisterThread(osc.autosendThd, "osc-autosend", sizeof(waAutosendThd));
   }
   else if (!enabled && osc.autosendThd != 0) {
     chThdTerminate(osc.autosendThd);
@@ -257,6 +650,80 @@ void oscAutosendEnable(bool enabled)
   }
 }
 
+static OscAutosendEntry* oscAutosendFind(const OscNode* node)
+{
+  uint8_t i;
+  for (i = 0; i < osc.autosenderCount; i++) {
+    if (osc.autosenders[i].node == node)
+      return &osc.autosenders[i];
+  }
+  return 0;
+}
+
+/*
+  The interval, in milliseconds, that a subsystem's autosender runs at.
+  This is the global autosend interval unless it's been given one of its own.
+*/
+uint32_t oscAutosendNodeInterval(const OscNode* node)
+{
+  uint32_t period = 0;
+  chSysLock();
+  OscAutosendEntry* e = oscAutosendFind(node);
+  if (e != 0)
+    period = e->period;
+  chSysUnlock();
+  return period ? period : oscAutosendInterval();
+}
+
+/*
+  Give a subsystem's autosender its own interval, in milliseconds.
+  0 goes back to following the global autosend interval.
+*/
+void oscSetAutosendNodeInterval(const OscNode* node, uint32_t interval)
+{
+  if (interval > OSC_AUTOSEND_MAX_INTERVAL)
+    return;
+  chSysLock();
+  OscAutosendEntry* e = oscAutosendFind(node);
+  if (e == 0 || e->period == interval) {
+    chSysUnlock();
+    return;
+  }
+  e->period = interval;
+  e->due = chTimeNow() + oscAutosendPeriodOf(e);
+  uint8_t slot = e->slot;
+  oscAutosendHeapify();
+  chSemSignalI(&osc.autosendWake);
+  chSchRescheduleS();
+  chSysUnlock();
+  eepromWriteDeferred(EEPROM_OSC_AUTOSEND_INTERVALS + (slot * 4), interval);
+}
+
+/*
+  The number of times an autosender ran more than a whole interval late.
+*/
+uint32_t oscAutosendOverruns()
+{
+  return osc.autosendOverruns.value;
+}
+
+/*
+  Handle an "autosend-interval" property for a subsystem's autosender, eg.
+  /analogins/autosend-interval 5 - call it from the property's handler.
+  It can't be a handler itself, since the property can't live under the
+  autosender's node if that's a range node, so it couldn't tell from the
+  address whose interval it is.
+*/
+void oscAutosendIntervalProperty(OscChannel ch, char* address, const OscNode* node, OscData d[], int datalen)
+{
+  if (datalen == 1 && d[0].type == INT)
+    oscSetAutosendNodeInterval(node, d[0].value.i);
+  else if (datalen == 0) {
+    OscData d = { .type = INT, .value.i = oscAutosendNodeInterval(node) };
+    oscCreateMessage(ch, address, &d, 1);
+  }
+}
+
 OscChannel oscAutosendDestination()
 {
   if (osc.autosendDestination == 0) { // uninitialized
@@ -280,7 +747,7 @@ void oscSetAutosendDestination(OscChannel oc)
 {
   if (osc.autosendDestination != oc) {
     osc.autosendDestination = oc;
-    eepromWrite(EEPROM_OSC_ASYNC_DEST, oc);
+    eepromWriteDeferred(EEPROM_OSC_ASYNC_DEST, oc);
   }
 }
 
@@ -297,8 +764,23 @@ uint32_t oscAutosendInterval()
 void oscSetAutosendInterval(uint32_t interval)
 {
   if (interval != osc.autosendPeriod && interval > 1 && interval < OSC_AUTOSEND_MAX_INTERVAL) {
+    chSysLock();
     osc.autosendPeriod = interval;
-    eepromWrite(EEPROM_OSC_ASYNC_INTERVAL, interval);
+    // anybody following the global interval starts over on the new one
+    uint8_t i;
+    systime_t now = chTimeNow();
+    for (i = 0; i < osc.autosenderCount; i++) {
+      OscAutosendEntry* e = &osc.autosenders[i];
+      if (e->period == 0)
+        e->due = now + MS2ST(interval);
+    }
+    oscAutosendHeapify();
+    if (osc.autosendThd != 0) {
+      chSemSignalI(&osc.autosendWake);
+      chSchRescheduleS();
+    }
+    chSysUnlock();
+    eepromWriteDeferred(EEPROM_OSC_ASYNC_INTERVAL, interval);
   }
 }
 
@@ -310,17 +792,15 @@ OscChannelData* oscGetChannelByType(OscChannel ct)
 #ifdef MAKE_CTRL_NETWORK
   if (ct == UDP) return &osc.udp;
 #endif
+  if (ct == LOCAL) return &osc.local;
   return 0;
 }
 
 void oscLockChannel(OscChannel ct)
 {
-#ifdef MAKE_CTRL_USB
-  if (ct == USB) chMtxLock(&osc.usb.lock); return;
-#endif
-#ifdef MAKE_CTRL_NETWORK
-  if (ct == UDP) chMtxLock(&osc.udp.lock); return;
-#endif
+  OscChannelData* chd = oscGetChannelByType(ct);
+  if (chd != 0)
+    chMtxLock(&chd->lock);
 }
 
 void oscUnlockChannel(OscChannel ct)
@@ -331,11 +811,80 @@ void oscUnlockChannel(OscChannel ct)
 
 void oscResetChannel(OscChannelData* channel)
 {
-  channel->outBufRemaining = sizeof(channel->outBuf);
-  channel->outBufPtr = channel->outBuf;
+  if (channel->outBufs == 0)
+    return; // never enabled, so there's nothing to write into
+  channel->outBufRemaining = sizeof(channel->outBufs[0].data);
+  channel->outBufPtr = channel->outBufs[channel->outHead].data;
   channel->outMsgCount = 0;
 }
 
+/*
+  Send filled output buffers as they're handed over by oscSendPendingMessages(),
+  leaving the producers free to carry on encoding into the next one.
+*/
+static msg_t OscTxThread(void *arg)
+{
+  OscChannelData* chd = arg;
+  while (!chThdShouldTerminate()) {
+    chSemWait(&chd->outQueued);
+    OscOutBuffer* ob = &chd->outBufs[chd->outTail];
+    chd->sendMessage(ob);
+    chd->outTail = (chd->outTail + 1) % chd->outBufCount;
+    chSemSignal(&chd->outFree);
+  }
+  return 0;
+}
+
+void oscInitChannel(OscChannelData* chd, OscOutBuffer* bufs, uint8_t count, OscSendMsg send, void* wa, size_t wasize)
+{
+  chMtxInit(&chd->lock);
+  chd->sendMessage = send;
+  statsAdd(&chd->stats.in);
+  statsAdd(&chd->stats.out);
+  statsAdd(&chd->stats.dropped);
+  statsAdd(&chd->stats.stalls);
+  statsAdd(&chd->stats.flushes);
+  statsAdd(&chd->stats.bundleMax);
+  if (chd->txThd == 0) { // only set the ring up once, since the transmit thread keeps running
+    chd->outBufs = bufs;
+    chd->outBufCount = count;
+    chd->outHead = chd->outTail = 0;
+    chSemInit(&chd->outFree, count - 1);
+    chSemInit(&chd->outQueued, 0);
+    if (count > 1)
+      chd->txThd = chThdCreateStatic(wa, wasize, NORMALPRIO, OscTxThread, chd);
+  }
+  oscResetChannel(chd);
+}
+
+/**
+  The number of times a thread sending on this channel had to wait for an
+  output buffer to become free.
+  If this keeps going up, the channel can't keep up with the messages being
+  created for it - consider a deeper ring via OSC_USB_OUT_BUFFERS or
+  OSC_UDP_OUT_BUFFERS.
+  @param ct The channel to check.
+  @return The number of stalls since the channel was enabled.
+*/
+uint32_t oscOutputStalls(OscChannel ct)
+{
+  OscChannelData* chd = oscGetChannelByType(ct);
+  return (chd != 0) ? chd->stats.stalls.value : 0;
+}
+
+/**
+  The number of outgoing messages dropped on this channel, because no output
+  buffer became free within OSC_OUT_TIMEOUT milliseconds or because they were
+  too big to fit in one.
+  @param ct The channel to check.
+  @return The number of dropped messages since the channel was enabled.
+*/
+uint32_t oscOutputDrops(OscChannel ct)
+{
+  OscChannelData* chd = oscGetChannelByType(ct);
+  return (chd != 0) ? chd->stats.dropped.value : 0;
+}
+
 /*
   A new packet has arrived.  Check if it's a single message or a
   bundle and process accordingly. If any response messages were
@@ -368,6 +917,8 @@ void oscReceivePacket(OscChannel ch, char* data, uint32_t len)
 */
 void oscReceiveMessage(OscChannel ch, char* data, uint32_t len)
 {
+  statInc(&oscGetChannelByType(ch)->stats.in);
+
   // if the last char is a /, treat it as a namespace query
   if (data[strlen(data) - 1] == '/') {
     oscNameSpaceQuery(ch, data + 1, data, &oscRoot);
@@ -384,10 +935,221 @@ void oscReceiveMessage(OscChannel ch, char* data, uint32_t len)
     return;
   OscData d[datalen];
   if (datalen == oscExtractData(data + length, len, d, datalen)) {
+    #ifndef OSC_NO_INDEX
+    if (oscIndexDispatch(ch, data, d, datalen))
+      return;
+    #endif
     oscDispatchNode(ch, data + 1, data, &oscRoot, d, datalen);
   }
 }
 
+/*
+  Send a message to the OSC tree from code on the board, as if it had
+  arrived on a channel of its own.  Any messages the handlers create in
+  response are passed to sink, one at a time, as they're created - nothing
+  is buffered, so a pattern that matches any number of handlers takes no
+  more memory than one.  The address can be a pattern, or end in / for a
+  namespace query.  One dispatch runs at a time.  Returns true if any
+  handler matched the address.
+*/
+bool oscDispatch(const char* address, OscData data[], int datalen, OscMessageSink sink, void* context)
+{
+  OscChannelData* chd = &osc.local;
+  int len = strlen(address);
+  if (address[0] != '/' || len > (int)sizeof(chd->inBuf) - OSC_ADDRESS_SLACK)
+    return false;
+
+  chMtxLock(&chd->lock);
+  if (!osc.localReady) {
+    statsAdd(&chd->stats.in);
+    statsAdd(&chd->stats.out);
+    statsAdd(&chd->stats.dropped);
+    #ifndef OSC_NO_INDEX
+    oscIndexBuild();
+    #endif
+    osc.localReady = true;
+  }
+  statInc(&chd->stats.in);
+  chd->sink = sink;
+  chd->sinkContext = context;
+  memcpy(chd->inBuf, address, len + 1);
+
+  bool matched;
+  if (chd->inBuf[len - 1] == '/')
+    matched = oscNameSpaceQuery(LOCAL, chd->inBuf + 1, chd->inBuf, &oscRoot);
+  else {
+    #ifndef OSC_NO_INDEX
+    matched = oscIndexDispatch(LOCAL, chd->inBuf, data, datalen);
+    if (!matched)
+    #endif
+    matched = oscDispatchNode(LOCAL, chd->inBuf + 1, chd->inBuf, &oscRoot, data, datalen);
+  }
+
+  chd->sink = 0;
+  chMtxUnlock();
+  return matched;
+}
+
+#ifndef OSC_NO_INDEX
+
+/*
+  Insert a handler node into the index, keeping it sorted by hash.
+*/
+static void oscIndexInsert(const OscNode* node, uint32_t hash, const uint8_t path[], uint8_t depth)
+{
+  if (osc.indexCount >= OSC_INDEX_SIZE)
+    return; // no room - this one will be found by oscDispatchNode()
+
+  int i = osc.indexCount++;
+  while (i > 0 && osc.index[i - 1].hash > hash) {
+    osc.index[i] = osc.index[i - 1];
+    i--;
+  }
+  osc.index[i].hash = hash;
+  osc.index[i].node = node;
+  osc.index[i].depth = depth;
+  memcpy(osc.index[i].path, path, depth);
+}
+
+/*
+  Walk the tree below a node, adding an entry for each handler we find.
+  Range nodes contribute a placeholder component, since the index
+  is only known once a message arrives.
+*/
+static void oscIndexAddNode(const OscNode* node, uint32_t hash, uint8_t path[], uint8_t depth)
+{
+  if (node->handler != NULL) {
+    oscIndexInsert(node, hash, path, depth);
+    return;
+  }
+
+  if (node->range > 0) {
+    if (depth >= OSC_INDEX_MAX_DEPTH)
+      return;
+    hash = oscHashChar(hash, '/');
+    hash = oscHashChar(hash, OSC_INDEX_RANGE_CHAR);
+    path[depth++] = OSC_INDEX_RANGE;
+  }
+
+  if (depth >= OSC_INDEX_MAX_DEPTH)
+    return; // too deep to index - leave it to the full dispatcher
+
+  uint8_t i;
+  for (i = 0; node->children[i] != 0; i++) {
+    const char* name = node->children[i]->name;
+    uint32_t h = oscHashChar(hash, '/');
+    while (*name)
+      h = oscHashChar(h, *name++);
+    path[depth] = i;
+    oscIndexAddNode(node->children[i], h, path, depth + 1);
+  }
+}
+
+/*
+  Flatten the OscNode tree into a table of handlers sorted by the hash
+  of their full address, so literal addresses can be dispatched without
+  walking the tree.  Only needs to happen once, since the tree is const.
+  Each channel builds it before it starts, so whichever starts first does
+  the work - the lock keeps a second one from starting over underneath it.
+*/
+static void oscIndexBuild()
+{
+  chMtxLock(&osc.indexLock);
+  if (!osc.indexBuilt) {
+    uint8_t path[OSC_INDEX_MAX_DEPTH];
+    osc.indexCount = 0;
+    oscIndexAddNode(&oscRoot, OSC_HASH_SEED, path, 0);
+    osc.indexBuilt = true;
+  }
+  chMtxUnlock();
+}
+
+/*
+  Confirm that an index entry really describes the given address,
+  since different addresses can hash to the same value.
+*/
+static bool oscIndexMatch(const OscIndexEntry* e, const char* address, int idx)
+{
+  const OscNode* node = &oscRoot;
+  uint8_t i;
+  for (i = 0; i < e->depth; i++) {
+    const char* component = address + 1; // skip the /
+    int len = strcspn(component, "/");
+    if (e->path[i] == OSC_INDEX_RANGE) {
+      if (idx >= node->range) // the hash pass already checked that it's a number
+        return false;
+    }
+    else {
+      node = node->children[e->path[i]];
+      if (strncmp(node->name, component, len) != 0 || node->name[len] != 0)
+        return false;
+    }
+    address = component + len;
+  }
+  return *address == 0;
+}
+
+/*
+  Fast path for literal addresses - hash the address, look it up in the
+  index and call the handler directly.  Returns false if the address contains
+  pattern characters or isn't in the index, in which case it's up to
+  oscDispatchNode() to deal with it.
+*/
+bool oscIndexDispatch(OscChannel ch, char* address, OscData d[], int datalen)
+{
+  uint32_t hash = OSC_HASH_SEED;
+  int idx = 0;
+  const char* p = address;
+
+  if (!osc.indexBuilt)
+    return false;
+  while (*p == '/') {
+    hash = oscHashChar(hash, *p++);
+    if (isdigit((int)*p)) {
+      if (*p == '0' && isdigit((int)p[1]))
+        return false; // leading zeros - let the dispatcher normalize the address
+      idx = 0;
+      while (isdigit((int)*p))
+        idx = idx * 10 + (*p++ - '0');
+      if (*p != '/' && *p != 0)
+        return false;
+      hash = oscHashChar(hash, OSC_INDEX_RANGE_CHAR);
+    }
+    else {
+      while (*p != '/' && *p != 0) {
+        switch (*p) {
+          case '*': case '?': case '[': case '{': case '\\':
+            return false;
+        }
+        hash = oscHashChar(hash, *p++);
+      }
+    }
+  }
+  if (*p != 0)
+    return false;
+
+  // binary search for the first entry with this hash
+  int lo = 0, hi = osc.indexCount;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (osc.index[mid].hash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (; lo < osc.indexCount && osc.index[lo].hash == hash; lo++) {
+    const OscIndexEntry* e = &osc.index[lo];
+    if (oscIndexMatch(e, address, idx)) {
+      e->node->handler(ch, address, idx, d, datalen);
+      return true;
+    }
+  }
+  return false;
+}
+
+#endif // OSC_NO_INDEX
+
 /*
  * Dispatch data to matching nodes.
  * Range nodes are treated specially - check if the direct child has
@@ -396,9 +1158,14 @@ void oscReceiveMessage(OscChannel ch, char* data, uint32_t len)
  */
 bool oscDispatchNode(OscChannel ch, char* addr, char* fulladdr, const OscNode* node, OscData data[], int datalen)
 {
-  char* nextPattern = strchr(addr, '/');
-  if (nextPattern != 0)
-    *nextPattern++ = 0;
+  char* separator = strchr(addr, '/');
+  char* nextPattern;
+  if (separator != 0) {
+    *separator = 0;
+    nextPattern = separator + 1;
+  }
+  else // last component - nothing left to match below this node
+    nextPattern = addr + strlen(addr);
 
   if (node->handler != NULL) {
     node->handler(ch, fulladdr, 0, data, datalen);
@@ -427,14 +1194,13 @@ bool oscDispatchNode(OscChannel ch, char* addr, char* fulladdr, const OscNode* n
         }
       }
     }
-    // replace the nulls we stuck in the address string
-    *--addr = '/';
-    *(nextPattern - 1) = '/';
+    // no index here - fall through and see if the name matches anything else
   }
   // otherwise, go down to the next level and try some more
   for (i = 0; node->children[i] != 0; ++i) {
     if (oscPatternMatch(addr, node->children[i]->name)) {
-      *(nextPattern - 1) = '/'; // replace this - we nulled it earlier
+      if (separator != 0)
+        *separator = '/'; // replace this - we nulled it earlier
       if (oscDispatchNode(ch, nextPattern, fulladdr, node->children[i], data, datalen))
         return true;
     }
@@ -627,6 +1393,7 @@ static char* oscDoCreateMessage(OscChannelData* chd, const char* address, OscDat
 
   // write the vals back into the real pointers
   chd->outMsgCount++;
+  statInc(&chd->stats.out);
   chd->outBufPtr = buf;
   chd->outBufRemaining = len;
   // write the length of this message - len is just used as a dummy here
@@ -639,19 +1406,33 @@ bool oscCreateMessage(OscChannel ch, const char* address, OscData* data, int dat
 {
   OscChannelData* chd = oscGetChannelByType(ch);
   bool rv = true;
+  if (ch == LOCAL) { // straight to whoever's dispatching, if anybody
+    if (chd->sink == 0) {
+      statInc(&chd->stats.dropped);
+      return false;
+    }
+    statInc(&chd->stats.out);
+    chd->sink(chd->sinkContext, address, data, datacount);
+    return true;
+  }
   // Try to create the message. If it fails, send any messages
   // in the buffer and try again.
   if (oscDoCreateMessage(chd, address, data, datacount) == NULL) {
+    statInc(&chd->stats.flushes);
     oscSendPendingMessages(ch);
     oscResetChannel(chd);
-    if (oscDoCreateMessage(chd, address, data, datacount) == NULL)
+    if (oscDoCreateMessage(chd, address, data, datacount) == NULL) {
+      statInc(&chd->stats.dropped);
       rv = false;
+    }
   }
   return rv;
 }
 
 /*
  * Send any pending messages out via a channel's sendMessage() routine.
+ * With more than one output buffer, the current one is queued for the
+ * transmit thread and we move on to the next free one.
  */
 int oscSendPendingMessages(OscChannel ch)
 {
@@ -659,16 +1440,41 @@ int oscSendPendingMessages(OscChannel ch)
   if (chd->outMsgCount == 0)
     return 0;
   // set the buffer and length up
-  char* data = chd->outBuf;
-  int len = sizeof(chd->outBuf) - chd->outBufRemaining;
+  OscOutBuffer* ob = &chd->outBufs[chd->outHead];
+  statMax(&chd->stats.bundleMax, chd->outMsgCount);
+  ob->start = ob->data;
+  ob->length = sizeof(ob->data) - chd->outBufRemaining;
   // if we only have 1 message, skip past the bundle preamble
   // which has already been written to the buffer
   if (chd->outMsgCount == 1) {
     // skip 8 bytes of "#bundle" + 8 bytes of timetag + 4 bytes of size
-    data += 20;
-    len -= 20;
+    ob->start += 20;
+    ob->length -= 20;
+  }
+#ifdef MAKE_CTRL_NETWORK
+  // the transmit thread might not get to it until after the next packet
+  // has come in from somewhere else, so note where this one's going now
+  if (ch == UDP) {
+    ob->address = osc.udpReplyAddress;
+    ob->port = osc.udpReplyPort;
+  }
+#endif
+
+  if (chd->outBufCount == 1) {
+    chd->sendMessage(ob);
+    oscResetChannel(chd);
+    return 1;
+  }
+
+  if (chSemGetCounterI(&chd->outFree) <= 0)
+    statInc(&chd->stats.stalls);
+  if (chSemWaitTimeout(&chd->outFree, MS2ST(OSC_OUT_TIMEOUT)) != RDY_OK) {
+    statAdd(&chd->stats.dropped, chd->outMsgCount);
+    oscResetChannel(chd); // nowhere to go - start over in the same buffer
+    return 0;
   }
-  chd->sendMessage(data, len);
+  chd->outHead = (chd->outHead + 1) % chd->outBufCount;
+  chSemSignal(&chd->outQueued);
   oscResetChannel(chd);
   return 1;
 }
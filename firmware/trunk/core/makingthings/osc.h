@@ -9,7 +9,8 @@
 typedef enum OscChannel_t {
   NONE,
   UDP,
-  USB
+  USB,
+  LOCAL   // messages dispatched from code on the board, via oscDispatch()
 } OscChannel;
 
 typedef enum OscDataType_t {
@@ -33,6 +34,8 @@ typedef void (*OscHandler)(OscChannel ch, char* address, int idx, OscData data[]
 
 typedef void (*OscAutosender)(OscChannel ch);
 
+typedef void (*OscMessageSink)(void* context, const char* address, OscData data[], int datalen);
+
 // should typically be declared const so they're located in read-only storage.
 typedef struct OscNode_t {
   const char* name;
@@ -57,10 +60,17 @@ void oscLockChannel(OscChannel ct);
 void oscUnlockChannel(OscChannel ct);
 bool oscCreateMessage(OscChannel ct, const char* address, OscData* data, int datacount);
 int  oscSendPendingMessages(OscChannel ct);
+uint32_t oscOutputStalls(OscChannel ct);
+uint32_t oscOutputDrops(OscChannel ct);
 OscChannel oscAutosendDestination(void);
 void oscSetAutosendDestination(OscChannel oc);
 uint32_t oscAutosendInterval(void);
 void oscSetAutosendInterval(uint32_t interval);
+uint32_t oscAutosendNodeInterval(const OscNode* node);
+void oscSetAutosendNodeInterval(const OscNode* node, uint32_t interval);
+uint32_t oscAutosendOverruns(void);
+void oscAutosendIntervalProperty(OscChannel ch, char* address, const OscNode* node, OscData d[], int datalen);
+bool oscDispatch(const char* address, OscData data[], int datalen, OscMessageSink sink, void* context);
 #ifdef __cplusplus
 }
 #endif
@@ -28,163 +28,231 @@
 #include "osc_patternmatch.h"
 #include <stdio.h>
 #include <ctype.h>
+#include <string.h>
 
-static bool oscMatchBrackets (const char *pattern, const char *test);
-static bool oscMatchList (const char *pattern, const char *test);
 /*
-static bool oscIsSpecialChar(char c)
-{
-  switch(c) {
-    case 0:
-    case '?':
-    case '*':
-    case '[':
-    case '{':
-    case ']':
-    case '}':
-    case '\\':
-      return true;
-    default:
-      return false;
-  }
-}
+  Patterns are matched iteratively rather than recursively, so a nasty
+  pattern can't run the calling thread out of stack.  Each '*' and
+  '{...}' leaves a choice point that we can come back to if the rest
+  of the pattern fails to match - a '*' that follows another '*' with
+  only fixed width elements in between replaces it, so a plain glob only
+  ever needs a single backtrack point.  Patterns that need more choice
+  points than this match the rest of the test string with a fresh set,
+  in a nested call - so the stack only grows by one call for every
+  OSC_PATTERN_MAX_BACKTRACK choice points.
 */
+#ifndef OSC_PATTERN_MAX_BACKTRACK
+#define OSC_PATTERN_MAX_BACKTRACK 8
+#endif
+
+typedef struct OscMatchPoint_t {
+  const char* pattern; // for '*' the pattern after it, for '{' the delimiter before the next alternative
+  const char* test;    // where in the test string this choice was made
+  bool star;
+} OscMatchPoint;
 
-bool oscPatternMatch(const char *  pattern, const char * test)
+static const char* oscMatchBrackets(const char* pattern, char c);
+static const char* oscMatchAlternative(const char* delim, const char* test, int* len);
+static bool oscMatchResume(OscMatchPoint* points, int* count, const char** pattern, const char** test);
+
+bool oscPatternMatch(const char* pattern, const char* test)
 {
-  if (pattern == 0 || pattern[0] == 0)
-    return test[0] == 0;
-  
-  if (test[0] == 0) {
-    if (pattern[0] == '*')
-      return oscPatternMatch(pattern+1,test);
-    else
-      return false;
+  OscMatchPoint points[OSC_PATTERN_MAX_BACKTRACK];
+  int count = 0;
+  const char* p = pattern;
+  const char* t = test;
+  const char* q;
+  int len;
+  bool fixed = false; // only fixed width elements since the last '*'
+
+  if (p == 0)
+    return t[0] == 0;
+
+  while (1) {
+    bool ok = true;
+    switch (*p) {
+      case 0:
+        if (*t == 0)
+          return true;
+        ok = false;
+        break;
+      case '?':
+        if (*t == 0)
+          ok = false;
+        else {
+          p++;
+          t++;
+        }
+        break;
+      case '*':
+        q = p;
+        while (*p == '*')
+          p++;
+        if (*p == 0)
+          return true; // trailing '*' eats whatever's left
+        if (fixed && count > 0 && points[count - 1].star)
+          count--; // nothing variable since the last '*', so it's redundant
+        if (count >= OSC_PATTERN_MAX_BACKTRACK) {
+          if (oscPatternMatch(q, t)) // out of choice points - carry on in a nested call
+            return true;
+          ok = false;
+          break;
+        }
+        points[count].pattern = p;
+        points[count].test = t;
+        points[count].star = true;
+        count++;
+        fixed = true;
+        break;
+      case ']':
+      case '}':
+        return false; // spurious closing bracket
+      case '[':
+        if (*t == 0 || (q = oscMatchBrackets(p, *t)) == 0)
+          ok = false;
+        else {
+          p = q;
+          t++;
+        }
+        break;
+      case '{':
+        if (strchr(p, '}') == 0)
+          return false; // unterminated { in pattern
+        if ((q = oscMatchAlternative(p, t, &len)) == 0)
+          ok = false;
+        else {
+          if (*q != '}') { // more alternatives to try if this one doesn't work out
+            if (count >= OSC_PATTERN_MAX_BACKTRACK) {
+              if (oscPatternMatch(p, t)) // out of choice points - carry on in a nested call
+                return true;
+              ok = false;
+              break;
+            }
+            points[count].pattern = q;
+            points[count].test = t;
+            points[count].star = false;
+            count++;
+          }
+          p = strchr(q, '}') + 1;
+          t += len;
+        }
+        fixed = false;
+        break;
+      case '\\':
+        if (p[1] == 0)
+          p++;
+        else if (p[1] == *t) {
+          p += 2;
+          t++;
+        }
+        else
+          ok = false;
+        break;
+      default:
+        // run through literal characters without going back around the switch
+        do {
+          if (*p != *t) {
+            ok = false;
+            break;
+          }
+          p++;
+          t++;
+        } while (*p != 0 && !strchr("?*[]{}\\", *p));
+        break;
+    }
+
+    if (!ok) {
+      if (!oscMatchResume(points, &count, &p, &t))
+        return false;
+      fixed = count > 0 && points[count - 1].star && points[count - 1].pattern == p;
+    }
   }
+}
 
-  switch (pattern[0]) {
-    case 0: 
-      return test[0] == 0;
-    case '?': 
-      return oscPatternMatch(pattern + 1, test + 1);
-    case '*': 
-      if (oscPatternMatch(pattern + 1, test))
+/*
+  Pick up from the most recent choice point - let the '*' eat one more
+  character, or move on to the next alternative in the list.
+*/
+static bool oscMatchResume(OscMatchPoint* points, int* count, const char** pattern, const char** test)
+{
+  while (*count > 0) {
+    OscMatchPoint* mp = &points[*count - 1];
+    if (mp->star) {
+      if (*mp->test != 0) {
+        mp->test++;
+        *pattern = mp->pattern;
+        *test = mp->test;
         return true;
-      else 
-	      return oscPatternMatch(pattern, test+1);
-    case ']':
-    case '}':
-      return false; // spurious closing bracket
-    case '[':
-      return oscMatchBrackets(pattern,test);
-    case '{':
-      return oscMatchList(pattern,test);
-    case '\\':  
-      if (pattern[1] == 0) 
-      	return test[0] == 0;
-      else {
-        if (pattern[1] == test[0]) 
-          return oscPatternMatch(pattern+2,test+1);
-        else 
-          return false;
       }
-    default:
-      // TODO - this recurses for *each* character...should
-      // iterate unless it's a special osc character
-      if (pattern[0] == test[0])
-      	return oscPatternMatch(pattern+1,test+1);
-      else
-      	return false;
+    }
+    else {
+      int len;
+      const char* q = oscMatchAlternative(mp->pattern, mp->test, &len);
+      if (q != 0) {
+        *pattern = strchr(q, '}') + 1;
+        *test = mp->test + len;
+        if (*q == '}')
+          (*count)--; // that was the last one
+        else
+          mp->pattern = q;
+        return true;
+      }
+    }
+    (*count)--;
   }
+  return false;
 }
 
-
-/* we know that pattern[0] == '[' and test[0] != 0 */
-static bool oscMatchBrackets (const char *pattern, const char *test)
+/*
+  We know that pattern[0] == '['.  Returns a pointer just past the
+  closing ']' if c is in the set, or 0 if not.
+*/
+static const char* oscMatchBrackets(const char* pattern, char c)
 {
-  bool result;
   bool negated = false;
-  const char *p = pattern;
+  bool found = false;
+  const char* p = pattern + 1;
 
-  if (pattern[1] == 0)
-    return false; // unterminated [ in pattern
-
-  if (pattern[1] == '!')  {
+  if (*p == '!') {
     negated = true;
     p++;
   }
 
-  while (*p != ']') {
+  for (; *p != ']'; p++) {
     if (*p == 0)
-      return false; // unterminated [ in pattern
-    if (p[1] == '-' && p[2] != 0)  {
-      if (test[0] >= p[0] && test[0] <= p[2])  {
-	      result = !negated;
-	      goto advance;
-      }
+      return 0; // unterminated [ in pattern
+    if (p[1] == '-' && p[2] != 0 && p[2] != ']') {
+      if (c >= p[0] && c <= p[2])
+        found = true;
+      p += 2;
     }
-    if (p[0] == test[0]) {
-      result = !negated;
-      goto advance;
-    }
-    p++;
-  }
-
-  result = negated;
-
-advance:
-
-  if (!result)
-    return false;
-
-  while (*p != ']') {
-    if (*p == 0)
-      return false; // unterminated [ in pattern
-    p++;
+    else if (*p == c)
+      found = true;
   }
 
-  return oscPatternMatch(p + 1, test + 1);
+  return (found != negated) ? p + 1 : 0;
 }
 
-static bool oscMatchList (const char *pattern, const char *test)
+/*
+  delim points at the '{' or ',' before the next alternative to try.
+  Find the first alternative from there that test starts with, and
+  return the ',' or '}' that ends it - len gets its length.
+  Returns 0 if none of the remaining alternatives match.
+*/
+static const char* oscMatchAlternative(const char* delim, const char* test, int* len)
 {
-  const char *restOfPattern, *tp = test;
-
-  for (restOfPattern = pattern; *restOfPattern != '}'; restOfPattern++) {
-    if (*restOfPattern == 0)
-      return false; // unterminated { in pattern
-  }
-
-  restOfPattern++; /* skip close curly brace */
-  pattern++; /* skip open curly brace */
-
-  while (1) {
-    if (*pattern == ',')  {
-      if (oscPatternMatch(restOfPattern, tp))
-        return true;
-      else  {
-        tp = test;
-        ++pattern;
-      }
-    }
-    else  {
-      if (*pattern == '}')
-       return oscPatternMatch(restOfPattern, tp);
-      else  {
-        if (*pattern == *tp)  {
-          ++pattern;
-          ++tp;
-        }
-        else {
-          tp = test;
-          while (*pattern != ',' && *pattern != '}')
-           pattern++;
-          if (*pattern == ',')
-            pattern++;
-        }
-      }
+  while (*delim != '}') {
+    const char* alt = delim + 1;
+    const char* end = alt;
+    while (*end != ',' && *end != '}')
+      end++;
+    if (strncmp(alt, test, end - alt) == 0) {
+      *len = end - alt;
+      return end;
     }
+    delim = end;
   }
+  return 0;
 }
 
 /*
@@ -0,0 +1,125 @@
+/*********************************************************************************
+
+ Copyright 2006-2009 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+/*
+  The SLIP (http://tools.ietf.org/html/rfc1055) codec used to packetize
+  OSC over USB.  It works on spans rather than bytes, so the USB driver
+  can hand it whatever's contiguous in its queue or output buffer, and
+  the bulk of the data - which needs no escaping - just gets copied.
+*/
+
+#include "slip.h"
+#include <string.h>
+
+// nonzero if any byte in the word is zero
+#define SLIP_HAS_ZERO(w) (((w) - 0x01010101UL) & ~(w) & 0x80808080UL)
+
+/*
+  Find the first a or b byte between p and end, or return end if there isn't one.
+  Checks a word at a time once p is word aligned, since most of the data
+  we're looking through has neither.
+*/
+const char* slipScan(const char* p, const char* end, uint8_t a, uint8_t b)
+{
+  uint32_t wa = a * 0x01010101UL;
+  uint32_t wb = b * 0x01010101UL;
+
+  while (p < end && ((uint32_t)p & 3)) {
+    if ((uint8_t)*p == a || (uint8_t)*p == b)
+      return p;
+    p++;
+  }
+  while (end - p >= 4) {
+    uint32_t w = *(const uint32_t*)p;
+    if (SLIP_HAS_ZERO(w ^ wa) || SLIP_HAS_ZERO(w ^ wb))
+      break;
+    p += 4;
+  }
+  while (p < end && (uint8_t)*p != a && (uint8_t)*p != b)
+    p++;
+  return p;
+}
+
+/*
+  Unescape len bytes of SLIP data in place, returning the new length.
+  escaped carries an ESC at the end of one chunk over to the next.
+  Per the RFC, an ESC followed by anything other than ESC_END or ESC_ESC
+  just drops that byte into the packet.
+*/
+int slipDecode(char* buf, int len, bool* escaped)
+{
+  const char* r = buf;
+  const char* end = buf + len;
+  char* w = buf;
+
+  while (r < end) {
+    if (*escaped) {
+      char c = *r++;
+      if (c == (char)SLIP_ESC_END)
+        c = SLIP_END;
+      else if (c == (char)SLIP_ESC_ESC)
+        c = SLIP_ESC;
+      *w++ = c;
+      *escaped = false;
+    }
+    const char* esc = slipScan(r, end, SLIP_ESC, SLIP_ESC);
+    int run = esc - r;
+    if (w != r)
+      memmove(w, r, run);
+    w += run;
+    r = esc;
+    if (r < end) {
+      r++;
+      *escaped = true;
+    }
+  }
+  return w - buf;
+}
+
+/*
+  Escape as much of the data from *in to end as fits in outlen bytes of out,
+  moving *in past whatever was used up.  Returns how many bytes were written
+  to out - if *in hasn't reached end, out is full and wants sending before
+  the rest.  The END that finishes the packet is left to the caller.
+*/
+int slipEncode(const char** in, const char* end, char* out, int outlen)
+{
+  const char* p = *in;
+  char* w = out;
+  char* wend = out + outlen;
+
+  while (p < end && w < wend) {
+    // copy everything up to the next special character in one go
+    const char* special = slipScan(p, end, SLIP_END, SLIP_ESC);
+    int n = special - p;
+    if (n > wend - w)
+      n = wend - w;
+    memcpy(w, p, n);
+    w += n;
+    p += n;
+    if (p == special && p < end) {
+      // if it's the same code as an END or ESC character, we send a special two character
+      // code so as not to make the receiver think we sent an END or ESC.
+      if (wend - w < 2)
+        break;
+      *w++ = (char)SLIP_ESC;
+      *w++ = (*p++ == (char)SLIP_END) ? (char)SLIP_ESC_END : (char)SLIP_ESC_ESC;
+    }
+  }
+  *in = p;
+  return w - out;
+}
@@ -0,0 +1,38 @@
+/*********************************************************************************
+
+ Copyright 2006-2009 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+#ifndef SLIP_H
+#define SLIP_H
+
+#include "types.h"
+
+#define SLIP_END      0300 // indicates end of packet
+#define SLIP_ESC      0333 // indicates byte stuffing
+#define SLIP_ESC_END  0334 // ESC ESC_END means END data byte
+#define SLIP_ESC_ESC  0335 // ESC ESC_ESC means ESC data byte
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+const char* slipScan(const char* p, const char* end, uint8_t a, uint8_t b);
+int slipDecode(char* buf, int len, bool* escaped);
+int slipEncode(const char** in, const char* end, char* out, int outlen);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SLIP_H
@@ -19,7 +19,9 @@
 #include "system.h"
 #include <ctype.h>
 #include <string.h>
+#if !defined(SIMULATOR)
 #include "at91sam7.h"
+#endif
 
 #ifndef SYSTEM_MAX_NAME
 #define SYSTEM_MAX_NAME 99
@@ -61,6 +63,60 @@ int systemFreeMemory()
   return chCoreStatus();
 }
 
+#ifndef CH_STACK_FILL_VALUE
+#define CH_STACK_FILL_VALUE 0x55
+#endif
+
+/**
+  Name a thread and note how big its working area is.
+  Threads registered this way are reported by name via /system/threads, along with
+  how much of their stack they've used.  createThread() does this for you.
+  @param t The thread.
+  @param name A name for it - this is not copied, so it needs to stick around.
+  @param wasize The size of its working area, as passed to chThdCreateStatic(), or
+  0 if it doesn't have one.
+
+  \b Example
+  \code
+  static WORKING_AREA(myWA, 512);
+  Thread* t = chThdCreateStatic(myWA, sizeof(myWA), NORMALPRIO, myThread, 0);
+  systemRegisterThread(t, "mythread", sizeof(myWA));
+  \endcode
+*/
+void systemRegisterThread(Thread* t, const char* name, size_t wasize)
+{
+  if (t != 0) {
+    t->p_label = name;
+    t->p_wasize = wasize;
+  }
+}
+
+/**
+  How much of a thread's stack has never been touched.
+  Working areas are filled with a pattern when threads are created, so this is
+  the closest the thread has come to overflowing its stack since it started.
+  @param t The thread, which must have been registered with systemRegisterThread().
+  @return The number of bytes, or -1 if the thread's working area size isn't known.
+
+  \b Example
+  \code
+  if (systemThreadStackUnused(myThread) < 64) {
+    // getting close - give it a bigger working area
+  }
+  \endcode
+*/
+int systemThreadStackUnused(Thread* t)
+{
+  if (t->p_wasize <= sizeof(Thread))
+    return -1;
+  const uint8_t* start = (const uint8_t*)(t + 1);
+  const uint8_t* end = (const uint8_t*)t + t->p_wasize;
+  const uint8_t* p = start;
+  while (p < end && *p == CH_STACK_FILL_VALUE)
+    p++;
+  return p - start;
+}
+
 /**
   Gets the board's Serial Number.
   Each board has a serial number, although it's not necessarily unique
@@ -96,7 +152,7 @@ int systemSerialNumber()
 */
 int systemSetSerialNumber(int serial)
 {
-  eepromWrite(EEPROM_SYSTEM_SERIAL_NUMBER, serial & 0xFFFF);
+  eepromWriteDeferred(EEPROM_SYSTEM_SERIAL_NUMBER, serial & 0xFFFF);
   return CONTROLLER_OK;
 }
 
@@ -117,7 +173,15 @@ int systemSetSerialNumber(int serial)
 */
 void systemSamba(bool sure)
 {
+#if defined(SIMULATOR)
+  // nothing to upload to - just stop like systemReset() does
+  if (sure) {
+    deferFlush(1000);
+    kill();
+  }
+#else
   if (sure) {
+    deferFlush(1000); // let any settings waiting to be saved get written first
     chSysLock(); // disable interrupts, etc.
 
     /* Disable the USB pullup. */
@@ -190,6 +254,7 @@ void systemSamba(bool sure)
     "r7", "r6"
     );
   }
+#endif // SIMULATOR
 }
 
 /**
@@ -265,8 +330,10 @@ const char* systemName()
 */
 void systemReset(bool sure)
 {
-  if (sure)
+  if (sure) {
+    deferFlush(1000); // let any settings waiting to be saved get written first
     kill();
+  }
 }
 
 /** @} */
@@ -328,6 +395,25 @@ void systemReset(bool sure)
     To read the board's serial number, send the message
     \verbatim /system/serialnumber \endverbatim
 
+    \par Stats
+    The \b stats property reports the board's runtime counters - see \ref stats.  It replies with a
+    bundle of messages, one per counter, each with the counter's name and its value.
+    \par
+    To read the counters, send the message
+    \verbatim /system/stats \endverbatim
+    To clear them, send the message
+    \verbatim /system/stats 0 \endverbatim
+
+    \par Threads
+    The \b threads property reports on each thread that's running.  It replies with a bundle of
+    messages, one per thread, each with the thread's name, its priority, the total CPU time it has
+    used in milliseconds, its share of the CPU in percent since threads was last read, the size of
+    its working area and how many bytes of that it has never used.  Threads that haven't been named
+    with systemRegisterThread() report -1 for their working area.
+    \par
+    To read the threads, send the message
+    \verbatim /system/threads \endverbatim
+
     \par Version
     The \b version property corresponds to the of the firmware currently running on the board.
     This is read-only.
@@ -357,6 +443,64 @@ static void systemFreememOsc(OscChannel ch, char* address, int idx, OscData d[],
   }
 }
 
+/*
+  One message per stat, with its name and value, all in the same bundle.
+  Send a 0 to clear them.
+*/
+static void systemStatsOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  UNUSED(idx);
+  if (datalen == 0) {
+    Stat* s;
+    for (s = statsRead(); s != 0; s = s->next) {
+      OscData sd[2] = {
+        { .type = STRING, .value.s = (char*)s->name },
+        { .type = INT, .value.i = s->value }
+      };
+      oscCreateMessage(ch, address, sd, 2);
+    }
+  }
+  else if (datalen == 1 && d[0].type == INT && d[0].value.i == 0) {
+    statsReset();
+  }
+}
+
+#if CH_USE_REGISTRY && CH_DBG_THREADS_PROFILING
+/*
+  One message per thread - name, priority, total CPU time in milliseconds,
+  percentage of the CPU since the last time we were asked, working area size
+  and how much of it has never been used.
+*/
+static void systemThreadsOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  UNUSED(idx); UNUSED(d);
+  static systime_t lastRead;
+  if (datalen == 0) {
+    systime_t now = chTimeNow();
+    systime_t elapsed = now - lastRead;
+    Thread* t;
+    lastRead = now;
+    for (t = chRegFirstThread(); t != 0; t = chRegNextThread(t)) {
+      const char* name = t->p_label;
+      if (name == 0)
+        name = (t->p_prio == IDLEPRIO) ? "idle" : "unnamed";
+      systime_t time = t->p_time;
+      int percent = (elapsed > 0) ? ((time - t->p_lasttime) * 100) / elapsed : 0;
+      t->p_lasttime = time;
+      OscData td[6] = {
+        { .type = STRING, .value.s = (char*)name },
+        { .type = INT, .value.i = t->p_prio },
+        { .type = INT, .value.i = ((uint64_t)time * 1000) / CH_FREQUENCY },
+        { .type = INT, .value.i = percent },
+        { .type = INT, .value.i = t->p_wasize ? (int)t->p_wasize : -1 },
+        { .type = INT, .value.i = systemThreadStackUnused(t) }
+      };
+      oscCreateMessage(ch, address, td, 6);
+    }
+  }
+}
+#endif
+
 static void systemResetOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
 {
   UNUSED(idx); UNUSED(ch); UNUSED(address);
@@ -482,6 +626,10 @@ static void systemSerialNumOsc(OscChannel ch, char* address, int idx, OscData d[
 
 static const OscNode systemNameNode = { .name = "name", .handler = systemNameOsc };
 static const OscNode systemFreememNode = { .name = "freememory", .handler = systemFreememOsc };
+#if CH_USE_REGISTRY && CH_DBG_THREADS_PROFILING
+static const OscNode systemThreadsNode = { .name = "threads", .handler = systemThreadsOsc };
+#endif
+static const OscNode systemStatsNode = { .name = "stats", .handler = systemStatsOsc };
 static const OscNode systemResetNode = { .name = "reset", .handler = systemResetOsc };
 static const OscNode systemSambaNode = { .name = "samba", .handler = systemSambaOsc };
 static const OscNode systemVersionNode = { .name = "version", .handler = systemVersionOsc };
@@ -502,7 +650,12 @@ const OscNode systemOsc = {
     &systemAutosendNode,
     &systemAutosendIntervalNode,
     &systemInfoNode, &systemInfoInternalNode,
-    &systemSerialNumNode, 0
+    &systemSerialNumNode,
+    &systemStatsNode,
+#if CH_USE_REGISTRY && CH_DBG_THREADS_PROFILING
+    &systemThreadsNode,
+#endif
+    0
   }
 };
 
@@ -19,6 +19,7 @@
 #define SYSTEM_H
 
 #include "types.h"
+#include "ch.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -30,6 +31,8 @@ void systemSamba(bool sure);
 int  systemSerialNumber(void);
 int  systemSetSerialNumber(int serial);
 int  systemFreeMemory(void);
+void systemRegisterThread(Thread* t, const char* name, size_t wasize);
+int  systemThreadStackUnused(Thread* t);
 #ifdef __cplusplus
 }
 #endif
@@ -20,6 +20,9 @@
 #if defined(MAKE_CTRL_NETWORK) && LWIP_TCP
 #include "tcpsocket.h"
 #include "lwip/sockets.h"
+#include "core.h"
+
+static bool tcpreaderFill(TcpReader* r);
 
 /**
   \defgroup tcpsocket TCP Socket
@@ -50,6 +53,23 @@
   }
   \endcode
 
+  \section Buffered Reading
+  Every tcpRead() is a trip through the network thread, so reading a byte at a time - to find the
+  end of a line, say - is slow going.  A TcpReader reads as much as the socket has ready, up to
+  \b TCP_READER_SIZE bytes (128 by default), and hands it out from there.  Read lines with
+  tcpreaderReadLine(), read up to some other character with tcpreaderReadUntil(), or read an exact
+  number of bytes with tcpreaderReadExact().  Once you've started reading a socket with a
+  TcpReader, stick with it - it may well have read ahead of what it has handed out.
+
+  \code
+  TcpReader reader;
+  char line[64];
+  tcpreaderInit(&reader, sock);
+  while (tcpreaderReadLine(&reader, line, sizeof(line)) > 0) {
+    // one line at a time, without the line ending
+  }
+  \endcode
+
   If you're looking to access the web check the \ref webclient instead, which
   provides web-specific behavior on top of TCP sockets.
 
@@ -179,7 +199,10 @@ int tcpRead(int socket, char* data, int length)
 /**
   Read a single line from a TCP socket, as terminated by CR LF (0x0D 0x0A).
   Make sure you have an open socket before trying to read from it.  The line
-  endings are not included in the data returned.
+  endings are included in the data returned.
+
+  This reads a byte at a time - tcpreaderReadLine() is much quicker if you're
+  reading more than a line or two.
   @param socket The socket to read from.
   @param data Where to store the incoming data.
   @param length The maximum number of bytes to read.
@@ -206,7 +229,134 @@ int tcpReadLine(int socket, char* data, int length)
   return lineLength;
 }
 
+/**
+  Start reading from a socket a buffer at a time.
+  @param r The reader.
+  @param socket The socket to read from.
+*/
+void tcpreaderInit(TcpReader* r, int socket)
+{
+  r->socket = socket;
+  r->start = 0;
+  r->end = 0;
+}
+
+/**
+  Read whatever's ready, up to a maximum.
+  If the reader has anything left over from last time, you get that - otherwise
+  this waits for the socket, like tcpRead().
+  @param r The reader.
+  @param data Where to store the incoming data.
+  @param length The most bytes to read.
+  @return The number of bytes read, or less than 1 if the socket was closed or timed out.
+*/
+int tcpreaderRead(TcpReader* r, char* data, int length)
+{
+  if (r->start == r->end) {
+    if (length >= (int)sizeof(r->buf)) // no point going through the buffer
+      return tcpRead(r->socket, data, length);
+    if (!tcpreaderFill(r))
+      return -1;
+  }
+  int n = MIN(length, r->end - r->start);
+  memcpy(data, &r->buf[r->start], n);
+  r->start += n;
+  return n;
+}
+
+/**
+  Read a certain number of bytes.
+  This waits until they've all arrived, unless the socket is closed or times out first.
+  @param r The reader.
+  @param data Where to store the incoming data.
+  @param length How many bytes to read.
+  @return The number of bytes read - fewer than \b length if the socket was closed or timed out.
+*/
+int tcpreaderReadExact(TcpReader* r, char* data, int length)
+{
+  int got = 0;
+  while (got < length) {
+    int n = tcpreaderRead(r, data + got, length - got);
+    if (n <= 0)
+      break;
+    got += n;
+  }
+  return got;
+}
+
+/**
+  Read up to a given character.
+  The delimiter is read, but not stored.  The data is null-terminated, so there's room
+  for \b length - 1 bytes - if there's more than that before the delimiter, the rest
+  is skipped.
+  @param r The reader.
+  @param delimiter The character to read up to.
+  @param data Where to store the incoming data.
+  @param length The size of \b data.
+  @return The number of bytes stored, or -1 if the socket was closed or timed out before
+  anything was read.
+*/
+int tcpreaderReadUntil(TcpReader* r, char delimiter, char* data, int length)
+{
+  if (length < 1)
+    return -1;
+  int got = 0;
+  bool found = false, readAny = false;
+  while (!found) {
+    if (r->start == r->end && !tcpreaderFill(r))
+      break;
+    readAny = true;
+    char* p = &r->buf[r->start];
+    int available = r->end - r->start;
+    char* hit = memchr(p, delimiter, available);
+    int n = hit ? hit - p : available;
+    int copy = MIN(n, length - 1 - got);
+    memcpy(data + got, p, copy);
+    got += copy;
+    r->start += hit ? n + 1 : n;
+    found = (hit != 0);
+  }
+  data[got] = 0;
+  return readAny ? got : -1;
+}
+
+/**
+  Read a line, as terminated by LF or CR LF.
+  The line ending isn't included in the data, which is null-terminated.  An empty
+  line reads as 0 bytes.
+  @param r The reader.
+  @param data Where to store the line.
+  @param length The size of \b data - any more of the line than will fit is skipped.
+  @return The length of the line, or -1 if the socket was closed or timed out.
+
+  \b Example
+  \code
+  // read the headers of an HTTP request, up to the blank line
+  while (tcpreaderReadLine(&reader, line, sizeof(line)) > 0) {
+    // ...
+  }
+  \endcode
+*/
+int tcpreaderReadLine(TcpReader* r, char* data, int length)
+{
+  int got = tcpreaderReadUntil(r, '\n', data, length);
+  if (got > 0 && data[got - 1] == '\r')
+    data[--got] = 0;
+  return got;
+}
+
 /** @}
 */
 
+// only called once everything read so far has been handed out
+static bool tcpreaderFill(TcpReader* r)
+{
+  int n = tcpRead(r->socket, r->buf, sizeof(r->buf));
+  if (n <= 0)
+    return false;
+  r->start = 0;
+  r->end = n;
+  return true;
+}
+
 #endif // MAKE_CTRL_NETWORK
@@ -20,6 +20,21 @@
 
 #include "types.h"
 
+#ifndef TCP_READER_SIZE
+#define TCP_READER_SIZE 128
+#endif
+
+/**
+  Reads from a TCP socket a buffer at a time, for when you want a line or a few bytes at a time.
+  \ingroup tcpsocket
+*/
+typedef struct TcpReader_t {
+  int socket;
+  short start;              // the next byte to hand out
+  short end;                // the end of what's been read from the socket
+  char buf[TCP_READER_SIZE];
+} TcpReader;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -30,6 +45,12 @@ int  tcpRead(int socket, char* data, int length);
 int  tcpReadLine(int socket, char* data, int length);
 int  tcpWrite(int socket, const char* data, int length);
 int  tcpSetReadTimeout(int socket, int timeout);
+
+void tcpreaderInit(TcpReader* r, int socket);
+int  tcpreaderRead(TcpReader* r, char* data, int length);
+int  tcpreaderReadExact(TcpReader* r, char* data, int length);
+int  tcpreaderReadUntil(TcpReader* r, char delimiter, char* data, int length);
+int  tcpreaderReadLine(TcpReader* r, char* data, int length);
 #ifdef __cplusplus
 }
 #endif
@@ -19,8 +19,11 @@
 #include "lwipopts.h"
 #if defined(MAKE_CTRL_NETWORK) && LWIP_UDP
 #include "udpsocket.h"
+#include "mtstats.h"
 #include "lwip/sockets.h"
 
+static Stat udpRecvErrors = { .name = "udp.recv.errors" };
+
 /**
   \defgroup udpsocket UDP Socket
   Read and write Ethernet data via UDP.
@@ -65,6 +68,7 @@
 */
 int udpOpen(void)
 {
+  statsAdd(&udpRecvErrors);
   return lwip_socket(0, SOCK_DGRAM, IPPROTO_UDP);
 }
 
@@ -167,6 +171,8 @@ int udpRead(int socket, char* data, int length, int* from_address, int* from_por
   struct sockaddr_in from;
   socklen_t fromlen = sizeof(from);
   int recvd = lwip_recvfrom(socket, data, length, 0, (struct sockaddr*)&from, &fromlen);
+  if (recvd < 0)
+    statInc(&udpRecvErrors);
   if (from_address)
     *from_address = from.sin_addr.s_addr;
   if (from_port)
@@ -21,13 +21,14 @@
 #include "usbserial.h"
 #include "core.h"
 #include "string.h"
+#include "slip.h"
 #include <usb/device/core/USBDCallbacks.h>
 
 #ifndef USBSER_NO_SLIP
-#define END             0300    // indicates end of packet 
-#define ESC             0333    // indicates byte stuffing 
-#define ESC_END         0334    // ESC ESC_END means END data byte 
-#define ESC_ESC         0335    // ESC ESC_ESC means ESC data byte
+// size of the buffer SLIP encoded data is written to the endpoint from
+#ifndef USBSER_SLIP_OUT_SIZE
+#define USBSER_SLIP_OUT_SIZE 256
+#endif
 #endif // USBSER_NO_SLIP
 
 #define qRemaining(q) (chQSizeI(q) - chQSpaceI(q))
@@ -41,11 +42,16 @@ typedef struct UsbSerial_t {
   InputQueue inq;
   uint8_t inbuffer[USBSER_MAX_READ * 2];
 #ifndef USBSER_NO_SLIP
-  char slipOutBuf[USBSER_MAX_WRITE];
+  char slipOutBuf[USBSER_SLIP_OUT_SIZE];
 #endif
+  Stat txBytes;   // bytes sent to the host
+  Stat txStalls;  // writes the endpoint wouldn't take, or that didn't complete
 } UsbSerial;
 
-static UsbSerial usbSerial;
+static UsbSerial usbSerial = {
+  .txBytes = { .name = "usb.tx.bytes" },
+  .txStalls = { .name = "usb.tx.stalls" }
+};
 
 /**
   \defgroup usbserial USB Serial
@@ -105,6 +111,8 @@ void usbserialInit()
   chIQInit(&usbSerial.inq, usbSerial.inbuffer, sizeof(usbSerial.inbuffer), usbserialInotify);
   usbSerial.thd = 0;
   chMtxInit(&usbSerial.txMutex);
+  statsAdd(&usbSerial.txBytes);
+  statsAdd(&usbSerial.txStalls);
   CDCDSerialDriver_Initialize();
   USBD_Connect();
 }
@@ -239,6 +247,8 @@ int usbserialWrite(const char *buffer, int length)
       // this thread gets rescheduled from the ISR
       rv = chThdSelf()->p_u.rdymsg;
     }
+    else
+      statAddI(&usbSerial.txStalls, 1);
     chMtxUnlockS();
     chSysUnlock();
   }
@@ -249,8 +259,12 @@ int usbserialWrite(const char *buffer, int length)
 void usbserialOnTx(void *pArg, unsigned char status, unsigned int received, unsigned int remaining)
 {
   UNUSED(pArg);
-  if (status == USBD_STATUS_SUCCESS)
+  if (status == USBD_STATUS_SUCCESS) {
     usbSerial.thd->p_u.rdymsg += received;
+    statAddI(&usbSerial.txBytes, received);
+  }
+  else
+    statAddI(&usbSerial.txStalls, 1);
   if (remaining == 0 && usbSerial.thd != 0) {
     // reschedule the thread waiting on the TX event
     chSchReadyI(usbSerial.thd);
@@ -276,30 +290,52 @@ void usbserialOnTx(void *pArg, unsigned char status, unsigned int received, unsi
 */
 int usbserialReadSlip(char *buffer, int length)
 {
+  InputQueue* q = &usbSerial.inq;
   int received = 0;
+  bool escaped = false;
 
   while (received < length) {
-    char c = usbserialGet();
-    switch (c) {
-      case END:
-        if (received) // only return if we actually got anything
-          return received;
-        else
-          break;
-      case ESC:
-        // get the next byte.  if it's not an ESC_END or ESC_ESC, it's a
-        // malformed packet.  http://tools.ietf.org/html/rfc1055 says just
-        // drop it in the packet in this case
-        c = usbserialGet();
-        if (c == ESC_END)
-          c = END;
-        else if (c == ESC_ESC)
-          c = ESC;
-        // no break here
-      default:
-        buffer[received++] = c;
-        break;
+    int n;
+    bool done = false;
+    char* dst = buffer + received;
+    if (chIQIsEmptyI(q)) {
+      // nothing waiting - block until a byte shows up
+      char c = usbserialGet();
+      if (c == (char)SLIP_END)
+        done = true;
+      else
+        *dst = c;
+      n = done ? 0 : 1;
+    }
+    else {
+      // copy a whole contiguous span out of the queue under a single lock,
+      // stopping at the END of this packet
+      chSysLock();
+      n = chQSpaceI(q);
+      if (n > q->q_top - q->q_rdptr)
+        n = q->q_top - q->q_rdptr;
+      if (n > length - received) // unescaping only ever shrinks the data
+        n = length - received;
+      const char* span = (const char*)q->q_rdptr;
+      const char* e = slipScan(span, span + n, SLIP_END, SLIP_END);
+      int consumed = n;
+      if (e < span + n) {
+        done = true;
+        n = e - span;
+        consumed = n + 1; // eat the END too
+      }
+      memcpy(dst, span, n);
+      q->q_rdptr += consumed;
+      if (q->q_rdptr >= q->q_top)
+        q->q_rdptr = q->q_buffer;
+      q->q_sem.s_cnt -= consumed;
+      usbserialInotify(q); // go get some more if there's room
+      chSysUnlock();
     }
+
+    received += slipDecode(dst, n, &escaped);
+    if (done && received) // only return if we actually got anything
+      return received;
   }
   return CONTROLLER_ERROR_BAD_FORMAT; // error if we get here
 }
@@ -321,50 +357,26 @@ int usbserialReadSlip(char *buffer, int length)
 */
 int usbserialWriteSlip(const char *buffer, int length)
 {
-  char* obp = usbSerial.slipOutBuf;
-  int totalTxCount = 0, currentChunkSize;
-
-  while (length--) {
-    char c = *buffer++;
-    switch (c) {
-      // if it's the same code as an END character, we send a special
-      // two character code so as not to make the receiver think we sent an END.
-      case END:
-        // if we don't have enough room in the current chunk for these 2 bytes, write out what we have first.
-        currentChunkSize = obp - usbSerial.slipOutBuf;
-        if (currentChunkSize >= USBSER_MAX_WRITE - 2) {
-          totalTxCount += usbserialWrite(usbSerial.slipOutBuf, currentChunkSize);
-          obp = usbSerial.slipOutBuf;
-        }
-        *obp++ = (char)ESC;
-        *obp++ = (char)ESC_END;
-        break;
-        // if it's the same code as an ESC character, we send a special
-        // two character code so as not to make the receiver think we sent an ESC
-      case ESC:
-        // if we don't have enough room in the current chunk for these 2 bytes, write out what we have first.
-        currentChunkSize = obp - usbSerial.slipOutBuf;
-        if (currentChunkSize >= USBSER_MAX_WRITE - 2) {
-          totalTxCount += usbserialWrite(usbSerial.slipOutBuf, currentChunkSize);
-          obp = usbSerial.slipOutBuf;
-        }
-        *obp++ = (char)ESC;
-        *obp++ = (char)ESC_ESC;
-        break;
-        // otherwise, just send the character
-      default:
-        *obp++ = c;
-        // is it time to write a chunk?
-        if ((obp - usbSerial.slipOutBuf) >= USBSER_MAX_WRITE) {
-          totalTxCount += usbserialWrite(usbSerial.slipOutBuf, sizeof(usbSerial.slipOutBuf));
-          obp = usbSerial.slipOutBuf;
-        }
-        break;
+  char* obuf = usbSerial.slipOutBuf;
+  const char* end = buffer + length;
+  int totalTxCount = 0;
+  int n = 0;
+
+  // escape into the buffer, writing it out whenever it fills up
+  while (buffer < end) {
+    n = slipEncode(&buffer, end, obuf, sizeof(usbSerial.slipOutBuf));
+    if (buffer < end) {
+      totalTxCount += usbserialWrite(obuf, n);
+      n = 0;
     }
   }
 
-  *obp++ = END; // end byte
-  return totalTxCount + usbserialWrite(usbSerial.slipOutBuf, (obp - usbSerial.slipOutBuf));
+  if (n == sizeof(usbSerial.slipOutBuf)) {
+    totalTxCount += usbserialWrite(obuf, n);
+    n = 0;
+  }
+  obuf[n++] = SLIP_END; // end byte
+  return totalTxCount + usbserialWrite(obuf, n);
 }
 
 /** @}
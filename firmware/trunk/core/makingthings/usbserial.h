@@ -19,12 +19,19 @@
 #define USB_SERIAL_H
 
 #include "types.h"
+
+#if defined(SIMULATOR)
+// no USB hardware - the simulator's mock uses the same packet size
+#define USBSER_MAX_READ 64
+#define USBSER_MAX_WRITE 64
+#else
 #include "board.h"
 #include "usb/device/cdc-serial/CDCDSerialDriver.h"
 #include "usb/device/cdc-serial/CDCDSerialDriverDescriptors.h"
 
 #define USBSER_MAX_READ BOARD_USB_ENDPOINTS_MAXPACKETSIZE(CDCDSerialDriverDescriptors_DATAOUT)
 #define USBSER_MAX_WRITE BOARD_USB_ENDPOINTS_MAXPACKETSIZE(CDCDSerialDriverDescriptors_DATAIN)
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -114,15 +114,24 @@ bool digitalinValue(int channel)
   If the voltage on the input is greater than <b>~0.6V</b>, the Digital In will read high.
   
   \section properties Properties
-  The Digital Ins have the following properties
+  Each Digital In has the following property
   - value
 
+  and the Digital Ins as a whole have this one, at \b /digitalins:
+  - autosend-interval
+
   \par Value
   The \b value property corresponds to the on/off value of a Digital In.
   Because you can only ever \b read the value of an input, you'll never
   want to include an argument at the end of your OSC message to read the value.
   To read the third Digital In, send the message
   \verbatim /digitalin/2/value \endverbatim
+
+  \par Autosend-interval
+  Digital Ins autosend at the interval set by \b /system/autosend-interval unless
+  given one of their own, in milliseconds.  To check the Digital Ins every 50 milliseconds, send
+  \verbatim /digitalins/autosend-interval 50 \endverbatim
+  Send an interval of 0 to go back to following the system interval.
 */
 
 static void digitalinOscHandler(OscChannel ch, char* address, int idx, OscData d[], int datalen)
@@ -134,17 +143,13 @@ static void digitalinOscHandler(OscChannel ch, char* address, int idx, OscData d
   }
 }
 
-// sort of a checksum to verify whether a previous save was legit
-#define DIN_AUTOSEND_SAVED 0xDF
-
 static uint8_t digitalinAutosendVals[DIGITALIN_COUNT];
 static uint16_t digitalinAutosendChannels;
 
 void digitalinAutoSendInit()
 {
-  digitalinAutosendChannels = eepromRead(EEPROM_DIGITALIN_AUTOSEND);
-  if (((digitalinAutosendChannels >> 8) & 0xFF) != DIN_AUTOSEND_SAVED)
-    digitalinAutosendChannels = DIN_AUTOSEND_SAVED << 8;
+  int saved = eepromRead(EEPROM_DIGITALIN_AUTOSEND);
+  digitalinAutosendChannels = (saved == -1) ? 0 : saved & 0xFF;
 }
 
 static void digitalinOscAutosender(OscChannel ch)
@@ -152,9 +157,19 @@ static void digitalinOscAutosender(OscChannel ch)
   uint8_t i;
   OscData d = { .type = INT };
   char addr[20];
-  for (i = 0; i < ANALOGIN_CHANNELS; i++) {
+  int ain[ANALOGIN_CHANNELS];
+  // inputs 4-7 are read through the analog ins - share one conversion
+  // per autosend period with the analogin autosender
+  if (digitalinAutosendChannels & 0xF0) {
+    if (!analoginSnapshot(ain, oscAutosendNodeInterval(&digitalinOsc) / 2))
+      return; // no reading this time around - try again next period
+  }
+  for (i = 0; i < DIGITALIN_COUNT; i++) {
     if (digitalinAutosendChannels & (1 << i)) {
-      d.value.i = digitalinValue(i);
+      if (i > 3)
+        d.value.i = ain[i] > DIGITALIN_THRESHOLD;
+      else
+        d.value.i = pinValue(digitalinGetPin(i));
       if (digitalinAutosendVals[i] != d.value.i) {
         digitalinAutosendVals[i] = d.value.i;
         sniprintf(addr, sizeof(addr), "/digitalin/%d/value", i);
@@ -180,12 +195,20 @@ static void digitalinAutosendHandler(OscChannel ch, char* address, int idx, OscD
     else
       digitalinAutosendChannels &= ~(1 << idx);
 
-    eepromWrite(EEPROM_DIGITALIN_AUTOSEND, digitalinAutosendChannels);
+    eepromWriteDeferred(EEPROM_DIGITALIN_AUTOSEND, digitalinAutosendChannels);
   }
 }
 
+// the autosender belongs to digitalinOsc, even though its interval is set via /digitalins
+static void digitalinAutosendIntervalHandler(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  UNUSED(idx);
+  oscAutosendIntervalProperty(ch, address, &digitalinOsc, d, datalen);
+}
+
 static const OscNode digitalinAutosendNode = { .name = "autosend", .handler = digitalinAutosendHandler };
 static const OscNode digitalinValueNode = { .name = "value", .handler = digitalinOscHandler };
+static const OscNode digitalinAutosendIntervalNode = { .name = "autosend-interval", .handler = digitalinAutosendIntervalHandler };
 
 const OscNode digitalinOsc = {
   .name = "digitalin",
@@ -197,4 +220,12 @@ const OscNode digitalinOsc = {
   }
 };
 
+// properties of all the inputs at once - everything below digitalinOsc is per channel
+const OscNode digitalinsOsc = {
+  .name = "digitalins",
+  .children = {
+    &digitalinAutosendIntervalNode, 0
+  }
+};
+
 #endif // OSC
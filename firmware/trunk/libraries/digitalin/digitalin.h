@@ -18,6 +18,7 @@
 #ifndef DIGITALIN_H
 #define DIGITALIN_H
 
+#include "config.h"
 #include "types.h"
 
 #ifdef __cpluscplus
@@ -32,6 +33,7 @@ extern "C" {
 #ifdef OSC
 #include "osc.h"
 extern const OscNode digitalinOsc;
+extern const OscNode digitalinsOsc;
 #endif
 
 #endif // DIGITALIN_H
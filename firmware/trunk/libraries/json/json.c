@@ -30,8 +30,8 @@
   devices from the Make Controller.
 
   \b Disclaimer - in an attempt to keep it as small and as simple as possible, this library is not
-  completely full featured at the moment.  It doesn't process escaped strings for you, and doesn't deal
-  with some of the more exotic numeric representations outlined in the JSON specification.
+  completely full featured at the moment.  It doesn't process escaped strings for you, and doesn't check
+  numbers too closely - anything that atoi() or atof() can make sense of will do.
   It does, however, work quite well for most other JSON tasks.
 
   \section Generating
@@ -44,6 +44,9 @@
    - a count of how many bytes are left in that buffer
    The API will update the count, so it's not too much trouble.
 
+  If the JSON could be bigger than you'd like to set aside a buffer for, the writer can
+  stream it out a piece at a time instead - see jsonwriterSetFlush().
+
   \code
   #define MAX_JSON_LEN 256
   char jsonbuf[MAX_JSON_LEN];
@@ -74,6 +77,9 @@
   you can pass it to jsonreaderInit() and it will be passed to each of the callbacks you've registered.
   Otherwise, just pass 0 if you don't need it.
 
+  The JSON doesn't need to all be in memory at once, either - it can be passed in a piece at
+  a time as it comes in from the network with jsonreaderFeed().
+
   \code
   // first, define the functions that we want to be called back on
   bool on_obj_opened(void* ctx)
@@ -115,6 +121,8 @@
 */
 
 static void jsonwriterAppendedAtom(JsonWriter* jw);
+static bool jsonwriterRoom(JsonWriter* jw, int len);
+static bool jsonwriterPut(JsonWriter* jw, char c);
 
 /**
   Initialize or reset the state of a JsonWriter.
@@ -129,6 +137,64 @@ void jsonwriterInit(JsonWriter* jw, char* buffer, int len)
   jw->steps[0] = JSON_START;
   jw->p = buffer;
   jw->remaining = len;
+  jw->buffer = buffer;
+  jw->size = len;
+  jw->flush = 0;
+  jw->context = 0;
+}
+
+/**
+  Stream the JSON out as it's written, rather than keeping it all in the buffer.
+  Once this is set, the buffer only needs to be big enough for the biggest single
+  element - whenever the next one won't fit, \b flush is called with what's in the
+  buffer so far, and the buffer starts over.  Call jsonwriterFlush() once you're
+  done, to send the last of it.
+  @param jw The JsonWriter being used - set it up with jsonwriterInit() first.
+  @param flush The function to send the JSON on to.  It should return false if it couldn't,
+  which stops the writer.
+  @param context Passed to \b flush, along with the data.
+
+  \b Example
+  \code
+  bool sendJson(void* context, const char* data, int length)
+  {
+    int socket = *(int*)context;
+    return tcpWrite(socket, data, length) == length;
+  }
+
+  char buf[64];
+  JsonWriter jw;
+  jsonwriterInit(&jw, buf, sizeof(buf));
+  jsonwriterSetFlush(&jw, sendJson, &socket);
+  jsonwriterArrayOpen(&jw);
+  for (i = 0; i < 1000; i++) // much more than fits in buf
+    jsonwriterInt(&jw, i);
+  jsonwriterArrayClose(&jw);
+  jsonwriterFlush(&jw);
+  \endcode
+*/
+void jsonwriterSetFlush(JsonWriter* jw, bool (*flush)(void* context, const char* data, int length), void* context)
+{
+  jw->flush = flush;
+  jw->context = context;
+}
+
+/**
+  Send what's in the buffer to the flush function, and start the buffer over.
+  If there's no flush function, this does nothing.
+  @param jw The JsonWriter being used.
+  @return True if the buffer is now empty.
+*/
+bool jsonwriterFlush(JsonWriter* jw)
+{
+  if (jw->flush == 0 || jw->p == 0)
+    return false;
+  int len = jw->p - jw->buffer;
+  if (len > 0 && !jw->flush(jw->context, jw->buffer, len))
+    return false;
+  jw->p = jw->buffer;
+  jw->remaining = jw->size;
+  return true;
 }
 
 /**
@@ -146,20 +212,20 @@ char* jsonwriterObjectOpen(JsonWriter* jw)
     case JSON_ARRAY_START:
     case JSON_OBJ_START:
     case JSON_START:
-      if (jw->remaining < len)
+      if (!jsonwriterRoom(jw, len))
         return NULL;
       *jw->p = '{';
       break;
     case JSON_OBJ_KEY:
     case JSON_IN_ARRAY:
       len += 1; // for ,
-      if (jw->remaining < len)
+      if (!jsonwriterRoom(jw, len))
         return NULL;
       memcpy(jw->p, ",{", len);
       break;
     case JSON_OBJ_VALUE:
       len += 1; // for :
-      if (jw->remaining < len)
+      if (!jsonwriterRoom(jw, len))
         return NULL;
       memcpy(jw->p, ":{", len);
       break;
@@ -195,7 +261,7 @@ char* jsonwriterObjectKey(JsonWriter* jw, const char *key)
 */
 char* jsonwriterObjectClose(JsonWriter* jw)
 {
-  if (jw->remaining < 1 || !jw->p )
+  if (!jw->p || !jsonwriterRoom(jw, 1))
     return NULL;
   *jw->p++ = '}';
   jw->remaining--;
@@ -219,20 +285,20 @@ char* jsonwriterArrayOpen(JsonWriter* jw)
     case JSON_ARRAY_START:
     case JSON_OBJ_START:
     case JSON_START:
-      if (jw->remaining < len)
+      if (!jsonwriterRoom(jw, len))
         return NULL;
       *jw->p = '[';
       break;
     case JSON_OBJ_KEY:
     case JSON_IN_ARRAY:
       len += 1; // for ,
-      if (jw->remaining < len)
+      if (!jsonwriterRoom(jw, len))
         return NULL;
       memcpy(jw->p, ",[", len);
       break;
     case JSON_OBJ_VALUE:
       len += 1; // for :
-      if (jw->remaining < len)
+      if (!jsonwriterRoom(jw, len))
         return NULL;
       memcpy(jw->p, ":[", len);
       break;
@@ -253,7 +319,7 @@ char* jsonwriterArrayOpen(JsonWriter* jw)
 */
 char* jsonwriterArrayClose(JsonWriter* jw)
 {
-  if (jw->remaining < 1 || !jw->p)
+  if (!jw->p || !jsonwriterRoom(jw, 1))
     return NULL;
   *jw->p++ = ']';
   jw->remaining--;
@@ -266,6 +332,8 @@ char* jsonwriterArrayClose(JsonWriter* jw)
   Add a string to the current JSON string.
   Depending on whether you've opened objects, arrays, or other inserted 
   other data, the approprate separating symbols will be added to the string.
+  Any quotes or backslashes in \b string are escaped.  If the JSON is being streamed (see
+  jsonwriterSetFlush()), a string that's too long for the buffer is sent out in pieces.
 
   @param jw The JsonWriter being used.
   @param string The string to be added.
@@ -275,36 +343,47 @@ char* jsonwriterString(JsonWriter* jw, const char *string)
 {
   if (!jw->p)
     return 0;
-  int string_len = strlen(string) + 2 /* quotes */ + 1 /* null terminator*/;
-  // json doesn't actually need the null-terminator, but it's worth
-  // requiring so we can just use sprintf directly into the buffer
-
+  const char* prefix;
   switch (jw->steps[jw->depth]) {
     case JSON_ARRAY_START:
     case JSON_OBJ_START:
-      if (jw->remaining < string_len)
-        return NULL;
-      string_len = sniprintf(jw->p, string_len, "\"%s\"", string);
+      prefix = "";
       break;
     case JSON_OBJ_KEY:
     case JSON_IN_ARRAY:
-      string_len += 1; // for ,
-      if (jw->remaining < string_len)
-        return NULL;
-      string_len = sniprintf(jw->p, string_len, ",\"%s\"", string);
+      prefix = ",";
       break;
     case JSON_OBJ_VALUE:
-      string_len += 1; // for :
-      if (jw->remaining < string_len)
-        return NULL;
-      string_len = sniprintf(jw->p, string_len, ":\"%s\"", string);
+      prefix = ":";
       break;
     default:
       return NULL;
   }
+
+  // quotes and backslashes in the string each need a backslash in front of them
+  const char* s;
+  int string_len = strlen(prefix) + 2 /* quotes */;
+  for (s = string; *s; s++)
+    string_len += (*s == '"' || *s == '\\') ? 2 : 1;
+  // json doesn't actually need the null-terminator, but it's worth
+  // leaving one so the buffer can be used as a string straight away
+  if (!jsonwriterRoom(jw, string_len + 1) && (jw->flush == 0 || jw->p != jw->buffer))
+    return NULL; // no room, and it can't be streamed out a bit at a time either
+
+  bool ok = true;
+  while (ok && *prefix)
+    ok = jsonwriterPut(jw, *prefix++);
+  ok = ok && jsonwriterPut(jw, '"');
+  for (s = string; ok && *s; s++) {
+    if (*s == '"' || *s == '\\')
+      ok = jsonwriterPut(jw, '\\');
+    ok = ok && jsonwriterPut(jw, *s);
+  }
+  ok = ok && jsonwriterPut(jw, '"');
+  if (!ok)
+    return NULL;
+  *jw->p = 0;
   jsonwriterAppendedAtom(jw);
-  jw->remaining -= string_len;
-  jw->p += string_len;
   return jw->p;
 }
 
@@ -326,7 +405,7 @@ char* jsonwriterInt(JsonWriter* jw, int value)
     {
       char temp[int_as_str_len];
       int_len = sniprintf(temp, int_as_str_len, "%d", value);
-      if (jw->remaining < int_len)
+      if (!jsonwriterRoom(jw, int_len))
         return NULL;
       memcpy(jw->p, temp, int_len);
       break;
@@ -336,7 +415,7 @@ char* jsonwriterInt(JsonWriter* jw, int value)
       int_as_str_len += 1; // for ,
       char temp[int_as_str_len];
       int_len = sniprintf(temp, int_as_str_len, ",%d", value);
-      if (jw->remaining < int_len)
+      if (!jsonwriterRoom(jw, int_len))
         return NULL;
       memcpy(jw->p, temp, int_len);
       break;
@@ -346,7 +425,7 @@ char* jsonwriterInt(JsonWriter* jw, int value)
       int_as_str_len += 1; // for :
       char temp[int_as_str_len];
       int_len = sniprintf(temp, int_as_str_len, ":%d", value);
-      if (jw->remaining < int_len)
+      if (!jsonwriterRoom(jw, int_len))
         return NULL;
       memcpy(jw->p, temp, int_len);
       break;
@@ -360,6 +439,52 @@ char* jsonwriterInt(JsonWriter* jw, int value)
   return jw->p;
 }
 
+/**
+  Add a float to a JSON string.
+  It's written with 3 decimal places, which is as much as most sensors need.
+
+  @param jw The JsonWriter being used.
+  @param value The float to be added - up to about 4 billion, either way.
+  @return A pointer to the JSON buffer after this element has been added, or NULL if there was no room.
+*/
+char* jsonwriterFloat(JsonWriter* jw, float value)
+{
+  if (!jw->p)
+    return 0;
+  char temp[20];
+  int len = 0;
+  switch (jw->steps[jw->depth]) {
+    case JSON_ARRAY_START:
+      break;
+    case JSON_IN_ARRAY:
+      temp[len++] = ',';
+      break;
+    case JSON_OBJ_VALUE:
+      temp[len++] = ':';
+      break;
+    default:
+      return NULL; // bogus state
+  }
+  // the integer-only printf can't do floats, so do the whole and fractional parts separately
+  bool negative = (value < 0);
+  if (negative)
+    value = -value;
+  unsigned int whole = (unsigned int)value;
+  unsigned int frac = (unsigned int)((value - whole) * 1000 + 0.5f);
+  if (frac >= 1000) {
+    whole++;
+    frac -= 1000;
+  }
+  len += sniprintf(temp + len, sizeof(temp) - len, "%s%u.%03u", negative ? "-" : "", whole, frac);
+  if (!jsonwriterRoom(jw, len))
+    return NULL;
+  memcpy(jw->p, temp, len);
+  jsonwriterAppendedAtom(jw);
+  jw->remaining -= len;
+  jw->p += len;
+  return jw->p;
+}
+
 /**
   Add a boolean value to a JSON string.
 
@@ -383,19 +508,19 @@ char* jsonwriterBool(JsonWriter* jw, bool value)
   }
   switch (jw->steps[jw->depth]) {
     case JSON_ARRAY_START:
-      if (jw->remaining < bool_len)
+      if (!jsonwriterRoom(jw, bool_len))
         return NULL;
       bool_len = sniprintf(jw->p, bool_len, "%s", boolval);
       break;
     case JSON_IN_ARRAY:
       bool_len += 1; // for ,
-      if (jw->remaining < bool_len)
+      if (!jsonwriterRoom(jw, bool_len))
         return NULL;
       bool_len = sniprintf(jw->p, bool_len, ",%s", boolval);
       break;
     case JSON_OBJ_VALUE:
       bool_len += 1; // for :
-      if (jw->remaining < bool_len)
+      if (!jsonwriterRoom(jw, bool_len))
         return NULL;
       bool_len = sniprintf(jw->p, bool_len, ":%s", boolval);
       break;
@@ -408,6 +533,27 @@ char* jsonwriterBool(JsonWriter* jw, bool value)
   return jw->p;
 }
 
+/*
+  Make sure there's room for len more bytes - if there isn't, and
+  we're streaming, send what we've got so far to make some.
+*/
+static bool jsonwriterRoom(JsonWriter* jw, int len)
+{
+  if (jw->remaining >= len)
+    return true;
+  return jsonwriterFlush(jw) && jw->remaining >= len;
+}
+
+// add a character, and leave room for a null after it - flushing first if need be
+static bool jsonwriterPut(JsonWriter* jw, char c)
+{
+  if (!jsonwriterRoom(jw, 2))
+    return false;
+  *jw->p++ = c;
+  jw->remaining--;
+  return true;
+}
+
 /*
   Called after adding a new value (atom) to a string in order
   to update the state appropriately.
@@ -435,29 +581,18 @@ void jsonwriterAppendedAtom(JsonWriter* jw)
  JsonDecode
 ****************************************************************************/
 
-typedef enum JsonReaderToken_t {
-  token_true,
-  token_false,
-  token_colon,
-  token_comma,
-  token_eof,
-  token_error,
-  token_left_brace,
-  token_left_bracket,
-  token_null,
-  token_right_brace,
-  token_right_bracket,
-  token_number,
-  token_maybe_negative,
-  token_string,
-  token_unknown
-} JsonReaderToken;
-
-static JsonReaderToken jsonreaderGetToken(char* text, int len);
+static bool jsonreaderResume(JsonReader* jr);
+static bool jsonreaderKeep(JsonReader* jr, JsonReaderPartial partial, const char* p, int len);
+static bool jsonreaderEndToken(JsonReader* jr);
+static bool jsonreaderString(JsonReader* jr, char* string, int size);
+static bool jsonreaderWord(JsonReader* jr, char* word, int size);
+static int  jsonreaderScanString(const char* p, int len, bool* escaped);
+static int  jsonreaderScanWord(const char* p, int len);
 
 /**
   Initialize or reset a JsonReader.
-  Do this prior to making a call to jsonreaderGo().
+  Do this prior to making a call to jsonreaderGo(), or before feeding it the first
+  piece of a new string with jsonreaderFeed().
   @param jr The JsonReader to use.
   @param context (optional) An optional parameter that your code can use to
   pass around a known object within the callbacks.  Set it to 0 if you don't need it.
@@ -466,10 +601,14 @@ static JsonReaderToken jsonreaderGetToken(char* text, int len);
 void jsonreaderInit(JsonReader* jr, void* context, bool resetHandlers)
 {
   jr->depth = 0;
+  jr->steps[0] = JSON_READER_IN_ARRAY; // so a string on its own isn't taken for a key
   jr->gotcomma = false;
   jr->context = context;
   jr->p = 0;
   jr->len = 0;
+  jr->partial = JSON_READER_NONE;
+  jr->escaped = false;
+  jr->tokenLen = 0;
   if (resetHandlers) {
     jr->null_handler        = 0;
     jr->bool_handler        = 0;
@@ -506,169 +645,270 @@ void jsonreaderInit(JsonReader* jr, void* context, bool resetHandlers)
 */
 bool jsonreaderGo(JsonReader* jr, char* text, int len)
 {
-  JsonReaderToken token;
+  return jsonreaderFeed(jr, text, len) && jsonreaderFinish(jr);
+}
+
+/**
+  Parse the next piece of a JSON string.
+  The string can be split up anywhere - in the middle of a string or a number is fine.
+  Whatever's been cut off at the end of \b text is held on to in the JsonReader, and
+  picked up again at the start of the next piece, so \b text can be reused as soon as this returns.
+  Call jsonreaderFinish() once the last piece has been read.
+
+  A string that's split across two pieces is collected in the JsonReader before it's
+  passed to your handler, so it can't be longer than \b JSON_READER_TOKEN_SIZE - 64 by default.
+  Strings that turn up in one piece can be as long as you like.
+  @param jr The JsonReader to use.
+  @param text The next piece of the JSON string.
+  @param len The length of \b text.
+  @return True if everything's OK so far, false on a parse error or if a handler returned false.
+
+  \par Example
+  \code
+  // read a JSON document of any size off a socket, 256 bytes at a time
+  char buf[256];
+  int n;
+  bool ok = true;
+  JsonReader jr;
+  jsonreaderInit(&jr, 0, true);
+  jr.int_handler = myIntHandler;
+  while (ok && (n = tcpRead(sock, buf, sizeof(buf))) > 0)
+    ok = jsonreaderFeed(&jr, buf, n);
+  if (ok)
+    ok = jsonreaderFinish(&jr);
+  \endcode
+*/
+bool jsonreaderFeed(JsonReader* jr, char* text, int len)
+{
   jr->p = text;
   jr->len = len;
+  if (jr->partial != JSON_READER_NONE && !jsonreaderResume(jr))
+    return false;
 
-  while (jr->len) {
-    while (*jr->p == ' ') // eat white space
-      jr->p++;
-    token = jsonreaderGetToken( jr->p, jr->len);
-    switch (token) {
-      case token_true:
-        if (jr->bool_handler && !jr->bool_handler(jr->context, true))
-          return false;
-        jr->p += 4;
-        jr->len -= 4;
-        break;
-      case token_false:
-        if (jr->bool_handler && !jr->bool_handler(jr->context, false))
-          return false;
-        jr->p += 5;
-        jr->len -= 5;
-        break;
-      case token_null:
-        if (jr->null_handler && !jr->null_handler(jr->context))
-          return false;
-        jr->p += 4;
-        jr->len -= 4;
+  while (jr->len > 0) {
+    switch (*jr->p) {
+      case ' ': case '\t': case '\r': case '\n': // eat white space
+      case ':': // just get the next one
         break;
-      case token_comma:
+      case ',':
         jr->gotcomma = true;
-        // intentional fall-through
-      case token_colon: // just get the next one      
-        jr->p++;
-        jr->len--;
         break;
-      case token_left_bracket:
+      case '{':
+        if (jr->depth >= JSON_MAX_DEPTH - 1)
+          return false;
         jr->steps[++jr->depth] = JSON_READER_OBJECT_START;
         if (jr->start_obj_handler && !jr->start_obj_handler(jr->context))
           return false;
-        jr->p++;
-        jr->len--;
         break;
-      case token_right_bracket:
+      case '}':
+        if (jr->depth <= 0) // more closed than were opened
+          return false;
         jr->depth--;
         if (jr->end_obj_handler && !jr->end_obj_handler(jr->context))
           return false;
-        jr->p++;
-        jr->len--;
         break;
-      case token_left_brace:
+      case '[':
+        if (jr->depth >= JSON_MAX_DEPTH - 1)
+          return false;
         jr->steps[++jr->depth] = JSON_READER_IN_ARRAY;
         if (jr->start_array_handler && !jr->start_array_handler(jr->context))
           return false;
-        jr->p++;
-        jr->len--;
         break;
-      case token_right_brace:
+      case ']':
+        if (jr->depth <= 0) // more closed than were opened
+          return false;
         jr->depth--;
         if (jr->end_array_handler && !jr->end_array_handler(jr->context))
           return false;
-        jr->p++;
-        jr->len--;
         break;
-      case token_number:
+      case '"':
       {
-        const char* p = jr->p;
-        bool keepgoing = true;
-        bool gotdecimal = false;
-        do {
-          if (*p == '.') {
-            if (gotdecimal) // we only expect to get one decimal place in a number
-              return false;
-            gotdecimal = true;
-            p++;
-          }
-          else if (!isdigit((int)*p))
-            keepgoing = false;
-          else
-            p++;
-        } while (keepgoing);
-        int size = p - jr->p;
-        if (gotdecimal) {
-          if (jr->float_handler && !jr->float_handler(jr->context, atof(jr->p)))
-            return false;
+        char* s = jr->p + 1; // move past the opening "
+        int size = jsonreaderScanString(s, jr->len - 1, &jr->escaped);
+        if (size < 0) { // it carries on in the next piece
+          jr->len = 0;
+          return jsonreaderKeep(jr, JSON_READER_STRING, s, (text + len) - s);
         }
-        else {
-          if (jr->int_handler && !jr->int_handler(jr->context, atoi(jr->p)))
-            return false;
-        }
-        jr->p += size;
-        jr->len -= size;
-        break;
+        s[size] = 0; // replace the trailing " with a null to make a string
+        if (!jsonreaderString(jr, s, size))
+          return false;
+        jr->p += size + 2; // account for both quotes
+        jr->len -= size + 2;
+        continue;
       }
-      case token_string:
+      default: // true, false, null or a number
       {
-        char* p = ++jr->p; // move past the opening "
-        jr->len--;
-        bool keepgoing = true;
-        while (keepgoing) {
-          if (*p == '\\') // we got an escape - skip the escape and the next character
-            p += 2;
-          else if (*p == '"') // we got the end of a string
-            keepgoing = false;
-          else
-            p++; // keep looking for the end of the string
-        }
-        int size = p - jr->p;
-        *p = 0; // replace the trailing " with a null to make a string
-
-        // figure out if this is a key or a normal string
-        bool objkey = false;
-        if (jr->steps[jr->depth] == JSON_READER_OBJECT_START) {
-            jr->steps[jr->depth] = JSON_READER_IN_OBJECT;
-          objkey = true;
-        }
-        if (jr->gotcomma && jr->steps[jr->depth] == JSON_READER_IN_OBJECT) {
-          jr->gotcomma = false;
-          objkey = true;
-        }
-
-        if (objkey) { // last one was a comma - next string has to be a key
-          if(jr->obj_key_handler && !jr->obj_key_handler(jr->context, jr->p, size))
-            return false;
+        int size = jsonreaderScanWord(jr->p, jr->len);
+        if (size == jr->len) { // there might be more of it in the next piece
+          jr->len = 0;
+          return jsonreaderKeep(jr, JSON_READER_WORD, jr->p, size);
         }
-        else { // just a normal string
-          if (jr->string_handler && !jr->string_handler(jr->context, jr->p, size))
-            return false;
-        }
-        jr->p += (size+1); // account for the trailing "
-        jr->len -= (size+1);
-        break;
+        if (!jsonreaderWord(jr, jr->p, size))
+          return false;
+        jr->p += size;
+        jr->len -= size;
+        continue;
       }
-      default:
-        return false;
     }
+    jr->p++;
+    jr->len--;
   }
   return true;
 }
 
+/**
+  Finish parsing a JSON string that's been passed in with jsonreaderFeed().
+  A number at the very end of the string can't be read until now, since there
+  might have been more of it to come.
+  @param jr The JsonReader to use.
+  @return True on a successful parse, false if the string stopped in the middle of a string,
+  or the last number was no good.
+*/
+bool jsonreaderFinish(JsonReader* jr)
+{
+  if (jr->partial == JSON_READER_WORD)
+    return jsonreaderEndToken(jr);
+  return jr->partial == JSON_READER_NONE;
+}
+
 /** @}
 */
 
-// static
-JsonReaderToken jsonreaderGetToken(char* text, int len)
+// carry on with a token that was cut off at the end of the last piece
+bool jsonreaderResume(JsonReader* jr)
 {
-  if (len < 1) return token_unknown;
-  switch (text[0]) {
-    case ':': return token_colon;
-    case ',': return token_comma;
-    case '{': return token_left_bracket;
-    case '}': return token_right_bracket;
-    case '[': return token_left_brace;
-    case ']': return token_right_brace;
-    case '"': return token_string;
-    case '0': case '1': case '2': case '3': case '4': 
-    case '5': case '6': case '7': case '8': case '9':
-      return token_number;
-    case '-': return token_maybe_negative;
-    case 't': return strncmp(text, "true", 4) == 0 ? token_true : token_unknown;
-    case 'f': return strncmp(text, "false", 5) == 0 ? token_false : token_unknown;
-    case 'n': return strncmp(text, "null", 4) == 0 ? token_null : token_unknown;
-    case '\0': return token_eof;
-    default:  return token_unknown;
+  bool done;
+  int size;
+  if (jr->partial == JSON_READER_STRING) {
+    size = jsonreaderScanString(jr->p, jr->len, &jr->escaped);
+    done = (size >= 0);
+  }
+  else {
+    size = jsonreaderScanWord(jr->p, jr->len);
+    done = (size < jr->len);
+  }
+  if (!done)
+    size = jr->len;
+  if (!jsonreaderKeep(jr, jr->partial, jr->p, size))
+    return false;
+  jr->p += size;
+  jr->len -= size;
+  if (!done)
+    return true;
+  if (jr->partial == JSON_READER_STRING) { // move past the closing "
+    jr->p++;
+    jr->len--;
+  }
+  return jsonreaderEndToken(jr);
+}
+
+// hang on to some of a token, until the rest of it turns up
+bool jsonreaderKeep(JsonReader* jr, JsonReaderPartial partial, const char* p, int len)
+{
+  if (jr->tokenLen + len >= JSON_READER_TOKEN_SIZE) // leave room for the null
+    return false;
+  memcpy(jr->token + jr->tokenLen, p, len);
+  jr->tokenLen += len;
+  jr->partial = partial;
+  return true;
+}
+
+// a token that was split up is all here now - pass it along
+bool jsonreaderEndToken(JsonReader* jr)
+{
+  JsonReaderPartial partial = jr->partial;
+  int size = jr->tokenLen;
+  jr->token[size] = 0;
+  jr->partial = JSON_READER_NONE;
+  jr->tokenLen = 0;
+  if (partial == JSON_READER_STRING)
+    return jsonreaderString(jr, jr->token, size);
+  return jsonreaderWord(jr, jr->token, size);
+}
+
+// figure out if this is a key or a normal string, and call the right handler
+bool jsonreaderString(JsonReader* jr, char* string, int size)
+{
+  bool objkey = false;
+  if (jr->steps[jr->depth] == JSON_READER_OBJECT_START) {
+    jr->steps[jr->depth] = JSON_READER_IN_OBJECT;
+    objkey = true;
+  }
+  if (jr->gotcomma && jr->steps[jr->depth] == JSON_READER_IN_OBJECT) {
+    jr->gotcomma = false;
+    objkey = true;
+  }
+
+  if (objkey) // last one was a comma - next string has to be a key
+    return !jr->obj_key_handler || jr->obj_key_handler(jr->context, string, size);
+  else // just a normal string
+    return !jr->string_handler || jr->string_handler(jr->context, string, size);
+}
+
+/*
+  Anything outside quotes that isn't punctuation - true, false, null or a number.
+  The character after the word is never part of a number, so atoi() and atof()
+  know where to stop, whether it's still in the text or it's the null in jr->token.
+*/
+bool jsonreaderWord(JsonReader* jr, char* word, int size)
+{
+  if (size == 4 && strncmp(word, "true", 4) == 0)
+    return !jr->bool_handler || jr->bool_handler(jr->context, true);
+  if (size == 5 && strncmp(word, "false", 5) == 0)
+    return !jr->bool_handler || jr->bool_handler(jr->context, false);
+  if (size == 4 && strncmp(word, "null", 4) == 0)
+    return !jr->null_handler || jr->null_handler(jr->context);
+
+  int i, decimals = 0;
+  bool isfloat = false;
+  if (!isdigit((int)word[0]) && word[0] != '-')
+    return false;
+  for (i = 0; i < size; i++) {
+    char c = word[i];
+    if (c == '.') {
+      if (++decimals > 1) // we only expect to get one decimal place in a number
+        return false;
+      isfloat = true;
+    }
+    else if (c == 'e' || c == 'E')
+      isfloat = true;
+    else if (!isdigit((int)c) && c != '-' && c != '+')
+      return false;
+  }
+  if (isfloat)
+    return !jr->float_handler || jr->float_handler(jr->context, atof(word));
+  else
+    return !jr->int_handler || jr->int_handler(jr->context, atoi(word));
+}
+
+/*
+  How far it is to the closing quote, or -1 if it's not in this piece.
+  Escapes are left as they are, but an escaped quote doesn't end the string - and
+  since a \ might be the last thing in a piece, whether we're in an escape is kept in escaped.
+*/
+int jsonreaderScanString(const char* p, int len, bool* escaped)
+{
+  int i;
+  for (i = 0; i < len; i++) {
+    if (*escaped)
+      *escaped = false;
+    else if (p[i] == '\\')
+      *escaped = true;
+    else if (p[i] == '"')
+      return i;
+  }
+  return -1;
+}
+
+// how long the word at p is - len if it runs to the end of the piece
+int jsonreaderScanWord(const char* p, int len)
+{
+  int i;
+  for (i = 0; i < len; i++) {
+    if (strchr(" \t\r\n,:{}[]\"", p[i]) != 0)
+      break;
   }
+  return i;
 }
 
 
@@ -24,6 +24,10 @@
 #define JSON_MAX_DEPTH 20
 #endif
 
+#ifndef JSON_READER_TOKEN_SIZE
+#define JSON_READER_TOKEN_SIZE 64
+#endif
+
 // state object for encoding
 typedef enum JsonWriterStep_t {
   JSON_START,
@@ -44,6 +48,10 @@ typedef struct JsonWriter_t {
   int depth;                            /**< The current depth of the encoder (how many elements have been opened). */
   char* p;                              /**< A pointer to the buffer to write into. */
   int remaining;                        /**< The number of bytes remaining in the buffer to write into. */
+  char* buffer;                         /**< The start of the buffer. */
+  int size;                             /**< The size of the buffer. */
+  bool (*flush)(void* context, const char* data, int length); /**< Called to empty the buffer when it fills up, if set - see jsonwriterSetFlush(). */
+  void* context;                        /**< Passed to \b flush. */
 } JsonWriter;
 
 // state object for decoding
@@ -53,6 +61,13 @@ typedef enum JsonReaderStep_t {
   JSON_READER_IN_ARRAY
 } JsonReaderStep;
 
+// what was cut off at the end of the last piece of a JSON string
+typedef enum JsonReaderPartial_t {
+  JSON_READER_NONE,
+  JSON_READER_STRING,
+  JSON_READER_WORD
+} JsonReaderPartial;
+
 /**
   The structure used to maintain the state of a JSON decode process.
   You'll need to have one of these for each JSON string you want to encode.
@@ -65,6 +80,10 @@ typedef struct JsonReader_t {
   void* context;                            /**< A pointer to the user context. */
   char* p;                                  /**< A pointer to the data. */
   int len;                                  /**< The current length. */
+  JsonReaderPartial partial;                /**< Used internally by the decoder - the kind of token that's been cut off, if any. */
+  bool escaped;                             /**< Used internally by the decoder. */
+  char token[JSON_READER_TOKEN_SIZE];       /**< Used internally by the decoder - holds a token that's been cut off until the rest of it turns up. */
+  int tokenLen;                             /**< Used internally by the decoder. */
   bool(*null_handler)(void*);                /**< Called when "null" is encountered. */
   bool(*bool_handler)(void*, bool);          /**< Called when a boolean value is encountered. */
   bool(*int_handler)(void*, int);            /**< Called when an int is encountered. */
@@ -82,6 +101,8 @@ extern "C" {
 #endif
 // writer
 void  jsonwriterInit(JsonWriter* jw, char* buffer, int length);
+void  jsonwriterSetFlush(JsonWriter* jw, bool (*flush)(void* context, const char* data, int length), void* context);
+bool  jsonwriterFlush(JsonWriter* jw);
 char* jsonwriterObjectOpen(JsonWriter* jw);
 char* jsonwriterObjectKey(JsonWriter* jw, const char *key);
 char* jsonwriterObjectClose(JsonWriter* jw);
@@ -89,11 +110,14 @@ char* jsonwriterArrayOpen(JsonWriter* jw);
 char* jsonwriterArrayClose(JsonWriter* jw);
 char* jsonwriterString(JsonWriter* jw, const char *string);
 char* jsonwriterInt(JsonWriter* jw, int value);
+char* jsonwriterFloat(JsonWriter* jw, float value);
 char* jsonwriterBool(JsonWriter* jw, bool value);
 
 // reader
 void jsonreaderInit(JsonReader* jr, void* context, bool resetHandlers);
 bool jsonreaderGo(JsonReader* jr, char* text, int len);
+bool jsonreaderFeed(JsonReader* jr, char* text, int len);
+bool jsonreaderFinish(JsonReader* jr);
 #ifdef __cplusplus
 }
 #endif
@@ -19,8 +19,6 @@
 #include "core.h"
 #include "fasttimer.h"
 
-#include "at91sam7.h"
-
 #if ( APPBOARD_VERSION == 90 || APPBOARD_VERSION == 95 || APPBOARD_VERSION == 100 )
   #define STEPPER_0_IO_0 PIN_PA24
   #define STEPPER_0_IO_1 PIN_PA5
@@ -38,16 +36,59 @@
 #define STEPPER_DEFAULT_SPEED 10
 #endif
 
+// how many steps the acceleration ramp can take to get up to speed.
+// If it would need more, the motor tops out at the end of the ramp.
+#ifndef STEPPER_RAMP_SIZE
+#define STEPPER_RAMP_SIZE 128
+#endif
+
+// how many moves can be waiting behind the current one
+#ifndef STEPPER_MOVE_QUEUE
+#define STEPPER_MOVE_QUEUE 4
+#endif
+
+// the achieved rate is averaged over at least this many milliseconds
+#ifndef STEPPER_RATE_WINDOW
+#define STEPPER_RATE_WINDOW 250
+#endif
+
+#define STEPPER_MAX_ACCELERATION 0xFFFF
+
+// the pins to set and clear for one position in the step sequence
+typedef struct StepperPhase_t {
+  int aOn;
+  int aOff;
+  int bOn;
+  int bOff;
+} StepperPhase;
+
 typedef struct Stepper_t {
   unsigned int bipolar : 1;
   unsigned int halfStep : 1;
   unsigned int timerRunning : 1;
-  unsigned int speed;
+  unsigned int enabled : 1;
+  unsigned int speed;     // us per step at full speed, 0 to stay put
   int duty;
-  int acceleration;
+  int acceleration;       // steps per second per second, 0 for none
   int destination;
   int position;
+  int direction;
+  int level;              // how far up the ramp we are
+  int rampLength;
+  int interval;           // what the timer's running at, in us
+  int runOn;              // queued steps that carry on in the same direction after this move
   int pins[4];
+  int phaseMask;
+  StepperPhase phases[8];
+  int moves[STEPPER_MOVE_QUEUE];
+  int moveHead;
+  int moveCount;
+  unsigned int steps;     // steps taken, for the achieved rate
+  unsigned int rateSteps;
+  systime_t rateTime;
+  int achievedRate;
+  unsigned int* ramp;     // us between steps at each level - one of the tables below
+  unsigned int rampTables[2][STEPPER_RAMP_SIZE]; // the next ramp is planned in whichever one isn't in use
   FastTimer fastTimer;
 } Stepper;
 
@@ -55,17 +96,22 @@ static void stepperIRQCallback(int id);
 
 static int stepperGetIo(int stepper, int io);
 static void stepperSetDetails(Stepper* s);
-static void stepperSetUnipolarHalfStepOutput(Stepper *s, int position);
-static void stepperSetUnipolarOutput(Stepper *s, int position);
-static void stepperSetBipolarOutput(Stepper *s, int position);
-static void stepperSetBipolarHalfStepOutput(Stepper *s, int position);
-
-static void stepperSetOn(int stepper, int* portAOn, int* portBOn);
-static void stepperSetOff(int stepper, int* portAOff, int* portBOff);
-static void stepperSetAll(int portAOn, int portBOn, int portAOff, int portBOff);
+static void stepperSetPhases(Stepper* s);
+static void stepperPlanRamp(Stepper* s);
+static void stepperNextMove(Stepper* s);
+static void stepperSetRunOn(Stepper* s);
+static unsigned int stepperSqrt(unsigned int x);
 
 static Stepper steppers[STEPPER_COUNT];
 
+/*
+  Which of the 4 IOs are on at each position in the step sequence.
+*/
+static const uint8_t stepperUnipolarSequence[] = { 0x1, 0x2, 0x4, 0x8 };
+static const uint8_t stepperUnipolarHalfSequence[] = { 0x1, 0x3, 0x2, 0x6, 0x4, 0xC, 0x8, 0x9 };
+static const uint8_t stepperBipolarSequence[] = { 0x5, 0x6, 0xA, 0x9 };
+static const uint8_t stepperBipolarHalfSequence[] = { 0x1, 0x5, 0x4, 0x6, 0x2, 0xA, 0x8, 0x9 };
+
 /** \defgroup Stepper Stepper
   The Stepper Motor subsystem provides speed and position control for one or two stepper motors.
   Up to 2 stepper motors can be controlled with the Make Application Board.
@@ -84,6 +130,15 @@ static Stepper steppers[STEPPER_COUNT];
 
   \section rel Relative Positioning
   For relative positioning, simply use stepperStep() to move a number of steps from the current position.
+  To line up several moves one after the other, use stepperQueueSteps() - consecutive moves in the same
+  direction run straight into each other without slowing down in between.
+
+  \section accel Acceleration
+  Most motors can't start at their top speed without stalling.  Give the stepper an acceleration with
+  stepperSetAcceleration() and it will ramp up to the speed set by stepperSetSpeed() or stepperSetRate(), 
+  and ramp back down in time to stop at its destination.  The ramp is worked out when the settings change, 
+  so each step only costs a table lookup.  Use stepperAchievedRate() to check whether the motor 
+  is actually getting up to the rate you've asked for.
   
   See the <a href="http://www.makingthings.com/documentation/how-to/stepper-motor">Stepper Motor how-to</a>
   for more detailed info on hooking up a stepper motor to the Make Controller.
@@ -105,8 +160,8 @@ void stepperEnable(int stepper)
 {
   fasttimerInit(2);
   Stepper* s = &steppers[stepper];
-  pwmEnableChannel(stepper * 2);
-  pwmEnableChannel(stepper * 2 + 1);
+  pwmEnable(stepper * 2, 0, 0);
+  pwmEnable(stepper * 2 + 1, 0, 0);
   // Fire the PWM's up
   s->duty = 1023;
 
@@ -124,14 +179,26 @@ void stepperEnable(int stepper)
 
   s->position = 0;
   s->destination = 0;
-  s->speed = STEPPER_DEFAULT_SPEED;
+  s->direction = 1;
+  s->level = 0;
+  s->moveHead = 0;
+  s->moveCount = 0;
+  s->runOn = 0;
+  s->speed = STEPPER_DEFAULT_SPEED * 1000;
+  s->acceleration = 0;
   s->timerRunning = 0;
   s->halfStep = false;
   s->bipolar = true;
+  s->steps = 0;
+  s->rateSteps = 0;
+  s->rateTime = chTimeNow();
+  s->achievedRate = 0;
+  stepperSetPhases(s);
+  stepperPlanRamp(s);
 
   s->fastTimer.handler = stepperIRQCallback;
   s->fastTimer.id = stepper;
-  fasttimerStart(&s->fastTimer, s->speed * 1000, true);
+  s->enabled = true;
 }
 
 /**
@@ -144,23 +211,35 @@ void stepperDisable(int stepper)
   if (s->timerRunning) {
     chSysDisable();
     fasttimerStop(&s->fastTimer);
+    s->timerRunning = false;
     chSysEnable();
   }
+  s->enabled = false;
 
   int i;
   for (i = 0; i < 4; i++)
     pinOff(s->pins[i]);
 
   int pwm = stepper * 2;
-  pwmDisableChannel(pwm);
-  pwmDisableChannel(pwm + 1);
+  pwmDisable(pwm);
+  pwmDisable(pwm + 1);
+}
+
+/**
+  Read whether a stepper motor is enabled.
+  @param stepper Which stepper (0 or 1).
+  @return True if it's enabled, false if not.
+*/
+bool stepperEnabled(int stepper)
+{
+  return steppers[stepper].enabled;
 }
 
 /**	
 	Reset the position of the specified stepper motor.
 	Note that this will not ask the stepper to move.  It will simply set the
 	stepper's current position as 0.  To move the stepper, see
-	stepperSetDestination() or stepperStep().
+	stepperSetDestination() or stepperStep().  Any queued moves are dropped.
 	@param stepper An integer specifying which stepper (0 or 1).
 	@param position An integer specifying the stepper position.
   @return status (0 = OK).
@@ -168,7 +247,7 @@ void stepperDisable(int stepper)
   \b Example
 	\code
 	// reset stepper 1 to call its current position 0
-	stepperSetPosition(1, 0);
+	stepperResetPosition(1, 0);
 	\endcode
 */
 int stepperResetPosition(int stepper, int position)
@@ -178,6 +257,9 @@ int stepperResetPosition(int stepper, int position)
   chSysDisable();
   s->position = position;
   s->destination = position;
+  s->moveCount = 0;
+  s->runOn = 0;
+  s->level = 0;
   chSysEnable();
 
   stepperSetDetails(s);
@@ -186,10 +268,12 @@ int stepperResetPosition(int stepper, int position)
 
 /**	
 	Set the destination position for a stepper motor.
-	This will start the stepper moving the given number of
-	steps at the current speed, as set by Stepper_SetSpeed().
+	This will start the stepper moving towards the given position
+	at the current speed, as set by stepperSetSpeed().  Any queued
+  moves are dropped.  If the motor is already running the other way, 
+  it slows to a stop before heading back.
 	
-	While it's moving, you can call Stepper_GetPosition() to read
+	While it's moving, you can call stepperPosition() to read
 	its current position.
 	@param stepper An integer specifying which stepper (0 or 1).
 	@param positionRequested An integer specifying the desired stepper position.
@@ -197,7 +281,7 @@ int stepperResetPosition(int stepper, int position)
   
   \b Example
 	\code
-	// start moving stepper 0 1500 steps
+	// start moving stepper 0 to position 1500
 	stepperSetDestination(0, 1500);
 	\endcode
 */
@@ -206,6 +290,8 @@ int stepperSetDestination(int stepper, int positionRequested)
   Stepper* s = &steppers[stepper];
   chSysDisable();
   s->destination = positionRequested;
+  s->moveCount = 0;
+  s->runOn = 0;
   chSysEnable();
 
   stepperSetDetails(s);
@@ -217,6 +303,8 @@ int stepperSetDestination(int stepper, int positionRequested)
   This is a number of ms per step, rather than the more common steps per second.  
   Arranging it this way makes it easier to express as an integer.  
   Fastest speed is 1ms / step (1000 steps per second) and slowest is many seconds.
+  To go faster than 1000 steps per second, use stepperSetRate().
+  If an acceleration has been set, this is the top speed the motor ramps up to.
 	@param stepper An integer specifying which stepper (0 or 1).
 	@param speed An integer specifying the stepper speed in ms per step
   @return status (0 = OK).
@@ -229,14 +317,11 @@ int stepperSetDestination(int stepper, int positionRequested)
 */
 int stepperSetSpeed(int stepper, int speed)
 {
+  if (speed < 0)
+    return CONTROLLER_ERROR_ILLEGAL_PARAMETER_VALUE;
   Stepper* s = &steppers[stepper];
   s->speed = speed * 1000;
-
-  chSysDisable();
-  fasttimerStop(&s->fastTimer);
-  fasttimerStart(&s->fastTimer, s->speed, true);
-  chSysEnable();
-
+  stepperPlanRamp(s);
   stepperSetDetails(s);
   return CONTROLLER_OK;
 }
@@ -245,7 +330,7 @@ int stepperSetSpeed(int stepper, int speed)
 	Get the speed at which a stepper will move.
 	Read the value previously set for the speed parameter.
 	@param stepper An integer specifying which stepper (0 or 1).
-  @return The speed (0 - 1023), or 0 on error.
+  @return The speed, in ms per step.
   
   \b Example
 	\code
@@ -255,7 +340,113 @@ int stepperSetSpeed(int stepper, int speed)
 */
 int stepperSpeed(int stepper)
 {
-  return steppers[stepper].speed;
+  return steppers[stepper].speed / 1000;
+}
+
+/**
+  Set the top speed of a stepper in steps per second.
+  This is the same as stepperSetSpeed(), but allows rates above 1000 steps per second.
+  Motors generally can't start at high rates, so you'll probably want to set
+  an acceleration as well - see stepperSetAcceleration().
+  @param stepper Which stepper (0 or 1).
+  @param rate The number of steps per second, or 0 to stay put.
+  @return status (0 = OK).
+
+  \b Example
+  \code
+  stepperSetAcceleration(0, 4000);
+  stepperSetRate(0, 2500); // ramp up to 2500 steps a second
+  \endcode
+*/
+int stepperSetRate(int stepper, int rate)
+{
+  if (rate < 0)
+    return CONTROLLER_ERROR_ILLEGAL_PARAMETER_VALUE;
+  Stepper* s = &steppers[stepper];
+  s->speed = (rate > 0) ? 1000000 / rate : 0;
+  stepperPlanRamp(s);
+  stepperSetDetails(s);
+  return CONTROLLER_OK;
+}
+
+/**
+  Read the top speed of a stepper in steps per second.
+  This is the rate that's been requested - see stepperAchievedRate() for
+  the rate it's actually stepping at.
+  @param stepper Which stepper (0 or 1).
+  @return The requested number of steps per second.
+*/
+int stepperRate(int stepper)
+{
+  Stepper* s = &steppers[stepper];
+  return (s->speed > 0) ? 1000000 / s->speed : 0;
+}
+
+/**
+  Read the rate a stepper has actually been stepping at.
+  This is averaged since the last time it was read, as long as that was at least
+  STEPPER_RATE_WINDOW milliseconds ago, so it includes time spent accelerating
+  and standing still.  If it falls short of stepperRate() while the motor is
+  cruising, the acceleration ramp isn't long enough to reach the requested speed
+  or the fast timer is overloaded.
+  @param stepper Which stepper (0 or 1).
+  @return The number of steps per second.
+
+  \b Example
+  \code
+  stepperStep(0, 5000);
+  sleep(1000);
+  int rate = stepperAchievedRate(0);
+  \endcode
+*/
+int stepperAchievedRate(int stepper)
+{
+  Stepper* s = &steppers[stepper];
+  systime_t now = chTimeNow();
+  systime_t elapsed = now - s->rateTime;
+  if (elapsed >= MS2ST(STEPPER_RATE_WINDOW)) {
+    unsigned int steps = s->steps;
+    s->achievedRate = ((steps - s->rateSteps) * CH_FREQUENCY) / elapsed;
+    s->rateSteps = steps;
+    s->rateTime = now;
+  }
+  return s->achievedRate;
+}
+
+/**
+  Set how quickly a stepper gets up to speed.
+  When a stepper starts moving it ramps up to the speed set by stepperSetSpeed() or
+  stepperSetRate() at this acceleration, and it ramps back down in time to stop at its
+  destination.  An acceleration of 0 (the default) starts and stops at full speed.
+  @param stepper Which stepper (0 or 1).
+  @param acceleration The acceleration, in steps per second per second.
+  @return status (0 = OK).
+
+  \b Example
+  \code
+  // take 1 second to get up to 2000 steps per second
+  stepperSetAcceleration(0, 2000);
+  stepperSetRate(0, 2000);
+  \endcode
+*/
+int stepperSetAcceleration(int stepper, int acceleration)
+{
+  if (acceleration < 0 || acceleration > STEPPER_MAX_ACCELERATION)
+    return CONTROLLER_ERROR_ILLEGAL_PARAMETER_VALUE;
+  Stepper* s = &steppers[stepper];
+  s->acceleration = acceleration;
+  stepperPlanRamp(s);
+  return CONTROLLER_OK;
+}
+
+/**
+  Read the acceleration of a stepper.
+  @param stepper Which stepper (0 or 1).
+  @return The acceleration, in steps per second per second.
+*/
+int stepperAcceleration(int stepper)
+{
+  return steppers[stepper].acceleration;
 }
 
 /**	
@@ -276,8 +467,8 @@ int stepperPosition(int index)
 
 /**	
 	Read the destination position of a stepper motor.
-	This indicates where the stepper is ultimately headed.  To see
-	where it actually is, see Stepper_GetPosition().
+	This indicates where the stepper's current move is headed.  To see
+	where it actually is, see stepperPosition().
 	@param stepper An integer specifying which stepper (0 or 1).
   @return The position and 0 on error
   
@@ -295,6 +486,7 @@ int stepperDestination(int stepper)
 /**	
 	Simply take a number of steps from wherever the motor is currently positioned.
   This function will move the motor a given number of steps from the current position.
+  Any queued moves are dropped.
 	@param stepper Which stepper (0 or 1).
 	@param steps An integer specifying the number of steps.  Can be negative to go in reverse.
   @return status (0 = OK).
@@ -310,12 +502,58 @@ int stepperStep(int stepper, int steps)
   Stepper* s = &steppers[stepper];
   chSysDisable();
   s->destination = (s->position + steps);
+  s->moveCount = 0;
+  s->runOn = 0;
   chSysEnable();
 
   stepperSetDetails(s);
   return CONTROLLER_OK;
 }
 
+/**
+  Add a move to the end of a stepper's queue.
+  The move starts from wherever the previous one finishes.  If it's in the same
+  direction the motor carries straight on without slowing down in between.
+  @param stepper Which stepper (0 or 1).
+  @param steps The number of steps.  Can be negative to go in reverse.
+  @return status (0 = OK), or CONTROLLER_ERROR_NO_SPACE if the queue is full.
+
+  \b Example
+  \code
+  // forward 400, then back 100
+  stepperQueueSteps(0, 400);
+  stepperQueueSteps(0, -100);
+  \endcode
+*/
+int stepperQueueSteps(int stepper, int steps)
+{
+  Stepper* s = &steppers[stepper];
+  int status = CONTROLLER_OK;
+  chSysDisable();
+  if (s->moveCount >= STEPPER_MOVE_QUEUE)
+    status = CONTROLLER_ERROR_NO_SPACE;
+  else {
+    s->moves[(s->moveHead + s->moveCount) % STEPPER_MOVE_QUEUE] = steps;
+    s->moveCount++;
+    stepperSetRunOn(s);
+  }
+  chSysEnable();
+
+  stepperSetDetails(s);
+  return status;
+}
+
+/**
+  Read how many moves are waiting in a stepper's queue.
+  This doesn't include the move that's currently running.
+  @param stepper Which stepper (0 or 1).
+  @return The number of queued moves.
+*/
+int stepperQueuedMoves(int stepper)
+{
+  return steppers[stepper].moveCount;
+}
+
 /**	
 	Set the duty - from 0 to 1023.  The default is for 100% power (1023).
 	@param stepper Which stepper (0 or 1).
@@ -372,8 +610,32 @@ int stepperDuty(int stepper)
 */
 void stepperConfigure(int stepper, bool bipolar, bool halfstep)
 {
-  steppers[stepper].bipolar = bipolar;
-  steppers[stepper].halfStep = halfstep;
+  Stepper* s = &steppers[stepper];
+  chSysDisable();
+  s->bipolar = bipolar;
+  s->halfStep = halfstep;
+  stepperSetPhases(s);
+  chSysEnable();
+}
+
+/**
+  Read whether a stepper is in bipolar mode.
+  @param stepper Which stepper (0 or 1).
+  @return True for bipolar, false for unipolar.
+*/
+bool stepperBipolar(int stepper)
+{
+  return steppers[stepper].bipolar;
+}
+
+/**
+  Read whether a stepper is in half step mode.
+  @param stepper Which stepper (0 or 1).
+  @return True for half step, false for full step.
+*/
+bool stepperHalfStep(int stepper)
+{
+  return steppers[stepper].halfStep;
 }
 
 /** @}
@@ -403,310 +665,192 @@ int stepperGetIo(int stepper, int ioIndex)
   return io;
 }
 
+/*
+  Take one step, and work out how long until the next one.
+  Everything that takes any real work - the pin masks and the ramp - 
+  has been figured out ahead of time.
+*/
 void stepperIRQCallback(int id)
 {
   Stepper* s = &steppers[id];
 
-  if (s->position < s->destination)
-    s->position++;
-  if (s->position > s->destination)
-    s->position--;
-
-  if (s->bipolar) {
-    if (s->halfStep)
-      stepperSetBipolarHalfStepOutput(s, s->position);
-    else
-      stepperSetBipolarOutput(s, s->position);
-  }
-  else {
-    if (s->halfStep) 
-      stepperSetUnipolarHalfStepOutput(s, s->position);
-    else
-      stepperSetUnipolarOutput(s, s->position);
-  }
-
-  if (s->position == s->destination) {
-    fasttimerStop(&s->fastTimer);
-    s->timerRunning = false;
-  }
-}
-
-void stepperSetDetails(Stepper* s)
-{
-  if (!s->timerRunning && (s->position != s->destination) && (s->speed != 0)) {
-    s->timerRunning = true;
-    chSysDisable();
-    fasttimerStart(&s->fastTimer, s->speed, true);
-    chSysEnable();
-  }
-  else {
-    if ((s->timerRunning) && ((s->position == s->destination) || (s->speed == 0))) {
-      chSysDisable();
-      fasttimerStop(&s->fastTimer);
-      chSysEnable();
-      s->timerRunning = false;
+  if (s->position == s->destination && s->moveCount > 0)
+    stepperNextMove(s);
+
+  // how far we can keep going in this direction
+  int togo = (s->destination + s->runOn - s->position) * s->direction;
+  if (togo <= 0) {
+    if (s->level == 0) {
+      if (s->position == s->destination) { // we've arrived
+        fasttimerStop(&s->fastTimer);
+        s->timerRunning = false;
+        return;
+      }
+      s->direction = -s->direction; // turn around from a standstill
+      togo = -togo;
     }
+    else
+      togo = 0; // still headed the wrong way - keep slowing down
   }
-}
 
-void stepperSetUnipolarHalfStepOutput(Stepper *s, int position)
-{
-  //int output = position % 8;
-  int output = position & 0x7;
-
-  int* iop = s->pins;
+  s->position += s->direction;
+  s->steps++;
+  togo--;
 
-  int portAOn = 0;
-  int portBOn = 0;
-  int portAOff = 0;
-  int portBOff = 0;
+  StepperPhase* p = &s->phases[s->position & s->phaseMask];
+  pinGroupSetValue(GROUP_A, p->aOn, ON);
+  pinGroupSetValue(GROUP_B, p->bOn, ON);
+  pinGroupSetValue(GROUP_A, p->aOff, OFF);
+  pinGroupSetValue(GROUP_B, p->bOff, OFF);
 
-  switch (output) {
-    case -1:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 0:
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 1:
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 2:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 3:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 4:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 5:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);      
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      break;
-    case 6:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);      
-      stepperSetOff(*iop++, &portAOff, &portBOff);      
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      break;
-    case 7:
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);      
-      stepperSetOff(*iop++, &portAOff, &portBOff);      
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      break;
-  }  
+  // it takes as many steps to slow down as it took to speed up
+  if (togo <= s->level) {
+    if (s->level > 0)
+      s->level--;
+  }
+  else if (s->level < s->rampLength - 1)
+    s->level++;
 
-  stepperSetAll( portAOn, portBOn, portAOff, portBOff );
+  int interval = s->ramp[s->level];
+  if (interval != s->interval) {
+    s->interval = interval;
+    fasttimerStart(&s->fastTimer, interval, true);
+  }
 }
 
-void stepperSetUnipolarOutput(Stepper *s, int position)
+/*
+  Start the next queued move - it picks up from the current destination.
+*/
+void stepperNextMove(Stepper* s)
 {
-  //int output = position % 4;
-  int output = position & 0x3;
-  int* iop = s->pins;
-
-  int portAOn = 0;
-  int portBOn = 0;
-  int portAOff = 0;
-  int portBOff = 0;
-
-  switch (output) {
-    case -1:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 0:
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 1:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 2:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 3:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      break;
-  }  
-  stepperSetAll(portAOn, portBOn, portAOff, portBOff);
+  s->destination += s->moves[s->moveHead];
+  s->moveHead = (s->moveHead + 1) % STEPPER_MOVE_QUEUE;
+  s->moveCount--;
+  stepperSetRunOn(s);
 }
 
-void stepperSetBipolarHalfStepOutput(Stepper *s, int position)
+/*
+  Add up the queued moves that carry on in the same direction as
+  the current one, so we don't slow down at the end of it.
+*/
+void stepperSetRunOn(Stepper* s)
 {
-  //int output = position % 8;
-  int output = position & 0x7;
-  int* iop = s->pins;
-
-  int portAOn = 0;
-  int portBOn = 0;
-  int portAOff = 0;
-  int portBOff = 0;
-
-  switch (output) {
-    case -1:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 0:
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 1:
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 2:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 3:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 4:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 5:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      break;
-    case 6:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      break;
-    case 7:
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);      
-      stepperSetOff(*iop++, &portAOff, &portBOff);      
-      stepperSetOn(*iop++, &portAOn, &portBOn);
+  int i;
+  int dir = s->destination - s->position;
+  s->runOn = 0;
+  for (i = 0; i < s->moveCount; i++) {
+    int steps = s->moves[(s->moveHead + i) % STEPPER_MOVE_QUEUE];
+    if (dir == 0)
+      dir = steps;
+    if ((steps > 0) != (dir > 0) || steps == 0)
       break;
-  }  
-
-  stepperSetAll(portAOn, portBOn, portAOff, portBOff);
+    s->runOn += steps;
+  }
 }
 
-void stepperSetBipolarOutput(Stepper *s, int position)
+void stepperSetDetails(Stepper* s)
 {
-  //int output = position % 4; // work around % bug - negative numbers not handled properly
-  int output = position & 0x3;
-  int* iop = s->pins;
-
-  int portAOn = 0;
-  int portBOn = 0;
-  int portAOff = 0;
-  int portBOff = 0;
-
-  // This may be the least efficient code I have ever written
-  switch (output) {
-    case -1:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 0:
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 1:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      break;
-    case 2:
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      break;
-    case 3:
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOff(*iop++, &portAOff, &portBOff);
-      stepperSetOn(*iop++, &portAOn, &portBOn);
-      break;
-  }  
-  stepperSetAll(portAOn, portBOn, portAOff, portBOff);
+  if (!s->enabled)
+    return;
+  chSysDisable();
+  if (!s->timerRunning && (s->position != s->destination || s->moveCount > 0) && (s->speed != 0)) {
+    s->timerRunning = true;
+    s->level = 0;
+    s->interval = s->ramp[0];
+    s->direction = (s->destination != s->position) ? 
+                      ((s->destination > s->position) ? 1 : -1) :
+                      ((s->moves[s->moveHead] > 0) ? 1 : -1);
+    fasttimerStart(&s->fastTimer, s->interval, true);
+  }
+  else if (s->timerRunning && s->speed == 0) {
+    fasttimerStop(&s->fastTimer);
+    s->timerRunning = false;
+    s->level = 0;
+  }
+  chSysEnable();
 }
 
-void stepperSetOn(int stepper, int* portAOn, int* portBOn)
+/*
+  Work out the pins to set and clear at each position in the step sequence.
+*/
+void stepperSetPhases(Stepper* s)
 {
-  if (stepper < 32)
-    *portAOn |= (1 << (stepper & 0x1F));
+  const uint8_t* sequence;
+  if (s->bipolar)
+    sequence = s->halfStep ? stepperBipolarHalfSequence : stepperBipolarSequence;
   else
-    *portBOn |= (1 << (stepper & 0x1F));
+    sequence = s->halfStep ? stepperUnipolarHalfSequence : stepperUnipolarSequence;
+  s->phaseMask = s->halfStep ? 0x7 : 0x3;
+
+  int i, io;
+  for (i = 0; i <= s->phaseMask; i++) {
+    StepperPhase* p = &s->phases[i];
+    p->aOn = p->aOff = p->bOn = p->bOff = 0;
+    for (io = 0; io < 4; io++) {
+      int pin = s->pins[io];
+      int mask = 1 << (pin & 0x1F);
+      if (sequence[i] & (1 << io)) {
+        if (pin < 32) p->aOn |= mask; else p->bOn |= mask;
+      }
+      else {
+        if (pin < 32) p->aOff |= mask; else p->bOff |= mask;
+      }
+    }
+  }
 }
 
-void stepperSetOff(int stepper, int* portAOff, int* portBOff)
+/*
+  Work out the time between steps for each step of the acceleration ramp,
+  using David Austin's approximation: the first step takes 0.676 * sqrt(2 / a)
+  seconds, and each one after that is c(n) = c(n-1) - 2c(n-1) / (4n + 1).
+  The last entry is the cruising speed, if we can get there within the table.
+*/
+void stepperPlanRamp(Stepper* s)
 {
-  if (stepper < 32)
-    *portAOff |= (1 << (stepper & 0x1F));
-  else
-    *portBOff |= (1 << (stepper & 0x1F));
+  // the interrupt carries on with the current table while we work out the new one
+  unsigned int* ramp = (s->ramp == s->rampTables[0]) ? s->rampTables[1] : s->rampTables[0];
+  int n = 0;
+  unsigned int top = (s->speed > 0) ? s->speed : 1;
+
+  if (s->acceleration > 0) {
+    // 0.676 * sqrt(2) * 1000000 us, over sqrt(a) in 8.8 fixed point
+    unsigned int c0 = 244738048 / stepperSqrt(s->acceleration << 16);
+    unsigned int c = c0 << 4; // keep 4 fractional bits so the rounding doesn't pile up
+    while (n < STEPPER_RAMP_SIZE - 1 && (c >> 4) > top) {
+      ramp[n++] = c >> 4;
+      c -= (2 * c) / (4 * n + 1);
+    }
+    // if the table ran out before we got up to speed, top out here
+    if ((c >> 4) > top)
+      top = c >> 4;
+  }
+  ramp[n++] = top;
+
+  chSysDisable();
+  s->ramp = ramp;
+  s->rampLength = n;
+  if (s->level >= n)
+    s->level = n - 1;
+  chSysEnable();
 }
 
-void stepperSetAll(int portAOn, int portBOn, int portAOff, int portBOff)
+// integer square root
+unsigned int stepperSqrt(unsigned int x)
 {
-  AT91C_BASE_PIOA->PIO_SODR = portAOn;
-  AT91C_BASE_PIOB->PIO_SODR = portBOn;
-  AT91C_BASE_PIOA->PIO_CODR = portAOff;
-  AT91C_BASE_PIOB->PIO_CODR = portBOff;
+  unsigned int root = 0;
+  unsigned int bit = 1 << 30;
+  while (bit > x)
+    bit >>= 2;
+  while (bit != 0) {
+    if (x >= root + bit) {
+      x -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else
+      root >>= 1;
+    bit >>= 2;
+  }
+  return root;
 }
 
 #ifdef OSC // defined in config.h
@@ -724,7 +868,8 @@ void stepperSetAll(int portAOn, int portBOn, int portAOff, int portBOff)
   You can read back the stepper's \b position property at any point along the way to determine where it is at a given moment.  The board
   keeps an internal count of how many steps the motor has taken in order to keep track of where it is.
 
-  For relative positioning, use the \b step property to simply move a number of steps from the current position.
+  For relative positioning, use the \b step property to simply move a number of steps from the current position,
+  or \b queue to line up moves one after another.
 	
 	\section devices Devices
 	There are 2 Stepper controllers available on the Application Board, numbered 0 & 1.
@@ -732,14 +877,24 @@ void stepperSetAll(int portAOn, int portBOn, int portAOff, int portBOff)
 	on hooking steppers up to the board.
 	
 	\section properties Properties
-	Each stepper controller has eight properties:
+	Each stepper controller has the following properties:
+  - active
   - position
   - positionrequested
   - speed
+  - rate
+  - acceleration
+  - achievedrate
   - duty
   - bipolar
   - halfstep
   - step
+  - queue
+
+  \par Active
+  The \b active property enables or disables the stepper.  A stepper must be
+  active before it will move.
+  \verbatim /stepper/0/active 1\endverbatim
 
 	\par Step
 	The \b step property simply tells the motor to take a certain number of steps.
@@ -747,6 +902,11 @@ void stepperSetAll(int portAOn, int portBOn, int portAOff, int portBOff)
 	\par
 	To take 1000 steps with the first stepper, send the message
 	\verbatim /stepper/0/step 1000\endverbatim
+
+  \par Queue
+  The \b queue property adds a move to the end of the stepper's queue, to start when 
+  the moves ahead of it have finished.  Read it to get the number of moves waiting.
+  \verbatim /stepper/0/queue 1000\endverbatim
   
   \par Position
 	The \b position property corresponds to the current step position of the stepper motor
@@ -773,13 +933,29 @@ void stepperSetAll(int portAOn, int portBOn, int portAOff, int portBOff)
   would be a step every millisecond, or 1000 steps a second.  
   \par
 	Note that not all stepper motors can be stepped quite that fast.  If you find your stepper motor acting strangely, 
-  experiment with slowing down the speed a bit.
+  experiment with slowing down the speed a bit, or giving it an acceleration.
 	\par
 	To set the speed of the first stepper to step at 100ms per step, send a message like
 	\verbatim /stepper/0/speed 100 \endverbatim
 	Adjust the argument value to one that suits your application.\n
 	Leave the argument value off to read the speed of the stepper:
 	\verbatim /stepper/0/speed \endverbatim
+
+  \par Rate
+  The \b rate property is another way to set the speed, in steps per second, and can go
+  faster than 1000 steps per second.
+  \verbatim /stepper/0/rate 2500 \endverbatim
+
+  \par Acceleration
+  The \b acceleration property sets how quickly the stepper ramps up to its speed, and back down
+  again, in steps per second per second.  0 (the default) means no ramp at all.
+  \verbatim /stepper/0/acceleration 5000 \endverbatim
+
+  \par AchievedRate
+  The \b achievedrate property is the number of steps per second the stepper has actually 
+  taken, averaged since it was last read.  Compare it to \b rate to see whether the motor
+  is getting up to speed.  This is read-only.
+  \verbatim /stepper/0/achievedrate \endverbatim
 	
   \par Duty
 	The \b duty property corresponds to the how much of the power supply is to be sent to the
@@ -805,104 +981,140 @@ void stepperSetAll(int portAOn, int portBOn, int portAOff, int portBOff)
 	This value can be both read and written.
 */
 
-#include "osc.h"
-#include "string.h"
-#include "stdio.h"
+static void stepperOscReply(OscChannel ch, char* address, int value)
+{
+  OscData d = { .type = INT, .value.i = value };
+  oscCreateMessage(ch, address, &d, 1);
+}
 
-// Need a list of property names
-// MUST end in zero
-static char* StepperOsc_Name = "stepper";
-static char* StepperOsc_PropertyNames[] = { "active", "position", "positionrequested", 
-                                            "speed", "duty", "halfstep", 
-                                            "bipolar", "step", 0 }; // must have a trailing 0
+static void stepperActiveOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  if (datalen == 1 && d[0].type == INT) {
+    if (d[0].value.i)
+      stepperEnable(idx);
+    else
+      stepperDisable(idx);
+  }
+  else if (datalen == 0)
+    stepperOscReply(ch, address, stepperEnabled(idx));
+}
 
-int StepperOsc_PropertySet( int index, int property, int value );
-int StepperOsc_PropertyGet( int index, int property );
+static void stepperPositionOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  if (datalen == 1 && d[0].type == INT)
+    stepperResetPosition(idx, d[0].value.i);
+  else if (datalen == 0)
+    stepperOscReply(ch, address, stepperPosition(idx));
+}
 
-// Returns the name of the subsystem
-const char* StepperOsc_GetName( )
+static void stepperPositionRequestedOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
 {
-  return StepperOsc_Name;
+  if (datalen == 1 && d[0].type == INT)
+    stepperSetDestination(idx, d[0].value.i);
+  else if (datalen == 0)
+    stepperOscReply(ch, address, stepperDestination(idx));
 }
 
-// Now getting a message.  This is actually a part message, with the first
-// part (the subsystem) already parsed off.
-int StepperOsc_ReceiveMessage( int channel, char* message, int length )
+static void stepperSpeedOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
 {
-  int status = Osc_IndexIntReceiverHelper( channel, message, length, 
-                                           STEPPER_COUNT, StepperOsc_Name,
-                                           StepperOsc_PropertySet, StepperOsc_PropertyGet, 
-                                           StepperOsc_PropertyNames );
+  if (datalen == 1 && d[0].type == INT)
+    stepperSetSpeed(idx, d[0].value.i);
+  else if (datalen == 0)
+    stepperOscReply(ch, address, stepperSpeed(idx));
+}
 
-  if ( status != CONTROLLER_OK )
-    return Osc_SendError( channel, StepperOsc_Name, status );
-  return CONTROLLER_OK;
+static void stepperRateOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  if (datalen == 1 && d[0].type == INT)
+    stepperSetRate(idx, d[0].value.i);
+  else if (datalen == 0)
+    stepperOscReply(ch, address, stepperRate(idx));
 }
 
-// Set the index LED, property with the value
-int StepperOsc_PropertySet( int index, int property, int value )
+static void stepperAccelerationOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
 {
-  switch ( property )
-  {
-    case 0:
-      Stepper_SetActive( index, value );
-      break;
-    case 1:
-      Stepper_SetPosition( index, value );
-      break;
-    case 2:
-      Stepper_SetPositionRequested( index, value );
-      break;
-    case 3:
-      Stepper_SetSpeed( index, value );
-      break;
-    case 4:
-      Stepper_SetDuty( index, value );
-      break;
-    case 5:
-      Stepper_SetHalfStep( index, value );
-      break;
-    case 6:
-      Stepper_SetBipolar( index, value );
-      break;
-    case 7: // step
-      Stepper_Step( index, value );
-      break;
-  }
-  return CONTROLLER_OK;
+  if (datalen == 1 && d[0].type == INT)
+    stepperSetAcceleration(idx, d[0].value.i);
+  else if (datalen == 0)
+    stepperOscReply(ch, address, stepperAcceleration(idx));
 }
 
-// Get the index LED, property
-int StepperOsc_PropertyGet( int index, int property )
+static void stepperAchievedRateOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
 {
-  int value = 0;
-  switch ( property )
-  {
-    case 0:
-      value = Stepper_GetActive( index );
-      break;
-    case 1:
-      value = Stepper_GetPosition( index );
-      break;
-    case 2:
-      value = Stepper_GetPositionRequested( index );
-      break;
-    case 3:
-      value = Stepper_GetSpeed( index );
-      break;
-    case 4:
-      value = Stepper_GetDuty( index );
-      break;
-    case 5:
-      value = Stepper_GetHalfStep( index );
-      break;
-    case 6:
-      value = Stepper_GetBipolar( index );
-      break;
-  }
-  return value;
+  UNUSED(d);
+  if (datalen == 0)
+    stepperOscReply(ch, address, stepperAchievedRate(idx));
 }
 
-#endif
+static void stepperDutyOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  if (datalen == 1 && d[0].type == INT)
+    stepperSetDuty(idx, d[0].value.i);
+  else if (datalen == 0)
+    stepperOscReply(ch, address, stepperDuty(idx));
+}
+
+static void stepperBipolarOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  if (datalen == 1 && d[0].type == INT)
+    stepperConfigure(idx, d[0].value.i, stepperHalfStep(idx));
+  else if (datalen == 0)
+    stepperOscReply(ch, address, stepperBipolar(idx));
+}
+
+static void stepperHalfStepOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  if (datalen == 1 && d[0].type == INT)
+    stepperConfigure(idx, stepperBipolar(idx), d[0].value.i);
+  else if (datalen == 0)
+    stepperOscReply(ch, address, stepperHalfStep(idx));
+}
+
+static void stepperStepOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  UNUSED(ch); UNUSED(address);
+  if (datalen == 1 && d[0].type == INT)
+    stepperStep(idx, d[0].value.i);
+}
 
+static void stepperQueueOsc(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  if (datalen == 1 && d[0].type == INT)
+    stepperQueueSteps(idx, d[0].value.i);
+  else if (datalen == 0)
+    stepperOscReply(ch, address, stepperQueuedMoves(idx));
+}
+
+static const OscNode stepperActiveNode = { .name = "active", .handler = stepperActiveOsc };
+static const OscNode stepperPositionNode = { .name = "position", .handler = stepperPositionOsc };
+static const OscNode stepperPositionRequestedNode = { .name = "positionrequested", .handler = stepperPositionRequestedOsc };
+static const OscNode stepperSpeedNode = { .name = "speed", .handler = stepperSpeedOsc };
+static const OscNode stepperRateNode = { .name = "rate", .handler = stepperRateOsc };
+static const OscNode stepperAccelerationNode = { .name = "acceleration", .handler = stepperAccelerationOsc };
+static const OscNode stepperAchievedRateNode = { .name = "achievedrate", .handler = stepperAchievedRateOsc };
+static const OscNode stepperDutyNode = { .name = "duty", .handler = stepperDutyOsc };
+static const OscNode stepperBipolarNode = { .name = "bipolar", .handler = stepperBipolarOsc };
+static const OscNode stepperHalfStepNode = { .name = "halfstep", .handler = stepperHalfStepOsc };
+static const OscNode stepperStepNode = { .name = "step", .handler = stepperStepOsc };
+static const OscNode stepperQueueNode = { .name = "queue", .handler = stepperQueueOsc };
+
+const OscNode stepperOsc = {
+  .name = "stepper",
+  .range = STEPPER_COUNT,
+  .children = {
+    &stepperActiveNode,
+    &stepperPositionNode,
+    &stepperPositionRequestedNode,
+    &stepperSpeedNode,
+    &stepperRateNode,
+    &stepperAccelerationNode,
+    &stepperAchievedRateNode,
+    &stepperDutyNode,
+    &stepperBipolarNode,
+    &stepperHalfStepNode,
+    &stepperStepNode,
+    &stepperQueueNode, 0
+  }
+};
 
+#endif // OSC
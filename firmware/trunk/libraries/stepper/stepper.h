@@ -18,6 +18,7 @@
 #ifndef STEPPER_H
 #define STEPPER_H
 
+#include "config.h"
 #include "types.h"
 
 #ifdef __cplusplus
@@ -25,6 +26,7 @@ extern "C" {
 #endif
 void stepperEnable(int stepper);
 void stepperDisable(int stepper);
+bool stepperEnabled(int stepper);
 int  stepperResetPosition(int stepper, int position);
 int  stepperPosition(int stepper);
 int  stepperSetDestination(int stepper, int destination);
@@ -32,11 +34,25 @@ int  stepperDestination(int stepper);
 int  stepperSetDuty(int stepper, int duty);
 int  stepperDuty(int stepper);
 void stepperConfigure(int stepper, bool bipolar, bool halfstep);
+bool stepperBipolar(int stepper);
+bool stepperHalfStep(int stepper);
 int  stepperSetSpeed(int stepper, int speed);
 int  stepperSpeed(int stepper);
+int  stepperSetRate(int stepper, int rate);
+int  stepperRate(int stepper);
+int  stepperAchievedRate(int stepper);
+int  stepperSetAcceleration(int stepper, int acceleration);
+int  stepperAcceleration(int stepper);
 int  stepperStep(int stepper, int steps);
+int  stepperQueueSteps(int stepper, int steps);
+int  stepperQueuedMoves(int stepper);
 #ifdef __cplusplus
 }
 #endif
 
+#ifdef OSC
+#include "osc.h"
+extern const OscNode stepperOsc;
+#endif // OSC
+
 #endif // STEPPER_H
@@ -25,6 +25,7 @@
 #include "webclient.h"
 #include "network.h"
 #include "error.h"
+#include "core.h"
 
 #ifndef WEBCLIENT_BUFFER_SIZE
 #define WEBCLIENT_BUFFER_SIZE 128
@@ -32,6 +33,7 @@
 
 static int webclientReadResponse(int s, char* buf, int size);
 static char webclientBuf[WEBCLIENT_BUFFER_SIZE];
+static TcpReader webclientReader;
 
 /**
   \defgroup webclient Web Client
@@ -158,57 +160,47 @@ int webclientPost(const char* hostname, const char* path, int port, char* data,
 
 int webclientReadResponse(int s, char* buf, int size)
 {
-  int len, bodylen = 0;
+  int len, bodylen = -1;
   bool chunked = false;
-  
+  TcpReader* r = &webclientReader;
+  tcpreaderInit(r, s);
+
   // read through the headers - figure out the content length scheme
-  while ((len = tcpReadLine(s, webclientBuf, WEBCLIENT_BUFFER_SIZE))) {
-    if (!strncasecmp(webclientBuf, "Content-Length", 14)) // check for content length
-      bodylen = atoi(&webclientBuf[16]);
+  while ((len = tcpreaderReadLine(r, webclientBuf, WEBCLIENT_BUFFER_SIZE)) > 0) {
+    if (!strncasecmp(webclientBuf, "Content-Length:", 15)) // check for content length
+      bodylen = atoi(&webclientBuf[15]);
     else if (!strncasecmp(webclientBuf, "Transfer-Encoding: chunked", 26)) // check to see if we're chunked
       chunked = true;
-    else if (strncmp(webclientBuf, "\r\n", 2) == 0) // final CRLF means end of headers
-      break;
   }
 
-  if (len <= 0)
+  if (len < 0) // cut off before the empty line at the end of the headers
     return 0;
   
   int content_read = 0;
   // read the actual response data into the caller's buffer, if there's any to grab
   if (chunked) { // first see if it's chunked
-    int chunklen = 1;
-    while (chunklen != 0 && content_read < size) {
-      len = tcpReadLine(s, webclientBuf, WEBCLIENT_BUFFER_SIZE);
-      if (siscanf(webclientBuf, "%x", &chunklen) != 1) // the first part of the chunk should indicate the chunk's length (hex)
+    int chunklen;
+    while (content_read < size) {
+      // the first part of the chunk should indicate the chunk's length (hex)
+      if (tcpreaderReadLine(r, webclientBuf, WEBCLIENT_BUFFER_SIZE) < 0 ||
+          siscanf(webclientBuf, "%x", &chunklen) != 1)
         break;
-      if (chunklen == 0) // an empty chunk indicates the end of the transfer
+      if (chunklen <= 0) // an empty chunk indicates the end of the transfer
         break;
-      if (chunklen > (size - content_read)) // make sure we have enough room to read this chunk, based on what we've already read
-        chunklen = size - content_read;
-      content_read += tcpRead(s, buf, chunklen);
-      tcpReadLine(s, webclientBuf, WEBCLIENT_BUFFER_SIZE); // slurp out the remaining newlines
-    }
-  }
-  // otherwise see if we got a content length
-  else if (bodylen > 0) {
-    while ((len = tcpRead(s, buf, size - content_read))) {
+      int toRead = MIN(chunklen, size - content_read); // only as much as there's room for
+      len = tcpreaderReadExact(r, buf + content_read, toRead);
       content_read += len;
-      buf += len;
-      if (content_read >= bodylen)
-        break;
+      if (len < chunklen)
+        break; // cut off, or out of room
+      tcpreaderReadLine(r, webclientBuf, WEBCLIENT_BUFFER_SIZE); // slurp out the remaining newline
     }
   }
+  // otherwise see if we got a content length
+  else if (bodylen >= 0)
+    content_read = tcpreaderReadExact(r, buf, MIN(bodylen, size));
   // lastly, just try to read until we get cut off
-  else {
-    while (content_read < size) {
-      len = tcpRead(s, buf, size - content_read);
-      if (len <= 0)
-        break;
-      content_read += len;
-      buf += len;
-    }
-  }
+  else
+    content_read = tcpreaderReadExact(r, buf, size);
   return content_read;
 }
 
@@ -0,0 +1,292 @@
+/*********************************************************************************
+
+ Copyright 2006-2010 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+#include "config.h"
+#if defined(MAKE_CTRL_NETWORK) && defined(OSC)
+
+#include "webosc.h"
+#include "core.h"
+#include "osc.h"
+#include "json.h"
+#include <string.h>
+#include <ctype.h>
+
+#ifndef WEBOSC_BUFFER_SIZE
+#define WEBOSC_BUFFER_SIZE 128
+#endif
+
+#ifndef WEBOSC_MAX_ARGS
+#define WEBOSC_MAX_ARGS 8
+#endif
+
+typedef struct WebOsc_t {
+  Mutex lock;             // one request at a time, since there's one of everything below
+  int socket;
+  bool started;           // the headers and the opening brace have gone out
+  bool failed;            // the connection's gone - don't write any more of the response
+  JsonWriter jw;
+  JsonReader jr;
+  OscData args[WEBOSC_MAX_ARGS];
+  int argCount;
+  char buf[WEBOSC_BUFFER_SIZE];
+} WebOsc;
+
+static WebOsc webosc = {
+  .lock = _MUTEX_DATA(webosc.lock)
+};
+
+static bool weboscRequest(int socket, HttpMethod method, char* path, char* body, int bodylen);
+static void weboscReply(void* context, const char* address, OscData data[], int datalen);
+static bool weboscStart(void);
+static bool weboscValue(const OscData* d);
+static bool weboscFlush(void* context, const char* data, int length);
+static bool weboscParseArgs(char* body, int bodylen);
+static void weboscUnescape(char* s);
+
+/**
+  \defgroup webosc Web OSC
+  Get at the board's OSC system over HTTP.
+
+  Anything you can do with OSC over UDP or USB, you can do with a web request - handy for
+  scripts and tools that speak HTTP rather than OSC.  Add weboscHandler to the web server,
+  and the OSC address goes after /osc in the URL:
+  \code
+  webserverAddHandler(&weboscHandler);
+  webserverEnable(YES, 80);
+  \endcode
+
+  A GET request is an OSC query - a message with no arguments.  Whatever the board sends back
+  comes in a JSON object, keyed by address.  Patterns work just like they do in OSC, and
+  an address ending in / lists what's underneath it.  (curl needs -g to leave the brackets
+  alone - a browser doesn't mind them.)
+  \code
+  $ curl -g http://192.168.0.200/osc/analogin/[0-7]/value
+  {"/analogin/0/value":512,"/analogin/1/value":0, ... }
+  \endcode
+
+  To send a message with arguments, POST (or PUT) them as JSON - a single value, or an array.
+  Strings and numbers are passed along as they are, and true and false become 1 and 0.
+  \code
+  $ curl -d 1023 http://192.168.0.200/osc/pwmout/0/duty
+  $ curl -d '[1, 2.5, "three"]' http://192.168.0.200/osc/some/handler
+  \endcode
+  Up to \b WEBOSC_MAX_ARGS arguments can be sent - 8 by default.
+
+  The response is written out as the replies come in, in chunks, so a pattern that matches
+  a lot of handlers doesn't need any more memory than one that matches a single handler.
+  If nothing matches the address, the response is a 404.
+
+  \section Threads
+  The OSC handlers run on the web server's worker threads, which by default have as much
+  stack as the OSC threads - if you've made \b WEBSERVER_STACK_SIZE smaller in your config.h,
+  keep it at 1536 or more.  Requests are handled one at a time.
+  \ingroup networking
+  @{
+*/
+
+/**
+  A web server handler that passes requests for /osc/... on to the OSC system.
+  Add it with webserverAddHandler().
+*/
+WebHandler weboscHandler = {
+  .address = "/osc/",
+  .onRequest = weboscRequest
+};
+
+/** @}
+*/
+
+static bool weboscRequest(int socket, HttpMethod method, char* path, char* body, int bodylen)
+{
+  char* address = path + 4; // keep the / after "/osc"
+  char* query = strchr(address, '?');
+  if (query != 0)
+    *query = 0;
+  weboscUnescape(address); // braces and brackets in patterns get escaped
+
+  bool responded = true;
+  chMtxLock(&webosc.lock);
+  webosc.socket = socket;
+  webosc.started = false;
+  webosc.failed = false;
+  webosc.argCount = 0;
+  if (method == HTTP_POST || method == HTTP_PUT) {
+    if (!weboscParseArgs(body, bodylen)) {
+      webserverWriteHeader(socket, 400, 0, 0);
+      chMtxUnlock();
+      return true;
+    }
+  }
+  else if (method != HTTP_GET) {
+    chMtxUnlock();
+    return false;
+  }
+
+  jsonwriterInit(&webosc.jw, webosc.buf, sizeof(webosc.buf));
+  jsonwriterSetFlush(&webosc.jw, weboscFlush, 0);
+  bool matched = oscDispatch(address, webosc.args, webosc.argCount, weboscReply, 0);
+  if (matched || webosc.started) {
+    if (weboscStart() && jsonwriterObjectClose(&webosc.jw)) // start it in case nothing replied
+      jsonwriterFlush(&webosc.jw);
+  }
+  else
+    responded = false; // nothing there - let the server send a 404
+  chMtxUnlock();
+  return responded;
+}
+
+/*
+  Called with each message the handlers create, while they're being
+  dispatched.  Out it goes, straight away.
+*/
+static void weboscReply(void* context, const char* address, OscData data[], int datalen)
+{
+  int i;
+  UNUSED(context);
+  if (webosc.failed)
+    return;
+  bool ok = weboscStart() && jsonwriterObjectKey(&webosc.jw, address) != 0;
+  if (datalen == 1)
+    ok = ok && weboscValue(&data[0]);
+  else {
+    ok = ok && jsonwriterArrayOpen(&webosc.jw) != 0;
+    for (i = 0; ok && i < datalen; i++)
+      ok = weboscValue(&data[i]);
+    ok = ok && jsonwriterArrayClose(&webosc.jw) != 0;
+  }
+  if (!ok)
+    webosc.failed = true;
+}
+
+// the headers don't go out until there's something to say, since it might be a 404
+static bool weboscStart()
+{
+  if (!webosc.started) {
+    webosc.started = true;
+    if (!webserverWriteHeader(webosc.socket, 200, "application/json", -1) ||
+        !jsonwriterObjectOpen(&webosc.jw))
+      webosc.failed = true;
+  }
+  return !webosc.failed;
+}
+
+static bool weboscValue(const OscData* d)
+{
+  switch (d->type) {
+    case INT:
+      return jsonwriterInt(&webosc.jw, d->value.i) != 0;
+    case FLOAT:
+      return jsonwriterFloat(&webosc.jw, d->value.f) != 0;
+    case STRING: // long ones are streamed out, so this only fails if the connection does
+      return jsonwriterString(&webosc.jw, d->value.s) != 0;
+    case BLOB:
+      return jsonwriterString(&webosc.jw, "") != 0; // no length to go on
+  }
+  return false;
+}
+
+static bool weboscFlush(void* context, const char* data, int length)
+{
+  UNUSED(context);
+  return webserverWrite(webosc.socket, data, length) == length;
+}
+
+/*
+  JsonReader handlers, to collect the arguments from a POST body.
+*/
+
+static OscData* weboscNextArg(void)
+{
+  return (webosc.argCount < WEBOSC_MAX_ARGS) ? &webosc.args[webosc.argCount++] : 0;
+}
+
+static bool weboscIntArg(void* ctx, int value)
+{
+  UNUSED(ctx);
+  OscData* d = weboscNextArg();
+  if (d == 0)
+    return false;
+  d->type = INT;
+  d->value.i = value;
+  return true;
+}
+
+static bool weboscFloatArg(void* ctx, float value)
+{
+  UNUSED(ctx);
+  OscData* d = weboscNextArg();
+  if (d == 0)
+    return false;
+  d->type = FLOAT;
+  d->value.f = value;
+  return true;
+}
+
+static bool weboscBoolArg(void* ctx, bool value)
+{
+  return weboscIntArg(ctx, value ? 1 : 0);
+}
+
+// the reader has already null-terminated the string in the body
+static bool weboscStringArg(void* ctx, char* string, int len)
+{
+  UNUSED(ctx); UNUSED(len);
+  OscData* d = weboscNextArg();
+  if (d == 0)
+    return false;
+  d->type = STRING;
+  d->value.s = string;
+  return true;
+}
+
+static bool weboscParseArgs(char* body, int bodylen)
+{
+  if (body == 0 || bodylen == 0)
+    return true;
+  jsonreaderInit(&webosc.jr, 0, true);
+  webosc.jr.int_handler = weboscIntArg;
+  webosc.jr.float_handler = weboscFloatArg;
+  webosc.jr.bool_handler = weboscBoolArg;
+  webosc.jr.string_handler = weboscStringArg;
+  return jsonreaderGo(&webosc.jr, body, bodylen);
+}
+
+static int weboscHexValue(char c)
+{
+  if (isdigit((int)c))
+    return c - '0';
+  c = tolower((int)c);
+  return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+// undo %XX escapes in place
+static void weboscUnescape(char* s)
+{
+  char* out = s;
+  while (*s) {
+    int hi, lo;
+    if (*s == '%' && (hi = weboscHexValue(s[1])) >= 0 && (lo = weboscHexValue(s[2])) >= 0) {
+      *out++ = (char)((hi << 4) | lo);
+      s += 3;
+    }
+    else
+      *out++ = *s++;
+  }
+  *out = 0;
+}
+
+#endif // MAKE_CTRL_NETWORK && OSC
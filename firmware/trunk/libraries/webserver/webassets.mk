@@ -0,0 +1,11 @@
+# Pack a directory of web files into a C file, for the webserver to serve
+# out of flash.  Set WEBASSETS to the directory before including this, then
+# add $(WEBASSETSSRC) to CSRC.  The table is called webAssets - pass it to
+# webserverAddAssets().  The C file goes next to the Makefile, so the usual
+# rules find it, and is made again whenever one of the files changes.
+
+WEBASSETSSRC = webassets.c
+WEBPACK = python $(LIBRARIES)/webserver/webpack.py
+
+$(WEBASSETSSRC): $(shell find $(WEBASSETS) -type f ! -name '.*') $(LIBRARIES)/webserver/webpack.py
+	@$(WEBPACK) $(WEBASSETS) $@
@@ -0,0 +1,131 @@
+#!/usr/bin/env python
+#
+# Copyright 2006-2010 MakingThings
+#
+# Licensed under the Apache License,
+# Version 2.0 (the "License"); you may not use this file except in compliance
+# with the License. You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software distributed
+# under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+# CONDITIONS OF ANY KIND, either express or implied. See the License for
+# the specific language governing permissions and limitations under the License.
+
+"""
+Pack a directory of web files into a C file, for the webserver library to
+serve out of flash - see webserverAddAssets().
+
+  usage: webpack.py [--name webAssets] <directory> <output.c>
+
+Text files are gzip-compressed when that makes them smaller.  Each file
+gets an ETag from a hash of what's stored, so it only changes when the
+file does.  Files and directories starting with a . are left out.
+"""
+
+import gzip
+import hashlib
+import io
+import os
+import sys
+
+CONTENT_TYPES = {
+  ".html": "text/html",
+  ".htm":  "text/html",
+  ".css":  "text/css",
+  ".js":   "application/javascript",
+  ".json": "application/json",
+  ".txt":  "text/plain",
+  ".xml":  "text/xml",
+  ".svg":  "image/svg+xml",
+  ".png":  "image/png",
+  ".jpg":  "image/jpeg",
+  ".jpeg": "image/jpeg",
+  ".gif":  "image/gif",
+  ".ico":  "image/x-icon",
+}
+
+# already compressed, so gzip would only make them bigger
+INCOMPRESSIBLE = (".png", ".jpg", ".jpeg", ".gif", ".ico")
+
+def compress(data):
+  out = io.BytesIO()
+  # no file name or time in the header, so the output only depends on the input
+  f = gzip.GzipFile(filename="", mode="wb", compresslevel=9, fileobj=out, mtime=0)
+  f.write(data)
+  f.close()
+  return out.getvalue()
+
+def collect(root):
+  assets = []
+  for dirpath, dirnames, filenames in os.walk(root):
+    dirnames[:] = sorted(d for d in dirnames if not d.startswith("."))
+    for name in sorted(filenames):
+      if name.startswith("."):
+        continue
+      path = os.path.join(dirpath, name)
+      url = "/" + os.path.relpath(path, root).replace(os.sep, "/")
+      assets.append((url, path))
+  return assets
+
+def cbytes(data):
+  lines = []
+  for i in range(0, len(data), 16):
+    lines.append("  " + ", ".join("0x%02x" % b for b in bytearray(data[i:i + 16])) + ",")
+  return "\n".join(lines)
+
+def pack(root, output, name):
+  out = []
+  out.append("/* Generated by webpack.py from %s - don't edit, it gets overwritten. */" % root)
+  out.append("")
+  out.append('#include "webserver.h"')
+  out.append("")
+
+  entries = []
+  for i, (url, path) in enumerate(collect(root)):
+    f = open(path, "rb")
+    data = f.read()
+    f.close()
+    ext = os.path.splitext(path)[1].lower()
+    gzipped = False
+    if ext not in INCOMPRESSIBLE:
+      packed = compress(data)
+      if len(packed) < len(data):
+        data = packed
+        gzipped = True
+    etag = hashlib.sha1(data).hexdigest()[:8]
+    ctype = CONTENT_TYPES.get(ext, "application/octet-stream")
+    out.append("// %s - %d bytes%s" % (url, len(data), " gzipped" if gzipped else ""))
+    out.append("static const char asset%d[] = {" % i)
+    out.append(cbytes(data))
+    out.append("};")
+    out.append("")
+    entries.append('  { "%s", "%s", "\\"%s\\"", asset%d, %d, %s },'
+                   % (url, ctype, etag, i, len(data), "true" if gzipped else "false"))
+
+  out.append("const WebAsset %s[] = {" % name)
+  out.extend(entries)
+  out.append("  { 0, 0, 0, 0, 0, false }")
+  out.append("};")
+  out.append("")
+
+  f = open(output, "w")
+  f.write("\n".join(out))
+  f.close()
+  return len(entries)
+
+def main(args):
+  name = "webAssets"
+  if len(args) >= 2 and args[0] == "--name":
+    name = args[1]
+    args = args[2:]
+  if len(args) != 2:
+    sys.stderr.write(__doc__)
+    return 1
+  count = pack(args[0], args[1], name)
+  print("webpack: %d files from %s into %s" % (count, args[0], args[1]))
+  return 0
+
+if __name__ == "__main__":
+  sys.exit(main(sys.argv[1:]))
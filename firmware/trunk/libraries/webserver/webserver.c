@@ -24,31 +24,119 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stdio.h>
+#include <stdarg.h>
 
 #ifndef WEBSERVER_STACK_SIZE
-#define WEBSERVER_STACK_SIZE 512
+#define WEBSERVER_STACK_SIZE 1536
+#endif
+
+#ifndef WEBSERVER_ACCEPT_STACK_SIZE
+#define WEBSERVER_ACCEPT_STACK_SIZE 256
+#endif
+
+#ifndef WEBSERVER_WORKERS
+#define WEBSERVER_WORKERS 2
+#endif
+
+#ifndef WEBSERVER_TIMEOUT
+#define WEBSERVER_TIMEOUT 3000 // milliseconds
+#endif
+
+#ifndef WEBSERVER_KEEPALIVE_MAX
+#define WEBSERVER_KEEPALIVE_MAX 100
 #endif
 
 #ifndef REQUEST_SIZE_MAX
 #define REQUEST_SIZE_MAX 256
 #endif
 
-static WORKING_AREA(webserverWA, WEBSERVER_STACK_SIZE);
-static msg_t webServerLoop(void *arg);
+#ifndef RESPONSE_HEADER_SIZE_MAX
+#define RESPONSE_HEADER_SIZE_MAX 256
+#endif
+
+#ifndef ETAG_SIZE_MAX
+#define ETAG_SIZE_MAX 48
+#endif
+
+// how the response to the current request is delimited
+typedef enum {
+  RESPONSE_UNFRAMED,  // by closing the connection
+  RESPONSE_LENGTH,    // by a Content-Length header
+  RESPONSE_CHUNKED    // by chunked transfer encoding
+} ResponseFraming;
+
+typedef struct WebConnection_t {
+  Thread* thd;
+  int socket;               // -1 while this worker is idle
+  bool http11;              // the client speaks HTTP/1.1
+  bool keepAlive;           // the client would like to keep the connection open
+  HttpMethod method;
+  ResponseFraming framing;
+  int rangeFirst;           // from the Range header - -1 if it's missing
+  int rangeLast;
+  char ifNoneMatch[ETAG_SIZE_MAX];
+  TcpReader reader;         // kept for the life of the connection, since it may have read ahead
+  char line[REQUEST_SIZE_MAX]; // the request line - the path points in here
+  char buf[REQUEST_SIZE_MAX];  // headers, then the body
+} WebConnection;
+
+static WORKING_AREA(webserverWA, WEBSERVER_ACCEPT_STACK_SIZE);
+static WORKING_AREA(webserverWorkerWA[WEBSERVER_WORKERS], WEBSERVER_STACK_SIZE);
+static msg_t webserverAcceptLoop(void *arg);
+static msg_t webserverWorker(void *arg);
 
 typedef struct WebServer_t {
   Thread* thd;
-  uint32_t hits;
   int port;
-  char buf[REQUEST_SIZE_MAX];
   WebHandler* handlers;
+  const WebAsset* assets;   // served by webserverAssetHandler
+  WebConnection connections[WEBSERVER_WORKERS];
+  Mailbox pending;          // accepted sockets, waiting for a worker
+  msg_t pendingBuf[WEBSERVER_WORKERS];
+  Stat requests;
+  Stat requestRate;
+  Stat accepted;
+  Stat active;
+  Stat assetBytes;
+  Stat notModified;
+  uint32_t rateCount;       // webserver.requests as of the last rate update
+  systime_t rateTime;
 } WebServer;
 
-static WebServer webserver;
-
-static void webserverProcessRequest(int socket);
-static char* webserverGetRequestAddress(int socket, char* request, int length, HttpMethod* method);
-static int webserverGetBody(int socket, char* requestBuffer, int maxSize);
+static void webserverRequestRate(Stat* s);
+static void webserverActive(Stat* s);
+
+static WebServer webserver = {
+  .requests = { .name = "webserver.requests" },
+  .requestRate = { .name = "webserver.requests.rate", .update = webserverRequestRate },
+  .accepted = { .name = "webserver.connections" },
+  .active = { .name = "webserver.connections.active", .update = webserverActive },
+  .assetBytes = { .name = "webserver.assets.bytes" },
+  .notModified = { .name = "webserver.assets.notmodified" }
+};
+
+static void webserverServe(WebConnection* conn);
+static bool webserverProcessRequest(WebConnection* conn);
+static char* webserverGetRequestAddress(WebConnection* conn, HttpMethod* method);
+static int webserverReadHeaders(WebConnection* conn);
+static void webserverParseRange(WebConnection* conn, const char* value);
+static int webserverGetBody(WebConnection* conn, int contentLength);
+static WebConnection* webserverFindConnection(int socket);
+static const char* webserverReason(int code);
+static int webserverBeginHeader(int socket, char* buf, int size, int code, const char* contentType, int contentLength);
+static bool webserverEndHeader(int socket, char* buf, int size, int len);
+static int webserverAppend(char* buf, int size, int len, const char* format, ...);
+static bool webserverStatsRequest(int socket, HttpMethod method, char* path, char* body, int bodylen);
+static bool webserverAssetRequest(int socket, HttpMethod method, char* path, char* body, int bodylen);
+static const WebAsset* webserverFindAsset(const char* path);
+static bool webserverEtagMatches(const char* ifNoneMatch, const char* etag);
+static int webserverRange(WebConnection* conn, int total, int* first, int* count);
+
+static WebHandler webserverAssetHandler = {
+  .address = "/",
+  .onRequest = webserverAssetRequest
+};
 
 /**
   \defgroup webserver Web Server
@@ -62,15 +150,12 @@ static int webserverGetBody(int socket, char* requestBuffer, int maxSize);
   address path and, in the case of a POST or PUT request, the body of the request.  You can use this
   information to determine what kind of action to take, and what kind of response to send.
 
-  To respond, simply start writing to the socket passed into the handler.  Proper HTTP responses start
-  with a status - you can use webserverSetStatusOK() to send a default OK status, or webserverSetStatusCode()
-  for something more specific.  If you just want to print something out to a web browser though, you can
-  usually omit this.
-
-  After that, write out whatever data you like via the socket and you're all set.
+  To respond, start with webserverWriteHeader() to send the status, the content type and, if you know it,
+  the length of what's to follow.  Then write out whatever data you like with webserverWrite().
   Remember that you can write it out a chunk at a time - you don't need to send it all at once.
   If you have responded to a request, return true from your handler and the web server will stop
-  processing the request.  Otherwise, it will continue to look for other responders.
+  processing the request.  Otherwise, it will continue to look for other responders.  If nobody
+  responds, the browser gets a 404.
 
   For more info about HTTP, check the <A HREF="http://en.wikipedia.org/wiki/Hypertext_Transfer_Protocol">Wikipedia article</A>.
 
@@ -79,7 +164,8 @@ static int webserverGetBody(int socket, char* requestBuffer, int maxSize);
   bool handlerFunction(int socket, HttpMethod method, char* path, char* body, int bodylen)
   {
     if (method == HTTP_GET) {
-      tcpWrite(socket, "hi there", strlen("hi there"));
+      webserverWriteHeader(socket, 200, "text/plain", strlen("hi there"));
+      webserverWrite(socket, "hi there", strlen("hi there"));
       return true; // indicate that we responded
     }
     else {
@@ -97,10 +183,56 @@ static int webserverGetBody(int socket, char* requestBuffer, int maxSize);
   // when a request comes in that starts with /simple, handlerFunction() will be called
   \endcode
 
+  \section Connections
+  Several connections are served at once, each by its own worker thread, so one slow browser
+  doesn't hold up everybody else.  HTTP/1.1 clients can keep a connection open and send
+  several requests down it, one after the other, as long as the server can tell where each
+  response ends.  That's the case if the handler passes a length to webserverWriteHeader(),
+  or passes -1 and writes the response with webserverWrite(), which sends it in chunks.
+  Handlers that write their response straight to the socket still work - the connection is
+  just closed afterwards, like it always was.
+
+  A connection that sits idle for \b WEBSERVER_TIMEOUT milliseconds (3000 by default) is closed.
+  The \ref stats include \b webserver.requests, \b webserver.requests.rate (per second),
+  \b webserver.connections and \b webserver.connections.active.
+
+  \section StaticFiles Static Files
+  A web page of any size is easier to write as files than as handlers - HTML, scripts, style sheets
+  and images, as you'd put on any other web server.  webpack.py (next to webserver.c) packs a
+  directory of them into a C file, which is compiled into your program, so the files end up in flash
+  alongside the code.  Include webassets.mk in your Makefile to have it done as part of the build:
+  \code
+  WEBASSETS = www
+  include $(LIBRARIES)/webserver/webassets.mk
+  # ...and add $(WEBASSETSSRC) to CSRC
+  \endcode
+  Then hand the table to the web server:
+  \code
+  extern const WebAsset webAssets[];
+  webserverAddAssets(webAssets);
+  \endcode
+  Text files are stored gzip-compressed, so they take up less flash and go out in fewer packets - browsers
+  unpack them as they arrive.  There's no room to unpack them on the board, so they're sent that way
+  even to a client that doesn't say it accepts gzip, but every browser does.  Each file gets an ETag, a hash of its contents, so a browser that already has
+  a copy gets a short 304 Not Modified instead of the whole thing, and requests for part of a file (with a
+  Range header) get just that part.  A request for a directory, like /, gets its index.html.
+  The \ref stats include \b webserver.assets.bytes and \b webserver.assets.notmodified.
+
+  \section Stats
+  webserverStatsHandler serves up the board's \ref stats as a JSON object, like
+  \code {"osc.usb.in":12,"usb.tx.bytes":3456} \endcode
+  at /stats - just add it along with any handlers of your own.
+  \code
+  webserverAddHandler(&webserverStatsHandler);
+  \endcode
+
   \section Configuration
-  The web server runs as its own thread.  If you find that you need to change the stack size
-  for the web server thread, you can define \b WEBSERVER_STACK_SIZE in your config.h.  The
-  default value is 512.
+  There are \b WEBSERVER_WORKERS worker threads (2 by default), which is how many connections can
+  be served at once.  Each one needs a netconn of its own, so make sure \b MEMP_NUM_NETCONN leaves
+  room for them.  Handlers run on the workers, and headers are put together on their stacks, so
+  each one gets as much stack as the OSC threads.  If you find that you need to change the stack
+  size of the worker threads, you can define \b WEBSERVER_STACK_SIZE in your config.h.  The
+  default value is 1536.
   \ingroup networking
   @{
 */
@@ -117,16 +249,47 @@ static int webserverGetBody(int socket, char* requestBuffer, int maxSize);
 */
 bool webserverEnable(bool on, int port)
 {
+  int i;
   if (on && webserver.thd == 0) {
-    webserver.hits = 0;
+    statsAdd(&webserver.requests);
+    statsAdd(&webserver.requestRate);
+    statsAdd(&webserver.accepted);
+    statsAdd(&webserver.active);
+    webserver.rateCount = webserver.requests.value;
+    webserver.rateTime = chTimeNow();
+
+    chMBInit(&webserver.pending, webserver.pendingBuf, WEBSERVER_WORKERS);
+    for (i = 0; i < WEBSERVER_WORKERS; i++) {
+      WebConnection* conn = &webserver.connections[i];
+      conn->socket = -1;
+      conn->thd = chThdCreateStatic(webserverWorkerWA[i], sizeof(webserverWorkerWA[i]), NORMALPRIO, webserverWorker, conn);
+      systemRegisterThread(conn->thd, "webworker", sizeof(webserverWorkerWA[i]));
+    }
     webserver.port = port;
-    webserver.thd = chThdCreateStatic(webserverWA, sizeof(webserverWA), NORMALPRIO, webServerLoop, &webserver.port);
+    webserver.thd = chThdCreateStatic(webserverWA, sizeof(webserverWA), NORMALPRIO, webserverAcceptLoop, &webserver.port);
+    systemRegisterThread(webserver.thd, "webserver", sizeof(webserverWA));
     return true;
   }
   else if (webserver.thd != 0) {
+    msg_t client;
     chThdTerminate(webserver.thd);
     chThdWait(webserver.thd);
     webserver.thd = 0;
+    // close connections that were accepted but never got to a worker,
+    // which also leaves room in the mailbox for the wake-ups below
+    while (chMBFetch(&webserver.pending, &client, TIME_IMMEDIATE) == RDY_OK) {
+      if (client >= 0)
+        tcpClose(client);
+    }
+    for (i = 0; i < WEBSERVER_WORKERS; i++) {
+      chThdTerminate(webserver.connections[i].thd);
+      chMBPost(&webserver.pending, -1, TIME_INFINITE); // wake it up, so it notices
+    }
+    for (i = 0; i < WEBSERVER_WORKERS; i++) {
+      chThdWait(webserver.connections[i].thd);
+      webserver.connections[i].thd = 0;
+    }
+    chMBReset(&webserver.pending); // wake-ups left over by workers that were busy
     return true;
   }
   return false;
@@ -150,69 +313,383 @@ void webserverAddHandler(WebHandler* handler)
   }
 }
 
+/**
+  Serve a table of files from flash.
+  The table is generated by webpack.py - see \ref StaticFiles.  Files are looked up after the handlers
+  added before this, so your own handlers can stand in for any of them.  Calling it again replaces the table.
+  @param assets The table of files, ending with an entry whose path is 0.
+
+  \b Example
+  \code
+  extern const WebAsset webAssets[];
+  webserverAddAssets(webAssets);
+  \endcode
+*/
+void webserverAddAssets(const WebAsset* assets)
+{
+  if (webserver.assets == 0) {
+    statsAdd(&webserver.assetBytes);
+    statsAdd(&webserver.notModified);
+    webserverAddHandler(&webserverAssetHandler);
+  }
+  webserver.assets = assets;
+}
+
+/**
+  Start the response to a request.
+  This sends the status line and headers - follow it with the response itself, via webserverWrite().
+
+  If you know how long the response will be, pass it as \b contentLength, and the client can send
+  another request down the same connection once it's got that much.  Otherwise, pass -1 - HTTP/1.1
+  clients get the response in chunks, which works just as well, and older ones get it until the
+  connection is closed.
+  @param socket The socket passed into your handler.
+  @param code The HTTP status code - 200 for OK, 404 for Not Found, etc.
+  @param contentType The MIME type of the response, like "text/html" - or 0 to leave it out.
+  @param contentLength How many bytes of response will follow, or -1 if you don't know yet.
+  @return True if the headers were sent.
+
+  \b Example
+  \code
+  webserverWriteHeader(socket, 200, "application/json", -1);
+  \endcode
+*/
+bool webserverWriteHeader(int socket, int code, const char* contentType, int contentLength)
+{
+  char buf[RESPONSE_HEADER_SIZE_MAX];
+  int len = webserverBeginHeader(socket, buf, sizeof(buf), code, contentType, contentLength);
+  return webserverEndHeader(socket, buf, sizeof(buf), len);
+}
+
+/**
+  Write part of the response to a request.
+  Call webserverWriteHeader() first.  If the response is being sent in chunks, this takes
+  care of that - otherwise, it's just like tcpWrite().
+  @param socket The socket passed into your handler.
+  @param data The data to write.
+  @param length How many bytes of data there are.
+  @return The number of bytes of data written.
+*/
+int webserverWrite(int socket, const char* data, int length)
+{
+  WebConnection* conn = webserverFindConnection(socket);
+  if (conn && conn->method == HTTP_HEAD)
+    return length; // just the headers, thanks
+  if (conn == 0 || conn->framing != RESPONSE_CHUNKED)
+    return tcpWrite(socket, data, length);
+  if (length <= 0)
+    return 0; // an empty chunk would end the response
+  char size[12];
+  int n = sniprintf(size, sizeof(size), "%x\r\n", length);
+  if (tcpWrite(socket, size, n) != n)
+    return 0;
+  int written = tcpWrite(socket, data, length);
+  tcpWrite(socket, "\r\n", 2);
+  return written;
+}
+
+/**
+  Send a status line.
+  The connection is closed once the request has been handled, so anything can follow - usually
+  a Content-Type header and a blank line, then the response.  webserverWriteHeader() does more
+  of the work for you, and lets the client keep the connection open.
+  @param socket The socket passed into your handler.
+  @param code The HTTP status code.
+*/
+void webserverSetStatusCode(int socket, int code)
+{
+  char buf[48];
+  WebConnection* conn = webserverFindConnection(socket);
+  if (conn) {
+    conn->framing = RESPONSE_UNFRAMED;
+    conn->keepAlive = false;
+  }
+  int len = sniprintf(buf, sizeof(buf), "HTTP/1.0 %d %s\r\n", code, webserverReason(code));
+  tcpWrite(socket, buf, len);
+}
+
+/**
+  Send a 200 OK status line.
+  @param socket The socket passed into your handler.
+  @see webserverSetStatusCode()
+*/
+void webserverSetStatusOK(int socket)
+{
+  webserverSetStatusCode(socket, 200);
+}
+
+/**
+  A handler that responds to GET requests for /stats with the board's
+  \ref stats, as a JSON object.
+*/
+WebHandler webserverStatsHandler = {
+  .address = "/stats",
+  .onRequest = webserverStatsRequest
+};
+
 /** @}
 */
 
+/*
+  Write out the stats a few at a time, so each one doesn't go out
+  in its own segment.
+*/
+static bool webserverStatsRequest(int socket, HttpMethod method, char* path, char* body, int bodylen)
+{
+  UNUSED(path); UNUSED(body); UNUSED(bodylen);
+  if (method != HTTP_GET)
+    return false;
+
+  webserverWriteHeader(socket, 200, "application/json", -1);
+
+  char buf[128];
+  int len = 0;
+  char sep = '{';
+  Stat* s;
+  for (s = statsRead(); s != 0; s = s->next) {
+    char item[64];
+    int n = sniprintf(item, sizeof(item), "%c\"%s\":%lu", sep, s->name, (unsigned long)s->value);
+    if (n >= (int)sizeof(item))
+      continue; // name's too long to report
+    if (len + n > (int)sizeof(buf) - 2) { // leave room for the closing brace
+      webserverWrite(socket, buf, len);
+      len = 0;
+    }
+    memcpy(buf + len, item, n);
+    len += n;
+    sep = ',';
+  }
+  if (sep == '{')
+    buf[len++] = '{';
+  buf[len++] = '}';
+  webserverWrite(socket, buf, len);
+  return true;
+}
+
+/*
+  Serve a file from the asset table - all of it, part of it, or just word
+  that the copy the client already has is still good.  The contents go
+  from flash straight into lwIP's segments, in one go.
+*/
+static bool webserverAssetRequest(int socket, HttpMethod method, char* path, char* body, int bodylen)
+{
+  UNUSED(body); UNUSED(bodylen);
+  if (method != HTTP_GET && method != HTTP_HEAD)
+    return false;
+  WebConnection* conn = webserverFindConnection(socket);
+  const WebAsset* asset = webserverFindAsset(path);
+  if (conn == 0 || asset == 0)
+    return false;
+
+  char buf[RESPONSE_HEADER_SIZE_MAX];
+  int len;
+  if (webserverEtagMatches(conn->ifNoneMatch, asset->etag)) {
+    statInc(&webserver.notModified);
+    len = webserverBeginHeader(socket, buf, sizeof(buf), 304, 0, 0);
+    len = webserverAppend(buf, sizeof(buf), len, "ETag: %s\r\n", asset->etag);
+    webserverEndHeader(socket, buf, sizeof(buf), len);
+    return true;
+  }
+
+  int first, count;
+  int code = webserverRange(conn, asset->length, &first, &count);
+  if (code == 416) {
+    len = webserverBeginHeader(socket, buf, sizeof(buf), code, 0, 0);
+    len = webserverAppend(buf, sizeof(buf), len, "Content-Range: bytes */%d\r\n", asset->length);
+    webserverEndHeader(socket, buf, sizeof(buf), len);
+    return true;
+  }
+
+  len = webserverBeginHeader(socket, buf, sizeof(buf), code, asset->contentType, count);
+  len = webserverAppend(buf, sizeof(buf), len, "ETag: %s\r\nAccept-Ranges: bytes\r\n", asset->etag);
+  if (asset->gzipped)
+    len = webserverAppend(buf, sizeof(buf), len, "Content-Encoding: gzip\r\n");
+  if (code == 206)
+    len = webserverAppend(buf, sizeof(buf), len, "Content-Range: bytes %d-%d/%d\r\n",
+                                                 first, first + count - 1, asset->length);
+  if (webserverEndHeader(socket, buf, sizeof(buf), len) && method == HTTP_GET && count > 0) {
+    if (tcpWrite(socket, asset->data + first, count) == count)
+      statAdd(&webserver.assetBytes, count);
+    else
+      conn->keepAlive = false; // the client won't know where this response ends
+  }
+  return true;
+}
+
+/*
+  Look up a path in the asset table.  Anything after a ? is ignored, and
+  a directory gets its index.html.
+*/
+static const WebAsset* webserverFindAsset(const char* path)
+{
+  const WebAsset* asset;
+  int len = strcspn(path, "?#");
+  bool directory = (len > 0 && path[len - 1] == '/');
+  for (asset = webserver.assets; asset != 0 && asset->path != 0; asset++) {
+    if (strncmp(asset->path, path, len) != 0)
+      continue;
+    const char* rest = asset->path + len;
+    if (*rest == 0 || (directory && strcmp(rest, "index.html") == 0))
+      return asset;
+  }
+  return 0;
+}
+
+// If-None-Match can have a list of ETags, or * for any at all
+static bool webserverEtagMatches(const char* ifNoneMatch, const char* etag)
+{
+  if (*ifNoneMatch == 0)
+    return false;
+  return (strcmp(ifNoneMatch, "*") == 0 || strstr(ifNoneMatch, etag) != 0);
+}
+
+/*
+  Work out which part of a file of the given size to send, given the
+  request's Range header.  Returns 200 for all of it, 206 for the part in
+  first and count, or 416 if the range is entirely past the end.
+*/
+static int webserverRange(WebConnection* conn, int total, int* first, int* count)
+{
+  int start = conn->rangeFirst;
+  int end = conn->rangeLast;
+  *first = 0;
+  *count = total;
+  if (start < 0 && end < 0)
+    return 200;
+  if (start < 0) { // the last so many bytes
+    if (end == 0)
+      return 416;
+    start = MAX(total - end, 0);
+    end = total - 1;
+  }
+  else {
+    if (end >= 0 && end < start)
+      return 200; // not a valid range, so it's ignored
+    if (start >= total)
+      return 416;
+    if (end < 0 || end >= total)
+      end = total - 1;
+  }
+  *first = start;
+  *count = end - start + 1;
+  return 206;
+}
+
 /*
   Wait for new connections (making sure we're listening on the right port)
-  and then dispatch them to processRequest()
+  and pass them on to the workers.  If they're all busy, new connections
+  wait in the mailbox, then in lwIP's backlog.
 */
-msg_t webServerLoop(void *arg)
+static msg_t webserverAcceptLoop(void *arg)
 {
   int client, serv = tcpserverOpen(*(int*)arg);
+  if (serv < 0)
+    return 0;
 
   while (!chThdShouldTerminate()) {
     // Block waiting for connection
     if ((client = tcpserverAccept(serv)) >= 0) {
-      webserverProcessRequest(client);
-      tcpClose(client);
-      webserver.hits++;
+      statInc(&webserver.accepted);
+      chMBPost(&webserver.pending, client, TIME_INFINITE);
     }
   }
+  tcpserverClose(serv);
+  return 0;
+}
+
+static msg_t webserverWorker(void *arg)
+{
+  WebConnection* conn = arg;
+  msg_t client;
+  while (!chThdShouldTerminate()) {
+    if (chMBFetch(&webserver.pending, &client, TIME_INFINITE) != RDY_OK || client < 0)
+      continue;
+    conn->socket = client;
+    tcpreaderInit(&conn->reader, client);
+    webserverServe(conn);
+    tcpClose(conn->socket);
+    conn->socket = -1;
+  }
   return 0;
 }
 
+/*
+  Handle requests on a connection until the client closes it, goes quiet
+  for too long, or we can't tell where a response ends.  Requests the client
+  sends without waiting for the last response just sit in the socket until
+  we get to them.
+*/
+static void webserverServe(WebConnection* conn)
+{
+  int requests = 0;
+  tcpSetReadTimeout(conn->socket, WEBSERVER_TIMEOUT);
+  while (!chThdShouldTerminate() && requests++ < WEBSERVER_KEEPALIVE_MAX) {
+    if (!webserverProcessRequest(conn))
+      break;
+  }
+}
+
 /*
   A new request has come in - loop through our registered handlers until
-  one of them indicates it has responded to it.
+  one of them indicates it has responded to it.  Returns true if the
+  connection can be used for another request.
 */
-void webserverProcessRequest(int socket)
+static bool webserverProcessRequest(WebConnection* conn)
 {
   bool responded = false;
-  HttpMethod method = 0;
+  HttpMethod method = HTTP_GET;
   WebHandler* h = webserver.handlers;
-  char* path = webserverGetRequestAddress(socket, webserver.buf, sizeof(webserver.buf), &method);
-
+  char* path = webserverGetRequestAddress(conn, &method);
+  if (path == 0)
+    return false;
+
+  int contentLength = webserverReadHeaders(conn);
+  if (contentLength < 0)
+    return false;
+  int bodylen = (contentLength > 0) ? webserverGetBody(conn, contentLength) : 0;
+  if (bodylen < 0)
+    return false;
+  if (bodylen < contentLength)
+    conn->keepAlive = false; // the rest of the body is still in the way of the next request
+
+  statInc(&webserver.requests);
+  conn->method = method;
+  conn->framing = RESPONSE_UNFRAMED;
   while (h != NULL && responded == false) {
     if (strncmp(h->address, path, strlen(h->address)) == 0) {
-      // if appropriate, get pointers to the request body
-      if (method == HTTP_POST || method == HTTP_PUT) {
-        int requestlen = webserverGetBody(socket, webserver.buf, sizeof(webserver.buf));
-        responded = h->onRequest(socket, method, path, webserver.buf, requestlen);
-      }
-      else {
-        responded = h->onRequest(socket, method, path, 0, 0);
-      }
+      // if appropriate, pass along the request body
+      if (method == HTTP_POST || method == HTTP_PUT)
+        responded = h->onRequest(conn->socket, method, path, conn->buf, bodylen);
+      else
+        responded = h->onRequest(conn->socket, method, path, 0, 0);
     }
     h = h->next;
   }
+
+  if (!responded)
+    webserverWriteHeader(conn->socket, 404, 0, 0);
+  else if (conn->framing == RESPONSE_CHUNKED && method != HTTP_HEAD)
+    tcpWrite(conn->socket, "0\r\n\r\n", 5); // the last chunk
+
+  return conn->keepAlive && conn->framing != RESPONSE_UNFRAMED;
 }
 
 /*
-  Extract the HTTP method for this request, and then return a pointer to the beginning
-  of the URL path
+  Read the request line, extract the HTTP method and version, and then return
+  a pointer to the beginning of the URL path
 */
-char* webserverGetRequestAddress(int socket, char* buf, int len, HttpMethod* method)
+static char* webserverGetRequestAddress(WebConnection* conn, HttpMethod* method)
 {
-  int reqlen = tcpReadLine(socket, buf, len);
-  char* request = buf;
+  int reqlen = tcpreaderReadLine(&conn->reader, conn->line, sizeof(conn->line));
+  if (reqlen <= 0)
+    return NULL; // closed, or nothing more to say
+  char* request = conn->line;
   char* end = request + reqlen;
-  char* address = NULL;
 
   // Skip any initial spaces
   while (isspace((int)*request))
     request++;
-  if (request > end) // make sure we didn't go too far
+  if (request >= end) // make sure we didn't go too far
     return NULL;
 
   if (strncmp("GET", request, 3) == 0)
@@ -223,65 +700,208 @@ char* webserverGetRequestAddress(int socket, char* buf, int len, HttpMethod* met
     *method = HTTP_PUT;
   else if (strncmp("DELETE", request, 6) == 0)
     *method = HTTP_DELETE;
+  else if (strncmp("HEAD", request, 4) == 0)
+    *method = HTTP_HEAD;
 
   // Skip the request type
   if ((request = strchr(request, ' ')) == NULL)
-    return address;
+    return NULL;
 
   // Skip any subsequent spaces
   while (isspace((int)*request))
     request++;
+  if (request >= end)
+    return NULL;
 
-  if (request > end)
-    return address;
+  char* address = request;
 
-  address = request;
-  
   // now terminate the end of the address so we can do stringy things on it
-  if ((request = strchr(request, ' ')) != 0)
+  conn->http11 = false;
+  if ((request = strchr(request, ' ')) != 0) {
+    conn->http11 = (strncmp(request + 1, "HTTP/1.1", 8) == 0);
     *request = 0;
-
+  }
+  conn->keepAlive = conn->http11; // unless the headers say otherwise
   return address;
 }
 
-int webserverGetBody(int socket, char* requestBuffer, int maxSize)
+/*
+  Keep reading lines of the HTTP header until we get an empty one, which signifies the end
+  of the header.  Returns the content length, or -1 if the connection went away.
+*/
+static int webserverReadHeaders(WebConnection* conn)
 {
-  // keep reading lines of the HTTP header until we get CRLF which signifies the end of the
-  // header.  If we see the contentlength along the way, keep that.
-  int bufferLength, contentLength = 0;
-  while ((bufferLength = tcpReadLine(socket, requestBuffer, maxSize))) {
-    if (strncmp(requestBuffer, "\r\n", 2) == 0)
-      break;
-    if (strncasecmp(requestBuffer, "Content-Length", 14) == 0)
-      contentLength = atoi(&requestBuffer[15]);
-  }
-  
-  // now we should be down to the HTTP POST data
-  // if there's any data, get up into it
-  int bufferRead = 0;
-  if (contentLength > 0 && bufferLength > 0) {
-    int lengthToRead = tcpAvailable(socket);
-    if (lengthToRead < 0)
-      return -1;
-    if (lengthToRead > maxSize)
-      lengthToRead = maxSize - 1;
-    char *rbp = requestBuffer;
-    // read all that the socket has to offer...may come in chunks, so keep going until there's none left
-    while ((bufferLength = tcpRead(socket, rbp, lengthToRead))) {
-      bufferRead += bufferLength;
-      rbp += bufferLength;
-      lengthToRead -= bufferLength;
-      if (bufferRead >= contentLength)
-        break;
+  int contentLength = 0;
+  int len;
+  conn->rangeFirst = conn->rangeLast = -1;
+  conn->ifNoneMatch[0] = 0;
+  while ((len = tcpreaderReadLine(&conn->reader, conn->buf, sizeof(conn->buf))) >= 0) {
+    if (len == 0)
+      return contentLength;
+    char* value = strchr(conn->buf, ':');
+    if (value == 0)
+      continue;
+    value++;
+    while (*value == ' ')
+      value++;
+    if (strncasecmp(conn->buf, "Content-Length:", 15) == 0)
+      contentLength = atoi(value);
+    else if (strncasecmp(conn->buf, "Connection:", 11) == 0) {
+      if (strncasecmp(value, "close", 5) == 0)
+        conn->keepAlive = false;
+      else if (strncasecmp(value, "keep-alive", 10) == 0)
+        conn->keepAlive = true;
     }
-    requestBuffer[bufferRead] = 0; // null-terminate the request
+    else if (strncasecmp(conn->buf, "If-None-Match:", 14) == 0) {
+      strncpy(conn->ifNoneMatch, value, sizeof(conn->ifNoneMatch) - 1);
+      conn->ifNoneMatch[sizeof(conn->ifNoneMatch) - 1] = 0;
+    }
+    else if (strncasecmp(conn->buf, "Range:", 6) == 0)
+      webserverParseRange(conn, value);
   }
-  return bufferRead;
+  return -1;
 }
 
-#endif // MAKE_CTRL_NETWORK
+/*
+  Only a single range is supported, like "bytes=100-199", "bytes=100-" or
+  "bytes=-100" - for anything else, the whole file is sent.
+*/
+static void webserverParseRange(WebConnection* conn, const char* value)
+{
+  int first = -1, last = -1;
+  if (strncasecmp(value, "bytes=", 6) != 0 || strchr(value, ',') != 0)
+    return;
+  value += 6;
+  if (isdigit((int)*value)) {
+    first = atoi(value);
+    while (isdigit((int)*value))
+      value++;
+  }
+  if (*value++ != '-')
+    return;
+  if (isdigit((int)*value))
+    last = atoi(value);
+  else if (first < 0)
+    return;
+  conn->rangeFirst = first;
+  conn->rangeLast = last;
+}
 
+/*
+  Read as much of the body as there's room for, and null-terminate it.
+*/
+static int webserverGetBody(WebConnection* conn, int contentLength)
+{
+  int toRead = MIN(contentLength, (int)sizeof(conn->buf) - 1);
+  int got = tcpreaderReadExact(&conn->reader, conn->buf, toRead);
+  if (got < toRead)
+    return -1;
+  conn->buf[got] = 0; // null-terminate the request
+  return got;
+}
 
+static WebConnection* webserverFindConnection(int socket)
+{
+  int i;
+  for (i = 0; i < WEBSERVER_WORKERS; i++) {
+    if (webserver.connections[i].socket == socket)
+      return &webserver.connections[i];
+  }
+  return 0;
+}
 
+/*
+  Format the status line and the headers that describe the response's
+  framing into buf, and decide whether the connection can stay open
+  afterwards.  Add any other headers, then finish with webserverEndHeader().
+  A 204 or 304 never has a body, so it needs no length to be framed.
+*/
+static int webserverBeginHeader(int socket, char* buf, int size, int code, const char* contentType, int contentLength)
+{
+  WebConnection* conn = webserverFindConnection(socket);
+  bool http11 = conn ? conn->http11 : false;
+  ResponseFraming framing = RESPONSE_UNFRAMED;
+
+  int len = webserverAppend(buf, size, 0, "HTTP/1.%d %d %s\r\n", http11 ? 1 : 0, code, webserverReason(code));
+  if (contentType)
+    len = webserverAppend(buf, size, len, "Content-Type: %s\r\n", contentType);
+  if (code == 204 || code == 304)
+    framing = RESPONSE_LENGTH;
+  else if (contentLength >= 0) {
+    len = webserverAppend(buf, size, len, "Content-Length: %d\r\n", contentLength);
+    framing = RESPONSE_LENGTH;
+  }
+  else if (http11) {
+    len = webserverAppend(buf, size, len, "Transfer-Encoding: chunked\r\n");
+    framing = RESPONSE_CHUNKED;
+  }
 
+  if (conn) {
+    conn->framing = framing;
+    conn->keepAlive = conn->keepAlive && framing != RESPONSE_UNFRAMED;
+  }
+  return len;
+}
+
+static bool webserverEndHeader(int socket, char* buf, int size, int len)
+{
+  WebConnection* conn = webserverFindConnection(socket);
+  bool keepAlive = conn && conn->keepAlive;
+  len = webserverAppend(buf, size, len, "Connection: %s\r\n\r\n", keepAlive ? "keep-alive" : "close");
+  if (len >= size)
+    return false;
+  return tcpWrite(socket, buf, len) == len;
+}
+
+// sniprintf onto the end of what's in buf, without running off the end of it
+static int webserverAppend(char* buf, int size, int len, const char* format, ...)
+{
+  if (len >= size)
+    return len;
+  va_list args;
+  va_start(args, format);
+  len += vsniprintf(buf + len, size - len, format, args);
+  va_end(args);
+  return len;
+}
+
+static const char* webserverReason(int code)
+{
+  switch (code) {
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 416: return "Requested Range Not Satisfiable";
+    case 500: return "Internal Server Error";
+    default:  return "";
+  }
+}
+
+// requests per second since the last time the stats were read
+static void webserverRequestRate(Stat* s)
+{
+  systime_t now = chTimeNow();
+  systime_t elapsed = now - webserver.rateTime;
+  if (elapsed >= MS2ST(1000)) {
+    uint32_t count = webserver.requests.value;
+    s->value = ((count - webserver.rateCount) * CH_FREQUENCY) / elapsed;
+    webserver.rateCount = count;
+    webserver.rateTime = now;
+  }
+}
 
+static void webserverActive(Stat* s)
+{
+  int i, active = 0;
+  for (i = 0; i < WEBSERVER_WORKERS; i++) {
+    if (webserver.connections[i].socket >= 0)
+      active++;
+  }
+  s->value = active;
+}
+
+#endif // MAKE_CTRL_NETWORK
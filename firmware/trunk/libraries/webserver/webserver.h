@@ -50,11 +50,29 @@ typedef struct WebHandler_t {
   struct WebHandler_t* next;
 } WebHandler;
 
+/**
+  A file to be served by the web server, straight out of flash.
+  Tables of these are generated from a directory of files by webpack.py - see webserverAddAssets().
+*/
+typedef struct WebAsset_t {
+  const char* path;        /**< Where it's served from, like "/index.html". */
+  const char* contentType; /**< Its MIME type, like "text/html". */
+  const char* etag;        /**< A quoted hash of the contents, like "\"3f2a9c01\"". */
+  const char* data;        /**< The contents. */
+  int length;              /**< How many bytes of contents there are. */
+  bool gzipped;            /**< Whether the contents are gzip-compressed. */
+} WebAsset;
+
+extern WebHandler webserverStatsHandler;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 bool webserverEnable(bool on, int port);
 void webserverAddHandler(WebHandler* handler);
+void webserverAddAssets(const WebAsset* assets);
+bool webserverWriteHeader(int socket, int code, const char* contentType, int contentLength);
+int  webserverWrite(int socket, const char* data, int length);
 void webserverSetStatusOK(int socket);
 void webserverSetStatusCode(int socket, int code);
 #ifdef __cplusplus
@@ -14,25 +14,59 @@
  the specific language governing permissions and limitations under the License.
 
 *********************************************************************************/
-#include "config.h"
-
-#include "stdlib.h"
-#include <stdio.h>
-#include "string.h"
+#include "core.h"
 #include "xbee.h"
-#include "serial.h"
-#include "error.h"
 
 static bool xbeeGetIOValues(XBeePacket* packet, int *inputs);
 #define XBEE_OSC_RX_TIMEOUT 500
 
 #ifndef XBEE_SERIAL
-#define XBEE_SERIAL 0
+#define XBEE_SERIAL Serial0
+#endif
+
+#ifndef XBEE_RX_PACKETS
+#define XBEE_RX_PACKETS 4
+#endif
+
+#ifndef XBEE_RX_STACK_SIZE
+#define XBEE_RX_STACK_SIZE 256
 #endif
 
+#ifndef XBEE_RX_PRIORITY
+#define XBEE_RX_PRIORITY (NORMALPRIO + 1)
+#endif
+
+#define XBEE_RX_CHUNK 32
+
+typedef struct XBeeReceiver_t {
+  Thread* thd;
+  int state;                 // where we're at in the current frame - XBEE_PACKET_RX_*
+  int length;
+  int index;
+  uint8_t crc;
+  XBeePacket* packet;        // being received into - 0 if the pool ran dry and this frame is being skipped
+  Mailbox received;          // complete packets, waiting to be picked up
+  msg_t receivedBuf[XBEE_RX_PACKETS];
+  Mailbox free;              // packets that can be received into
+  msg_t freeBuf[XBEE_RX_PACKETS];
+  XBeePacket packets[XBEE_RX_PACKETS];
+  Stat packetsStat;
+  Stat overruns;
+  Stat checksumErrors;
+} XBeeReceiver;
+
+static XBeeReceiver xbeerx = {
+  .packetsStat = { .name = "xbee.rx.packets" },
+  .overruns = { .name = "xbee.rx.overruns" },
+  .checksumErrors = { .name = "xbee.rx.checksum" }
+};
+
+static WORKING_AREA(waXBeeRx, XBEE_RX_STACK_SIZE);
+static msg_t xbeeRxThread(void *arg);
+static void xbeeRxByte(uint8_t c);
+
 #ifdef OSC
 typedef struct {
-  XBeePacket currentPkt;
   bool autosend;
   bool waitingForConfirm;
 } XBeeDriver;
@@ -94,115 +128,102 @@ static XBeeDriver xbee;
 */
 
 /**     
-  Controls the active state of the \b XBee subsystem
-  @param state Whether this subsystem is active or not
-  @return Zero on success.
+  Start up the \b XBee subsystem.
+  This opens the serial port at 9600 baud, and starts a thread that reads XBee API frames
+  from it as they arrive.  Completed packets wait in a queue until they're picked up with
+  xbeeReceive() or xbeeGetPacket().
+
+  Up to \b XBEE_RX_PACKETS packets (4 by default) can be waiting at once.  If a frame arrives
+  while they're all in use, it's dropped and counted in the \b xbee.rx.overruns stat.  Frames
+  with a bad checksum are dropped and counted in \b xbee.rx.checksum.
 */
 void xbeeInit()
 {
-  // Configure the serial port
+  int i;
+  if (xbeerx.thd != 0)
+    return;
   serialDisable(XBEE_SERIAL);
-  serialEnable(XBEE_SERIAL, 9600, 8, 0, 1, 0);
-  
-  // if( state ) 
-  // { 
-  //   if( XBee == NULL )
-  //   {
-  //     if( CONTROLLER_OK != Serial_SetActive( SERIAL_0, 1 ) )
-  //       return CONTROLLER_ERROR_SUBSYSTEM_INACTIVE;
-  //     
-  //     
-  // 
-  //     XBee = MallocWait( sizeof( XBeeSubsystem ), 100 );
-  //     XBee->packetIndex = 0;
-  //     #ifdef OSC
-  //     XBee->autosend = XBee_GetAutoSend( true );
-  //     #endif
-  //     XBee->currentPkt = MallocWait( sizeof( XBeePacket ), 100 );
-  //     XBee_ResetPacket( XBee->currentPkt );
-  //     XBee->waitingForConfirm = false;
-  //   }
-  // }
+  serialEnable(XBEE_SERIAL, 9600);
+
+  statsAdd(&xbeerx.packetsStat);
+  statsAdd(&xbeerx.overruns);
+  statsAdd(&xbeerx.checksumErrors);
+  chMBInit(&xbeerx.received, xbeerx.receivedBuf, XBEE_RX_PACKETS);
+  chMBInit(&xbeerx.free, xbeerx.freeBuf, XBEE_RX_PACKETS);
+  for (i = 0; i < XBEE_RX_PACKETS; i++)
+    chMBPost(&xbeerx.free, (msg_t)&xbeerx.packets[i], TIME_IMMEDIATE);
+  xbeerx.state = XBEE_PACKET_RX_START;
+  xbeerx.thd = chThdCreateStatic(waXBeeRx, sizeof(waXBeeRx), XBEE_RX_PRIORITY, xbeeRxThread, NULL);
+  systemRegisterThread(xbeerx.thd, "xbee", sizeof(waXBeeRx));
+}
+
+/**
+  Wait for the next incoming XBee packet.
+  The packet comes straight out of the receive queue, without being copied - once you're
+  done with it, hand it back with xbeeRelease() so it can be used for another one.
+  @param timeout The number of milliseconds to wait for a packet to arrive.  Use IMMEDIATE
+  to only take one that's already waiting, or FOREVER to wait as long as it takes.
+  @return The packet, or 0 if none arrived in time.
+  @see xbeeConfigSetPacketApiMode()
+
+  \par Example
+  \code
+  // we're inside a task here...
+  while (1) {
+    XBeePacket* xbp = xbeeReceive(FOREVER);
+    if (xbp->apiId == XBEE_IO16) {
+      // process the new packet
+    }
+    xbeeRelease(xbp);
+  }
+  \endcode
+*/
+XBeePacket* xbeeReceive(int timeout)
+{
+  msg_t packet;
+  if (xbeerx.thd == 0 || chMBFetch(&xbeerx.received, &packet, (systime_t)timeout) != RDY_OK)
+    return 0;
+  return (XBeePacket*)packet;
+}
+
+/**
+  Give a packet from xbeeReceive() back to the receive queue.
+  @param packet The packet you're done with.
+*/
+void xbeeRelease(XBeePacket* packet)
+{
+  chMBPost(&xbeerx.free, (msg_t)packet, TIME_IMMEDIATE); // never full - there's a spot for each packet
 }
 
 /**     
   Receive an incoming XBee packet.
-  A single call to this will continue to read from the serial port as long as there are characters 
-  to read or until it times out.  If a packet has not been completely received, call it repeatedly
-  with the same packet.
-
-  Clear out a packet before reading into it with a call to XBee_ResetPacket( )
+  Waits for a packet to arrive, and copies it into \b packet.  xbeeReceive() saves the copy,
+  if you'd rather work with the packet in place.
   @param packet The XBeePacket to receive into.
-  @param timeout The number of milliseconds to wait for a packet to arrive.  Set this to 0 to return as
-  soon as there are no characters left to process.
-        @return 1 if a complete packet has been received, 0 if not.
-  @see XBeeConfig_SetPacketApiMode( )
-  @todo Probably need some way to reset the parser if there are no bytes for a while
+  @param timeout The number of milliseconds to wait for a packet to arrive.  Set this to 0 to return
+  straight away if there's nothing waiting.
+  @return 1 if a packet has been received, 0 if not.
+  @see xbeeConfigSetPacketApiMode( )
 
   \par Example
   \code
   // we're inside a task here...
   XBeePacket myPacket;
-  XBee_ResetPacket( &myPacket );
-  while( 1 )
-  {
-    if( XBee_GetPacket( &myPacket, 100 ) )
-    {
+  while (1) {
+    if (xbeeGetPacket(&myPacket, 100)) {
       // process the new packet
-      XBee_ResetPacket( &myPacket ); // then clear it out before reading again
     }
-    Sleep( 10 );
   }
   \endcode
 */
 int xbeeGetPacket(XBeePacket* packet, int timeout)
 {
-  int time = chTimeNow();
-  do {
-    while (serialAvailable(XBEE_SERIAL)) {
-      int newChar = serialGet(XBEE_SERIAL);
-      if (newChar == -1)
-        break;
-  
-      switch (packet->rxState) {
-        case XBEE_PACKET_RX_START:
-          if (newChar == XBEE_PACKET_STARTBYTE)
-            packet->rxState = XBEE_PACKET_RX_LENGTH_1;
-          break;
-        case XBEE_PACKET_RX_LENGTH_1:
-          packet->length = newChar;
-          packet->length <<= 8;
-          packet->rxState = XBEE_PACKET_RX_LENGTH_2;
-          break;
-        case XBEE_PACKET_RX_LENGTH_2:
-          packet->length += newChar;
-          if (packet->length > XBEE_MAX_PACKET_SIZE) // in case we somehow get some garbage
-            packet->rxState = XBEE_PACKET_RX_START;
-          else
-            packet->rxState = XBEE_PACKET_RX_PAYLOAD;
-          packet->crc = 0;
-          break;
-        case XBEE_PACKET_RX_PAYLOAD:
-          *packet->dataPtr++ = newChar;
-          if (++packet->index >= packet->length)
-            packet->rxState = XBEE_PACKET_RX_CRC;
-          packet->crc += newChar;
-          break;
-        case XBEE_PACKET_RX_CRC:
-          packet->crc += newChar;
-          packet->rxState = XBEE_PACKET_RX_START;
-          if (packet->crc == 0xFF)
-            return 1;
-          else {
-            xbeeResetPacket(packet);
-            return 0;
-          }
-      }
-    }
-    if (timeout > 0 )
-      chThdSleepMilliseconds(1);
-  } while ((chTimeNow() - time) < timeout);
-  return 0;
+  XBeePacket* received = xbeeReceive(timeout);
+  if (received == 0)
+    return 0;
+  memcpy(packet, received, sizeof(XBeePacket));
+  xbeeRelease(received);
+  return 1;
 }
 
 /**     
@@ -226,7 +247,7 @@ int xbeeGetPacket(XBeePacket* packet, int timeout)
 */
 int xbeeSendPacket(XBeePacket* packet, int datalength)
 {
-  serialPut(XBEE_SERIAL, XBEE_PACKET_STARTBYTE);
+  serialPut(XBEE_SERIAL, XBEE_PACKET_STARTBYTE, FOREVER);
   switch (packet->apiId) {
     case XBEE_TX64: //account for apiId, frameId, 8 bytes destination, and options
       datalength += 11;
@@ -242,16 +263,16 @@ int xbeeSendPacket(XBeePacket* packet, int datalength)
       break;
   }
 
-  serialPut(XBEE_SERIAL, (datalength >> 8) & 0xFF); // send the most significant bit
-  serialPut(XBEE_SERIAL, datalength & 0xFF); // then the LSB
+  serialPut(XBEE_SERIAL, (datalength >> 8) & 0xFF, FOREVER); // send the most significant bit
+  serialPut(XBEE_SERIAL, datalength & 0xFF, FOREVER); // then the LSB
   packet->crc = 0; // just in case it hasn't been initialized.
   uint8_t* p = (uint8_t*)packet;
   while (datalength--) {
-    serialPut(XBEE_SERIAL, *p);
+    serialPut(XBEE_SERIAL, *p, FOREVER);
     packet->crc += *p++;
   }
   //uint8 test = 0xFF - packet->crc;
-  serialPut(XBEE_SERIAL, 0xFF - packet->crc);
+  serialPut(XBEE_SERIAL, 0xFF - packet->crc, FOREVER);
   return CONTROLLER_OK;
 }
 
@@ -297,13 +318,11 @@ void xbeeConfigSetPacketApiMode(bool enabled)
   if (enabled) {
     char buf[10];
     int len = siprintf(buf, "+++"); // enter command mode
-    serialPut(XBEE_SERIAL, buf, len, 0 );
+    serialWrite(XBEE_SERIAL, buf, len, FOREVER);
     chThdSleepMilliseconds(1025); // have to wait one second after +++ to actually get set to receive in AT mode
     len = siprintf(buf, "ATAP1,CN\r"); // turn API mode on, and leave command mode
-    serialPut(XBEE_SERIAL, buf, len, 0);
-    chThdSleepMilliseconds(50);
-    while (serialAvailable(XBEE_SERIAL) > 0)
-      (void)serialGet(XBEE_SERIAL); // rip the OKs out of there
+    serialWrite(XBEE_SERIAL, buf, len, FOREVER);
+    // the OKs that come back aren't framed, so the receiver skips them
   }
   else {
     XBeePacket xbp;
@@ -1089,6 +1108,89 @@ static bool xbeeGetIOValues(XBeePacket* packet, int *inputs)
     return false;
 }
 
+/*
+  The receiver.  Sleeps on the serial port's input queue until something
+  arrives, then takes whatever else is already there in one go.
+*/
+static msg_t xbeeRxThread(void *arg)
+{
+  uint8_t buf[XBEE_RX_CHUNK];
+  UNUSED(arg);
+  while (!chThdShouldTerminate()) {
+    int i, n = serialRead(XBEE_SERIAL, (char*)buf, 1, FOREVER);
+    if (n <= 0)
+      continue; // the port was reset
+    int avail = serialAvailable(XBEE_SERIAL);
+    if (avail > 0)
+      n += serialRead(XBEE_SERIAL, (char*)buf + 1, MIN(avail, XBEE_RX_CHUNK - 1), IMMEDIATE);
+    for (i = 0; i < n; i++)
+      xbeeRxByte(buf[i]);
+  }
+  return 0;
+}
+
+/*
+  Parse API frames a byte at a time:
+  0x7E, length (2 bytes, MSB first), payload - starting with the API ID - then a checksum.
+  A packet is only taken from the pool once the length checks out, and goes into the
+  received queue once the checksum does.
+*/
+static void xbeeRxByte(uint8_t c)
+{
+  switch (xbeerx.state) {
+    case XBEE_PACKET_RX_START:
+      if (c == XBEE_PACKET_STARTBYTE)
+        xbeerx.state = XBEE_PACKET_RX_LENGTH_1;
+      break;
+    case XBEE_PACKET_RX_LENGTH_1:
+      xbeerx.length = c << 8;
+      xbeerx.state = XBEE_PACKET_RX_LENGTH_2;
+      break;
+    case XBEE_PACKET_RX_LENGTH_2:
+    {
+      msg_t packet;
+      xbeerx.length |= c;
+      if (xbeerx.length == 0 || xbeerx.length > XBEE_MAX_PACKET_SIZE) { // in case we somehow get some garbage
+        xbeerx.state = XBEE_PACKET_RX_START;
+        break;
+      }
+      if (chMBFetch(&xbeerx.free, &packet, TIME_IMMEDIATE) == RDY_OK)
+        xbeerx.packet = (XBeePacket*)packet;
+      else { // nobody's picking them up - skip this one
+        xbeerx.packet = 0;
+        statInc(&xbeerx.overruns);
+      }
+      xbeerx.index = 0;
+      xbeerx.crc = 0;
+      xbeerx.state = XBEE_PACKET_RX_PAYLOAD;
+      break;
+    }
+    case XBEE_PACKET_RX_PAYLOAD:
+      if (xbeerx.packet != 0)
+        ((uint8_t*)xbeerx.packet)[xbeerx.index] = c; // the API ID, then the payload
+      xbeerx.crc += c;
+      if (++xbeerx.index >= xbeerx.length)
+        xbeerx.state = XBEE_PACKET_RX_CRC;
+      break;
+    case XBEE_PACKET_RX_CRC:
+      xbeerx.state = XBEE_PACKET_RX_START;
+      if (xbeerx.packet == 0)
+        break;
+      if ((uint8_t)(xbeerx.crc + c) == 0xFF) {
+        xbeerx.packet->length = xbeerx.length;
+        xbeerx.packet->crc = c;
+        chMBPost(&xbeerx.received, (msg_t)xbeerx.packet, TIME_IMMEDIATE);
+        statInc(&xbeerx.packetsStat);
+      }
+      else {
+        xbeeRelease(xbeerx.packet);
+        statInc(&xbeerx.checksumErrors);
+      }
+      xbeerx.packet = 0;
+      break;
+  }
+}
+
 #ifdef OSC
 #include "osc.h"
 
@@ -1782,9 +1884,11 @@ int XBeeOsc_Async( int channel )
   if( !XBee_GetAutoSend( false ) || XBee->waitingForConfirm )
     return newMsgs;
 
-  while( XBee_GetPacket( XBee->currentPkt, 0 ) )
+  XBeePacket* xbp;
+  while( ( xbp = xbeeReceive( IMMEDIATE ) ) != 0 )
   {
-    XBeeOsc_HandleNewPacket( XBee->currentPkt, channel );
+    XBeeOsc_HandleNewPacket( xbp, channel );
+    xbeeRelease( xbp );
     newMsgs++;
   }
   return newMsgs;
@@ -218,6 +218,8 @@ typedef struct {
 } __attribute__((packed)) XBeePacket;
 
 void xbeeInit(void);
+XBeePacket* xbeeReceive(int timeout);
+void xbeeRelease(XBeePacket* packet);
 int xbeeGetPacket(XBeePacket* packet, int timeout);
 int xbeeSendPacket(XBeePacket* packet, int datalength);
 void xbeeResetPacket(XBeePacket* packet);
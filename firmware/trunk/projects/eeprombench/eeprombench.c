@@ -0,0 +1,116 @@
+/*********************************************************************************
+
+ Copyright 2006-2010 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+/*
+  Times bulk reads and writes of the EEPROM on the board.  The start of the
+  user section is saved, written over with a test pattern, read back and
+  checked, then put back the way it was.  The results show up with the rest
+  of the stats - send /system/stats over USB or UDP to see them:
+
+    bench.eeprom.write    bytes per second written
+    bench.eeprom.read     bytes per second read
+    bench.eeprom.errors   bytes that didn't read back the way they were written
+
+  The LED stays on while it runs.
+*/
+
+#include "core.h"
+#include "osc.h"
+
+#ifndef BENCH_EEPROM_ADDRESS
+#define BENCH_EEPROM_ADDRESS 0
+#endif
+#ifndef BENCH_EEPROM_SIZE
+#define BENCH_EEPROM_SIZE 4096
+#endif
+#define BENCH_EEPROM_OFFSET 5 // start partway into a page, so the writes get split
+
+const OscNode oscRoot = {
+  .children = {
+    &systemOsc,
+    #ifdef MAKE_CTRL_NETWORK
+    &networkOsc,
+    #endif
+    0
+  }
+};
+
+static uint8_t saved[BENCH_EEPROM_SIZE];
+static uint8_t buf[BENCH_EEPROM_SIZE];
+
+static Stat benchWrite = { .name = "bench.eeprom.write" };
+static Stat benchRead = { .name = "bench.eeprom.read" };
+static Stat benchErrors = { .name = "bench.eeprom.errors" };
+
+static uint32_t benchRate(int bytes, systime_t start)
+{
+  systime_t ticks = chTimeNow() - start;
+  if (ticks == 0)
+    ticks = 1;
+  return (uint32_t)(((uint64_t)bytes * CH_FREQUENCY) / ticks);
+}
+
+static void benchEeprom(void)
+{
+  int address = BENCH_EEPROM_ADDRESS + BENCH_EEPROM_OFFSET;
+  int i, errors = 0;
+
+  eepromReadBlock(address, saved, BENCH_EEPROM_SIZE);
+  for (i = 0; i < BENCH_EEPROM_SIZE; i++)
+    buf[i] = (uint8_t)(i * 7 + 3);
+
+  systime_t start = chTimeNow();
+  eepromWriteBlock(address, buf, BENCH_EEPROM_SIZE);
+  eepromReadBlock(address, buf, 1); // doesn't return until the last write cycle is over
+  statSet(&benchWrite, benchRate(BENCH_EEPROM_SIZE, start));
+
+  memset(buf, 0, sizeof(buf));
+  start = chTimeNow();
+  eepromReadBlock(address, buf, BENCH_EEPROM_SIZE);
+  statSet(&benchRead, benchRate(BENCH_EEPROM_SIZE, start));
+
+  for (i = 0; i < BENCH_EEPROM_SIZE; i++) {
+    if (buf[i] != (uint8_t)(i * 7 + 3))
+      errors++;
+  }
+  statSet(&benchErrors, errors);
+
+  eepromWriteBlock(address, saved, BENCH_EEPROM_SIZE);
+}
+
+void setup()
+{
+  usbserialInit();
+  oscUsbEnable(YES);
+  #ifdef MAKE_CTRL_NETWORK
+  networkInit();
+  oscUdpEnable(YES);
+  #endif
+
+  statsAdd(&benchWrite);
+  statsAdd(&benchRead);
+  statsAdd(&benchErrors);
+
+  ledSetValue(ON);
+  benchEeprom();
+  ledSetValue(OFF);
+}
+
+void loop()
+{
+  sleep(1000);
+}
@@ -27,6 +27,7 @@ const OscNode oscRoot = {
   .children = {
     &appledOsc,
     &analoginOsc,
+    &analoginsOsc,
     &systemOsc,
     #ifdef MAKE_CTRL_NETWORK
     &networkOsc,
@@ -36,6 +37,7 @@ const OscNode oscRoot = {
     #endif
     &pinOsc,
     &digitalinOsc,
+    &digitalinsOsc,
     &digitaloutOsc,
     0
   }
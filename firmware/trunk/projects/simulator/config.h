@@ -0,0 +1,57 @@
+/*
+	config.h - Select which features & hardware you're using.
+  MakingThings
+*/
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define FIRMWARE_NAME          "Simulator svn"
+#define FIRMWARE_MAJOR_VERSION 2
+#define FIRMWARE_MINOR_VERSION 0
+#define FIRMWARE_BUILD_NUMBER  0
+
+//----------------------------------------------------------------
+//  Comment out the systems that you don't want to include in your build.
+//----------------------------------------------------------------
+#define MAKE_CTRL_USB     // enable the USB system - mocked in simhw.c
+#define MAKE_CTRL_NETWORK // enable the network system - lwIP over a loopback netif
+#define OSC               // enable the OSC system
+
+//  The version of the MAKE Controller Board you're using.
+#define CONTROLLER_VERSION  100    // valid options: 50, 90, 95, 100, 200
+
+//  The version of the MAKE Application Board you're using.
+#define APPBOARD_VERSION  100    // valid options: 50, 90, 95, 100, 200
+
+//----------------------------------------------------------------
+//  Host build - none of the SAM7X peripherals are there.
+//----------------------------------------------------------------
+#define NO_SPI_INIT
+#define NO_PWM_INIT
+#define NO_SERIAL_INIT
+
+#define HAL_USE_MAC    FALSE
+#define HAL_USE_SERIAL FALSE
+
+// no router to ask, and the loopback netif sends everything straight back in
+#define LWIP_DHCP              0
+#define LWIP_DNS               0
+#define LWIP_HAVE_LOOPIF       1
+#define LWIP_NETIF_LOOPBACK    1
+// so the benchmarks give up on a reply that never comes
+#define LWIP_SO_RCVTIMEO       1
+// no TC to time the stages against
+#define LWIP_PERF              0
+
+// the /osc gateway runs OSC handlers on the webserver's workers, and the
+// host C library's printf wants a lot more stack than newlib's
+#define WEBSERVER_STACK_SIZE   4096
+
+// newlib's integer-only printf family isn't in the host C library
+#define siprintf  sprintf
+#define sniprintf snprintf
+#define vsniprintf vsnprintf
+#define siscanf   sscanf
+
+#endif // CONFIG_H
@@ -0,0 +1,273 @@
+/*********************************************************************************
+
+ Copyright 2006-2010 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+/*
+  Stand-ins for the peripherals the core expects, so it runs on the host.
+  USB is a queue of whole packets - simUsbInject() puts them in, and whatever
+  the board sends back is counted rather than sent anywhere.  The EEPROM is
+  a block of RAM that starts out erased, and the analog ins return whatever
+  was last set with simAnaloginSet().
+*/
+
+#include "core.h"
+#include "simhw.h"
+#include <stdlib.h>
+
+#ifndef SIM_USB_PACKET_SIZE
+#define SIM_USB_PACKET_SIZE 512
+#endif
+
+static struct {
+  char packets[SIM_USB_QUEUE][SIM_USB_PACKET_SIZE];
+  int lengths[SIM_USB_QUEUE];
+  int head;
+  int tail;
+  Semaphore full;
+  Semaphore empty;
+  Semaphore replySem;
+  volatile uint32_t replies;
+  bool active;
+} usb;
+
+static uint8_t eeprom[EEPROM_SIZE];
+static int analogin[ANALOGIN_CHANNELS];
+
+void kill()
+{
+  exit(0);
+}
+
+/*
+  USB
+*/
+
+void usbserialInit()
+{
+  if (!usb.active) {
+    chSemInit(&usb.full, 0);
+    chSemInit(&usb.empty, SIM_USB_QUEUE);
+    chSemInit(&usb.replySem, 0);
+    usb.active = true;
+  }
+}
+
+bool usbserialIsActive()
+{
+  return usb.active;
+}
+
+int usbserialAvailable()
+{
+  return (chSemGetCounterI(&usb.full) > 0) ? usb.lengths[usb.tail] : 0;
+}
+
+int usbserialRead(char *buffer, int length, int timeout)
+{
+  if (!usb.active || chSemWaitTimeout(&usb.full, MS2ST(timeout)) == RDY_TIMEOUT)
+    return 0;
+  if (length > usb.lengths[usb.tail])
+    length = usb.lengths[usb.tail];
+  memcpy(buffer, usb.packets[usb.tail], length);
+  usb.tail = (usb.tail + 1) % SIM_USB_QUEUE;
+  chSemSignal(&usb.empty);
+  return length;
+}
+
+char usbserialGet()
+{
+  char c = 0;
+  usbserialRead(&c, 1, 0);
+  return c;
+}
+
+int usbserialWrite(const char *buffer, int length)
+{
+  UNUSED(buffer);
+  if (!usb.active)
+    return 0;
+  chSysLock();
+  usb.replies++;
+  chSemSignalI(&usb.replySem);
+  chSchRescheduleS();
+  chSysUnlock();
+  return length;
+}
+
+int usbserialPut(char c)
+{
+  return usbserialWrite(&c, 1);
+}
+
+/*
+  Packets are queued whole, so there's no SLIP framing to undo.  Wake up
+  every now and then so the OSC thread can notice when it's asked to stop.
+*/
+int usbserialReadSlip(char *buffer, int length)
+{
+  return usbserialRead(buffer, length, 100);
+}
+
+int usbserialWriteSlip(const char *buffer, int length)
+{
+  return usbserialWrite(buffer, length);
+}
+
+/**
+  Queue a packet to be read from the mock USB port.
+  @param packet The packet, as it would be after SLIP decoding.
+  @param length Its length in bytes.
+  @param timeout How long to wait for room in the queue, in milliseconds.
+  @return True if the packet was queued.
+*/
+bool simUsbInject(const char* packet, int length, int timeout)
+{
+  if (!usb.active || length > SIM_USB_PACKET_SIZE)
+    return false;
+  if (chSemWaitTimeout(&usb.empty, MS2ST(timeout)) == RDY_TIMEOUT)
+    return false;
+  memcpy(usb.packets[usb.head], packet, length);
+  usb.lengths[usb.head] = length;
+  usb.head = (usb.head + 1) % SIM_USB_QUEUE;
+  chSemSignal(&usb.full);
+  return true;
+}
+
+/**
+  The number of packets written to the mock USB port so far.
+*/
+uint32_t simUsbReplies()
+{
+  return usb.replies;
+}
+
+/**
+  Wait until the board has written a number of packets to the mock USB port.
+  @param count The total to wait for - compare with simUsbReplies().
+  @param timeout How long to wait, in milliseconds.
+  @return True if they all turned up in time.
+*/
+bool simUsbWaitReplies(uint32_t count, int timeout)
+{
+  systime_t end = chTimeNow() + MS2ST(timeout);
+  while (usb.replies < count) {
+    systime_t left = end - chTimeNow();
+    if ((int32_t)left <= 0 || chSemWaitTimeout(&usb.replySem, left) == RDY_TIMEOUT)
+      return usb.replies >= count;
+  }
+  return true;
+}
+
+/*
+  EEPROM
+*/
+
+void eepromInit()
+{
+  memset(eeprom, 0xFF, sizeof(eeprom)); // erased, like a new board
+}
+
+int eepromRead(int address)
+{
+  int val;
+  eepromReadBlock(address, (uint8_t*)&val, 4);
+  return val;
+}
+
+void eepromWrite(int address, int value)
+{
+  eepromWriteBlock(address, (uint8_t*)&value, 4);
+}
+
+// RAM is quick enough to write straight away
+void eepromWriteDeferred(int address, int value)
+{
+  eepromWrite(address, value);
+}
+
+int eepromReadBlock(int address, uint8_t* data, int length)
+{
+  if (address < 0 || address + length > EEPROM_SIZE)
+    return CONTROLLER_ERROR_BAD_ADDRESS;
+  memcpy(data, &eeprom[address], length);
+  return CONTROLLER_OK;
+}
+
+int eepromWriteBlock(int address, uint8_t *data, int length)
+{
+  if (address < 0 || address + length > EEPROM_SIZE)
+    return CONTROLLER_ERROR_BAD_ADDRESS;
+  memcpy(&eeprom[address], data, length);
+  return CONTROLLER_OK;
+}
+
+/*
+  Analog ins
+*/
+
+void analoginInit() { }
+
+void analoginDeinit() { }
+
+int analoginValue(int channel)
+{
+  if (channel < 0 || channel >= ANALOGIN_CHANNELS)
+    return CONTROLLER_ERROR_ILLEGAL_INDEX;
+  return analogin[channel];
+}
+
+bool analoginMulti(int values[])
+{
+  memcpy(values, analogin, sizeof(analogin));
+  return true;
+}
+
+bool analoginSnapshot(int values[], int maxAge)
+{
+  UNUSED(maxAge);
+  return analoginMulti(values);
+}
+
+int analoginStreamStart(int rate, AnaloginStreamHandler handler)
+{
+  UNUSED(rate);
+  UNUSED(handler);
+  return CONTROLLER_ERROR_SUBSYSTEM_INACTIVE; // no sampling hardware to stream from
+}
+
+void analoginStreamStop() { }
+
+int analoginStreamRate()
+{
+  return 0;
+}
+
+bool analoginStreamSnapshot(int values[])
+{
+  UNUSED(values);
+  return false;
+}
+
+/**
+  Set the value the mock analog in will read.
+  @param channel Which analog in, 0-7.
+  @param value The value, 0-1023.
+*/
+void simAnaloginSet(int channel, int value)
+{
+  if (channel >= 0 && channel < ANALOGIN_CHANNELS)
+    analogin[channel] = value & 0x3FF;
+}
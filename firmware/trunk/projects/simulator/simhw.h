@@ -0,0 +1,39 @@
+/*********************************************************************************
+
+ Copyright 2006-2010 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+#ifndef SIMHW_H
+#define SIMHW_H
+
+#include "types.h"
+
+// how many packets can be waiting to be read from the mock USB port
+#ifndef SIM_USB_QUEUE
+#define SIM_USB_QUEUE 16
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+bool simUsbInject(const char* packet, int length, int timeout);
+bool simUsbWaitReplies(uint32_t count, int timeout);
+uint32_t simUsbReplies(void);
+void simAnaloginSet(int channel, int value);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SIMHW_H
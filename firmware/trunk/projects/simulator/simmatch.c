@@ -0,0 +1,249 @@
+/*********************************************************************************
+
+ Copyright 2006-2010 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+/*
+  Two other OSC pattern matchers to hold oscPatternMatch() up against.
+  simOldPatternMatch() is the recursive matcher the core used to have,
+  kept as it was, to see what the iterative one costs or saves and how
+  deep the old one went.  simRefPatternMatch() is the simplest recursive
+  statement of what oscPatternMatch() is meant to do - every '*' and
+  every alternative in a '{...}' list is tried until something works -
+  for the fuzzer to compare against.  It's only fed small patterns, so
+  the recursion doesn't matter here.
+*/
+
+#include "core.h"
+#include "simmatch.h"
+#include <string.h>
+
+static bool oldMatchBrackets(const char* pattern, const char* test);
+static bool oldMatchList(const char* pattern, const char* test);
+
+bool simOldPatternMatch(const char* pattern, const char* test)
+{
+  if (pattern == 0 || pattern[0] == 0)
+    return test[0] == 0;
+
+  if (test[0] == 0) {
+    if (pattern[0] == '*')
+      return simOldPatternMatch(pattern + 1, test);
+    else
+      return false;
+  }
+
+  switch (pattern[0]) {
+    case 0:
+      return test[0] == 0;
+    case '?':
+      return simOldPatternMatch(pattern + 1, test + 1);
+    case '*':
+      if (simOldPatternMatch(pattern + 1, test))
+        return true;
+      else
+        return simOldPatternMatch(pattern, test + 1);
+    case ']':
+    case '}':
+      return false; // spurious closing bracket
+    case '[':
+      return oldMatchBrackets(pattern, test);
+    case '{':
+      return oldMatchList(pattern, test);
+    case '\\':
+      if (pattern[1] == 0)
+        return test[0] == 0;
+      else {
+        if (pattern[1] == test[0])
+          return simOldPatternMatch(pattern + 2, test + 1);
+        else
+          return false;
+      }
+    default:
+      if (pattern[0] == test[0])
+        return simOldPatternMatch(pattern + 1, test + 1);
+      else
+        return false;
+  }
+}
+
+// we know that pattern[0] == '[' and test[0] != 0
+static bool oldMatchBrackets(const char* pattern, const char* test)
+{
+  bool result;
+  bool negated = false;
+  const char* p = pattern;
+
+  if (pattern[1] == 0)
+    return false; // unterminated [ in pattern
+
+  if (pattern[1] == '!') {
+    negated = true;
+    p++;
+  }
+
+  while (*p != ']') {
+    if (*p == 0)
+      return false; // unterminated [ in pattern
+    if (p[1] == '-' && p[2] != 0) {
+      if (test[0] >= p[0] && test[0] <= p[2]) {
+        result = !negated;
+        goto advance;
+      }
+    }
+    if (p[0] == test[0]) {
+      result = !negated;
+      goto advance;
+    }
+    p++;
+  }
+
+  result = negated;
+
+advance:
+
+  if (!result)
+    return false;
+
+  while (*p != ']') {
+    if (*p == 0)
+      return false; // unterminated [ in pattern
+    p++;
+  }
+
+  return simOldPatternMatch(p + 1, test + 1);
+}
+
+static bool oldMatchList(const char* pattern, const char* test)
+{
+  const char *restOfPattern, *tp = test;
+
+  for (restOfPattern = pattern; *restOfPattern != '}'; restOfPattern++) {
+    if (*restOfPattern == 0)
+      return false; // unterminated { in pattern
+  }
+
+  restOfPattern++; // skip close curly brace
+  pattern++; // skip open curly brace
+
+  while (1) {
+    if (*pattern == ',') {
+      if (simOldPatternMatch(restOfPattern, tp))
+        return true;
+      else {
+        tp = test;
+        ++pattern;
+      }
+    }
+    else {
+      if (*pattern == '}')
+        return simOldPatternMatch(restOfPattern, tp);
+      else {
+        if (*pattern == *tp) {
+          ++pattern;
+          ++tp;
+        }
+        else {
+          tp = test;
+          while (*pattern != ',' && *pattern != '}')
+            pattern++;
+          if (*pattern == ',')
+            pattern++;
+        }
+      }
+    }
+  }
+}
+
+/*
+  The same character sets as oscPatternMatch() - a '-' just before the
+  closing ']' is a literal.  Returns just past the ']' if c is in the
+  set, or 0 if not.
+*/
+static const char* refMatchBrackets(const char* pattern, char c)
+{
+  bool negated = false;
+  bool found = false;
+  const char* p = pattern + 1;
+
+  if (*p == '!') {
+    negated = true;
+    p++;
+  }
+  for (; *p != ']'; p++) {
+    if (*p == 0)
+      return 0;
+    if (p[1] == '-' && p[2] != 0 && p[2] != ']') {
+      if (c >= p[0] && c <= p[2])
+        found = true;
+      p += 2;
+    }
+    else if (*p == c)
+      found = true;
+  }
+  return (found != negated) ? p + 1 : 0;
+}
+
+bool simRefPatternMatch(const char* pattern, const char* test)
+{
+  const char* q;
+  if (pattern == 0)
+    return test[0] == 0;
+
+  switch (*pattern) {
+    case 0:
+      return *test == 0;
+    case '?':
+      return *test != 0 && simRefPatternMatch(pattern + 1, test + 1);
+    case '*':
+      while (*pattern == '*')
+        pattern++;
+      while (1) {
+        if (simRefPatternMatch(pattern, test))
+          return true;
+        if (*test++ == 0)
+          return false;
+      }
+    case ']':
+    case '}':
+      return false;
+    case '[':
+      if (*test == 0 || (q = refMatchBrackets(pattern, *test)) == 0)
+        return false;
+      return simRefPatternMatch(q, test + 1);
+    case '{': {
+      const char* rest = strchr(pattern, '}');
+      if (rest == 0)
+        return false;
+      const char* alt = pattern + 1;
+      while (1) {
+        const char* end = alt;
+        while (*end != ',' && *end != '}')
+          end++;
+        if (strncmp(alt, test, end - alt) == 0 && simRefPatternMatch(rest + 1, test + (end - alt)))
+          return true;
+        if (*end == '}')
+          return false;
+        alt = end + 1;
+      }
+    }
+    case '\\':
+      if (pattern[1] == 0)
+        return *test == 0;
+      return pattern[1] == *test && simRefPatternMatch(pattern + 2, test + 1);
+    default:
+      return *pattern == *test && simRefPatternMatch(pattern + 1, test + 1);
+  }
+}
@@ -0,0 +1,90 @@
+/*********************************************************************************
+
+ Copyright 2006-2010 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+/*
+  Takes the place of lwipthread.c in the simulator.  There's no MAC, so the
+  board's one interface is a loopback netif at its usual address - anything
+  sent to that address, or broadcast, comes straight back in through lwIP.
+*/
+
+#include "config.h"
+#ifdef MAKE_CTRL_NETWORK
+
+#include "ch.h"
+#include "hal.h"
+#include <string.h>
+
+#include "lwip/opt.h"
+#include "lwip/netif.h"
+#include "lwip/tcpip.h"
+#include "netif/loopif.h"
+
+#include "lwipthread.h"
+
+WORKING_AREA(wa_lwip_thread, LWIP_THREAD_STACK_SIZE);
+
+static struct netif thisif;
+static struct ip_addr ip, gateway, netmask;
+
+/**
+ * @brief Adds the interface once the tcpip thread is up.
+ * @details Runs on the tcpip thread, so the interface is ready by the time
+ *          networkInit() is let go.
+ */
+static void lwipInitialized(void *a) {
+  Semaphore *sem = a;
+
+  netif_add(&thisif, &ip, &netmask, &gateway, NULL, loopif_init, tcpip_input);
+  netif_set_default(&thisif);
+  netif_set_up(&thisif);
+  if (sem != NULL)
+    chSemSignal(sem);
+}
+
+/**
+ * @brief LWIP set up for the simulator.
+ * @details Same options as the real one - the MAC address is ignored.
+ *
+ * @param[in] p pointer to a @p lwipthread_opts structure or @p NULL
+ */
+msg_t lwip_thread(void *p) {
+  struct lwipthread_opts *opts = p;
+
+  if (p) {
+    ip.addr = opts->address;
+    gateway.addr = opts->gateway;
+    netmask.addr = opts->netmask;
+    *opts->netif = &thisif;
+  }
+  else {
+    LWIP_IPADDR(&ip);
+    LWIP_GATEWAY(&gateway);
+    LWIP_NETMASK(&netmask);
+  }
+
+  tcpip_init(lwipInitialized, (opts != NULL) ? opts->semaphore : 0);
+  return 0; /* the tcpip thread does the rest */
+}
+
+/**
+ * @brief No frames to count in the simulator.
+ */
+void lwip_thread_stats(struct lwipthread_stats *sp) {
+  memset(sp, 0, sizeof(*sp));
+}
+
+#endif /* MAKE_CTRL_NETWORK */
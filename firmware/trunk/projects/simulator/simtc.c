@@ -0,0 +1,100 @@
+/*********************************************************************************
+
+ Copyright 2006-2010 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+/*
+  A stand-in for the timer/counter behind the fast timer.  Time is
+  simulated, in timer ticks, so the results come out the same however
+  busy the host is.  Each time the counter reaches RC it goes back to 0
+  and the interrupt is taken after a random latency, the way it would be
+  behind whatever else the board is doing with interrupts off.  Handlers
+  call simTcAdvance() to account for the time they'd take to run.
+*/
+
+#include "core.h"
+#include "simtc.h"
+#include <stdlib.h>
+
+AT91S_TC simTc[3];
+AT91S_PMC simPmc;
+AT91S_AIC simAic;
+
+static AT91S_TC* simTcCurrent = &simTc[0];
+static uint32_t simTcSliceStart; // when the counter last went back to 0
+
+// act on whatever's been written to the control register since we last looked
+static void simTcControl(AT91S_TC* tc)
+{
+  if (tc->TC_CCR & AT91C_TC_CLKDIS)
+    tc->TC_SR &= ~AT91C_TC_CLKSTA;
+  else if (tc->TC_CCR & AT91C_TC_CLKEN)
+    tc->TC_SR |= AT91C_TC_CLKSTA;
+  if (tc->TC_CCR & AT91C_TC_SWTRG) {
+    simTcSliceStart += tc->TC_CV;
+    tc->TC_CV = 0;
+  }
+  tc->TC_CCR = 0;
+}
+
+/*
+  Stop the counter and start the clock over at 0.  This is the counter
+  simTcRun() will drive from now on.
+*/
+void simTcReset(AT91S_TC* tc)
+{
+  simTcCurrent = tc;
+  tc->TC_CCR = 0;
+  tc->TC_CV = 0;
+  tc->TC_SR = 0;
+  simTcSliceStart = 0;
+}
+
+/*
+  Run the counter for the given number of ticks, or until the fast timer
+  stops it.  Interrupts are taken between 0 and maxLatency ticks late.
+*/
+void simTcRun(uint32_t ticks, int maxLatency)
+{
+  AT91S_TC* tc = simTcCurrent;
+  uint32_t end = simTcNow() + ticks;
+  simTcControl(tc);
+  while ((int32_t)(simTcNow() - end) < 0 && (tc->TC_SR & AT91C_TC_CLKSTA)) {
+    // run up to the compare, and start over - if we're already past it,
+    // that means going all the way around first
+    if (tc->TC_CV >= tc->TC_RC)
+      simTcSliceStart += 0x10000;
+    simTcSliceStart += tc->TC_RC;
+    tc->TC_CV = (maxLatency > 0) ? rand() % (maxLatency + 1) : 0;
+    tc->TC_SR |= AT91C_TC_CPCS;
+    FiqHandler();
+    tc->TC_SR &= ~AT91C_TC_CPCS; // cleared by reading the status register
+    simTcControl(tc);
+  }
+}
+
+/*
+  Move the counter along, as if the code calling it took that long to run.
+*/
+void simTcAdvance(int ticks)
+{
+  simTcCurrent->TC_CV += ticks;
+}
+
+// how long the counter's been running since simTcReset(), in ticks
+uint32_t simTcNow()
+{
+  return simTcSliceStart + simTcCurrent->TC_CV;
+}
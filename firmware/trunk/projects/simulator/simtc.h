@@ -0,0 +1,99 @@
+/*********************************************************************************
+
+ Copyright 2006-2010 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+#ifndef SIMTC_H
+#define SIMTC_H
+
+/*
+  Just enough of the AT91SAM7X timer/counter, PMC and AIC for fasttimer.c
+  to build on the host.  The registers are plain memory - nothing happens
+  when they're written.  Instead, simTcRun() plays the part of whichever
+  counter was last passed to simTcReset(), in simulated time, and calls
+  the fast interrupt handler whenever it reaches RC.
+*/
+
+#include "types.h"
+
+typedef volatile unsigned int AT91_REG;
+
+typedef struct {
+  AT91_REG TC_CCR;
+  AT91_REG TC_CMR;
+  AT91_REG TC_CV;
+  AT91_REG TC_RA;
+  AT91_REG TC_RB;
+  AT91_REG TC_RC;
+  AT91_REG TC_SR;
+  AT91_REG TC_IER;
+  AT91_REG TC_IDR;
+  AT91_REG TC_IMR;
+} AT91S_TC;
+
+typedef struct {
+  AT91_REG PMC_PCER;
+  AT91_REG PMC_PCDR;
+  AT91_REG PMC_PCSR;
+} AT91S_PMC;
+
+typedef struct {
+  AT91_REG AIC_SMR[32];
+  AT91_REG AIC_IECR;
+  AT91_REG AIC_IDCR;
+  AT91_REG AIC_ICCR;
+  AT91_REG AIC_FFER;
+} AT91S_AIC;
+
+#define AT91C_TC_CLKEN   (0x1 << 0)
+#define AT91C_TC_CLKDIS  (0x1 << 1)
+#define AT91C_TC_SWTRG   (0x1 << 2)
+#define AT91C_TC_CPCS    (0x1 << 4)
+#define AT91C_TC_CPCTRG  (0x1 << 14)
+#define AT91C_TC_CLKSTA  (0x1 << 16)
+#define AT91C_TC_CLKS_TIMER_DIV2_CLOCK 0x1
+#define AT91C_AIC_SRCTYPE_INT_HIGH_LEVEL (0x1 << 5)
+
+#define AT91C_ID_TC0 12
+#define AT91C_ID_TC1 13
+#define AT91C_ID_TC2 14
+
+extern AT91S_TC simTc[3];
+extern AT91S_PMC simPmc;
+extern AT91S_AIC simAic;
+
+#define AT91C_BASE_TC0 (&simTc[0])
+#define AT91C_BASE_TC1 (&simTc[1])
+#define AT91C_BASE_TC2 (&simTc[2])
+#define AT91C_BASE_PMC (&simPmc)
+#define AT91C_BASE_AIC (&simAic)
+
+#ifndef CH_FAST_IRQ_HANDLER
+#define CH_FAST_IRQ_HANDLER(id) void id(void)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void FiqHandler(void);
+void simTcReset(AT91S_TC* tc);
+void simTcRun(uint32_t ticks, int maxLatency);
+void simTcAdvance(int ticks);
+uint32_t simTcNow(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SIMTC_H
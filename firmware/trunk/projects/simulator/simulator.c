@@ -0,0 +1,1058 @@
+/*********************************************************************************
+
+ Copyright 2006-2010 MakingThings
+
+ Licensed under the Apache License,
+ Version 2.0 (the "License"); you may not use this file except in compliance
+ with the License. You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software distributed
+ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ CONDITIONS OF ANY KIND, either express or implied. See the License for
+ the specific language governing permissions and limitations under the License.
+
+*********************************************************************************/
+
+/*
+  Runs the core on the host and times the parts that don't need hardware:
+  OSC dispatch over the mock USB port and straight into the tree, with and
+  without the index, the OSC pattern matcher (fuzzed against a reference
+  and timed against the old recursive one), the SLIP codec, fast timer
+  jitter against the number of timers (in simulated time), JSON and
+  base64 encode/decode (and JSON that's malformed or split in awkward
+  places), UDP round trips through lwIP and the OSC UDP
+  thread, streaming a large JSON document off a socket, the webserver
+  (including files packed from www/ by webpack.py, and OSC queries via the
+  /osc gateway, including arguments POSTed to it), and reading HTTP
+  headers off a socket.
+  Results are printed one per line, then the program exits - build with
+  'make' and run build/simulator.
+*/
+
+#include "core.h"
+#include "osc.h"
+#include "simhw.h"
+#include "simmatch.h"
+#include "osc_patternmatch.h"
+#include "slip.h"
+#include "simtc.h"
+#include "json.h"
+#include "base64.h"
+#include "webserver.h"
+#include "webosc.h"
+#include "lwip/sockets.h"
+#include <time.h>
+
+#ifndef BENCH_OSC_PACKETS
+#define BENCH_OSC_PACKETS 20000
+#endif
+#ifndef BENCH_JSON_ROUNDS
+#define BENCH_JSON_ROUNDS 20000
+#endif
+#ifndef BENCH_BASE64_ROUNDS
+#define BENCH_BASE64_ROUNDS 20000
+#endif
+#ifndef BENCH_JSON_STREAM_SIZE
+#define BENCH_JSON_STREAM_SIZE (64 * 1024)
+#endif
+#ifndef BENCH_JSON_STREAM_ROUNDS
+#define BENCH_JSON_STREAM_ROUNDS 20
+#endif
+#ifndef BENCH_UDP_ROUNDS
+#define BENCH_UDP_ROUNDS 2000
+#endif
+#ifndef BENCH_HTTP_ROUNDS
+#define BENCH_HTTP_ROUNDS 200
+#endif
+#ifndef BENCH_HEADER_ROUNDS
+#define BENCH_HEADER_ROUNDS 500
+#endif
+#ifndef BENCH_DISPATCH_ROUNDS
+#define BENCH_DISPATCH_ROUNDS 200000
+#endif
+#ifndef BENCH_MATCH_ROUNDS
+#define BENCH_MATCH_ROUNDS 200000
+#endif
+#ifndef BENCH_FUZZ_CASES
+#define BENCH_FUZZ_CASES 100000
+#endif
+#ifndef BENCH_SLIP_SIZE
+#define BENCH_SLIP_SIZE (64 * 1024)
+#endif
+#ifndef BENCH_SLIP_ROUNDS
+#define BENCH_SLIP_ROUNDS 50
+#endif
+#ifndef BENCH_FASTTIMER_MS
+#define BENCH_FASTTIMER_MS 1000 // simulated, not real time
+#endif
+#define BENCH_FASTTIMER_MAX 32
+#define BENCH_FASTTIMER_LATENCY (3 * FASTTIMER_TICKS_PER_US) // how long interrupts might be held off
+#define BENCH_FASTTIMER_HANDLER (2 * FASTTIMER_TICKS_PER_US) // how long each handler takes to run
+#define BENCH_MATCH_STACK 16384
+#define BENCH_SLIP_WINDOW 256 // the same as USBSER_SLIP_OUT_SIZE
+#define BENCH_SLIP_SPAN 64    // the size of a USB packet
+#define BENCH_UDP_REPLY_PORT 10001
+#define BENCH_HTTP_PORT 80
+#define BENCH_HEADER_PORT 8081
+#define BENCH_JSON_PORT 8082
+#define BENCH_JSON_WINDOW 256
+#define BENCH_TIMEOUT 5000
+
+static void benchAnaloginHandler(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  UNUSED(d);
+  if (datalen == 0) {
+    OscData d = { .type = INT, .value.i = analoginValue(idx) };
+    oscCreateMessage(ch, address, &d, 1);
+  }
+}
+
+// the same shape as the real analogin node, backed by the mock
+static const OscNode benchAnaloginValueNode = { .name = "value", .handler = benchAnaloginHandler };
+static const OscNode benchAnaloginOsc = {
+  .name = "analogin",
+  .range = ANALOGIN_CHANNELS,
+  .children = { &benchAnaloginValueNode, 0 }
+};
+
+// sends back whatever it's sent, so the /osc gateway's arguments can be checked
+static void benchEchoHandler(OscChannel ch, char* address, int idx, OscData d[], int datalen)
+{
+  UNUSED(idx);
+  oscCreateMessage(ch, address, d, datalen);
+}
+
+static const OscNode benchEchoOsc = { .name = "echo", .handler = benchEchoHandler };
+
+const OscNode oscRoot = {
+  .children = {
+    &benchAnaloginOsc,
+    &benchEchoOsc,
+    &systemOsc,
+    &networkOsc,
+    0
+  }
+};
+
+static uint64_t benchNow(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void benchReport(const char* name, int count, uint64_t us, const char* unit)
+{
+  if (us == 0)
+    us = 1;
+  printf("%-24s %8d in %9lu us  %10.0f %s\n", name, count, (unsigned long)us,
+                                              (double)count * 1000000 / us, unit);
+}
+
+// a message with no arguments - a query, as far as the board is concerned
+static int benchOscQuery(char* buf, const char* address)
+{
+  int len = strlen(address);
+  memset(buf, 0, len + 8);
+  memcpy(buf, address, len);
+  len = (len + 4) & ~3;
+  buf[len] = ',';
+  return len + 4;
+}
+
+/*
+  Feed queries to the USB thread as fast as it will take them, and wait for
+  a reply to each.  The wildcard version gets the pattern matcher involved
+  and sends back a bundle of 8 messages each time.
+*/
+static void benchOscDispatch(const char* name, const char* address)
+{
+  char packet[64];
+  int i, len = benchOscQuery(packet, address);
+  uint32_t target = simUsbReplies() + BENCH_OSC_PACKETS;
+
+  uint64_t start = benchNow();
+  for (i = 0; i < BENCH_OSC_PACKETS; i++) {
+    if (!simUsbInject(packet, len, BENCH_TIMEOUT))
+      break;
+  }
+  bool ok = simUsbWaitReplies(target, BENCH_TIMEOUT);
+  uint64_t us = benchNow() - start;
+  if (ok)
+    benchReport(name, BENCH_OSC_PACKETS, us, "packets/s");
+  else
+    printf("%-24s timed out after %d replies\n", name, (int)(BENCH_OSC_PACKETS - (target - simUsbReplies())));
+}
+
+static void benchDispatchSink(void* context, const char* address, OscData data[], int datalen)
+{
+  UNUSED(address);
+  UNUSED(data);
+  UNUSED(datalen);
+  (*(int*)context)++;
+}
+
+/*
+  Dispatch straight into the tree, with no channel in the way.  A literal
+  address goes through the index; the same address with a pattern in it
+  can't, so it walks the tree and pattern matches each level the way every
+  message did before there was an index.
+*/
+static void benchOscLocal(void)
+{
+  const char* addresses[] = { "/analogin/3/value", "/analogin/3/valu[e]" };
+  const char* names[] = { "osc local indexed", "osc local tree walk" };
+  int test;
+  for (test = 0; test < 2; test++) {
+    int i, replies = 0;
+    uint64_t start = benchNow();
+    for (i = 0; i < BENCH_DISPATCH_ROUNDS; i++)
+      oscDispatch(addresses[test], 0, 0, benchDispatchSink, &replies);
+    uint64_t us = benchNow() - start;
+    if (replies == BENCH_DISPATCH_ROUNDS)
+      benchReport(names[test], BENCH_DISPATCH_ROUNDS, us, "msgs/s");
+    else
+      printf("%-24s failed - %d of %d replies\n", names[test], replies, BENCH_DISPATCH_ROUNDS);
+  }
+}
+
+/*
+  Build a random pattern out of the pieces oscPatternMatch() knows about,
+  over a three letter alphabet so there's a fair chance of a match.  With
+  globOnly, stick to literals, '?' and '*' - the only syntax the old
+  matcher got right.  Long ones have more '*'s and '{...}'s than there
+  are backtrack points, so the nested calls get tried too.
+*/
+static void benchRandomPattern(char* buf, bool globOnly)
+{
+  static const char* pieces[] = { "a", "b", "c", "?", "*", "[ab]", "[!c]", "[a-b]", "{a,bc,}", "{b,ab}" };
+  int i, n = rand() % 12 + 1;
+  *buf = 0;
+  for (i = 0; i < n; i++)
+    strcat(buf, pieces[rand() % (globOnly ? 5 : 10)]);
+}
+
+static void benchRandomTest(char* buf)
+{
+  int i, n = rand() % 7;
+  for (i = 0; i < n; i++)
+    buf[i] = "abc"[rand() % 3];
+  buf[n] = 0;
+}
+
+/*
+  Throw random patterns at oscPatternMatch() and check it against the
+  recursive reference, and against the old matcher for plain globs.
+*/
+static void benchPatternFuzz(void)
+{
+  // more choice points than OSC_PATTERN_MAX_BACKTRACK, that still match
+  static const char* deepPatterns[] = { "*{a,b}*{a,b}*{a,b}*{a,b}*{a,b}*", "{a,b}{a,b}{a,b}{a,b}{a,b}{a,b}{a,b}{a,b}{a,b}c" };
+  static const char* deepTests[] = { "aaaaaaaaaaa", "aaaaaaaaac" };
+  char pattern[128], test[8];
+  int i, failures = 0;
+  for (i = 0; i < 2; i++) {
+    if (!oscPatternMatch(deepPatterns[i], deepTests[i])) {
+      if (failures++ == 0)
+        printf("%-24s '%s' against '%s' should be 1\n", "osc pattern fuzz", deepPatterns[i], deepTests[i]);
+    }
+  }
+  srand(1);
+  uint64_t start = benchNow();
+  for (i = 0; i < BENCH_FUZZ_CASES; i++) {
+    bool globOnly = (i & 1);
+    benchRandomPattern(pattern, globOnly);
+    benchRandomTest(test);
+    bool expected = globOnly ? simOldPatternMatch(pattern, test) : simRefPatternMatch(pattern, test);
+    if (oscPatternMatch(pattern, test) != expected) {
+      if (failures++ == 0)
+        printf("%-24s '%s' against '%s' should be %d\n", "osc pattern fuzz", pattern, test, expected);
+    }
+  }
+  uint64_t us = benchNow() - start;
+  if (failures == 0)
+    benchReport("osc pattern fuzz", BENCH_FUZZ_CASES, us, "cases/s");
+  else
+    printf("%-24s failed - %d of %d cases disagreed\n", "osc pattern fuzz", failures, BENCH_FUZZ_CASES);
+}
+
+typedef bool (*BenchMatcher)(const char* pattern, const char* test);
+
+typedef struct {
+  BenchMatcher match;
+  const char* pattern;
+  const char* test;
+} BenchMatchJob;
+
+static WORKING_AREA(benchMatchWA, BENCH_MATCH_STACK);
+
+static msg_t benchMatchThread(void* arg)
+{
+  BenchMatchJob* job = arg;
+  return job->match(job->pattern, job->test);
+}
+
+/*
+  Run a single match on a thread of its own, and see how much of the
+  thread's stack it got through.
+*/
+static int benchMatchStack(BenchMatcher match, const char* pattern, const char* test)
+{
+  BenchMatchJob job = { match, pattern, test };
+  Thread* t = chThdCreateStatic(benchMatchWA, sizeof(benchMatchWA), NORMALPRIO + 1, benchMatchThread, &job);
+  chThdWait(t);
+  return sizeof(benchMatchWA) - sizeof(Thread) - systemThreadStackUnused(t);
+}
+
+/*
+  The old matcher against the new, on the kind of patterns that show up in
+  OSC addresses, then on a long pattern and one that makes a naive matcher
+  try every way of placing each '*'.  The stack figures are bytes used on
+  the host, so they're only good for comparing the two.
+*/
+static void benchPatternMatch(void)
+{
+  static const char* patterns[] = { "value", "valu[e]", "*", "{active,value}", "[0-7]", "*e" };
+  static const char* tests[] = { "value", "value", "autosend", "value", "5", "value" };
+  static const BenchMatcher matchers[] = { simOldPatternMatch, oscPatternMatch };
+  static const char* names[] = { "osc pattern old", "osc pattern new" };
+  char longPattern[129], longTest[65], worstTest[25];
+  const char* worstPattern = "*a*a*a*a*a*a*a*ab";
+  int m, i;
+
+  for (i = 0; i < 64; i++) {
+    longPattern[i * 2] = '*';
+    longPattern[i * 2 + 1] = 'a';
+    longTest[i] = 'a';
+  }
+  longPattern[128] = 0;
+  longTest[64] = 0;
+  memset(worstTest, 'a', 24);
+  worstTest[24] = 0;
+
+  for (m = 0; m < 2; m++) {
+    uint64_t start = benchNow();
+    for (i = 0; i < BENCH_MATCH_ROUNDS; i++)
+      matchers[m](patterns[i % 6], tests[i % 6]);
+    benchReport(names[m], BENCH_MATCH_ROUNDS, benchNow() - start, "matches/s");
+
+    start = benchNow();
+    matchers[m](worstPattern, worstTest);
+    uint64_t us = benchNow() - start;
+    int longStack = benchMatchStack(matchers[m], longPattern, longTest);
+    int worstStack = benchMatchStack(matchers[m], worstPattern, worstTest);
+    printf("%-24s worst case in %lu us, stack %d bytes long / %d bytes worst\n",
+           names[m], (unsigned long)us, longStack, worstStack);
+  }
+}
+
+static char benchSlipRaw[BENCH_SLIP_SIZE];
+static char benchSlipEncoded[BENCH_SLIP_SIZE * 2 + 1];
+static char benchSlipDecoded[BENCH_SLIP_SIZE * 2 + 1];
+
+static void benchReportRate(const char* name, int bytes, uint64_t us)
+{
+  if (us == 0)
+    us = 1;
+  printf("%-24s %8d kB in %9lu us  %10.1f MB/s\n", name, bytes / 1024, (unsigned long)us, (double)bytes / us);
+}
+
+/*
+  SLIP encode a block of random data the way usbserialWriteSlip() does,
+  through a window the size of its output buffer, then decode it the way
+  usbserialReadSlip() does, a USB packet's worth at a time, and make sure
+  we got back what we started with.
+*/
+static void benchSlip(void)
+{
+  char window[BENCH_SLIP_WINDOW];
+  int i, round, len = 0, decodedLen = 0;
+  srand(2);
+  for (i = 0; i < BENCH_SLIP_SIZE; i++)
+    benchSlipRaw[i] = rand();
+
+  uint64_t start = benchNow();
+  for (round = 0; round < BENCH_SLIP_ROUNDS; round++) {
+    const char* in = benchSlipRaw;
+    const char* end = benchSlipRaw + BENCH_SLIP_SIZE;
+    len = 0;
+    while (in < end) {
+      int n = slipEncode(&in, end, window, sizeof(window));
+      memcpy(benchSlipEncoded + len, window, n); // stands in for usbserialWrite()
+      len += n;
+    }
+    benchSlipEncoded[len++] = SLIP_END;
+  }
+  benchReportRate("slip encode", BENCH_SLIP_ROUNDS * BENCH_SLIP_SIZE, benchNow() - start);
+
+  start = benchNow();
+  for (round = 0; round < BENCH_SLIP_ROUNDS; round++) {
+    bool escaped = false;
+    decodedLen = 0;
+    for (i = 0; i < len; i += BENCH_SLIP_SPAN) {
+      int n = (len - i < BENCH_SLIP_SPAN) ? len - i : BENCH_SLIP_SPAN;
+      char* dst = benchSlipDecoded + decodedLen;
+      memcpy(dst, benchSlipEncoded + i, n); // stands in for copying out of the input queue
+      const char* e = slipScan(dst, dst + n, SLIP_END, SLIP_END);
+      decodedLen += slipDecode(dst, e - dst, &escaped);
+    }
+  }
+  uint64_t us = benchNow() - start;
+  if (decodedLen == BENCH_SLIP_SIZE && memcmp(benchSlipDecoded, benchSlipRaw, BENCH_SLIP_SIZE) == 0)
+    benchReportRate("slip decode", BENCH_SLIP_ROUNDS * BENCH_SLIP_SIZE, us);
+  else
+    printf("%-24s failed - got back %d of %d bytes, or the wrong ones\n", "slip decode", decodedLen, BENCH_SLIP_SIZE);
+}
+
+static struct {
+  FastTimer timers[BENCH_FASTTIMER_MAX];
+  uint32_t period[BENCH_FASTTIMER_MAX]; // in ticks
+  uint32_t due[BENCH_FASTTIMER_MAX];    // when each one should fire next
+  uint32_t errorMax;
+  uint64_t errorTotal;
+  int fired;
+} benchFt;
+
+static void benchFastTimerHandler(int id)
+{
+  int32_t error = (int32_t)(simTcNow() - benchFt.due[id]);
+  if (error < 0)
+    error = -error;
+  if ((uint32_t)error > benchFt.errorMax)
+    benchFt.errorMax = error;
+  benchFt.errorTotal += error;
+  benchFt.fired++;
+  benchFt.due[id] += benchFt.period[id];
+  simTcAdvance(BENCH_FASTTIMER_HANDLER);
+}
+
+/*
+  How far fast timer handlers run from when they were due, as more timers
+  share the one timer/counter.  The counter is simulated (see simtc.c), so
+  this measures the queue and the interrupt handler rather than the host.
+  Each handler is charged a couple of microseconds and the interrupt can be
+  held off for a few more, so timers that come due close together have to
+  wait their turn.  The periods are all different, so the timers keep
+  drifting in and out of step with each other.
+*/
+static void benchFastTimer(void)
+{
+  static const int counts[] = { 1, 2, 4, 8, 16, BENCH_FASTTIMER_MAX };
+  uint8_t c;
+  int i;
+  fasttimerInit(2);
+  for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+    int n = counts[c];
+    memset(&benchFt, 0, sizeof(benchFt));
+    simTcReset(AT91C_BASE_TC2);
+    fasttimerResetStats();
+    for (i = 0; i < n; i++) {
+      int micros = 200 + i * 13;
+      benchFt.period[i] = micros * FASTTIMER_TICKS_PER_US;
+      benchFt.due[i] = benchFt.period[i];
+      benchFt.timers[i].handler = benchFastTimerHandler;
+      benchFt.timers[i].id = i;
+      fasttimerStart(&benchFt.timers[i], micros, true);
+    }
+    simTcRun(BENCH_FASTTIMER_MS * 1000 * FASTTIMER_TICKS_PER_US, BENCH_FASTTIMER_LATENCY);
+    for (i = 0; i < n; i++)
+      fasttimerStop(&benchFt.timers[i]);
+
+    FastTimerStats stats;
+    fasttimerStats(&stats);
+    double avg = benchFt.fired ? (double)benchFt.errorTotal / benchFt.fired : 0;
+    printf("%-24s %8d timers  jitter avg %5.1f max %5.1f us, %d of %d late\n", "fasttimer", n,
+           avg / FASTTIMER_TICKS_PER_US, (double)benchFt.errorMax / FASTTIMER_TICKS_PER_US,
+           stats.late, stats.fired);
+  }
+}
+
+// roughly what the webserver's /stats page looks like
+static int benchJsonEncode(char* buf, int len)
+{
+  JsonWriter jw;
+  int i;
+  char* start = buf;
+  jsonwriterInit(&jw, buf, len);
+  jsonwriterObjectOpen(&jw);
+  jsonwriterObjectKey(&jw, "name");
+  jsonwriterString(&jw, "Make Controller Kit");
+  jsonwriterObjectKey(&jw, "analogin");
+  jsonwriterArrayOpen(&jw);
+  for (i = 0; i < ANALOGIN_CHANNELS; i++)
+    jsonwriterInt(&jw, analoginValue(i));
+  jsonwriterArrayClose(&jw);
+  jsonwriterObjectKey(&jw, "dhcp");
+  jsonwriterBool(&jw, false);
+  return jsonwriterObjectClose(&jw) - start;
+}
+
+static bool benchJsonInt(void* ctx, int val)
+{
+  *(int*)ctx += val;
+  return true;
+}
+
+static void benchJson(void)
+{
+  char json[256], scratch[256];
+  int i, len = 0, sum = 0;
+  JsonReader jr;
+
+  uint64_t start = benchNow();
+  for (i = 0; i < BENCH_JSON_ROUNDS; i++)
+    len = benchJsonEncode(json, sizeof(json));
+  benchReport("json encode", BENCH_JSON_ROUNDS, benchNow() - start, "docs/s");
+
+  start = benchNow();
+  for (i = 0; i < BENCH_JSON_ROUNDS; i++) {
+    memcpy(scratch, json, len); // in case the reader writes into it
+    jsonreaderInit(&jr, &sum, true);
+    jr.int_handler = benchJsonInt;
+    jsonreaderGo(&jr, scratch, len);
+  }
+  benchReport("json decode", BENCH_JSON_ROUNDS, benchNow() - start, "docs/s");
+}
+
+static char benchJsonDoc[BENCH_JSON_STREAM_SIZE];
+
+// an array of /stats-like objects, much bigger than the board could hold
+static int benchJsonDocument(void)
+{
+  int len = 0;
+  benchJsonDoc[len++] = '[';
+  while (len < BENCH_JSON_STREAM_SIZE - 256) {
+    if (len > 1)
+      benchJsonDoc[len++] = ',';
+    len += benchJsonEncode(benchJsonDoc + len, 256);
+  }
+  benchJsonDoc[len++] = ']';
+  return len;
+}
+
+/*
+  Send the big document down a loopback connection a bit at a time, and
+  parse it as it's read, through a window the size a board could spare.
+  It's parsed all in one go from memory too, for comparison.
+*/
+static void benchJsonStream(void)
+{
+  static char scratch[BENCH_JSON_STREAM_SIZE];
+  char window[BENCH_JSON_WINDOW];
+  int i, sum = 0, address, mask, gateway;
+  bool ok = true;
+  JsonReader jr;
+  int len = benchJsonDocument();
+  int kb = len / 1024;
+
+  uint64_t start = benchNow();
+  for (i = 0; i < BENCH_JSON_STREAM_ROUNDS && ok; i++) {
+    memcpy(scratch, benchJsonDoc, len); // the reader writes into it
+    jsonreaderInit(&jr, &sum, true);
+    jr.int_handler = benchJsonInt;
+    ok = jsonreaderGo(&jr, scratch, len);
+  }
+  if (ok)
+    benchReport("json decode in memory", BENCH_JSON_STREAM_ROUNDS * kb, benchNow() - start, "kB/s");
+  else
+    printf("%-24s failed\n", "json decode in memory");
+
+  networkAddress(&address, &mask, &gateway);
+  int server = tcpserverOpen(BENCH_JSON_PORT);
+  int client = tcpOpen(address, BENCH_JSON_PORT);
+  int conn = (client >= 0) ? tcpserverAccept(server) : -1;
+  if (conn < 0) {
+    printf("%-24s couldn't connect\n", "json decode tcp stream");
+    if (client >= 0)
+      tcpClose(client);
+    tcpserverClose(server);
+    return;
+  }
+  tcpSetReadTimeout(conn, BENCH_TIMEOUT);
+
+  start = benchNow();
+  for (i = 0; i < BENCH_JSON_STREAM_ROUNDS && ok; i++) {
+    int sent = 0, got = 0;
+    jsonreaderInit(&jr, &sum, true);
+    jr.int_handler = benchJsonInt;
+    while (ok && got < len) {
+      int chunk = (len - sent < 1024) ? len - sent : 1024; // so the connection never backs up
+      ok = tcpWrite(client, benchJsonDoc + sent, chunk) == chunk;
+      sent += chunk;
+      while (ok && got < sent) {
+        int n = tcpRead(conn, window, sizeof(window));
+        ok = n > 0 && jsonreaderFeed(&jr, window, n);
+        got += n;
+      }
+    }
+    ok = ok && jsonreaderFinish(&jr) && jr.depth == 0;
+  }
+  if (ok)
+    benchReport("json decode tcp stream", BENCH_JSON_STREAM_ROUNDS * kb, benchNow() - start, "kB/s");
+  else
+    printf("%-24s failed after %d docs\n", "json decode tcp stream", i - 1);
+
+  tcpClose(conn);
+  tcpClose(client);
+  tcpserverClose(server);
+}
+
+static bool benchJsonString(void* ctx, char* string, int len)
+{
+  UNUSED(string); UNUSED(len);
+  (*(int*)ctx)++;
+  return true;
+}
+
+/*
+  Documents that have gone wrong, or are unusual, and how they're split up
+  shouldn't matter - more closers than openers have to fail rather than
+  walk off the front of the reader's state, and a string on its own is a
+  value, not a key.
+*/
+static void benchJsonEdges(void)
+{
+  static const char* const bad[] = { "}}\"x\"", "]]\"x\"", "[]]", "{}}\"x\":1" };
+  char doc[16];
+  int i, split;
+  bool ok = true;
+  JsonReader jr;
+
+  for (i = 0; i < 4; i++) {
+    int len = strlen(bad[i]);
+    for (split = 0; split <= len; split++) {
+      strcpy(doc, bad[i]);
+      jsonreaderInit(&jr, 0, true);
+      if (jsonreaderFeed(&jr, doc, split) && jsonreaderFeed(&jr, doc + split, len - split) &&
+          jsonreaderFinish(&jr)) {
+        printf("%-24s '%s' should have failed\n", "json edge cases", bad[i]);
+        ok = false;
+      }
+    }
+  }
+
+  for (split = 0; split <= 7; split++) {
+    int strings = 0;
+    strcpy(doc, "\"hello\"");
+    jsonreaderInit(&jr, &strings, true);
+    jr.string_handler = benchJsonString;
+    if (!jsonreaderFeed(&jr, doc, split) || !jsonreaderFeed(&jr, doc + split, 7 - split) ||
+        !jsonreaderFinish(&jr) || strings != 1) {
+      printf("%-24s a lone string split at %d wasn't read as a value\n", "json edge cases", split);
+      ok = false;
+    }
+  }
+  if (ok)
+    printf("%-24s ok\n", "json edge cases");
+}
+
+static void benchBase64(void)
+{
+  char raw[192], encoded[260], decoded[200];
+  int i, len = 0, decodedLen;
+  for (i = 0; i < (int)sizeof(raw); i++)
+    raw[i] = i;
+
+  uint64_t start = benchNow();
+  for (i = 0; i < BENCH_BASE64_ROUNDS; i++)
+    len = base64Encode(encoded, sizeof(encoded), raw, sizeof(raw));
+  benchReport("base64 encode", BENCH_BASE64_ROUNDS, benchNow() - start, "blocks/s");
+
+  start = benchNow();
+  for (i = 0; i < BENCH_BASE64_ROUNDS; i++) {
+    decodedLen = sizeof(decoded);
+    base64Decode(decoded, &decodedLen, encoded, len);
+  }
+  benchReport("base64 decode", BENCH_BASE64_ROUNDS, benchNow() - start, "blocks/s");
+}
+
+/*
+  Round trips through lwIP and the OSC UDP thread - the board answers its
+  own address on the loopback netif, to the port we're listening on.
+*/
+static void benchUdpEcho(void)
+{
+  char packet[64], reply[256];
+  int i, address, mask, gateway, timeout = BENCH_TIMEOUT;
+  uint64_t total = 0, worst = 0, best = ~0ULL;
+  int len = benchOscQuery(packet, "/system/name");
+
+  networkAddress(&address, &mask, &gateway);
+  int sock = udpOpen();
+  if (sock < 0 || !udpBind(sock, BENCH_UDP_REPLY_PORT)) {
+    printf("%-24s couldn't open a socket\n", "udp echo");
+    return;
+  }
+  lwip_setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  for (i = 0; i < BENCH_UDP_ROUNDS; i++) {
+    uint64_t start = benchNow();
+    udpWrite(sock, packet, len, address, oscUdpListenPort());
+    if (udpRead(sock, reply, sizeof(reply), 0, 0) <= 0)
+      break;
+    uint64_t us = benchNow() - start;
+    total += us;
+    if (us > worst)
+      worst = us;
+    if (us < best)
+      best = us;
+  }
+  udpClose(sock);
+
+  if (i < BENCH_UDP_ROUNDS) {
+    printf("%-24s timed out after %d replies\n", "udp echo", i);
+    return;
+  }
+  benchReport("udp echo", BENCH_UDP_ROUNDS, total, "round trips/s");
+  printf("%-24s min %lu us, avg %lu us, max %lu us\n", "", (unsigned long)best,
+                            (unsigned long)(total / BENCH_UDP_ROUNDS), (unsigned long)worst);
+}
+
+// one connection per request, like a browser polling /stats
+static void benchHttp(void)
+{
+  static const char request[] = "GET /stats HTTP/1.0\r\n\r\n";
+  char reply[1024];
+  int i, address, mask, gateway;
+
+  networkAddress(&address, &mask, &gateway);
+  uint64_t start = benchNow();
+  for (i = 0; i < BENCH_HTTP_ROUNDS; i++) {
+    int sock = tcpOpen(address, BENCH_HTTP_PORT);
+    if (sock < 0)
+      break;
+    tcpSetReadTimeout(sock, BENCH_TIMEOUT);
+    tcpWrite(sock, request, sizeof(request) - 1);
+    int got = 0, n;
+    while ((n = tcpRead(sock, reply, sizeof(reply))) > 0)
+      got += n;
+    tcpClose(sock);
+    if (got == 0)
+      break;
+  }
+  if (i < BENCH_HTTP_ROUNDS)
+    printf("%-24s failed after %d requests\n", "http /stats", i);
+  else
+    benchReport("http /stats", BENCH_HTTP_ROUNDS, benchNow() - start, "requests/s");
+}
+
+// the response to a HTTP/1.1 request comes in chunks, and ends with an empty one
+static bool benchHttpReadChunked(int sock, char* buf, int size)
+{
+  static const char end[] = "\r\n0\r\n\r\n";
+  int i, n, matched = 0;
+  while ((n = tcpRead(sock, buf, size)) > 0) {
+    for (i = 0; i < n; i++) {
+      if (buf[i] == end[matched])
+        matched++;
+      else
+        matched = (buf[i] == end[0]) ? 1 : 0;
+      if (matched == (int)sizeof(end) - 1)
+        return true;
+    }
+  }
+  return false;
+}
+
+// one connection for all the requests, like a browser that keeps it open between polls
+static void benchHttpKeepAlive(void)
+{
+  static const char request[] = "GET /stats HTTP/1.1\r\nHost: simulator\r\n\r\n";
+  char reply[1024];
+  int i, address, mask, gateway;
+
+  networkAddress(&address, &mask, &gateway);
+  int sock = tcpOpen(address, BENCH_HTTP_PORT);
+  if (sock < 0) {
+    printf("%-24s couldn't connect\n", "http /stats keep-alive");
+    return;
+  }
+  tcpSetReadTimeout(sock, BENCH_TIMEOUT);
+  uint64_t start = benchNow();
+  for (i = 0; i < BENCH_HTTP_ROUNDS; i++) {
+    tcpWrite(sock, request, sizeof(request) - 1);
+    if (!benchHttpReadChunked(sock, reply, sizeof(reply)))
+      break;
+  }
+  uint64_t us = benchNow() - start;
+  tcpClose(sock);
+  if (i < BENCH_HTTP_ROUNDS)
+    printf("%-24s failed after %d requests\n", "http /stats keep-alive", i);
+  else
+    benchReport("http /stats keep-alive", BENCH_HTTP_ROUNDS, us, "requests/s");
+}
+
+/*
+  Read a response to the end of its Content-Length, and return its status
+  code - or 0 if it didn't all turn up.  If etag isn't 0, the ETag header
+  is copied into it.
+*/
+static int benchHttpReadResponse(TcpReader* r, char* etag, int etagSize)
+{
+  char line[128];
+  int len, length = 0;
+  if (tcpreaderReadLine(r, line, sizeof(line)) < 12)
+    return 0;
+  int status = atoi(line + 9); // after "HTTP/1.1 "
+  while ((len = tcpreaderReadLine(r, line, sizeof(line))) > 0) {
+    if (strncasecmp(line, "Content-Length:", 15) == 0)
+      length = atoi(line + 15);
+    else if (etag != 0 && strncasecmp(line, "ETag: ", 6) == 0)
+      sniprintf(etag, etagSize, "%s", line + 6);
+  }
+  if (len < 0)
+    return 0;
+  while (length > 0) {
+    int n = tcpreaderRead(r, line, MIN(length, (int)sizeof(line)));
+    if (n <= 0)
+      return 0;
+    length -= n;
+  }
+  return status;
+}
+
+/*
+  Fetch the page packed from www/ over and over on one connection - first
+  like a browser that hasn't seen it before, then like one that has it
+  cached and just checks it hasn't changed, then a piece at a time.
+*/
+static void benchHttpAssets(void)
+{
+  static const char request[] =
+    "GET / HTTP/1.1\r\nHost: simulator\r\nAccept-Encoding: gzip, deflate\r\n\r\n";
+  static const char* const names[] = { "http asset 200", "http asset 304", "http asset 206" };
+  static const int expected[] = { 200, 304, 206 };
+  char req[160], etag[24] = "";
+  int i, test, address, mask, gateway;
+  TcpReader reader;
+
+  extern const WebAsset webAssets[];
+  webserverAddAssets(webAssets);
+  networkAddress(&address, &mask, &gateway);
+  int sock = tcpOpen(address, BENCH_HTTP_PORT);
+  if (sock < 0) {
+    printf("%-24s couldn't connect\n", "http asset");
+    return;
+  }
+  tcpSetReadTimeout(sock, BENCH_TIMEOUT);
+  tcpreaderInit(&reader, sock);
+
+  for (test = 0; test < 3; test++) {
+    int len;
+    if (test == 0)
+      len = sniprintf(req, sizeof(req), "%s", request);
+    else if (test == 1)
+      len = sniprintf(req, sizeof(req), "GET / HTTP/1.1\r\nHost: simulator\r\n"
+                                         "Accept-Encoding: gzip\r\nIf-None-Match: %s\r\n\r\n", etag);
+    else
+      len = sniprintf(req, sizeof(req), "GET / HTTP/1.1\r\nHost: simulator\r\n"
+                                         "Accept-Encoding: gzip\r\nRange: bytes=0-255\r\n\r\n");
+    uint64_t start = benchNow();
+    for (i = 0; i < BENCH_HTTP_ROUNDS; i++) {
+      tcpWrite(sock, req, len);
+      if (benchHttpReadResponse(&reader, etag, sizeof(etag)) != expected[test])
+        break;
+    }
+    uint64_t us = benchNow() - start;
+    if (i < BENCH_HTTP_ROUNDS) {
+      printf("%-24s failed after %d requests\n", names[test], i);
+      break;
+    }
+    benchReport(names[test], BENCH_HTTP_ROUNDS, us, "requests/s");
+  }
+  tcpClose(sock);
+}
+
+/*
+  Query all the analog ins through the /osc gateway, on one connection.
+  The replies are streamed out as JSON while the handlers run, in chunks.
+*/
+static void benchHttpOsc(void)
+{
+  static const char request[] = "GET /osc/analogin/%5B0-7%5D/value HTTP/1.1\r\nHost: simulator\r\n\r\n";
+  char reply[1024];
+  int i, address, mask, gateway;
+
+  networkAddress(&address, &mask, &gateway);
+  int sock = tcpOpen(address, BENCH_HTTP_PORT);
+  if (sock < 0) {
+    printf("%-24s couldn't connect\n", "http /osc");
+    return;
+  }
+  tcpSetReadTimeout(sock, BENCH_TIMEOUT);
+  uint64_t start = benchNow();
+  for (i = 0; i < BENCH_HTTP_ROUNDS; i++) {
+    tcpWrite(sock, request, sizeof(request) - 1);
+    if (!benchHttpReadChunked(sock, reply, sizeof(reply)))
+      break;
+  }
+  uint64_t us = benchNow() - start;
+  tcpClose(sock);
+  if (i < BENCH_HTTP_ROUNDS)
+    printf("%-24s failed after %d requests\n", "http /osc", i);
+  else
+    benchReport("http /osc", BENCH_HTTP_ROUNDS, us, "requests/s");
+}
+
+/*
+  POST a single string to the echo handler through the /osc gateway, and
+  check it comes back whole - once short, and once much longer than the
+  buffer the replies are written through.
+*/
+static void benchHttpOscPost(void)
+{
+  static char body[320], request[512], reply[1024], expected[340];
+  int test, i, address, mask, gateway;
+
+  networkAddress(&address, &mask, &gateway);
+  for (test = 0; test < 2; test++) {
+    int len = (test == 0) ? 5 : 300;
+    body[0] = '"';
+    for (i = 0; i < len; i++)
+      body[i + 1] = (test == 0) ? "hello"[i] : 'a' + i % 26;
+    body[len + 1] = '"';
+    body[len + 2] = 0;
+    sniprintf(expected, sizeof(expected), "{\"/echo\":%s}", body);
+    int reqlen = sniprintf(request, sizeof(request), "POST /osc/echo HTTP/1.0\r\n"
+                           "Content-Length: %d\r\n\r\n%s", len + 2, body);
+
+    int sock = tcpOpen(address, BENCH_HTTP_PORT);
+    if (sock < 0) {
+      printf("%-24s couldn't connect\n", "http /osc post");
+      return;
+    }
+    tcpSetReadTimeout(sock, BENCH_TIMEOUT);
+    tcpWrite(sock, request, reqlen);
+    int got = 0, n;
+    while (got < (int)sizeof(reply) - 1 && (n = tcpRead(sock, reply + got, sizeof(reply) - 1 - got)) > 0)
+      got += n;
+    reply[got] = 0;
+    tcpClose(sock);
+    char* json = strstr(reply, "\r\n\r\n");
+    if (atoi(reply + 9) != 200 || json == 0 || strcmp(json + 4, expected) != 0) {
+      printf("%-24s failed - a %d character string didn't come back\n", "http /osc post", len);
+      return;
+    }
+  }
+  printf("%-24s ok\n", "http /osc post");
+}
+
+// about what a browser sends
+static const char benchHeaders[] =
+  "GET /stats HTTP/1.1\r\n"
+  "Host: 192.168.0.200\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:68.0) Gecko/20100101 Firefox/68.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Connection: keep-alive\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "\r\n";
+
+/*
+  Send a request's worth of headers down a loopback connection, then read
+  them back a line at a time - once with tcpReadLine(), and once with a
+  TcpReader.  Sending costs the same both ways, so the difference is down
+  to the reading.
+*/
+static void benchHeaderParse(void)
+{
+  char line[128];
+  int i, address, mask, gateway;
+  TcpReader reader;
+
+  networkAddress(&address, &mask, &gateway);
+  int server = tcpserverOpen(BENCH_HEADER_PORT);
+  int client = tcpOpen(address, BENCH_HEADER_PORT);
+  int conn = (client >= 0) ? tcpserverAccept(server) : -1; // already queued up, so no waiting
+  if (conn < 0) {
+    printf("%-24s couldn't connect\n", "http header parse");
+    if (client >= 0)
+      tcpClose(client);
+    tcpserverClose(server);
+    return;
+  }
+  tcpSetReadTimeout(conn, BENCH_TIMEOUT);
+
+  uint64_t start = benchNow();
+  for (i = 0; i < BENCH_HEADER_ROUNDS; i++) {
+    tcpWrite(client, benchHeaders, sizeof(benchHeaders) - 1);
+    int len;
+    while ((len = tcpReadLine(conn, line, sizeof(line))) > 0 && strncmp(line, "\r\n", 2) != 0)
+      ;
+    if (len <= 0)
+      break;
+  }
+  if (i == BENCH_HEADER_ROUNDS)
+    benchReport("http header tcpReadLine", BENCH_HEADER_ROUNDS, benchNow() - start, "requests/s");
+  else
+    printf("%-24s failed after %d requests\n", "http header tcpReadLine", i);
+
+  tcpreaderInit(&reader, conn);
+  start = benchNow();
+  for (i = 0; i < BENCH_HEADER_ROUNDS; i++) {
+    tcpWrite(client, benchHeaders, sizeof(benchHeaders) - 1);
+    int len;
+    while ((len = tcpreaderReadLine(&reader, line, sizeof(line))) > 0)
+      ;
+    if (len < 0)
+      break;
+  }
+  if (i == BENCH_HEADER_ROUNDS)
+    benchReport("http header tcpreader", BENCH_HEADER_ROUNDS, benchNow() - start, "requests/s");
+  else
+    printf("%-24s failed after %d requests\n", "http header tcpreader", i);
+
+  tcpClose(conn);
+  tcpClose(client);
+  tcpserverClose(server);
+}
+
+void setup()
+{
+  int i;
+  for (i = 0; i < ANALOGIN_CHANNELS; i++)
+    simAnaloginSet(i, i * 128);
+
+  usbserialInit();
+  oscUsbEnable(YES);
+
+  networkInit();
+  oscUdpSetReplyPort(BENCH_UDP_REPLY_PORT);
+  oscUdpEnable(YES);
+  webserverAddHandler(&webserverStatsHandler);
+  webserverAddHandler(&weboscHandler);
+  webserverEnable(YES, BENCH_HTTP_PORT);
+
+  benchOscDispatch("osc dispatch", "/analogin/3/value");
+  benchOscDispatch("osc dispatch wildcard", "/analogin/*/value");
+  benchOscLocal();
+  benchPatternFuzz();
+  benchPatternMatch();
+  benchSlip();
+  benchFastTimer();
+  benchJson();
+  benchJsonStream();
+  benchJsonEdges();
+  benchBase64();
+  benchUdpEcho();
+  benchHttp();
+  benchHttpKeepAlive();
+  benchHttpAssets();
+  benchHttpOsc();
+  benchHttpOscPost();
+  benchHeaderParse();
+
+  Stat* s;
+  for (s = statsRead(); s != 0; s = s->next)
+    printf("%-24s %8lu\n", s->name, (unsigned long)s->value);
+
+  kill();
+}
+
+void loop()
+{
+  sleep(1000);
+}